@@ -85,15 +85,26 @@ void CentralFreeList::InsertRange(void** batch, int N) {
     counter_.LossyAdd(N);
   }
 
-  // Then, release all free spans into page heap under its mutex.
-  if (free_count) {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    for (int i = 0; i < free_count; ++i) {
-      ASSERT(!IsTaggedMemory(free_spans[i]->start_address()));
-      Static::pagemap()->UnregisterSizeClass(free_spans[i]);
-      Static::page_allocator()->Delete(free_spans[i], /*tagged=*/false);
+  // Then, release all free spans, preferably into the page run cache, and
+  // the rest into page heap under its mutex.
+  int uncached = 0;
+  for (int i = 0; i < free_count; ++i) {
+    ASSERT(!IsTaggedMemory(free_spans[i]->start_address()));
+    Static::pagemap()->UnregisterSizeClass(free_spans[i]);
+    if (!Static::page_allocator()->DeleteToCache(free_spans[i],
+                                                 /*tagged=*/false)) {
+      free_spans[uncached++] = free_spans[i];
     }
   }
+  if (uncached) {
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      for (int i = 0; i < uncached; ++i) {
+        Static::page_allocator()->Delete(free_spans[i], /*tagged=*/false);
+      }
+    }
+    Static::page_allocator()->ReturnFreedHugepages();
+  }
 }
 
 int CentralFreeList::RemoveRange(void** batch, int N) {
@@ -428,6 +428,11 @@ class SizeMap {
 // Linker initialized, so this lock can be accessed at any time.
 extern absl::base_internal::SpinLock pageheap_lock;
 
+// Guards the HugeAllocators and HugeCaches of the hugepage-aware allocators
+// (see HugePageAwareAllocator).  Like pageheap_lock, linker initialized.  When
+// both are held, huge_cache_lock is acquired first.
+extern absl::base_internal::SpinLock huge_cache_lock;
+
 }  // namespace tcmalloc
 
 #endif  // TCMALLOC_COMMON_H_
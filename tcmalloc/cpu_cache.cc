@@ -101,12 +101,14 @@ void CPUCache::Activate(ActivationMode mode) {
   lazy_slabs_ = Parameters::lazy_per_cpu_caches();
 
   auto max_cache_size = Parameters::max_per_cpu_cache_size();
+  cache_limit_.store(max_cache_size, std::memory_order_relaxed);
 
   for (int cpu = 0; cpu < num_cpus; ++cpu) {
     for (int cl = 1; cl < kNumClasses; ++cl) {
       resize_[cpu].per_class[cl].Init();
     }
     resize_[cpu].available.store(max_cache_size, std::memory_order_relaxed);
+    resize_[cpu].owed.store(0, std::memory_order_relaxed);
     resize_[cpu].last_steal.store(1, std::memory_order_relaxed);
   }
 
@@ -268,14 +270,10 @@ void CPUCache::Grow(int cpu, size_t cl, size_t desired_increase,
   const size_t desired_bytes = desired_increase * size;
   size_t acquired_bytes;
 
-  // First, there might be unreserved slack.  Take what we can.
-  size_t before, after;
-  do {
-    before = resize_[cpu].available.load(std::memory_order_relaxed);
-    acquired_bytes = std::min(before, desired_bytes);
-    after = before - acquired_bytes;
-  } while (!resize_[cpu].available.compare_exchange_strong(
-      before, after, std::memory_order_relaxed, std::memory_order_relaxed));
+  // First, there might be unreserved slack, once we have paid what we owe.
+  // Take what we can.
+  PayOwed(cpu);
+  acquired_bytes = TakeAvailable(cpu, desired_bytes);
 
   if (acquired_bytes < desired_bytes) {
     acquired_bytes +=
@@ -298,6 +296,37 @@ void CPUCache::Grow(int cpu, size_t cl, size_t desired_increase,
   }
 }
 
+size_t CPUCache::TakeAvailable(int cpu, size_t bytes) {
+  std::atomic<size_t> *available = &resize_[cpu].available;
+  size_t before, taken;
+  do {
+    before = available->load(std::memory_order_relaxed);
+    taken = std::min(before, bytes);
+  } while (!available->compare_exchange_strong(before, before - taken,
+                                               std::memory_order_relaxed,
+                                               std::memory_order_relaxed));
+  return taken;
+}
+
+void CPUCache::PayOwed(int cpu) {
+  std::atomic<size_t> *owed = &resize_[cpu].owed;
+  size_t before = owed->load(std::memory_order_relaxed);
+  if (ABSL_PREDICT_TRUE(before == 0)) return;
+
+  const size_t paid = TakeAvailable(cpu, before);
+  // Someone may have paid (or SetCacheLimit forgiven) some of it meanwhile.
+  size_t settled;
+  do {
+    settled = std::min(before, paid);
+  } while (!owed->compare_exchange_strong(before, before - settled,
+                                          std::memory_order_relaxed,
+                                          std::memory_order_relaxed));
+  if (settled < paid) {
+    resize_[cpu].available.fetch_add(paid - settled,
+                                     std::memory_order_relaxed);
+  }
+}
+
 // There are rather a lot of policy knobs we could tweak here.
 size_t CPUCache::Steal(int cpu, size_t dest_cl, size_t bytes,
                        ObjectClass *to_return, size_t *returned) {
@@ -470,7 +499,54 @@ uint64_t CPUCache::Unallocated(int cpu) const {
 }
 
 uint64_t CPUCache::CacheLimit() const {
-  return Parameters::max_per_cpu_cache_size();
+  return cache_limit_.load(std::memory_order_relaxed);
+}
+
+// Serializes changes to the per-cpu limit.
+ABSL_CONST_INIT static absl::base_internal::SpinLock cache_limit_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+
+void CPUCache::SetCacheLimit(uint64_t bytes) {
+  absl::base_internal::SpinLockHolder l(&cache_limit_lock);
+  const uint64_t before = cache_limit_.load(std::memory_order_relaxed);
+  if (bytes == before) return;
+  cache_limit_.store(bytes, std::memory_order_relaxed);
+
+  // A cpu busy enough to grow its lists right back after each drain could
+  // keep us here indefinitely, so give up on it after this many.
+  constexpr int kMaxReclaims = 2;
+  for (int cpu = 0, num_cpus = absl::base_internal::NumCPUs(); cpu < num_cpus;
+       ++cpu) {
+    if (bytes > before) {
+      // Forgive what the cpu still owes from an earlier cut first.
+      size_t increase = bytes - before;
+      std::atomic<size_t> *owed = &resize_[cpu].owed;
+      size_t old = owed->load(std::memory_order_relaxed);
+      size_t forgiven;
+      do {
+        forgiven = std::min<size_t>(old, increase);
+      } while (!owed->compare_exchange_strong(old, old - forgiven,
+                                              std::memory_order_relaxed,
+                                              std::memory_order_relaxed));
+      resize_[cpu].available.fetch_add(increase - forgiven,
+                                       std::memory_order_relaxed);
+      continue;
+    }
+
+    // Take what we can from the slack, as Grow does.
+    size_t owed = before - bytes;
+    owed -= TakeAvailable(cpu, owed);
+    // The rest is capacity of this cpu's size classes.  Draining gives all
+    // of that back, though the cpu may grow its lists again before we take
+    // it.
+    for (int i = 0; owed > 0 && i < kMaxReclaims; ++i) {
+      Reclaim(cpu);
+      owed -= TakeAvailable(cpu, owed);
+    }
+    if (owed > 0) {
+      resize_[cpu].owed.fetch_add(owed, std::memory_order_relaxed);
+    }
+  }
 }
 
 struct DrainContext {
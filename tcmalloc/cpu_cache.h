@@ -78,9 +78,18 @@ class CPUCache {
   // Give the number of bytes unallocated to any sizeclass in <cpu>'s cache.
   uint64_t Unallocated(int cpu) const;
 
-  // Give the per-cpu limit of cache size.
+  // Give the per-cpu limit of cache size.  This is
+  // Parameters::max_per_cpu_cache_size() at activation, unless SetCacheLimit
+  // has changed it since.
   uint64_t CacheLimit() const;
 
+  // Set the per-cpu limit of cache size.  Lowering it takes the difference
+  // from each cpu's unallocated space, draining that cpu's cache to the
+  // transfer caches if there is too little.  Whatever a busy cpu grows back
+  // before we can take it stays owed, and comes out of its unallocated space
+  // as that frees up.  This function is thread safe.
+  void SetCacheLimit(uint64_t bytes);
+
   // Empty out the cache on <cpu>; move all objects to the central
   // cache.  (If other threads run concurrently on that cpu, we can't
   // guarantee it will be fully empty on return, but if the cpu is
@@ -130,6 +139,9 @@ class CPUCache {
     // cache space on this CPU we're not using.  Modify atomically;
     // we don't want to lose space.
     std::atomic<size_t> available;
+    // Space SetCacheLimit took away that we have yet to take out of
+    // available.  Grow settles it before using any.
+    std::atomic<size_t> owed;
     // this is just a hint
     std::atomic<size_t> last_steal;
     // Track whether we have initialized this CPU.
@@ -146,6 +158,8 @@ class CPUCache {
   };
   // Tracking data for each CPU's cache resizing efforts.
   ResizeInfo *resize_;
+  // The per-cpu limit we last gave each cpu's resize_[cpu].available.
+  std::atomic<uint64_t> cache_limit_;
   // Track whether we are lazily initializing slabs.  We cannot use the latest
   // value in Parameters, as it can change after initialization.
   bool lazy_slabs_;
@@ -175,6 +189,13 @@ class CPUCache {
   void Grow(int cpu, size_t cl, size_t desired_increase, ObjectClass *to_return,
             size_t *returned);
 
+  // Takes up to <bytes> of <cpu>'s unallocated space, returning how much.
+  size_t TakeAvailable(int cpu, size_t bytes);
+
+  // Takes what <cpu> owes SetCacheLimit out of its unallocated space, as far
+  // as that goes.
+  void PayOwed(int cpu);
+
   // Tries to steal <bytes> for <cl> on <cpu> from other size classes on that
   // CPU. Returns acquired bytes. <to_return>[0...*returned) will contain
   // objects that need to be freed.
@@ -14,6 +14,8 @@
 
 #include "tcmalloc/cpu_cache.h"
 
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "tcmalloc/common.h"
@@ -126,5 +128,49 @@ TEST(CpuCacheTest, Metadata) {
   }
 }
 
+TEST(CpuCacheTest, SetCacheLimit) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  const int num_cpus = absl::base_internal::NumCPUs();
+
+  CPUCache& cache = *Static::cpu_cache();
+  cache.Activate(CPUCache::ActivationMode::FastPathOffTestOnly);
+  const uint64_t limit = cache.CacheLimit();
+  EXPECT_EQ(Parameters::max_per_cpu_cache_size(), limit);
+
+  // Give one size class some capacity to take back.
+  const size_t kSizeClass = 3;
+  std::vector<void*> ptrs;
+  {
+    tcmalloc_internal::ScopedAffinityMask mask(
+        tcmalloc_internal::AllowedCpus()[0]);
+    for (int i = 0; i < 1000; ++i) {
+      ptrs.push_back(cache.Allocate<OOMHandler>(kSizeClass));
+    }
+    for (void* ptr : ptrs) {
+      cache.Deallocate(ptr, kSizeClass);
+    }
+  }
+
+  // Lowering the limit leaves no cpu more unallocated space than that.
+  cache.SetCacheLimit(limit / 4);
+  EXPECT_EQ(limit / 4, cache.CacheLimit());
+  for (int i = 0; i < num_cpus; i++) {
+    EXPECT_LE(cache.Unallocated(i), limit / 4);
+  }
+
+  // Raising it gives the difference back.
+  const uint64_t unallocated = cache.Unallocated(num_cpus - 1);
+  cache.SetCacheLimit(limit);
+  EXPECT_EQ(limit, cache.CacheLimit());
+  EXPECT_LE(unallocated + limit - limit / 4, cache.Unallocated(num_cpus - 1));
+
+  for (int i = 0; i < num_cpus; i++) {
+    cache.Reclaim(i);
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc
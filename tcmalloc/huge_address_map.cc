@@ -25,90 +25,136 @@
 // Implementations of functions.
 namespace tcmalloc {
 
-const HugeAddressMap::Node *HugeAddressMap::Node::next() const {
-  const Node *n = right_;
-  if (n) {
-    while (n->left_) n = n->left_;
-    return n;
-  }
-
-  n = parent_;
-  const Node *last = this;
-  while (n) {
-    if (n->left_ == last) return n;
-    last = n;
-    n = n->parent_;
-  }
-
-  return nullptr;
+uint64_t HugeAddressMap::LengthBit(HugeLength n) {
+  ASSERT(n > NHugePages(0));
+  const size_t len = std::min<size_t>(n.raw_num(), 64);
+  return uint64_t{1} << (len - 1);
 }
 
-HugeAddressMap::Node *HugeAddressMap::Node::next() {
-  const Node *n = static_cast<const Node *>(this)->next();
-  return const_cast<Node *>(n);
+HugePage HugeAddressMap::FirstPage(const Block *b, bool leaf) {
+  ASSERT(b->size > 0);
+  if (leaf) return static_cast<const Leaf *>(b)->nodes[0].range_.start();
+  return static_cast<const Inner *>(b)->first[0];
 }
 
-void HugeAddressMap::Node::Check(size_t *num_nodes, HugeLength *size) const {
-  HugeLength longest = range_.len();
-  *num_nodes += 1;
-  *size += range_.len();
-
-  if (left_) {
-    // tree
-    CHECK_CONDITION(left_->range_.start() < range_.start());
-    // disjoint
-    CHECK_CONDITION(left_->range_.end_addr() < range_.start_addr());
-    // well-formed
-    CHECK_CONDITION(left_->parent_ == this);
-    // heap
-    CHECK_CONDITION(left_->prio_ <= prio_);
-    left_->Check(num_nodes, size);
-    if (left_->longest_ > longest) longest = left_->longest_;
+size_t HugeAddressMap::IndexIn(const Inner *parent, const Block *child) {
+  for (size_t i = 0; i < parent->size; ++i) {
+    if (parent->children[i] == child) return i;
   }
+  CHECK_CONDITION(false);
+  return 0;
+}
 
-  if (right_) {
-    // tree
-    CHECK_CONDITION(right_->range_.start() > range_.start());
-    // disjoint
-    CHECK_CONDITION(right_->range_.start_addr() > range_.end_addr());
-    // well-formed
-    CHECK_CONDITION(right_->parent_ == this);
-    // heap
-    CHECK_CONDITION(right_->prio_ <= prio_);
-    right_->Check(num_nodes, size);
-    if (right_->longest_ > longest) longest = right_->longest_;
+void HugeAddressMap::Summarize(Block *b, bool leaf) {
+  HugeLength longest = NHugePages(0);
+  uint64_t lengths = 0;
+  if (leaf) {
+    const Leaf *l = static_cast<const Leaf *>(b);
+    for (size_t i = 0; i < l->size; ++i) {
+      const HugeLength len = l->nodes[i].range_.len();
+      longest = std::max(longest, len);
+      lengths |= LengthBit(len);
+    }
+  } else {
+    const Inner *in = static_cast<const Inner *>(b);
+    for (size_t i = 0; i < in->size; ++i) {
+      longest = std::max(longest, in->child_longest[i]);
+      lengths |= in->child_lengths[i];
+    }
   }
+  b->longest = longest;
+  b->lengths = lengths;
+}
 
-  CHECK_CONDITION(longest_ == longest);
+void HugeAddressMap::SetEntry(Inner *parent, size_t i, Block *child,
+                              bool leaf) {
+  parent->children[i] = child;
+  parent->first[i] = FirstPage(child, leaf);
+  parent->child_longest[i] = child->longest;
+  parent->child_lengths[i] = child->lengths;
+  child->parent = parent;
 }
 
-const HugeAddressMap::Node *HugeAddressMap::first() const {
-  const Node *n = root();
-  if (!n) return nullptr;
-  const Node *left = n->left_;
-  while (left) {
-    n = left;
-    left = n->left_;
+void HugeAddressMap::FixUp(Block *b, bool leaf) {
+  while (true) {
+    Summarize(b, leaf);
+    Inner *parent = b->parent;
+    if (parent == nullptr) return;
+    const size_t i = IndexIn(parent, b);
+    const HugePage first = FirstPage(b, leaf);
+    if (parent->first[i] == first && parent->child_longest[i] == b->longest &&
+        parent->child_lengths[i] == b->lengths) {
+      return;
+    }
+    SetEntry(parent, i, b, leaf);
+    b = parent;
+    leaf = false;
   }
-
-  return n;
 }
 
-HugeAddressMap::Node *HugeAddressMap::first() {
-  const Node *f = static_cast<const HugeAddressMap *>(this)->first();
-  return const_cast<Node *>(f);
+void HugeAddressMap::Check(const Block *b, size_t level, size_t *num_nodes,
+                           HugeLength *size) const {
+  CHECK_CONDITION(b->size > 0);
+  HugeLength longest = NHugePages(0);
+  uint64_t lengths = 0;
+  if (level == 0) {
+    const Leaf *leaf = static_cast<const Leaf *>(b);
+    CHECK_CONDITION(leaf->size <= kLeafSize);
+    for (size_t i = 0; i < leaf->size; ++i) {
+      const Node &n = leaf->nodes[i];
+      CHECK_CONDITION(n.leaf_ == leaf);
+      CHECK_CONDITION(n.range_.len() > NHugePages(0));
+      longest = std::max(longest, n.range_.len());
+      lengths |= LengthBit(n.range_.len());
+      *num_nodes += 1;
+      *size += n.range_.len();
+    }
+  } else {
+    const Inner *inner = static_cast<const Inner *>(b);
+    CHECK_CONDITION(inner->size <= kFanout);
+    for (size_t i = 0; i < inner->size; ++i) {
+      const Block *child = inner->children[i];
+      // well-formed
+      CHECK_CONDITION(child->parent == inner);
+      CHECK_CONDITION(inner->first[i] == FirstPage(child, level == 1));
+      CHECK_CONDITION(inner->child_longest[i] == child->longest);
+      CHECK_CONDITION(inner->child_lengths[i] == child->lengths);
+      // tree
+      if (i > 0) CHECK_CONDITION(inner->first[i - 1] < inner->first[i]);
+      Check(child, level - 1, num_nodes, size);
+      longest = std::max(longest, child->longest);
+      lengths |= child->lengths;
+    }
+  }
+  CHECK_CONDITION(b->longest == longest);
+  CHECK_CONDITION(b->lengths == lengths);
 }
 
 void HugeAddressMap::Check() {
   size_t nodes = 0;
   HugeLength size = NHugePages(0);
   if (root_) {
-    CHECK_CONDITION(root_->parent_ == nullptr);
-    root_->Check(&nodes, &size);
+    CHECK_CONDITION(root_->parent == nullptr);
+    Check(root_, height_, &nodes, &size);
+  } else {
+    CHECK_CONDITION(head_ == nullptr);
   }
   CHECK_CONDITION(nodes == nranges());
   CHECK_CONDITION(size == total_mapped());
-  CHECK_CONDITION(total_nodes_ == used_nodes_ + freelist_size_);
+
+  // The leaves, in order, hold disjoint, non-adjacent ranges in address
+  // order.
+  size_t listed = 0;
+  const Node *prev = nullptr;
+  for (const Node *n = first(); n != nullptr; n = n->next()) {
+    if (prev) {
+      CHECK_CONDITION(prev->range_.end_addr() < n->range_.start_addr());
+    }
+    prev = n;
+    listed++;
+  }
+  CHECK_CONDITION(listed == nranges());
+  if (head_) CHECK_CONDITION(head_->prev == nullptr);
 }
 
 size_t HugeAddressMap::nranges() const { return used_nodes_; }
@@ -116,37 +162,80 @@ size_t HugeAddressMap::nranges() const { return used_nodes_; }
 HugeLength HugeAddressMap::total_mapped() const { return total_size_; }
 
 void HugeAddressMap::Print(TCMalloc_Printer *out) const {
-  out->printf("HugeAddressMap: treap %zu / %zu nodes used / created\n",
-              used_nodes_, total_nodes_);
-  const size_t longest = root_ ? root_->longest_.raw_num() : 0;
-  out->printf("HugeAddressMap: %zu contiguous hugepages available\n", longest);
+  out->printf(
+      "HugeAddressMap: btree of %zu ranges in %zu / %zu leaves used / "
+      "created\n",
+      used_nodes_, used_leaves_, leaves_created_);
+  out->printf("HugeAddressMap: %zu contiguous hugepages available\n",
+              longest().raw_num());
 }
 
 void HugeAddressMap::PrintInPbtxt(PbtxtRegion *hpaa) const {
-  hpaa->PrintI64("num_huge_address_map_treap_nodes_used", used_nodes_);
-  hpaa->PrintI64("num_huge_address_map_treap_nodes_created", total_nodes_);
-  const size_t longest = root_ ? root_->longest_.in_bytes() : 0;
-  hpaa->PrintI64("contiguous_free_bytes", longest);
+  hpaa->PrintI64("num_huge_address_map_ranges", used_nodes_);
+  hpaa->PrintI64("num_huge_address_map_leaves_used", used_leaves_);
+  hpaa->PrintI64("num_huge_address_map_leaves_created", leaves_created_);
+  hpaa->PrintI64("contiguous_free_bytes", longest().in_bytes());
 }
 
 HugeAddressMap::Node *HugeAddressMap::Predecessor(HugePage p) {
-  Node *n = root();
-  Node *best = nullptr;
-  while (n) {
-    HugeRange here = n->range_;
-    if (here.contains(p)) return n;
-    if (p < here.start()) {
-      // p comes before here:
-      // our predecessor isn't here, nor in the right subtree.
-      n = n->left_;
-    } else {
-      // p comes after here:
-      // here is a valid candidate, and the right subtree might have better.
-      best = n;
-      n = n->right_;
+  if (root_ == nullptr) return nullptr;
+  Block *b = root_;
+  for (size_t level = height_; level > 0; --level) {
+    Inner *inner = static_cast<Inner *>(b);
+    // The last child starting at or before p.
+    size_t i = inner->size;
+    while (i > 0 && p < inner->first[i - 1]) --i;
+    if (i == 0) return nullptr;
+    b = inner->children[i - 1];
+  }
+
+  Leaf *leaf = static_cast<Leaf *>(b);
+  size_t i = leaf->size;
+  while (i > 0 && p < leaf->nodes[i - 1].range_.start()) --i;
+  return i == 0 ? nullptr : &leaf->nodes[i - 1];
+}
+
+HugeAddressMap::Node *HugeAddressMap::Find(HugeLength n) {
+  if (longest() < n) return nullptr;
+
+  // Lengths under 64 hugepages are exact, so we take the shortest length that
+  // fits and go straight to its lowest-addressed range.  If only longer ones
+  // fit, we descend by the shortest sufficient longest range instead.
+  uint64_t fits = kLongBit;
+  if (n.raw_num() < 64) {
+    fits = root_->lengths & (~uint64_t{0} << (n.raw_num() - 1));
+  }
+  const uint64_t want = fits & (~fits + 1);
+  ASSERT(want != 0);
+
+  Block *b = root_;
+  for (size_t level = height_; level > 0; --level) {
+    Inner *inner = static_cast<Inner *>(b);
+    size_t best = inner->size;
+    for (size_t i = 0; i < inner->size; ++i) {
+      if (!(inner->child_lengths[i] & want) || inner->child_longest[i] < n) continue;
+      if (want != kLongBit) {
+        best = i;
+        break;
+      }
+      if (best == inner->size || inner->child_longest[i] < inner->child_longest[best]) {
+        best = i;
+      }
     }
+    CHECK_CONDITION(best < inner->size);
+    b = inner->children[best];
   }
 
+  Leaf *leaf = static_cast<Leaf *>(b);
+  Node *best = nullptr;
+  for (size_t i = 0; i < leaf->size; ++i) {
+    Node *node = &leaf->nodes[i];
+    const HugeLength len = node->range_.len();
+    if (len < n || !(LengthBit(len) & want)) continue;
+    if (want != kLongBit) return node;
+    if (!best || len < best->range_.len()) best = node;
+  }
+  CHECK_CONDITION(best != nullptr);
   return best;
 }
 
@@ -165,12 +254,12 @@ void HugeAddressMap::Merge(Node *b, HugeRange r, Node *a) {
   if (a == nullptr) {
     b->when_ = merge_when(b->range_, b->when(), r, when);
     b->range_ = Join(b->range_, r);
-    FixLongest(b);
+    FixUp(b->leaf_, true);
     return;
   } else if (b == nullptr) {
     a->when_ = merge_when(r, when, a->range_, a->when());
     a->range_ = Join(r, a->range_);
-    FixLongest(a);
+    FixUp(a->leaf_, true);
     return;
   }
 
@@ -183,10 +272,11 @@ void HugeAddressMap::Merge(Node *b, HugeRange r, Node *a) {
   // Removing a will reduce total_size_ by that length, but since we're merging
   // we actually don't change lengths at all; undo that.
   total_size_ += a->range_.len();
+  // a follows b, so this leaves b where it is.
   Remove(a);
   b->range_ = full;
   b->when_ = full_when;
-  FixLongest(b);
+  FixUp(b->leaf_, true);
 }
 
 void HugeAddressMap::Insert(HugeRange r) {
@@ -211,160 +301,218 @@ void HugeAddressMap::Insert(HugeRange r) {
   CHECK_CONDITION(!before || !before->range_.precedes(r));
   CHECK_CONDITION(!after || !r.precedes(after->range_));
   // No merging possible; just add a new node.
-  Node *n = Get(r);
-  Node *curr = root();
-  Node *parent = nullptr;
-  Node **link = &root_;
-  // Walk down the tree to our correct location
-  while (curr != nullptr && curr->prio_ >= n->prio_) {
-    curr->longest_ = std::max(curr->longest_, r.len());
-    parent = curr;
-    if (curr->range_.start() < r.start()) {
-      link = &curr->right_;
-      curr = curr->right_;
-    } else {
-      link = &curr->left_;
-      curr = curr->left_;
+  if (before) {
+    InsertAt(before->leaf_, before - before->leaf_->nodes + 1, r);
+  } else {
+    if (root_ == nullptr) {
+      head_ = NewLeaf();
+      root_ = head_;
+      height_ = 0;
     }
+    InsertAt(head_, 0, r);
   }
-  *link = n;
-  n->parent_ = parent;
-  n->left_ = n->right_ = nullptr;
-  n->longest_ = r.len();
-  if (curr) {
-    HugePage p = r.start();
-    // We need to split the treap at curr into n's children.
-    // This will be two treaps: one less than p, one greater, and has
-    // a nice recursive structure.
-    Node **less = &n->left_;
-    Node *lp = n;
-    Node **more = &n->right_;
-    Node *mp = n;
-    while (curr) {
-      if (curr->range_.start() < p) {
-        *less = curr;
-        curr->parent_ = lp;
-        less = &curr->right_;
-        lp = curr;
-        curr = curr->right_;
-      } else {
-        *more = curr;
-        curr->parent_ = mp;
-        more = &curr->left_;
-        mp = curr;
-        curr = curr->left_;
-      }
+}
+
+void HugeAddressMap::InsertAt(Leaf *leaf, size_t i, HugeRange r) {
+  used_nodes_++;
+  if (leaf->size == kLeafSize) {
+    // Split: we keep the lower half, a new leaf after us takes the rest.
+    const size_t half = (kLeafSize + 1) / 2;
+    Leaf *right = NewLeaf();
+    right->size = leaf->size - half;
+    for (size_t j = 0; j < right->size; ++j) {
+      right->nodes[j] = leaf->nodes[half + j];
+      right->nodes[j].leaf_ = right;
+    }
+    leaf->size = half;
+    right->next = leaf->next;
+    if (right->next) right->next->prev = right;
+    right->prev = leaf;
+    leaf->next = right;
+    Summarize(right, true);
+    InsertSibling(leaf, right, 0);
+    FixUp(leaf, true);
+    if (i > half) {
+      leaf = right;
+      i -= half;
     }
-    *more = *less = nullptr;
-    // We ripped apart the tree along these two paths--fix longest pointers.
-    FixLongest(lp);
-    FixLongest(mp);
   }
-}
 
-void HugeAddressMap::Node::FixLongest() {
-  const HugeLength l = left_ ? left_->longest_ : NHugePages(0);
-  const HugeLength r = right_ ? right_->longest_ : NHugePages(0);
-  const HugeLength c = range_.len();
-  const HugeLength new_longest = std::max({l, r, c});
-  longest_ = new_longest;
+  for (size_t j = leaf->size; j > i; --j) {
+    leaf->nodes[j] = leaf->nodes[j - 1];
+  }
+  leaf->size++;
+  Node &node = leaf->nodes[i];
+  node.range_ = r;
+  node.when_ = absl::base_internal::CycleClock::Now();
+  node.leaf_ = leaf;
+  FixUp(leaf, true);
 }
 
-void HugeAddressMap::FixLongest(HugeAddressMap::Node *n) {
-  while (n) {
-    n->FixLongest();
-    n = n->parent_;
+void HugeAddressMap::InsertSibling(Block *left, Block *right, size_t level) {
+  const bool leaf = level == 0;
+  Inner *parent = left->parent;
+  if (parent == nullptr) {
+    // left was the root; grow a new one above it.
+    Inner *root = NewInner();
+    root->size = 2;
+    SetEntry(root, 0, left, leaf);
+    SetEntry(root, 1, right, leaf);
+    Summarize(root, false);
+    root_ = root;
+    height_++;
+    return;
+  }
+
+  size_t i = IndexIn(parent, left) + 1;
+  if (parent->size == kFanout) {
+    const size_t half = kFanout / 2;
+    Inner *sibling = NewInner();
+    sibling->size = parent->size - half;
+    for (size_t j = 0; j < sibling->size; ++j) {
+      sibling->children[j] = parent->children[half + j];
+      sibling->first[j] = parent->first[half + j];
+      sibling->child_longest[j] = parent->child_longest[half + j];
+      sibling->child_lengths[j] = parent->child_lengths[half + j];
+      sibling->children[j]->parent = sibling;
+    }
+    parent->size = half;
+    Summarize(sibling, false);
+    InsertSibling(parent, sibling, level + 1);
+    FixUp(parent, false);
+    if (i > half) {
+      parent = sibling;
+      i -= half;
+    }
+  }
+
+  for (size_t j = parent->size; j > i; --j) {
+    parent->children[j] = parent->children[j - 1];
+    parent->first[j] = parent->first[j - 1];
+    parent->child_longest[j] = parent->child_longest[j - 1];
+    parent->child_lengths[j] = parent->child_lengths[j - 1];
   }
+  parent->size++;
+  SetEntry(parent, i, right, leaf);
+  FixUp(parent, false);
 }
 
 void HugeAddressMap::Remove(HugeAddressMap::Node *n) {
   total_size_ -= n->range_.len();
-  // We need to merge the left and right children of n into one
-  // treap, then glue it into place wherever n was.
-  Node **link;
-  Node *parent = n->parent_;
-  Node *top = n->left_;
-  Node *bottom = n->right_;
-
-  const HugeLength child_longest =
-      std::max(top ? top->longest_ : NHugePages(0),
-               bottom ? bottom->longest_ : NHugePages(0));
-  if (!parent) {
-    link = &root_;
+  used_nodes_--;
+  Leaf *leaf = n->leaf_;
+  const size_t i = n - leaf->nodes;
+  for (size_t j = i + 1; j < leaf->size; ++j) {
+    leaf->nodes[j - 1] = leaf->nodes[j];
+  }
+  leaf->size--;
+  if (leaf->size == 0) {
+    RemoveBlock(leaf, 0);
+    return;
+  }
+  MaybeMergeNext(leaf);
+  FixUp(leaf, true);
+}
+
+void HugeAddressMap::MaybeMergeNext(Leaf *leaf) {
+  Leaf *next = leaf->next;
+  if (leaf->size > kLeafSize / 4 || next == nullptr ||
+      next->parent != leaf->parent || leaf->size + next->size > kLeafSize) {
+    return;
+  }
+  for (size_t j = 0; j < next->size; ++j) {
+    leaf->nodes[leaf->size + j] = next->nodes[j];
+    leaf->nodes[leaf->size + j].leaf_ = leaf;
+  }
+  leaf->size += next->size;
+  next->size = 0;
+  RemoveBlock(next, 0);
+}
+
+void HugeAddressMap::RemoveBlock(Block *b, size_t level) {
+  ASSERT(b->size == 0);
+  Inner *parent = b->parent;
+  if (parent == nullptr) {
+    root_ = nullptr;
+    height_ = 0;
   } else {
-    // Account for the removed child--might change longests.
-    // Easiest way: update this subtree to ignore the removed node,
-    // then fix the chain of parents.
-    n->longest_ = child_longest;
-    FixLongest(parent);
-    if (parent->range_.start() > n->range_.start()) {
-      link = &parent->left_;
-    } else {
-      link = &parent->right_;
+    const size_t i = IndexIn(parent, b);
+    for (size_t j = i + 1; j < parent->size; ++j) {
+      parent->children[j - 1] = parent->children[j];
+      parent->first[j - 1] = parent->first[j];
+      parent->child_longest[j - 1] = parent->child_longest[j];
+      parent->child_lengths[j - 1] = parent->child_lengths[j];
     }
+    parent->size--;
   }
 
-  // A routine op we'll need a lot: given two (possibly null)
-  // children, put the root-ier one into top.
-  auto reorder_maybe = [](Node **top, Node **bottom) {
-    Node *b = *bottom, *t = *top;
-    if (b && (!t || t->prio_ < b->prio_)) {
-      *bottom = t;
-      *top = b;
-    }
-  };
+  if (level == 0) {
+    Leaf *leaf = static_cast<Leaf *>(b);
+    if (leaf->prev) leaf->prev->next = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    if (head_ == leaf) head_ = leaf->next;
+    Put(leaf);
+  } else {
+    Put(static_cast<Inner *>(b));
+  }
 
-  reorder_maybe(&top, &bottom);
-  // if we have two treaps to merge (top is always non-null if bottom is)
-  // Invariant: top, bottom are two valid (longest included)
-  // treaps. parent (and all above/elsewhere) have the correct longest
-  // values, though parent does not have the correct children (will be the
-  // merged value of top and bottom.)
-  while (bottom) {
-    *link = top;
-    top->parent_ = parent;
-    // We're merging bottom into top, so top might contain a longer
-    // chunk than it thinks.
-    top->longest_ = std::max(top->longest_, bottom->longest_);
-    parent = top;
-    if (bottom->range_.start() < top->range_.start()) {
-      link = &top->left_;
-      top = top->left_;
-    } else {
-      link = &top->right_;
-      top = top->right_;
-    }
-    reorder_maybe(&top, &bottom);
+  if (parent == nullptr) return;
+  if (parent->size == 0) {
+    RemoveBlock(parent, level + 1);
+    return;
+  }
+  FixUp(parent, false);
+  // Don't keep a chain of single-child roots above the tree.
+  while (height_ > 0 && root_->size == 1) {
+    Inner *old = static_cast<Inner *>(root_);
+    root_ = old->children[0];
+    root_->parent = nullptr;
+    height_--;
+    Put(old);
   }
-  *link = top;
-  if (top) top->parent_ = parent;
-  Put(n);
 }
 
-void HugeAddressMap::Put(Node *n) {
-  freelist_size_++;
-  used_nodes_--;
-  n->left_ = freelist_;
-  freelist_ = n;
+HugeAddressMap::Leaf *HugeAddressMap::NewLeaf() {
+  used_leaves_++;
+  Leaf *leaf = free_leaves_;
+  if (leaf == nullptr) {
+    leaves_created_++;
+    leaf = new (meta_(sizeof(Leaf))) Leaf;
+  } else {
+    free_leaves_ = leaf->next;
+  }
+  leaf->parent = nullptr;
+  leaf->size = 0;
+  leaf->longest = NHugePages(0);
+  leaf->lengths = 0;
+  leaf->prev = leaf->next = nullptr;
+  return leaf;
 }
 
-HugeAddressMap::Node *HugeAddressMap::Get(HugeRange r) {
-  CHECK_CONDITION((freelist_ == nullptr) == (freelist_size_ == 0));
-  used_nodes_++;
-  int prio = rand_r(&seed_);
-  if (freelist_size_ == 0) {
-    total_nodes_++;
-    Node *ret = reinterpret_cast<Node *>(meta_(sizeof(Node)));
-    return new (ret) Node(r, prio);
+HugeAddressMap::Inner *HugeAddressMap::NewInner() {
+  Inner *inner = free_inners_;
+  if (inner == nullptr) {
+    inners_created_++;
+    inner = new (meta_(sizeof(Inner))) Inner;
+  } else {
+    free_inners_ = inner->parent;
   }
+  inner->parent = nullptr;
+  inner->size = 0;
+  inner->longest = NHugePages(0);
+  inner->lengths = 0;
+  return inner;
+}
 
-  freelist_size_--;
-  Node *ret = freelist_;
-  freelist_ = ret->left_;
-  return new (ret) Node(r, prio);
+void HugeAddressMap::Put(Leaf *leaf) {
+  used_leaves_--;
+  leaf->next = free_leaves_;
+  free_leaves_ = leaf;
 }
 
-HugeAddressMap::Node::Node(HugeRange r, int prio)
-    : range_(r), prio_(prio), when_(absl::base_internal::CycleClock::Now()) {}
+void HugeAddressMap::Put(Inner *inner) {
+  inner->parent = free_inners_;
+  free_inners_ = inner;
+}
 
 }  // namespace tcmalloc
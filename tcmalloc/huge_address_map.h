@@ -23,14 +23,19 @@
 namespace tcmalloc {
 
 // Maintains a set of disjoint HugeRanges, merging adjacent ranges into one.
-// Exposes a balanced (somehow) binary tree of free ranges on address,
-// augmented with the largest range in each subtree (this allows fairly simple
-// allocation algorithms from the contained ranges.
+// The ranges are kept in a B+-tree on address: leaves hold up to kLeafSize
+// ranges each and are linked in address order, and each interior node keeps,
+// for each child, the lowest address and the longest range in that subtree.
+// Lookups by address and by length (Find) touch a few cache lines per level
+// of a shallow tree, rather than one per level of a binary tree.
 //
 // This class scales well and is *reasonably* performant, but it is not intended
 // for use on extremely hot paths.
 // TODO(b/134688982): extend to support other range-like types?
 class HugeAddressMap {
+ private:
+  struct Leaf;
+
  public:
   typedef void *(*MetadataAllocFunction)(size_t bytes);
   explicit constexpr HugeAddressMap(MetadataAllocFunction meta);
@@ -39,15 +44,12 @@ class HugeAddressMap {
   // AT FREEING ALLOCATED METADATA.
   ~HugeAddressMap() = default;
 
+  // One range in the map.  Pointers to nodes are invalidated by any Insert or
+  // Remove.
   class Node {
    public:
     // the range stored at this point
     HugeRange range() const;
-    // Tree structure
-    Node *left();
-    const Node *left() const;
-    Node *right();
-    const Node *right() const;
     // Iterate to the next node in address order
     const Node *next() const;
     Node *next();
@@ -55,30 +57,13 @@ class HugeAddressMap {
     // absl::base_internal::CycleClock::Now units)?
     int64_t when() const;
 
-    // What is the length of the longest range in the subtree rooted here?
-    HugeLength longest() const;
-
    private:
-    Node(HugeRange r, int prio);
     friend class HugeAddressMap;
     HugeRange range_;
-    int prio_;  // chosen randomly
-    Node *left_, *right_;
-    Node *parent_;
-    HugeLength longest_;
     int64_t when_;
-    // Expensive, recursive consistency check.
-    // Accumulates node count and range sizes into passed arguments.
-    void Check(size_t *num_nodes, HugeLength *size) const;
-
-    // We've broken longest invariants somehow; fix them here.
-    void FixLongest();
+    Leaf *leaf_;
   };
 
-  // Get root of the tree.
-  Node *root();
-  const Node *root() const;
-
   // Get lowest-addressed node
   const Node *first() const;
   Node *first();
@@ -87,6 +72,16 @@ class HugeAddressMap {
   // after p (if any).
   Node *Predecessor(HugePage p);
 
+  // Returns a node holding at least n hugepages, if any.  We favor shorter
+  // ranges, then lower addresses.  This is an exact best fit as long as some
+  // range shorter than 64 hugepages will do; among longer ones we follow the
+  // shortest sufficient subtree maximum at each level, which may miss a
+  // slightly better fit elsewhere.
+  Node *Find(HugeLength n);
+
+  // The length of the longest range.
+  HugeLength longest() const;
+
   // Expensive consistency check.
   void Check();
 
@@ -103,48 +98,113 @@ class HugeAddressMap {
   void Remove(Node *n);
 
  private:
-  // our tree
-  Node *root_{nullptr};
+  static constexpr size_t kLeafSize = 15;
+  static constexpr size_t kFanout = 16;
+
+  struct Inner;
+  // What leaves and interior nodes have in common.
+  struct Block {
+    Inner *parent;
+    size_t size;
+    // The longest range under us, and the union of LengthBit() of them all.
+    HugeLength longest;
+    uint64_t lengths;
+  };
+
+  // Ranges of 1 to 63 hugepages get a bit each; longer ones share the top bit.
+  static constexpr uint64_t kLongBit = uint64_t{1} << 63;
+  static uint64_t LengthBit(HugeLength n);
+
+  struct Leaf : Block {
+    Leaf *prev;
+    Leaf *next;
+    Node nodes[kLeafSize];
+  };
+
+  struct Inner : Block {
+    // Leaves if we are at the lowest interior level, else Inners.
+    Block *children[kFanout];
+    // children[i]'s lowest address, longest range and LengthBits.
+    HugePage first[kFanout];
+    HugeLength child_longest[kFanout];
+    uint64_t child_lengths[kFanout];
+  };
+
+  // our tree: root_ is a Leaf if height_ is 0, else an Inner.
+  Block *root_{nullptr};
+  size_t height_{0};
+  // The leaves, in address order.
+  Leaf *head_{nullptr};
+
   size_t used_nodes_{0};
   HugeLength total_size_{NHugePages(0)};
 
-  // cache of unused nodes
-  Node *freelist_{nullptr};
-  size_t freelist_size_{0};
+  // caches of unused blocks
+  Leaf *free_leaves_{nullptr};
+  Inner *free_inners_{nullptr};
+  size_t used_leaves_{0};
+  size_t leaves_created_{0};
+  size_t inners_created_{0};
   // How we get more
   MetadataAllocFunction meta_;
-  Node *Get(HugeRange r);
-  void Put(Node *n);
-
-  size_t total_nodes_{0};
+  Leaf *NewLeaf();
+  Inner *NewInner();
+  void Put(Leaf *leaf);
+  void Put(Inner *inner);
+
+  static HugePage FirstPage(const Block *b, bool leaf);
+  static size_t IndexIn(const Inner *parent, const Block *child);
+  // Recomputes b's longest and lengths from its contents.
+  static void Summarize(Block *b, bool leaf);
+  // Copies child's summary into its entry i in parent.
+  static void SetEntry(Inner *parent, size_t i, Block *child, bool leaf);
+  // Summarizes b after a change in it, and so on up the tree until nothing
+  // changes.
+  void FixUp(Block *b, bool leaf);
+  // Inserts a new node for r at position i of leaf.
+  void InsertAt(Leaf *leaf, size_t i, HugeRange r);
+  // Adds right, a new block, to the tree as the next sibling of left.
+  void InsertSibling(Block *left, Block *right, size_t level);
+  // Takes an empty block out of the tree.
+  void RemoveBlock(Block *b, size_t level);
+  // Moves the nodes of leaf's successor into it, if they fit and the two
+  // share a parent.
+  void MaybeMergeNext(Leaf *leaf);
 
   void Merge(Node *b, HugeRange r, Node *a);
-  void FixLongest(Node *n);
-  // Note that we always use the same seed, currently; this isn't very random.
-  // In practice we're not worried about adversarial input and this works well
-  // enough.
-  unsigned int seed_{0};
+
+  // Recursive consistency check.  Accumulates node count and range sizes into
+  // passed arguments.
+  void Check(const Block *b, size_t level, size_t *num_nodes,
+             HugeLength *size) const;
 };
 
 inline constexpr HugeAddressMap::HugeAddressMap(MetadataAllocFunction meta)
     : meta_(meta) {}
 
 inline HugeRange HugeAddressMap::Node::range() const { return range_; }
-inline HugeAddressMap::Node *HugeAddressMap::Node::left() { return left_; }
-inline const HugeAddressMap::Node *HugeAddressMap::Node::left() const {
-  return left_;
+inline int64_t HugeAddressMap::Node::when() const { return when_; }
+
+inline HugeAddressMap::Node *HugeAddressMap::Node::next() {
+  const Node *n = static_cast<const Node *>(this)->next();
+  return const_cast<Node *>(n);
 }
-inline HugeAddressMap::Node *HugeAddressMap::Node::right() { return right_; }
-inline const HugeAddressMap::Node *HugeAddressMap::Node::right() const {
-  return right_;
+
+inline const HugeAddressMap::Node *HugeAddressMap::Node::next() const {
+  if (this + 1 < leaf_->nodes + leaf_->size) return this + 1;
+  return leaf_->next ? leaf_->next->nodes : nullptr;
 }
 
-inline int64_t HugeAddressMap::Node::when() const { return when_; }
-inline HugeLength HugeAddressMap::Node::longest() const { return longest_; }
+inline const HugeAddressMap::Node *HugeAddressMap::first() const {
+  return head_ ? head_->nodes : nullptr;
+}
+
+inline HugeAddressMap::Node *HugeAddressMap::first() {
+  return head_ ? head_->nodes : nullptr;
+}
 
-inline HugeAddressMap::Node *HugeAddressMap::root() { return root_; }
-inline const HugeAddressMap::Node *HugeAddressMap::root() const {
-  return root_;
+inline HugeLength HugeAddressMap::longest() const {
+  return root_ ? root_->longest : NHugePages(0);
 }
 
 }  // namespace tcmalloc
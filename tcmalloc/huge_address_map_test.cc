@@ -15,10 +15,14 @@
 #include "tcmalloc/huge_address_map.h"
 
 #include <stdlib.h>
+
+#include <map>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "benchmark/benchmark.h"
+#include "absl/random/random.h"
 
 namespace tcmalloc {
 namespace {
@@ -78,5 +82,198 @@ TEST_F(HugeAddressMapTest, Merging) {
   EXPECT_THAT(Contents(), testing::ElementsAre(all));
 }
 
+TEST_F(HugeAddressMapTest, FindBestFit) {
+  EXPECT_EQ(nullptr, map_.Find(hl(1)));
+  // Enough ranges to need several leaves.
+  for (size_t i = 0; i < 100; ++i) {
+    map_.Insert(HugeRange::Make(hp(1000 * i), hl(i % 10 + 2)));
+  }
+  map_.Insert(HugeRange::Make(hp(1000 * 100), hl(100)));
+  map_.Insert(HugeRange::Make(hp(1000 * 101), hl(80)));
+  map_.Check();
+  EXPECT_EQ(hl(100), map_.longest());
+
+  // Shortest sufficient, then lowest.
+  EXPECT_EQ(HugeRange::Make(hp(0), hl(2)), map_.Find(hl(1))->range());
+  EXPECT_EQ(HugeRange::Make(hp(3000), hl(5)), map_.Find(hl(5))->range());
+  EXPECT_EQ(HugeRange::Make(hp(8000), hl(10)), map_.Find(hl(10))->range());
+  EXPECT_EQ(HugeRange::Make(hp(101000), hl(80)), map_.Find(hl(12))->range());
+  EXPECT_EQ(HugeRange::Make(hp(101000), hl(80)), map_.Find(hl(64))->range());
+  EXPECT_EQ(HugeRange::Make(hp(100000), hl(100)), map_.Find(hl(81))->range());
+  EXPECT_EQ(nullptr, map_.Find(hl(101)));
+}
+
+TEST_F(HugeAddressMapTest, Predecessor) {
+  EXPECT_EQ(nullptr, map_.Predecessor(hp(5)));
+  for (size_t i = 1; i <= 50; ++i) {
+    map_.Insert(HugeRange::Make(hp(10 * i), hl(2)));
+  }
+  map_.Check();
+  EXPECT_EQ(nullptr, map_.Predecessor(hp(9)));
+  EXPECT_EQ(hp(10), map_.Predecessor(hp(10))->range().start());
+  EXPECT_EQ(hp(10), map_.Predecessor(hp(19))->range().start());
+  EXPECT_EQ(hp(250), map_.Predecessor(hp(255))->range().start());
+  EXPECT_EQ(hp(500), map_.Predecessor(hp(100000))->range().start());
+}
+
+// Random inserts and removals, against a simple reference.
+TEST_F(HugeAddressMapTest, Random) {
+  absl::BitGen rng;
+  // start -> length of free ranges, merged as the map should.
+  std::map<size_t, size_t> ref;
+  auto ref_contents = [&]() {
+    std::vector<HugeRange> ret;
+    for (auto [start, len] : ref) {
+      ret.push_back(HugeRange::Make(hp(start), hl(len)));
+    }
+    return ret;
+  };
+
+  constexpr size_t kPages = 4096;
+  std::vector<bool> used(kPages, false);
+  for (int iter = 0; iter < 20000; ++iter) {
+    const size_t len = absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, 8);
+    if (absl::Bernoulli(rng, 0.55)) {
+      // Insert a random free range, if it is free.
+      const size_t start = absl::Uniform<size_t>(rng, 0, kPages - len);
+      bool free = true;
+      for (size_t i = start; i < start + len; ++i) free = free && !used[i];
+      if (!free) continue;
+      for (size_t i = start; i < start + len; ++i) used[i] = true;
+      map_.Insert(HugeRange::Make(hp(start), hl(len)));
+      auto it = ref.emplace(start, len).first;
+      auto next = std::next(it);
+      if (next != ref.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        ref.erase(next);
+      }
+      if (it != ref.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+          prev->second += it->second;
+          ref.erase(it);
+        }
+      }
+    } else {
+      HugeAddressMap::Node *node = map_.Find(hl(len));
+      auto best = ref.end();
+      for (auto it = ref.begin(); it != ref.end(); ++it) {
+        if (it->second >= len &&
+            (best == ref.end() || it->second < best->second)) {
+          best = it;
+        }
+      }
+      if (best == ref.end()) {
+        EXPECT_EQ(nullptr, node);
+        continue;
+      }
+      ASSERT_NE(nullptr, node);
+      const HugeRange r = node->range();
+      EXPECT_EQ(HugeRange::Make(hp(best->first), hl(best->second)), r);
+      map_.Remove(node);
+      ref.erase(best);
+      for (size_t i = 0; i < r.len().raw_num(); ++i) {
+        used[r.start().index() + i] = false;
+      }
+    }
+    if (iter % 100 == 0) map_.Check();
+    ASSERT_EQ(ref.size(), map_.nranges());
+  }
+  map_.Check();
+  EXPECT_EQ(ref_contents(), Contents());
+}
+
+// Benchmarks build maps of tens of thousands of ranges, as a large heap's
+// HugeCache or HugeAllocator may hold.
+class BenchmarkMap {
+ public:
+  // num_ranges disjoint ranges of 2 to 16 hugepages, with gaps between them.
+  explicit BenchmarkMap(size_t num_ranges) : map_(Metadata) {
+    absl::BitGen rng;
+    for (size_t i = 0; i < num_ranges; ++i) {
+      const HugeRange r = HugeRange::Make(
+          HugePage{(i + 1) * kStride},
+          NHugePages(absl::Uniform<size_t>(absl::IntervalClosed, rng, 2, 16)));
+      map_.Insert(r);
+      starts_.push_back(r.start());
+    }
+    for (size_t i = 0; i < 4096; ++i) {
+      picks_.push_back(starts_[absl::Uniform<size_t>(rng, 0, num_ranges)]);
+      lengths_.push_back(
+          NHugePages(absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, 16)));
+    }
+  }
+
+  ~BenchmarkMap() {
+    for (void *p : allocs_) free(p);
+    allocs_.clear();
+  }
+
+  HugeAddressMap &map() { return map_; }
+  HugePage pick(size_t i) const { return picks_[i % picks_.size()]; }
+  HugeLength length(size_t i) const { return lengths_[i % lengths_.size()]; }
+
+ private:
+  static constexpr size_t kStride = 32;
+
+  static void *Metadata(size_t size) {
+    void *p = malloc(size);
+    allocs_.push_back(p);
+    return p;
+  }
+
+  static std::vector<void *> allocs_;
+  HugeAddressMap map_;
+  std::vector<HugePage> starts_;
+  std::vector<HugePage> picks_;
+  std::vector<HugeLength> lengths_;
+};
+
+std::vector<void *> BenchmarkMap::allocs_;
+
+// As HugeCache::Get and Release: find a fit, take it, put it back.
+void BM_FindRemoveInsert(benchmark::State &state) {
+  BenchmarkMap b(state.range(0));
+  HugeAddressMap &map = b.map();
+  size_t i = 0;
+  for (auto _ : state) {
+    HugeAddressMap::Node *node = map.Find(b.length(i++));
+    const HugeRange r = node->range();
+    map.Remove(node);
+    map.Insert(r);
+  }
+}
+BENCHMARK(BM_FindRemoveInsert)->Range(1 << 10, 1 << 16);
+
+// Looks up a range by address, as Insert does before merging.
+void BM_PredecessorRemoveInsert(benchmark::State &state) {
+  BenchmarkMap b(state.range(0));
+  HugeAddressMap &map = b.map();
+  size_t i = 0;
+  for (auto _ : state) {
+    HugeAddressMap::Node *node = map.Predecessor(b.pick(i++));
+    const HugeRange r = node->range();
+    map.Remove(node);
+    map.Insert(r);
+  }
+}
+BENCHMARK(BM_PredecessorRemoveInsert)->Range(1 << 10, 1 << 16);
+
+// Splits a range in two and lets Insert merge it back together.
+void BM_SplitAndMerge(benchmark::State &state) {
+  BenchmarkMap b(state.range(0));
+  HugeAddressMap &map = b.map();
+  size_t i = 0;
+  for (auto _ : state) {
+    HugeAddressMap::Node *node = map.Predecessor(b.pick(i++));
+    const HugeRange r = node->range();
+    map.Remove(node);
+    const HugeLength half = r.len() / 2;
+    map.Insert(HugeRange::Make(r.start(), half));
+    map.Insert(HugeRange::Make(r.start() + half, r.len() - half));
+  }
+}
+BENCHMARK(BM_SplitAndMerge)->Range(1 << 10, 1 << 16);
+
 }  // namespace
 }  // namespace tcmalloc
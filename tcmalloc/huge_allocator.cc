@@ -16,8 +16,11 @@
 
 #include <string.h>
 
+#include <algorithm>
+
 #include "tcmalloc/huge_address_map.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -28,59 +31,21 @@ void HugeAllocator::Print(TCMalloc_Printer *out) {
       "HugeAllocator: %zu requested - %zu in use = %zu hugepages free\n",
       from_system_.raw_num(), in_use_.raw_num(),
       (from_system_ - in_use_).raw_num());
+  out->printf("HugeAllocator: %zu free hugepages lazily freed\n",
+              lazily_freed_.raw_num());
+  out->printf(
+      "HugeAllocator: %zu idle hugepages unmapped in %zu ranges, "
+      "releasing %zu bytes of metadata\n",
+      unmapped_.raw_num(), unmapped_ranges_, unmapped_metadata_bytes_);
 }
 
 void HugeAllocator::PrintInPbtxt(PbtxtRegion *hpaa) const {
   free_.PrintInPbtxt(hpaa);
   hpaa->PrintI64("num_total_requested_huge_pages", from_system_.raw_num());
   hpaa->PrintI64("num_in_use_huge_pages", in_use_.raw_num());
-}
-
-HugeAddressMap::Node *HugeAllocator::Find(HugeLength n) {
-  HugeAddressMap::Node *curr = free_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node *best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
-      }
-    }
-
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
-
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
-      }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
-    }
-  }
-  return best;
+  hpaa->PrintI64("num_lazily_freed_huge_pages", lazily_freed_.raw_num());
+  hpaa->PrintI64("unmapped_idle_address_space_bytes", unmapped_.in_bytes());
+  hpaa->PrintI64("unmapped_idle_metadata_bytes", unmapped_metadata_bytes_);
 }
 
 void HugeAllocator::CheckFreelist() {
@@ -116,14 +81,14 @@ HugeRange HugeAllocator::AllocateRange(HugeLength n) {
 
 HugeRange HugeAllocator::Get(HugeLength n) {
   CHECK_CONDITION(n > NHugePages(0));
-  auto *node = Find(n);
+  auto *node = free_.Find(n);
   if (!node) {
     // Get more memory, then "delete" it
     HugeRange r = AllocateRange(n);
     if (!r.valid()) return r;
     in_use_ += r.len();
     Release(r);
-    node = Find(n);
+    node = free_.Find(n);
     CHECK_CONDITION(node != nullptr);
   }
   in_use_ += n;
@@ -143,9 +108,33 @@ HugeRange HugeAllocator::Get(HugeLength n) {
     DebugCheckFreelist();
   }
 
+  lazily_freed_ -= std::min(lazily_freed_, n);
   return r;
 }
 
+bool HugeAllocator::GetAt(HugeRange r) {
+  CHECK_CONDITION(r.len() > NHugePages(0));
+  auto *node = free_.Predecessor(r.start());
+  if (node == nullptr || !node->range().contains(r)) return false;
+
+  const HugeRange whole = node->range();
+  free_.Remove(node);
+  in_use_ += whole.len();
+  // Put back what lies on either side of r.
+  if (whole.start() < r.start()) {
+    Release(HugeRange::Make(whole.start(), r.start() - whole.start()));
+  }
+  const HugePage end = whole.start() + whole.len();
+  const HugePage r_end = r.start() + r.len();
+  if (r_end < end) {
+    Release(HugeRange::Make(r_end, end - r_end));
+  }
+  DebugCheckFreelist();
+
+  lazily_freed_ -= std::min(lazily_freed_, r.len());
+  return true;
+}
+
 void HugeAllocator::Release(HugeRange r) {
   in_use_ -= r.len();
 
@@ -153,6 +142,63 @@ void HugeAllocator::Release(HugeRange r) {
   DebugCheckFreelist();
 }
 
+void HugeAllocator::ReleaseLazilyFreed(HugeRange r) {
+  Release(r);
+  lazily_freed_ += r.len();
+}
+
+HugeLength HugeAllocator::UnmapIdle(int64_t cutoff) {
+  if (unmap_ == nullptr) return NHugePages(0);
+
+  HugeLength total = NHugePages(0);
+  HugeRange batch[kMaxReleaseBatch];
+  size_t n;
+  bool failed = false;
+  do {
+    // Removing nodes invalidates our place in the map, so pick a batch
+    // first and then take them out one by one.
+    n = 0;
+    for (const HugeAddressMap::Node *node = free_.first();
+         node != nullptr && n < kMaxReleaseBatch; node = node->next()) {
+      if (node->range().len() >= kMinUnmap && node->when() <= cutoff) {
+        batch[n++] = node->range();
+      }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      const HugeRange r = batch[i];
+      // unmap_ may have dropped our lock, and others changed the map since.
+      HugeAddressMap::Node *node = free_.Predecessor(r.start());
+      if (node == nullptr || !(node->range() == r) || node->when() > cutoff) {
+        continue;
+      }
+      // Take r out of the map while unmap_ works on it.
+      free_.Remove(node);
+      in_use_ += r.len();
+      size_t metadata = 0;
+      const bool unmapped = unmap_(r.start_addr(), r.byte_len(), &metadata);
+      in_use_ -= r.len();
+      if (!unmapped) {
+        // Leave it be, and don't go around again for the same ranges.
+        free_.Insert(r);
+        failed = true;
+        continue;
+      }
+      from_system_ -= r.len();
+      // Whatever was lazily freed is gone now; we don't know where it was, so
+      // assume it was here.
+      lazily_freed_ -= std::min(lazily_freed_, r.len());
+      total += r.len();
+      unmapped_ranges_++;
+      unmapped_metadata_bytes_ += metadata;
+    }
+  } while (n == kMaxReleaseBatch && !failed);
+
+  unmapped_ += total;
+  DebugCheckFreelist();
+  return total;
+}
+
 void HugeAllocator::AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                                  PageAgeHistograms *ages) const {
   for (const HugeAddressMap::Node *node = free_.first(); node != nullptr;
@@ -29,6 +29,11 @@ namespace tcmalloc {
 typedef void *(*MemoryAllocFunction)(size_t bytes, size_t *actual,
                                      size_t align);
 typedef void *(*MetadataAllocFunction)(size_t bytes);
+// Returns [start, start + len) to the OS, address space and all.  On success,
+// adds the bytes of metadata released along with it to *metadata_bytes.  May
+// drop the caller's lock while it does so.
+typedef bool (*MemoryUnmapFunction)(void *start, size_t len,
+                                    size_t *metadata_bytes);
 
 // This tracks available ranges of hugepages and fulfills requests for
 // usable memory, allocating more from the system as needed.  All
@@ -36,23 +41,48 @@ typedef void *(*MetadataAllocFunction)(size_t bytes);
 class HugeAllocator {
  public:
   constexpr HugeAllocator(MemoryAllocFunction allocate,
-                          MetadataAllocFunction meta_allocate)
-      : free_(meta_allocate), allocate_(allocate) {}
+                          MetadataAllocFunction meta_allocate,
+                          MemoryUnmapFunction unmap = nullptr)
+      : free_(meta_allocate), allocate_(allocate), unmap_(unmap) {}
+
+  // Shorter free ranges are never unmapped: each would split a mapping in
+  // two for little gain.
+  static constexpr HugeLength kMinUnmap = NHugePages(16);
 
   // Obtain a range of n unbacked hugepages, distinct from all other
   // calls to Get (other than those that have been Released.)
   HugeRange Get(HugeLength n);
 
+  // Obtains exactly <r>, if all of it is free, and returns true; otherwise
+  // returns false.  Lets a caller extend a range it already has.
+  bool GetAt(HugeRange r);
+
   // Returns a range of hugepages for reuse by subsequent Gets().
   // REQUIRES: <r> is the return value (or a subrange thereof) of a previous
   // call to Get(); neither <r> nor any overlapping range has been released
   // since that Get().
   void Release(HugeRange r);
+  // As Release, but <r> was released to the system lazily (see
+  // SystemReleaseIsLazy) and so may still be resident.
+  void ReleaseLazilyFreed(HugeRange r);
+
+  // Unmaps free ranges of at least kMinUnmap that have sat unused since
+  // before cutoff (in absl::base_internal::CycleClock::Now units), so that
+  // the address space of a past spike, and the metadata covering it, need
+  // not be kept forever.  Returns the hugepages unmapped; system() shrinks
+  // by as much.  Does nothing without an unmap function.
+  HugeLength UnmapIdle(int64_t cutoff);
 
   // Total memory requested from the system, whether in use or not,
   HugeLength system() const { return from_system_; }
   // Unused memory in the allocator.
   HugeLength size() const { return from_system_ - in_use_; }
+  // The number of contiguous ranges that is in.
+  size_t ranges() const { return free_.nranges(); }
+  // The subset of size() that was lazily freed.  We don't track which ranges
+  // these are, so Get() conservatively assumes it reuses lazily freed
+  // hugepages first.
+  HugeLength lazily_freed() const { return lazily_freed_; }
 
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                     PageAgeHistograms *ages) const;
@@ -62,6 +92,7 @@ class HugeAllocator {
     s.system_bytes = system().in_bytes();
     s.free_bytes = 0;
     s.unmapped_bytes = size().in_bytes();
+    s.lazily_freed_bytes = lazily_freed().in_bytes();
     return s;
   }
 
@@ -76,13 +107,12 @@ class HugeAllocator {
   // * no pre-allocation.
   // * reasonable space overhead
   //
-  // We use a treap ordered on addresses to track.  This isn't the most
+  // We use a B+-tree ordered on addresses to track.  This isn't the most
   // efficient thing ever but we're about to hit 100usec+/hugepage
   // backing costs if we've gotten this far; the last few bits of performance
   // don't matter, and most of the simple ideas can't hit all of the above
   // requirements.
   HugeAddressMap free_;
-  HugeAddressMap::Node *Find(HugeLength n);
 
   void CheckFreelist();
   void DebugCheckFreelist() {
@@ -93,9 +123,15 @@ class HugeAllocator {
 
   HugeLength from_system_{NHugePages(0)};
   HugeLength in_use_{NHugePages(0)};
+  HugeLength lazily_freed_{NHugePages(0)};
+  // Totals for UnmapIdle.
+  HugeLength unmapped_{NHugePages(0)};
+  size_t unmapped_ranges_{0};
+  size_t unmapped_metadata_bytes_{0};
 
   MemoryAllocFunction allocate_;
   HugeRange AllocateRange(HugeLength n);
+  MemoryUnmapFunction unmap_;
 };
 
 }  // namespace tcmalloc
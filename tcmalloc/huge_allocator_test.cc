@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -48,12 +49,17 @@ class HugeAllocatorTest : public testing::TestWithParam<bool> {
   // can be deleted.
   static void *MallocMetadata(size_t size);
   static std::vector<void *> metadata_allocs_;
+  // Records what we're asked to unmap, claiming some metadata went with it.
+  static bool UnmapFake(void *start, size_t len, size_t *metadata_bytes);
   static size_t metadata_bytes_;
   static bool should_overallocate_;
   static HugeLength huge_pages_requested_;
   static HugeLength huge_pages_received_;
 
  protected:
+  static constexpr size_t kUnmapMetadataBytes = 4096;
+  static std::vector<HugeRange> unmapped_;
+
   HugeLength HugePagesRequested() { return huge_pages_requested_; }
   HugeLength HugePagesReceived() { return huge_pages_received_; }
 
@@ -67,6 +73,7 @@ class HugeAllocatorTest : public testing::TestWithParam<bool> {
     // given zero pointers.
     backing_.resize(1024);
     metadata_bytes_ = 0;
+    unmapped_.clear();
   }
 
   ~HugeAllocatorTest() override {
@@ -101,7 +108,7 @@ class HugeAllocatorTest : public testing::TestWithParam<bool> {
     EXPECT_EQ(used, expected_use);
   }
 
-  HugeAllocator allocator_{AllocateFake, MallocMetadata};
+  HugeAllocator allocator_{AllocateFake, MallocMetadata, UnmapFake};
 };
 
 // Use a tiny fraction of actual size so we can test aggressively.
@@ -137,8 +144,17 @@ void *HugeAllocatorTest::MallocMetadata(size_t size) {
   return ptr;
 }
 
+bool HugeAllocatorTest::UnmapFake(void *start, size_t len,
+                                  size_t *metadata_bytes) {
+  unmapped_.push_back(
+      HugeRange::Make(HugePageContaining(start), HLFromBytes(len)));
+  *metadata_bytes += kUnmapMetadataBytes;
+  return true;
+}
+
 std::vector<size_t> HugeAllocatorTest::backing_;
 std::vector<void *> HugeAllocatorTest::metadata_allocs_;
+std::vector<HugeRange> HugeAllocatorTest::unmapped_;
 size_t HugeAllocatorTest::metadata_bytes_;
 bool HugeAllocatorTest::should_overallocate_;
 HugeLength HugeAllocatorTest::huge_pages_requested_;
@@ -432,6 +448,45 @@ TEST_P(HugeAllocatorTest, Stats) {
             avg_age);
 }
 
+TEST_P(HugeAllocatorTest, UnmapIdle) {
+  const HugeRange r = allocator_.Get(NHugePages(40));
+  ASSERT_TRUE(r.valid());
+  // Free a long range and a short one, separated by one in use.
+  const HugeRange r1 = {r.start(), NHugePages(20)};
+  const HugeRange r2 = {r.start() + NHugePages(21), NHugePages(4)};
+  const int64_t before = absl::base_internal::CycleClock::Now();
+  allocator_.Release(r1);
+  allocator_.Release(r2);
+  const HugeLength system = allocator_.system();
+  const HugeLength free = allocator_.size();
+
+  // Neither has been idle since before.
+  EXPECT_EQ(NHugePages(0), allocator_.UnmapIdle(before));
+  EXPECT_TRUE(unmapped_.empty());
+
+  // Only the long one goes.
+  EXPECT_EQ(NHugePages(20),
+            allocator_.UnmapIdle(absl::base_internal::CycleClock::Now()));
+  ASSERT_EQ(1, unmapped_.size());
+  EXPECT_EQ(r1, unmapped_[0]);
+  EXPECT_EQ(system - NHugePages(20), allocator_.system());
+  EXPECT_EQ(free - NHugePages(20), allocator_.size());
+  EXPECT_EQ(NHugePages(0),
+            allocator_.UnmapIdle(absl::base_internal::CycleClock::Now()));
+
+  // What's left is still usable.
+  EXPECT_EQ(r2, allocator_.Get(NHugePages(4)));
+
+  std::string buffer(1024 * 1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    allocator_.Print(&printer);
+  }
+  EXPECT_NE(std::string::npos,
+            buffer.find("HugeAllocator: 20 idle hugepages unmapped in 1 "
+                        "ranges, releasing 4096 bytes of metadata"));
+}
+
 // Make sure we're well-behaved in the presence of OOM (and that we do
 // OOM at some point...)
 TEST_P(HugeAllocatorTest, OOM) {
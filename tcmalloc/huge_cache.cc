@@ -22,6 +22,7 @@
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -102,7 +103,7 @@ template class MinMaxTracker<600>;
 // The logic for actually allocating from the cache or backing, and keeping
 // the hit rates specified.
 HugeRange HugeCache::DoGet(HugeLength n, bool *from_released) {
-  auto *node = Find(n);
+  auto *node = cache_.Find(n);
   if (!node) {
     misses_++;
     weighted_misses_ += n.raw_num();
@@ -216,9 +217,60 @@ HugeRange HugeCache::Get(HugeLength n, bool *from_released) {
 
   const bool miss = r.valid() && *from_released;
   if (miss) MaybeGrowCacheLimit(n);
+  if (warm_reserve_ > NHugePages(0)) {
+    if (miss) {
+      reserve_misses_++;
+    } else {
+      reserve_hits_++;
+    }
+  }
   return r;
 }
 
+bool HugeCache::GetAt(HugeRange r, bool *from_released) {
+  auto *node = cache_.Predecessor(r.start());
+  if (node != nullptr && node->range().contains(r)) {
+    const HugeRange whole = node->range();
+    cache_.Remove(node);
+    if (whole.start() < r.start()) {
+      cache_.Insert(HugeRange::Make(whole.start(), r.start() - whole.start()));
+    }
+    const HugePage end = whole.start() + whole.len();
+    const HugePage r_end = r.start() + r.len();
+    if (r_end < end) {
+      cache_.Insert(HugeRange::Make(r_end, end - r_end));
+    }
+    size_ -= r.len();
+    UpdateSize(size());
+    *from_released = false;
+  } else if (allocator_->GetAt(r)) {
+    *from_released = true;
+  } else {
+    return false;
+  }
+  // Not a hit or a miss: nobody asked us to find memory.
+  IncUsage(r.len());
+  return true;
+}
+
+HugeLength HugeCache::RefillWarmReserve() {
+  HugeLength added = NHugePages(0);
+  if (populate_ == nullptr) return added;
+  while (size_ < warm_reserve_) {
+    HugeRange r = allocator_->Get(warm_reserve_ - size_);
+    if (!r.valid()) break;
+    // Nobody else can see r until we add it to the cache, so it's fine if
+    // populate_ drops our lock.
+    populate_(r.start_addr(), r.byte_len());
+    cache_.Insert(r);
+    size_ += r.len();
+    added += r.len();
+  }
+  total_warm_populated_ += added;
+  UpdateSize(size());
+  return added;
+}
+
 void HugeCache::Release(HugeRange r) {
   DecUsage(r.len());
 
@@ -234,9 +286,11 @@ void HugeCache::Release(HugeRange r) {
   // the max size.  (This could reduce the number of regions we break
   // in half to avoid overshrinking.)
   if (absl::Nanoseconds(clock_() - last_limit_change_) > (kCacheTime * 2)) {
-    total_fast_unbacked_ += MaybeShrinkCacheLimit();
+    MaybeShrinkCacheLimit();
   }
-  total_fast_unbacked_ += ShrinkCache(limit());
+  // Only unback what would take us past the deferred budget; that is at most
+  // r, so the cost of a Release stays proportional to its size.
+  total_fast_unbacked_ += ShrinkCache(target() + deferred_unback_limit_);
 
   UpdateSize(size());
 }
@@ -244,30 +298,36 @@ void HugeCache::Release(HugeRange r) {
 void HugeCache::ReleaseUnbacked(HugeRange r) {
   DecUsage(r.len());
   // No point in trying to cache it, just hand it back.
-  allocator_->Release(r);
+  if (SystemReleaseIsLazy()) {
+    allocator_->ReleaseLazilyFreed(r);
+  } else {
+    allocator_->Release(r);
+  }
 }
 
-HugeLength HugeCache::MaybeShrinkCacheLimit() {
+void HugeCache::MaybeShrinkCacheLimit() {
   last_limit_change_ = clock_();
 
   const HugeLength min = size_tracker_.MinOverTime(kCacheTime * 2);
   // If cache size has gotten down to at most 20% of max, we assume
   // we're close enough to the optimal size--we don't want to fiddle
   // too much/too often unless we have large gaps in usage.
-  if (min < limit() / 5) return NHugePages(0);
+  if (min < limit() / 5) return;
 
   // Take away half of the unused portion.
   HugeLength drop = std::max(min / 2, NHugePages(1));
   limit_ = std::max(limit() <= drop ? NHugePages(0) : limit() - drop,
                     MinCacheLimit());
-  return ShrinkCache(limit());
 }
 
 HugeLength HugeCache::ShrinkCache(HugeLength target) {
   HugeLength removed = NHugePages(0);
+  // Unback what we remove in batches: the cache may be fragmented.
+  HugeRange batch[kMaxReleaseBatch];
+  size_t n = 0;
   while (size_ > target) {
     // Remove smallest-ish nodes, to avoid fragmentation where possible.
-    auto *node = Find(NHugePages(1));
+    auto *node = cache_.Find(NHugePages(1));
     CHECK_CONDITION(node);
     HugeRange r = node->range();
     cache_.Remove(node);
@@ -286,24 +346,57 @@ HugeLength HugeCache::ShrinkCache(HugeLength target) {
     }
 
     size_ -= r.len();
-    // Note, actual unback implementation is temporarily dropping and
-    // re-acquiring the page heap lock here.
-    unback_(r.start_addr(), r.byte_len());
-    allocator_->Release(r);
     removed += r.len();
+    batch[n++] = r;
+    if (n == kMaxReleaseBatch) {
+      UnbackAndRelease(batch, n);
+      n = 0;
+    }
   }
+  UnbackAndRelease(batch, n);
 
   return removed;
 }
 
+void HugeCache::UnbackAndRelease(const HugeRange *ranges, size_t n) {
+  if (n == 0) return;
+  // Note, actual unback implementation is temporarily dropping and
+  // re-acquiring the page heap lock here.
+  if (unback_ranges_ != nullptr) {
+    struct iovec iov[kMaxReleaseBatch];
+    ASSERT(n <= kMaxReleaseBatch);
+    for (size_t i = 0; i < n; ++i) {
+      iov[i].iov_base = ranges[i].start_addr();
+      iov[i].iov_len = ranges[i].byte_len();
+    }
+    unback_ranges_(iov, n);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      unback_(ranges[i].start_addr(), ranges[i].byte_len());
+    }
+  }
+
+  const bool lazy = SystemReleaseIsLazy();
+  for (size_t i = 0; i < n; ++i) {
+    if (lazy) {
+      allocator_->ReleaseLazilyFreed(ranges[i]);
+      total_lazily_unbacked_ += ranges[i].len();
+    } else {
+      allocator_->Release(ranges[i]);
+    }
+  }
+}
+
 HugeLength HugeCache::ReleaseCachedPages(HugeLength n) {
+  total_deferred_unbacked_ += deferred();
   // This is a good time to check: is our cache going persistently unused?
-  HugeLength released = MaybeShrinkCacheLimit();
+  MaybeShrinkCacheLimit();
+  HugeLength released = ShrinkCache(target());
 
   if (released < n) {
     n -= released;
-    const HugeLength target = n > size() ? NHugePages(0) : size() - n;
-    released += ShrinkCache(target);
+    const HugeLength goal = n > size() ? NHugePages(0) : size() - n;
+    released += ShrinkCache(std::max(goal, warm_reserve_));
   }
 
   UpdateSize(size());
@@ -328,53 +421,6 @@ void HugeCache::AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
   }
 }
 
-HugeAddressMap::Node *HugeCache::Find(HugeLength n) {
-  HugeAddressMap::Node *curr = cache_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node *best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
-      }
-    }
-
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
-
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
-      }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
-    }
-  }
-  return best;
-}
-
 void HugeCache::Print(TCMalloc_Printer *out) {
   const long long millis = absl::ToInt64Milliseconds(kCacheTime);
   out->printf(
@@ -398,6 +444,20 @@ void HugeCache::Print(TCMalloc_Printer *out) {
   out->printf("HugeCache: %zu MiB fast unbacked, %zu MiB periodic\n",
               total_fast_unbacked_.in_bytes() / 1024 / 1024,
               total_periodic_unbacked_.in_bytes() / 1024 / 1024);
+  out->printf("HugeCache: %zu MiB of those lazily freed\n",
+              total_lazily_unbacked_.in_bytes() / 1024 / 1024);
+  out->printf(
+      "HugeCache: %zu MiB deferred from frees to periodic release, "
+      "%zu MiB pending\n",
+      total_deferred_unbacked_.in_bytes() / 1024 / 1024,
+      deferred().in_mib());
+  if (warm_reserve_ > NHugePages(0) || reserve_hits_ + reserve_misses_ > 0) {
+    out->printf(
+        "HugeCache: %zu MiB warm reserve, %zu MiB pre-faulted; "
+        "%zu reserve hits, %zu reserve misses\n",
+        warm_reserve_.in_mib(), total_warm_populated_.in_mib(), reserve_hits_,
+        reserve_misses_);
+  }
   UpdateSize(size());
   out->printf("HugeCache: %zu MiB*s cached since startup\n",
               NHugePages(regret_).in_mib() / 1000 / 1000 / 1000);
@@ -453,6 +513,18 @@ void HugeCache::PrintInPbtxt(PbtxtRegion *hpaa) {
   // bytes unbacked by periodic releaser thread
   hpaa->PrintI64("periodic_unbacked_bytes",
                  total_periodic_unbacked_.in_bytes());
+  // bytes of the above released lazily (MADV_FREE)
+  hpaa->PrintI64("lazily_unbacked_bytes", total_lazily_unbacked_.in_bytes());
+  // bytes of the periodic ones left behind by frees, and those still pending
+  hpaa->PrintI64("deferred_unbacked_bytes",
+                 total_deferred_unbacked_.in_bytes());
+  hpaa->PrintI64("pending_unback_bytes", deferred().in_bytes());
+  // hugepages we keep faulted in, how much we faulted in for that, and how
+  // often (while we had the reserve) Get was served warm or cold
+  hpaa->PrintI64("warm_reserve_bytes", warm_reserve_.in_bytes());
+  hpaa->PrintI64("warm_populated_bytes", total_warm_populated_.in_bytes());
+  hpaa->PrintI64("warm_reserve_hits", reserve_hits_);
+  hpaa->PrintI64("warm_reserve_misses", reserve_misses_);
   UpdateSize(size());
   // memory cached since startup (in MiB*s)
   hpaa->PrintI64("huge_cache_regret",
@@ -18,6 +18,7 @@
 #define TCMALLOC_HUGE_CACHE_H_
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 #include <limits>
@@ -31,10 +32,27 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/timeseries_tracker.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
 typedef void (*MemoryModifyFunction)(void *start, size_t len);
+// As MemoryModifyFunction, for ranges[0, n).
+typedef void (*MemoryModifyRangesFunction)(const struct iovec *ranges,
+                                           size_t n);
+
+// Calls Unback on each of ranges[0, n), or lets SystemReleaseRanges release
+// them in fewer system calls if that's what Unback is.
+template <MemoryModifyFunction Unback>
+inline void UnbackRanges(const struct iovec *ranges, size_t n) {
+  if (Unback == &SystemRelease) {
+    SystemReleaseRanges(ranges, n);
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    Unback(ranges[i].iov_base, ranges[i].iov_len);
+  }
+}
 
 // Track the extreme values of a HugeLength value over the past
 // kWindow (time ranges approximate.)
@@ -91,10 +109,14 @@ constexpr HugeLength MinMaxTracker<kEpochs>::kMaxVal;
 
 class HugeCache {
  public:
-  // For use in production
+  // For use in production.  If given, unback_ranges unbacks several ranges
+  // at once; otherwise we unback them one at a time.
   HugeCache(HugeAllocator *allocator, MetadataAllocFunction meta_allocate,
-            MemoryModifyFunction unback)
-      : HugeCache(allocator, meta_allocate, unback, GetCurrentTimeNanos) {}
+            MemoryModifyFunction unback,
+            MemoryModifyRangesFunction unback_ranges = nullptr)
+      : HugeCache(allocator, meta_allocate, unback, GetCurrentTimeNanos) {
+    unback_ranges_ = unback_ranges;
+  }
 
   // For testing with mock clock
   HugeCache(HugeAllocator *allocator, MetadataAllocFunction meta_allocate,
@@ -115,17 +137,43 @@ class HugeCache {
   // otherwise, it is set to true (and the caller should back it.)
   HugeRange Get(HugeLength n, bool *from_released);
 
+  // As Get, but for exactly <r>, which must be free in its entirety (in the
+  // cache or in our allocator); returns false if it isn't.
+  bool GetAt(HugeRange r, bool *from_released);
+
   // Deallocate <r> (assumed to be backed by the kernel.)
   void Release(HugeRange r);
   // As Release, but the range is assumed to _not_ be backed.
   void ReleaseUnbacked(HugeRange r);
 
   // Release to the system up to <n> hugepages of cache contents; returns
-  // the number of hugepages released.
+  // the number of hugepages released.  Anything Release() left over our limit
+  // is released first (and regardless of <n>.)
   HugeLength ReleaseCachedPages(HugeLength n);
 
+  // Release() may leave up to <n> hugepages beyond our limit backed in the
+  // cache, for the next ReleaseCachedPages() to unback in one batch, rather
+  // than unbacking them on the spot.  Until then they can still be reused.
+  // This keeps the cost of Release() off the (latency sensitive) free path,
+  // provided someone calls ReleaseCachedPages() periodically.
+  void set_deferred_unback_limit(HugeLength n) { deferred_unback_limit_ = n; }
+
+  // Keep at least <n> hugepages backed and faulted in, whatever our limit, so
+  // that Get() rarely has to hand out cold memory.  RefillWarmReserve() tops
+  // the cache back up to <n> with fresh hugepages, which populate (which may
+  // drop the lock guarding us) faults in.
+  void set_warm_reserve(HugeLength n, MemoryModifyFunction populate) {
+    warm_reserve_ = n;
+    populate_ = populate;
+  }
+  // Returns the number of hugepages added.  Meant for a maintenance path:
+  // faulting memory in takes a while.
+  HugeLength RefillWarmReserve();
+
   // Backed memory available.
   HugeLength size() const { return size_; }
+  // The number of contiguous ranges that is in.
+  size_t ranges() const { return cache_.nranges(); }
   // Total memory cached (in HugeLength * nanoseconds)
   uint64_t regret() const { return regret_; }
   // Current limit for how much backed memory we'll cache.
@@ -136,6 +184,17 @@ class HugeCache {
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                     PageAgeHistograms *ages) const;
 
+  template <typename F>
+  void ForEachCachedHugePage(F f) const {
+    for (const HugeAddressMap::Node *node = cache_.first(); node != nullptr;
+         node = node->next()) {
+      const HugeRange r = node->range();
+      for (HugePage p = r.start(); p < r.start() + r.len(); ++p) {
+        f(p);
+      }
+    }
+  }
+
   BackingStats stats() const {
     BackingStats s;
     s.system_bytes = (usage() + size()).in_bytes();
@@ -153,26 +212,40 @@ class HugeCache {
   // We just cache-missed a request for <missed> pages;
   // should we grow?
   void MaybeGrowCacheLimit(HugeLength missed);
-  // Check if the cache seems consistently too big.  Returns the
-  // number of pages *evicted* (not the change in limit).
-  HugeLength MaybeShrinkCacheLimit();
+  // Check if the cache seems consistently too big, and lower the limit if so.
+  // Doesn't evict anything itself.
+  void MaybeShrinkCacheLimit();
 
   // Ensure the cache contains at most <target> hugepages,
   // returning the number removed.
   HugeLength ShrinkCache(HugeLength target);
+  // Unbacks ranges[0, n), which we've removed from the cache, and returns
+  // them to allocator_.
+  void UnbackAndRelease(const HugeRange *ranges, size_t n);
 
   HugeRange DoGet(HugeLength n, bool *from_released);
 
-  HugeAddressMap::Node *Find(HugeLength n);
-
   HugeAddressMap cache_;
   HugeLength size_{NHugePages(0)};
 
   HugeLength limit_{NHugePages(10)};
   const absl::Duration kCacheTime = absl::Seconds(1);
+  HugeLength deferred_unback_limit_{NHugePages(0)};
+  // How much of the cache is over the limit, waiting for ReleaseCachedPages.
+  HugeLength deferred() const {
+    return size_ > target() ? size_ - target() : NHugePages(0);
+  }
+  HugeLength warm_reserve_{NHugePages(0)};
+  MemoryModifyFunction populate_{nullptr};
+  // What we shrink to, unless asked to release more.
+  HugeLength target() const { return std::max(limit(), warm_reserve_); }
 
   size_t hits_{0};
   size_t misses_{0};
+  // Get()s made while we had a warm reserve, and which of them we served
+  // from the cache.
+  size_t reserve_hits_{0};
+  size_t reserve_misses_{0};
   size_t fills_{0};
   size_t overflows_{0};
   uint64_t weighted_hits_{0};
@@ -207,8 +280,12 @@ class HugeCache {
 
   HugeLength total_fast_unbacked_{NHugePages(0)};
   HugeLength total_periodic_unbacked_{NHugePages(0)};
+  HugeLength total_lazily_unbacked_{NHugePages(0)};
+  HugeLength total_deferred_unbacked_{NHugePages(0)};
+  HugeLength total_warm_populated_{NHugePages(0)};
 
   MemoryModifyFunction unback_;
+  MemoryModifyRangesFunction unback_ranges_{nullptr};
 };
 
 }  // namespace tcmalloc
@@ -29,6 +29,7 @@
 #include "absl/memory/memory.h"
 #include "absl/random/random.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/huge_pages.h"
@@ -87,17 +88,21 @@ class HugeCacheTest : public testing::Test {
   class BackingInterface {
    public:
     virtual void Unback(void *p, size_t len) = 0;
+    virtual void Populate(void *p, size_t len) = 0;
     virtual ~BackingInterface() {}
   };
 
   class MockBackingInterface : public BackingInterface {
    public:
     MOCK_METHOD2(Unback, void(void *p, size_t len));
+    MOCK_METHOD2(Populate, void(void *p, size_t len));
   };
 
   static void MockUnback(void *p, size_t len) { mock_->Unback(p, len); }
 
  protected:
+  static void MockPopulate(void *p, size_t len) { mock_->Populate(p, len); }
+
   static std::unique_ptr<testing::NiceMock<MockBackingInterface>> mock_;
 
   size_t HugePagesRequested() { return backing.size() - 1024; }
@@ -219,6 +224,100 @@ TEST_F(HugeCacheTest, Release) {
   EXPECT_EQ(NHugePages(4), cache_.ReleaseCachedPages(NHugePages(200)));
 }
 
+TEST_F(HugeCacheTest, DeferredUnback) {
+  bool from;
+  const HugeLength limit = cache_.limit();
+  const HugeLength extra = NHugePages(3);
+  cache_.set_deferred_unback_limit(extra);
+
+  // Going over the limit (but not the deferred budget) unbacks nothing.
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_)).Times(0);
+  HugeRange r = cache_.Get(limit + extra, &from);
+  EXPECT_TRUE(from);
+  cache_.Release(r);
+  EXPECT_EQ(limit + extra, cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Which is still available for reuse...
+  HugeRange r2 = cache_.Get(NHugePages(1), &from);
+  EXPECT_FALSE(from);
+  cache_.Release(r2);
+
+  // until the next periodic release, which unbacks all of it, however little
+  // was asked for.
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_))
+      .Times(testing::AtLeast(1));
+  EXPECT_EQ(extra, cache_.ReleaseCachedPages(NHugePages(0)));
+  EXPECT_EQ(limit, cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Past the budget, frees unback only the excess.  (Missing in the cache
+  // may have grown its limit.)
+  cache_.set_deferred_unback_limit(NHugePages(1));
+  r = cache_.Get(cache_.limit() + extra, &from);
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_))
+      .Times(testing::AtLeast(1));
+  cache_.Release(r);
+  EXPECT_EQ(cache_.limit() + NHugePages(1), cache_.size());
+
+  char buf[4096];
+  TCMalloc_Printer out(buf, sizeof(buf));
+  cache_.Print(&out);
+  EXPECT_THAT(
+      buf, testing::HasSubstr(absl::StrFormat(
+               "HugeCache: %zu MiB deferred from frees to periodic release, "
+               "%zu MiB pending\n",
+               extra.in_mib(), NHugePages(1).in_mib())));
+}
+
+TEST_F(HugeCacheTest, WarmReserve) {
+  bool from;
+  const HugeLength reserve = cache_.limit() + NHugePages(4);
+  cache_.set_warm_reserve(reserve, MockPopulate);
+
+  // Refilling faults in everything it adds, and only what it adds.
+  EXPECT_CALL(*mock_, Populate(testing::_, testing::_))
+      .Times(testing::AtLeast(1));
+  EXPECT_EQ(reserve, cache_.RefillWarmReserve());
+  EXPECT_EQ(reserve, cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+  EXPECT_CALL(*mock_, Populate(testing::_, testing::_)).Times(0);
+  EXPECT_EQ(NHugePages(0), cache_.RefillWarmReserve());
+
+  // Which Get() then hits, without unbacking anything once we give it back:
+  // the reserve may exceed our limit.
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_)).Times(0);
+  HugeRange r = cache_.Get(NHugePages(2), &from);
+  EXPECT_FALSE(from);
+  cache_.Release(r);
+  EXPECT_EQ(reserve, cache_.size());
+
+  // Nor does periodic release, however much is asked for.
+  EXPECT_EQ(NHugePages(0), cache_.ReleaseCachedPages(NHugePages(1000)));
+  EXPECT_EQ(reserve, cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Asking for more than the reserve misses.
+  r = cache_.Get(reserve + NHugePages(1), &from);
+  EXPECT_TRUE(from);
+  cache_.Release(r);
+
+  // Dropping the reserve lets us release it.
+  cache_.set_warm_reserve(NHugePages(0), MockPopulate);
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_))
+      .Times(testing::AtLeast(1));
+  cache_.ReleaseCachedPages(NHugePages(1000));
+  EXPECT_EQ(NHugePages(0), cache_.size());
+
+  char buf[4096];
+  TCMalloc_Printer out(buf, sizeof(buf));
+  cache_.Print(&out);
+  EXPECT_THAT(buf, testing::HasSubstr(absl::StrFormat(
+                       "HugeCache: 0 MiB warm reserve, %zu MiB pre-faulted; "
+                       "1 reserve hits, 1 reserve misses\n",
+                       reserve.in_mib())));
+}
+
 TEST_F(HugeCacheTest, Regret) {
   bool from;
   HugeRange r = cache_.Get(NHugePages(20), &from);
@@ -34,6 +34,7 @@
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -98,16 +99,238 @@ namespace tcmalloc {
 // - pick the right one for a given allocation
 // - provide enough data to figure out what we picked last time!
 
+namespace {
+
+// Calls SystemAlloc, dropping huge_cache_lock around the call, and makes sure
+// the pagemap covers the result.
+template <bool tagged>
+void *AllocAndReport(size_t bytes, size_t *actual, size_t align)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  // Nobody else can see this memory until our caller adds it to its free
+  // lists, so there is no need to keep the lock while we map it.
+  huge_cache_lock.Unlock();
+  void *p = SystemAlloc(bytes, actual, align, tagged);
+  huge_cache_lock.Lock();
+  if (p != nullptr) {
+    // The pagemap's interior nodes are guarded by pageheap_lock.
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    const PageId page = PageIdContaining(p);
+    const Length page_len = BytesToLengthFloor(*actual);
+    Static::pagemap()->Ensure(page, page_len);
+  }
+  return p;
+}
+
+// HugeAllocator and HugeCache allocate their metadata with huge_cache_lock
+// held, never pageheap_lock, which guards the arena.
+void *MetaDataAllocWithLock(size_t bytes)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return Static::arena()->Alloc(bytes);
+}
+
+// Calls SystemRelease, but with dropping of huge_cache_lock around the call.
+void UnbackWithoutLock(void *start, size_t length)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  huge_cache_lock.Unlock();
+  SystemRelease(start, length);
+  huge_cache_lock.Lock();
+}
+
+// As above, for SystemReleaseRanges.
+void UnbackRangesWithoutLock(const struct iovec *ranges, size_t n)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  huge_cache_lock.Unlock();
+  SystemReleaseRanges(ranges, n);
+  huge_cache_lock.Lock();
+}
+
+// As above, for SystemPopulate.
+void PopulateWithoutLock(void *start, size_t length)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  huge_cache_lock.Unlock();
+  SystemPopulate(start, length);
+  huge_cache_lock.Lock();
+}
+
+// Releases the pagemap leaves covering only the range, then calls SystemUnmap
+// without any lock.  The leaves have to go first, under pageheap_lock: once
+// the range is unmapped, SystemAlloc could hand it out again and have its
+// pagemap entries set, which we must not discard.
+bool UnmapWithoutLock(void *start, size_t length, size_t *metadata_bytes)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock) {
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    *metadata_bytes += Static::pagemap()->ReleaseLeaves(
+        PageIdContaining(start), BytesToLengthFloor(length));
+  }
+  huge_cache_lock.Unlock();
+  const bool unmapped = SystemUnmap(start, length);
+  huge_cache_lock.Lock();
+  return unmapped;
+}
+
+}  // namespace
+
 // TODO(b/141550014, b/122551676):  Select the parameter of the HugePageFiller
 // constructor from an experiment.
 HugePageAwareAllocator::HugePageAwareAllocator(bool tagged)
     : PageAllocatorInterface("HugePageAware", tagged),
       filler_(decide_partial_rerelease()),
       alloc_(tagged ? AllocAndReport<true> : AllocAndReport<false>,
-             MetaDataAlloc),
-      cache_(HugeCache{&alloc_, MetaDataAlloc, UnbackWithoutLock}) {
+             MetaDataAllocWithLock, UnmapWithoutLock),
+      cache_(HugeCache{&alloc_, MetaDataAllocWithLock, UnbackWithoutLock,
+                       UnbackRangesWithoutLock}),
+      populate_(PopulateWithoutLock) {
   tracker_allocator_.Init(Static::arena());
   region_allocator_.Init(Static::arena());
+  freed_.Init();
+  spare_spans_.Init();
+  filler_.set_prefer_subreleased(Parameters::hugepage_collapse());
+  filler_.set_segregate_span_lengths(
+      Parameters::filler_segregate_span_lengths());
+  cache_.set_deferred_unback_limit(DeferredUnbackLimit());
+  cache_.set_warm_reserve(WarmReserve(), populate_);
+}
+
+HugeLength HugePageAwareAllocator::DeferredUnbackLimit() {
+  const int64_t bytes = Parameters::huge_cache_deferred_unback_bytes();
+  return NHugePages(bytes > 0 ? bytes / kHugePageSize : 0);
+}
+
+HugeLength HugePageAwareAllocator::WarmReserve() const {
+  if (tagged_) return NHugePages(0);
+  const int64_t bytes = Parameters::huge_cache_warm_reserve_bytes();
+  return NHugePages(bytes > 0 ? bytes / kHugePageSize : 0);
+}
+
+HugeLength HugePageAwareAllocator::RefillWarmReserve() {
+  absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+  DrainFreedHugepages();
+  cache_.set_warm_reserve(WarmReserve(), populate_);
+  const HugeLength added = cache_.RefillWarmReserve();
+  PublishCacheStats();
+  return added;
+}
+
+void HugePageAwareAllocator::PublishCacheStats() {
+  const BackingStats alloc_stats = alloc_.stats();
+  const BackingStats cache_stats = cache_.stats();
+  LargeSpanStats cache_spans{};
+  cache_spans.spans = alloc_.ranges() + cache_.ranges();
+  cache_spans.normal_pages = cache_.size().in_pages();
+  cache_spans.returned_pages = alloc_.size().in_pages();
+  absl::base_internal::SpinLockHolder s(&stats_lock_);
+  alloc_stats_ = alloc_stats;
+  cache_stats_ = cache_stats;
+  cache_spans_ = cache_spans;
+}
+
+void HugePageAwareAllocator::RecordAlloc(PageId p, Length n) {
+  absl::base_internal::SpinLockHolder s(&stats_lock_);
+  info_.RecordAlloc(p, n);
+}
+
+void HugePageAwareAllocator::RecordFree(PageId p, Length n) {
+  absl::base_internal::SpinLockHolder s(&stats_lock_);
+  info_.RecordFree(p, n);
+}
+
+Span *HugePageAwareAllocator::NewWholeSpan(PageId p, Length n) {
+  if (spare_spans_.empty()) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (int i = 0; i < kSpanBatch; ++i) {
+      spare_spans_.prepend(Static::span_allocator()->New());
+    }
+    num_spare_spans_ += kSpanBatch;
+  }
+  Span *span = spare_spans_.first();
+  span->RemoveFromList();
+  --num_spare_spans_;
+  span->Init(p, n);
+  return span;
+}
+
+void HugePageAwareAllocator::DeleteWholeSpan(Span *span) {
+#ifndef NDEBUG
+  // As Span::Delete does, trash the contents of deleted Spans.
+  memset(static_cast<void *>(span), 0x3f, sizeof(*span));
+#endif
+  spare_spans_.prepend(span);
+  if (++num_spare_spans_ < 2 * kSpanBatch) return;
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  for (int i = 0; i < kSpanBatch; ++i) {
+    Span *spare = spare_spans_.last();
+    spare->RemoveFromList();
+    Static::span_allocator()->Delete(spare);
+  }
+  num_spare_spans_ -= kSpanBatch;
+}
+
+void HugePageAwareAllocator::QueueFreed(HugeRange r, bool released) {
+  Span *s = Span::New(r.start().first_page(), r.len().in_pages());
+  s->set_location(released ? Span::ON_RETURNED_FREELIST
+                           : Span::ON_NORMAL_FREELIST);
+  freed_.append(s);
+  if (released) {
+    freed_released_ += r.len();
+  } else {
+    freed_backed_ += r.len();
+  }
+  has_freed_.store(true, std::memory_order_relaxed);
+}
+
+void HugePageAwareAllocator::DrainFreedHugepages() {
+  if (!has_freed_.load(std::memory_order_relaxed)) return;
+
+  // cache_ may unback (dropping huge_cache_lock) or allocate metadata (taking
+  // pageheap_lock) as we return each batch, so we do it with neither held.
+  // The batch stays counted in freed_backed_ and freed_released_ until it is
+  // in what we publish of cache_.
+  static constexpr int kBatch = 16;
+  HugeRange batch[kBatch];
+  bool released[kBatch];
+  int n = 0;
+  pageheap_lock.Lock();
+  while (true) {
+    for (int i = 0; i < n; ++i) {
+      if (released[i]) {
+        freed_released_ -= batch[i].len();
+      } else {
+        freed_backed_ -= batch[i].len();
+      }
+    }
+    if (n > 0) PublishCacheStats();
+    n = 0;
+    while (n < kBatch && !freed_.empty()) {
+      Span *s = freed_.first();
+      s->RemoveFromList();
+      batch[n] = HugeRange::Make(HugePageContaining(s->first_page()),
+                                 HLFromPages(s->num_pages()));
+      released[n] = s->location() == Span::ON_RETURNED_FREELIST;
+      Span::Delete(s);
+      ++n;
+    }
+    if (n == 0) break;
+    pageheap_lock.Unlock();
+    for (int i = 0; i < n; ++i) {
+      if (released[i]) {
+        cache_.ReleaseUnbacked(batch[i]);
+      } else {
+        cache_.Release(batch[i]);
+      }
+    }
+    pageheap_lock.Lock();
+  }
+  has_freed_.store(false, std::memory_order_relaxed);
+  pageheap_lock.Unlock();
+}
+
+// public
+void HugePageAwareAllocator::ReturnFreedHugepages() {
+  if (!has_freed_.load(std::memory_order_relaxed)) return;
+  absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+  DrainFreedHugepages();
 }
 
 HugePageAwareAllocator::FillerType::Tracker *HugePageAwareAllocator::GetTracker(
@@ -136,44 +359,54 @@ PageId HugePageAwareAllocator::AllocAndContribute(HugePage p, Length n,
   return page;
 }
 
-PageId HugePageAwareAllocator::RefillFiller(Length n, bool *from_released) {
-  HugeRange r = cache_.Get(NHugePages(1), from_released);
-  if (!r.valid()) return PageId{0};
-  // This is duplicate to Finalize, but if we need to break up
-  // hugepages to get to our usage limit it would be very bad to break
-  // up what's left of r after we allocate from there--while r is
-  // mostly empty, clearly what's left in the filler is too fragmented
-  // to be very useful, and we would rather release those
-  // pages. Otherwise, we're nearly guaranteed to release r (if n
-  // isn't very large), and the next allocation will just repeat this
-  // process.
-  Static::page_allocator()->ShrinkToUsageLimit();
-  return AllocAndContribute(r.start(), n, /*donated=*/false);
+Span *HugePageAwareAllocator::RefillFiller(Length n, bool *from_released) {
+  // If we need to break up hugepages to get to our usage limit it would be
+  // very bad to break up what's left of the new hugepage after we allocate
+  // from it--while it is mostly empty, clearly what's left in the filler is
+  // too fragmented to be very useful, and we would rather release those
+  // pages.  Otherwise, we're nearly guaranteed to release it (if n isn't very
+  // large), and the next allocation will just repeat this process.  So if an
+  // earlier allocation took us over the limit, deal with that first.
+  Static::page_allocator()->MaybeShrinkToUsageLimit();
+
+  HugeRange r;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    r = cache_.Get(NHugePages(1), from_released);
+    PublishCacheStats();
+  }
+  if (!r.valid()) return nullptr;
+  // Someone may have refilled the filler while we held no lock, but the
+  // hugepage is as good as theirs.
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return Finalize(n, AllocAndContribute(r.start(), n, /*donated=*/false));
 }
 
-Span *HugePageAwareAllocator::Finalize(Length n, PageId page)
-    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+Span *HugePageAwareAllocator::Finalize(Length n, PageId page) {
   if (page == PageId{0}) return nullptr;
   Span *ret = Span::New(page, n);
   Static::pagemap()->Set(page, ret);
   ASSERT(!ret->sampled());
-  info_.RecordAlloc(page, n);
-  Static::page_allocator()->ShrinkToUsageLimit();
+  RecordAlloc(page, n);
+  Static::page_allocator()->CheckUsageLimit();
   return ret;
 }
 
 // For anything <= half a huge page, we will unconditionally use the filler
 // to pack it into a single page.  If we need another page, that's fine.
 Span *HugePageAwareAllocator::AllocSmall(Length n, bool *from_released) {
-  PageId page;
-  FillerType::Tracker *pt;
-  if (filler_.TryGet(n, &pt, &page)) {
-    *from_released = false;
-    return Finalize(n, page);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    PageId page;
+    FillerType::Tracker *pt;
+    if (filler_.TryGet(n, &pt, &page)) {
+      *from_released = false;
+      return Finalize(n, page);
+    }
   }
 
-  page = RefillFiller(n, from_released);
-  return Finalize(n, page);
+  return RefillFiller(n, from_released);
 }
 
 Span *HugePageAwareAllocator::AllocLarge(Length n, bool *from_released) {
@@ -183,22 +416,34 @@ Span *HugePageAwareAllocator::AllocLarge(Length n, bool *from_released) {
     return AllocRawHugepages(n, from_released);
   }
 
-  PageId page;
-  // If we fit in a single hugepage, try the Filler first.
-  if (n < kPagesPerHugePage) {
-    FillerType::Tracker *pt;
-    if (filler_.TryGet(n, &pt, &page)) {
-      *from_released = false;
+  bool want_region;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    PageId page;
+    // If we fit in a single hugepage, try the Filler first.
+    if (n < kPagesPerHugePage) {
+      FillerType::Tracker *pt;
+      if (filler_.TryGet(n, &pt, &page)) {
+        *from_released = false;
+        return Finalize(n, page);
+      }
+    }
+
+    // If we're using regions in this binary (see below comment), is
+    // there currently available space there?
+    if (regions_.MaybeGet(n, &page, from_released)) {
       return Finalize(n, page);
     }
-  }
 
-  // If we're using regions in this binary (see below comment), is
-  // there currently available space there?
-  if (regions_.MaybeGet(n, &page, from_released)) {
-    return Finalize(n, page);
+    want_region = ShouldAddRegion();
+  }
+  if (want_region) {
+    if (Span *s = AllocFromNewRegion(n, from_released)) return s;
   }
+  return AllocRawHugepages(n, from_released);
+}
 
+bool HugePageAwareAllocator::ShouldAddRegion() {
   // We have two choices here: allocate a new region or go to
   // hugepages directly (hoping that slack will be filled by small
   // allocation.) The second strategy is preferrable, as it's
@@ -209,26 +454,42 @@ Span *HugePageAwareAllocator::AllocLarge(Length n, bool *from_released) {
   //
   // So test directly if we're in the bad case--almost no binaries are.
   // If not, just fall back to direct allocation (and hope we do hit that case!)
-  const Length slack = info_.slack();
+  Length slack, small;
+  {
+    absl::base_internal::SpinLockHolder s(&stats_lock_);
+    slack = info_.slack();
+    small = info_.small();
+  }
   // Don't bother at all until the binary is reasonably sized
   if (slack < HLFromBytes(64 * 1024 * 1024).in_pages()) {
-    return AllocRawHugepages(n, from_released);
+    return false;
   }
 
   // In the vast majority of binaries, we have many small allocations which
   // will nicely fill slack.  (Fleetwide, the average ratio is 15:1; only
   // a handful of binaries fall below 1:1.)
-  const Length small = info_.small();
-  if (slack < small) {
-    return AllocRawHugepages(n, from_released);
-  }
+  return slack >= small;
+}
 
+Span *HugePageAwareAllocator::AllocFromNewRegion(Length n,
+                                                 bool *from_released) {
+  HugeRange r;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    r = alloc_.Get(Region::size());
+    PublishCacheStats();
+  }
   // We couldn't allocate a new region. They're oversized, so maybe we'd get
   // lucky with a smaller request?
-  if (!AddRegion()) {
-    return AllocRawHugepages(n, from_released);
-  }
+  if (!r.valid()) return nullptr;
 
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  Region *region = region_allocator_.New();
+  new (region) Region(r);
+  has_regions_.store(true, std::memory_order_relaxed);
+  regions_.Contribute(region);
+  PageId page;
   CHECK_CONDITION(regions_.MaybeGet(n, &page, from_released));
   return Finalize(n, page);
 }
@@ -240,14 +501,39 @@ Span *HugePageAwareAllocator::AllocEnormous(Length n, bool *from_released) {
 Span *HugePageAwareAllocator::AllocRawHugepages(Length n, bool *from_released) {
   HugeLength hl = HLFromPages(n);
 
-  HugeRange r = cache_.Get(hl, from_released);
-  if (!r.valid()) return nullptr;
+  HugeRange r;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    r = cache_.Get(hl, from_released);
+    PublishCacheStats();
+    if (!r.valid()) return nullptr;
+    if (hl.in_pages() == n) return FinishWholeHugepages(r);
+  }
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return FinishRawHugepages(r, n);
+}
 
+Span *HugePageAwareAllocator::FinishWholeHugepages(HugeRange r) {
+  // r is ours alone, and the pagemap already covers it, so we can fill in its
+  // entries without pageheap_lock.
+  const PageId page = r.start().first_page();
+  const Length n = r.len().in_pages();
+  SetTracker(r.start(), nullptr);
+  SetTracker(r.start() + r.len() - NHugePages(1), nullptr);
+  Span *ret = NewWholeSpan(page, n);
+  Static::pagemap()->Set(page, ret);
+  RecordAlloc(page, n);
+  Static::page_allocator()->CheckUsageLimitWithoutLock();
+  return ret;
+}
+
+Span *HugePageAwareAllocator::FinishRawHugepages(HugeRange r, Length n) {
   // We now have a huge page range that covers our request.  There
   // might be some slack in it if n isn't a multiple of
   // kPagesPerHugePage. Add the hugepage with slack to the filler,
   // pretending the non-slack portion is a smaller allocation.
-  Length total = hl.in_pages();
+  Length total = r.len().in_pages();
   Length slack = total - n;
   HugePage first = r.start();
   SetTracker(first, nullptr);
@@ -269,18 +555,21 @@ static void BackSpan(Span *span) {
   SystemBack(span->start_address(), span->bytes_in_span());
 }
 
+void HugePageAwareAllocator::FinishNew(Span *s, bool from_released) {
+  if (s && from_released) BackSpan(s);
+  ASSERT(!s || IsTaggedMemory(s->start_address()) == tagged_);
+}
+
 // public
 Span *HugePageAwareAllocator::New(Length n) {
   CHECK_CONDITION(n > 0);
   bool from_released;
   Span *s = LockAndAlloc(n, &from_released);
-  if (s && from_released) BackSpan(s);
-  ASSERT(!s || IsTaggedMemory(s->start_address()) == tagged_);
+  FinishNew(s, from_released);
   return s;
 }
 
 Span *HugePageAwareAllocator::LockAndAlloc(Length n, bool *from_released) {
-  absl::base_internal::SpinLockHolder h(&pageheap_lock);
   // Our policy depends on size.  For small things, we will pack them
   // into single hugepages.
   if (n <= kPagesPerHugePage / 2) {
@@ -308,13 +597,8 @@ Span *HugePageAwareAllocator::NewAligned(Length n, Length align) {
   // TODO(b/134690769): support higher align.
   CHECK_CONDITION(align <= kPagesPerHugePage);
   bool from_released;
-  Span *s;
-  {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    s = AllocRawHugepages(n, &from_released);
-  }
-  if (s && from_released) BackSpan(s);
-  ASSERT(!s || IsTaggedMemory(s->start_address()) == tagged_);
+  Span *s = AllocRawHugepages(n, &from_released);
+  FinishNew(s, from_released);
   return s;
 }
 
@@ -324,21 +608,12 @@ void HugePageAwareAllocator::DeleteFromHugepage(FillerType::Tracker *pt,
   ReleaseHugepage(pt);
 }
 
-bool HugePageAwareAllocator::AddRegion() {
-  HugeRange r = alloc_.Get(Region::size());
-  if (!r.valid()) return false;
-  Region *region = region_allocator_.New();
-  new (region) Region(r);
-  regions_.Contribute(region);
-  return true;
-}
-
 void HugePageAwareAllocator::Delete(Span *span) {
   ASSERT(!span || IsTaggedMemory(span->start_address()) == tagged_);
   PageId p = span->first_page();
   HugePage hp = HugePageContaining(p);
   Length n = span->num_pages();
-  info_.RecordFree(p, n);
+  RecordFree(p, n);
 
   Span::Delete(span);
 
@@ -361,13 +636,44 @@ void HugePageAwareAllocator::Delete(Span *span) {
   //    might have had slack put into the filler - if so, return that virtual
   //    allocation to the filler too!)
   ASSERT(n >= kPagesPerHugePage);
+  DeleteRawHugepages(hp, n);
+}
+
+// public
+bool HugePageAwareAllocator::DeleteWholeHugepages(Span *span) {
+  ASSERT(IsTaggedMemory(span->start_address()) == tagged_);
+  ASSERT(!span->sampled());
+  const PageId p = span->first_page();
+  const HugePage hp = HugePageContaining(p);
+  const Length n = span->num_pages();
+  const HugeLength hl = HLFromPages(n);
+  // Anything else shares a hugepage with the filler, or may be in a region;
+  // either needs pageheap_lock.  No one else can change the tracker of a
+  // hugepage that starts our span.
+  if (hp.first_page() != p || hl.in_pages() != n ||
+      has_regions_.load(std::memory_order_relaxed) ||
+      GetTracker(hp) != nullptr) {
+    return false;
+  }
+  ASSERT(GetTracker(hp + hl - NHugePages(1)) == nullptr);
+
+  absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+  RecordFree(p, n);
+  DeleteWholeSpan(span);
+  DrainFreedHugepages();
+  cache_.Release({hp, hl});
+  PublishCacheStats();
+  return true;
+}
+
+void HugePageAwareAllocator::DeleteRawHugepages(HugePage hp, Length n) {
   HugeLength hl = HLFromPages(n);
   HugePage last = hp + hl - NHugePages(1);
   Length slack = hl.in_pages() - n;
   if (slack == 0) {
     ASSERT(GetTracker(last) == nullptr);
   } else {
-    pt = GetTracker(last);
+    FillerType::Tracker *pt = GetTracker(last);
     CHECK_CONDITION(pt != nullptr);
     // We put the slack into the filler (see AllocEnormous.)
     // Handle this page separately as a virtual allocation
@@ -396,28 +702,240 @@ void HugePageAwareAllocator::Delete(Span *span) {
       }
     }
   }
-  cache_.Release({hp, hl});
+  if (hl > NHugePages(0)) QueueFreed({hp, hl}, /*released=*/false);
+}
+
+// public
+Span *HugePageAwareAllocator::Resize(Span *span, Length n, bool may_move) {
+  ASSERT(IsTaggedMemory(span->start_address()) == tagged_);
+  const PageId p = span->first_page();
+  const Length old_n = span->num_pages();
+  if (n == old_n) return span;
+
+  bool from_released = false;
+  bool resized;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    HugeRange needed = HugeRange::Nil();
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      resized = ResizeInPlace(p, old_n, n, &from_released, &needed);
+      if (resized) {
+        span->set_num_pages(n);
+        RecordResize(p, old_n, n);
+      }
+    }
+    if (!resized && needed.valid() &&
+        cache_.GetAt(needed, &from_released)) {
+      PublishCacheStats();
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      resized = ResizeOnto(p, old_n, n, needed, from_released);
+      if (resized) {
+        span->set_num_pages(n);
+        RecordResize(p, old_n, n);
+      }
+    }
+  }
+  // A shrink may have queued hugepages to freed_, as may a failed ResizeOnto.
+  ReturnFreedHugepages();
+  if (resized) {
+    if (from_released) {
+      SystemBack((p + old_n).start_addr(), (n - old_n) << kPageShift);
+    }
+    return span;
+  }
+
+  // Moving only pays off for runs of whole hugepages, which we can remap.
+  const HugeLength old_hl = HLFromPages(old_n);
+  if (!may_move || n < old_n || HugePageContaining(p).first_page() != p ||
+      old_hl.in_pages() != old_n || old_hl < kMinRemap) {
+    return nullptr;
+  }
+  return Remap(span, n);
+}
+
+void HugePageAwareAllocator::RecordResize(PageId p, Length old_n, Length n) {
+  RecordFree(p, old_n);
+  RecordAlloc(p, n);
+  resized_in_place_++;
+  if (n < old_n) shrunk_in_place_++;
+  resize_bytes_not_copied_ += std::min(old_n, n) << kPageShift;
+  Static::page_allocator()->CheckUsageLimit();
+}
+
+bool HugePageAwareAllocator::ResizeInPlace(PageId p, Length old_n, Length n,
+                                           bool *from_released,
+                                           HugeRange *needed) {
+  // As in Delete, it depends on where we came from.
+  const HugePage hp = HugePageContaining(p);
+  const bool grow = n > old_n;
+  FillerType::Tracker *pt = GetTracker(hp);
+  if (pt != nullptr) {
+    if (grow) return filler_.TryExtend(pt, p, old_n, n - old_n);
+    filler_.Trim(pt, p, old_n, old_n - n);
+    return true;
+  }
+
+  if (regions_.contains(p)) {
+    if (grow) {
+      return regions_.MaybeExtend(p, old_n, n - old_n, from_released);
+    }
+    return regions_.MaybeTrim(p, old_n, old_n - n);
+  }
+
+  // Straight from the HugeCache: we can move our end within the last
+  // hugepage, if we donated its slack to the filler, or across the hugepages
+  // after it.
+  ASSERT(hp.first_page() == p);
+  const HugeLength old_hl = HLFromPages(old_n);
+  const HugeLength hl = HLFromPages(n);
+  const HugePage last = hp + old_hl - NHugePages(1);
+  const Length slack = old_hl.in_pages() - old_n;
+  const Length virt_len = kPagesPerHugePage - slack;
+  if (grow) {
+    if (slack > 0 && hl == old_hl && n < hl.in_pages()) {
+      return filler_.TryExtend(GetTracker(last), last.first_page(), virt_len,
+                               n - old_n);
+    }
+    // Otherwise we need our last hugepage back whole...
+    if (!CanReclaimDonated(last, old_n)) return false;
+    // ...and the hugepages after it, which our caller has to get for us.
+    if (hl > old_hl) {
+      *needed = HugeRange::Make(hp + old_hl, hl - old_hl);
+      return false;
+    }
+    ReclaimDonated(last, old_n);
+  } else if (slack > 0 && hl == old_hl) {
+    filler_.Trim(GetTracker(last), last.first_page(), virt_len, old_n - n);
+    return true;
+  } else if (hl < old_hl) {
+    DeleteRawHugepages(hp + hl, old_n - hl.in_pages());
+  }
+
+  // As in AllocRawHugepages, our new last hugepage's slack goes to the
+  // filler.
+  const Length new_slack = hl.in_pages() - n;
+  if (new_slack > 0) {
+    ++donated_huge_pages_;
+    AllocAndContribute(hp + hl - NHugePages(1), kPagesPerHugePage - new_slack,
+                       /*donated=*/true);
+  }
+  return true;
+}
+
+bool HugePageAwareAllocator::ResizeOnto(PageId p, Length old_n, Length n,
+                                        HugeRange needed, bool from_released) {
+  // Our span is still ours, but someone may have allocated from the slack of
+  // its last hugepage while we had no pageheap_lock.
+  const HugePage hp = HugePageContaining(p);
+  const HugeLength hl = HLFromPages(n);
+  if (!CanReclaimDonated(hp + HLFromPages(old_n) - NHugePages(1), old_n)) {
+    QueueFreed(needed, from_released);
+    return false;
+  }
+  ReclaimDonated(hp + HLFromPages(old_n) - NHugePages(1), old_n);
+  const Length new_slack = hl.in_pages() - n;
+  if (new_slack > 0) {
+    ++donated_huge_pages_;
+    AllocAndContribute(hp + hl - NHugePages(1), kPagesPerHugePage - new_slack,
+                       /*donated=*/true);
+  }
+  return true;
+}
+
+bool HugePageAwareAllocator::CanReclaimDonated(HugePage last, Length old_n) {
+  const Length slack = HLFromPages(old_n).in_pages() - old_n;
+  if (slack == 0) return true;
+  FillerType::Tracker *donated = GetTracker(last);
+  return donated->used_pages() == kPagesPerHugePage - slack &&
+         !donated->released() && !donated->releasing() &&
+         !donated->collapsing();
+}
+
+void HugePageAwareAllocator::ReclaimDonated(HugePage last, Length old_n) {
+  const Length slack = HLFromPages(old_n).in_pages() - old_n;
+  if (slack == 0) return;
+  FillerType::Tracker *donated = GetTracker(last);
+  CHECK_CONDITION(filler_.Put(donated, last.first_page(),
+                              kPagesPerHugePage - slack) == donated);
+  --donated_huge_pages_;
+  SetTracker(last, nullptr);
+  tracker_allocator_.Delete(donated);
+}
+
+Span *HugePageAwareAllocator::Remap(Span *span, Length n) {
+  const HugeLength hl = HLFromPages(n);
+  const HugeRange old = HugeRange::Make(HugePageContaining(span->first_page()),
+                                        HLFromPages(span->num_pages()));
+  bool from_released;
+  HugeRange r;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    r = cache_.Get(hl, &from_released);
+    PublishCacheStats();
+    if (!r.valid()) return nullptr;
+  }
+
+  // Nobody else can see r yet, and span is our caller's alone, so the kernel
+  // can take its time moving one onto the other.
+  if (!SystemRemap(old.start_addr(), old.byte_len(), r.start_addr())) {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    if (from_released) {
+      cache_.ReleaseUnbacked(r);
+    } else {
+      cache_.Release(r);
+    }
+    PublishCacheStats();
+    return nullptr;
+  }
+  // The head of r now holds span's pages; the rest is as Get() left it.
+  const HugeRange tail = HugeRange::Make(r.start() + old.len(), hl - old.len());
+  if (from_released) SystemBack(tail.start_addr(), tail.byte_len());
+
+  Span *moved;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    moved = FinishRawHugepages(r, n);
+    RecordFree(span->first_page(), span->num_pages());
+    if (StackTrace *st = span->Unsample()) moved->Sample(st);
+    Span::Delete(span);
+    // SystemRemap left nothing behind.
+    QueueFreed(old, /*released=*/true);
+    remapped_++;
+    resize_bytes_not_copied_ += old.byte_len();
+  }
+  ReturnFreedHugepages();
+  FinishNew(moved, /*from_released=*/false);
+  return moved;
 }
 
 void HugePageAwareAllocator::ReleaseHugepage(FillerType::Tracker *pt) {
   ASSERT(pt->used_pages() == 0);
   HugeRange r = {pt->location(), NHugePages(1)};
   SetTracker(pt->location(), nullptr);
+  QueueFreed(r, pt->released());
+  tracker_allocator_.Delete(pt);
+}
 
-  if (pt->released()) {
-    cache_.ReleaseUnbacked(r);
-  } else {
-    cache_.Release(r);
+void HugePageAwareAllocator::PublishedCacheStats(BackingStats *alloc,
+                                                 BackingStats *cache) const {
+  {
+    absl::base_internal::SpinLockHolder s(&stats_lock_);
+    *alloc = alloc_stats_;
+    *cache = cache_stats_;
   }
-
-  tracker_allocator_.Delete(pt);
+  // cache_ still counts what is in freed_ as in use.
+  cache->free_bytes += freed_backed_.in_bytes();
+  cache->unmapped_bytes += freed_released_.in_bytes();
 }
 
 // public
 BackingStats HugePageAwareAllocator::stats() const {
-  BackingStats stats = alloc_.stats();
+  BackingStats stats, cache_stats;
+  PublishedCacheStats(&stats, &cache_stats);
   const auto actual_system = stats.system_bytes;
-  stats += cache_.stats();
+  stats += cache_stats;
   stats += filler_.stats();
   stats += regions_.stats();
   // the "system" (total managed) byte count is wildly double counted,
@@ -447,32 +965,108 @@ void HugePageAwareAllocator::GetSpanStats(SmallSpanStats *small,
     memset(large, 0, sizeof(*large));
   }
 
-  alloc_.AddSpanStats(small, large, ages);
   filler_.AddSpanStats(small, large, ages);
   regions_.AddSpanStats(small, large, ages);
-  cache_.AddSpanStats(small, large, ages);
+  // Everything alloc_ and cache_ hold is at least a hugepage long.
+  if (large != nullptr) {
+    {
+      absl::base_internal::SpinLockHolder s(&stats_lock_);
+      large->spans += cache_spans_.spans;
+      large->normal_pages += cache_spans_.normal_pages;
+      large->returned_pages += cache_spans_.returned_pages;
+    }
+    for (const Span *s : freed_) {
+      large->spans++;
+      if (s->location() == Span::ON_RETURNED_FREELIST) {
+        large->returned_pages += s->num_pages();
+      } else {
+        large->normal_pages += s->num_pages();
+      }
+    }
+  }
 }
 
+static constexpr HugeLength kMaxCollapsesPerRelease = NHugePages(4);
+
 // public
 Length HugePageAwareAllocator::ReleaseAtLeastNPages(Length num_pages) {
   Length released = 0;
-  released += cache_.ReleaseCachedPages(HLFromPages(num_pages)).in_pages();
-
-  // This is our long term plan but in current state will lead to insufficent
-  // THP coverage. It is however very useful to have the ability to turn this on
-  // for testing.
-  // TODO(b/134690769): make this work, remove the flag guard.
-  if (Parameters::hpaa_subrelease()) {
-    if (released < num_pages) {
-      released += filler_.ReleasePages(
-          num_pages - released, Parameters::filler_skip_subrelease_interval());
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    // This is also where the cache unbacks what Delete() left it, so pick up
+    // any change in how much that may be.
+    cache_.set_deferred_unback_limit(DeferredUnbackLimit());
+    cache_.set_warm_reserve(WarmReserve(), populate_);
+    released += cache_.ReleaseCachedPages(HLFromPages(num_pages)).in_pages();
+
+    // Address space left over from a past spike need not stay reserved
+    // forever.
+    const absl::Duration unmap_interval =
+        Parameters::unmap_idle_address_space_interval();
+    if (unmap_interval > absl::ZeroDuration()) {
+      const int64_t cutoff =
+          absl::base_internal::CycleClock::Now() -
+          absl::ToDoubleSeconds(unmap_interval) *
+              absl::base_internal::CycleClock::Frequency();
+      alloc_.UnmapIdle(cutoff);
     }
+    PublishCacheStats();
   }
 
-  // TODO(b/134690769):
-  // - perhaps release region?
-  // - refuse to release if we're too close to zero?
-  info_.RecordRelease(num_pages, released);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    filler_.set_segregate_span_lengths(
+        Parameters::filler_segregate_span_lengths());
+
+    // This is our long term plan but in current state will lead to
+    // insufficent THP coverage. It is however very useful to have the ability
+    // to turn this on for testing.
+    // TODO(b/134690769): make this work, remove the flag guard.
+    if (Parameters::hpaa_subrelease()) {
+      if (released < num_pages) {
+        absl::Duration skip_interval =
+            Parameters::filler_skip_subrelease_interval();
+        const absl::Duration max_skip_interval =
+            Parameters::filler_skip_subrelease_max_interval();
+        if (max_skip_interval > skip_interval) {
+          skip_interval = filler_.AdaptiveSkipSubreleaseInterval(
+              skip_interval, max_skip_interval);
+        }
+        released += ReleaseFromFiller(num_pages - released, skip_interval);
+      }
+    }
+
+    // Reconsider how we treat frees onto subreleased hugepages.  Switching to
+    // FillerPartialRerelease::Return releases what we retained.
+    if (Parameters::filler_adaptive_partial_rerelease()) {
+      released += filler_.AdaptPartialRerelease();
+      while (FillerType::Tracker *pt = filler_.TakeEmptied()) {
+        ReleaseHugepage(pt);
+      }
+    }
+
+    // TODO(b/134690769):
+    // - perhaps release region?
+    // - refuse to release if we're too close to zero?
+    {
+      absl::base_internal::SpinLockHolder s(&stats_lock_);
+      info_.RecordRelease(num_pages, released);
+    }
+
+    // This is called periodically, which makes it a convenient place to
+    // repair hugepages broken by earlier subreleases.  Collapsing is
+    // expensive, so only do a few at a time.
+    const bool collapse = Parameters::hugepage_collapse();
+    filler_.set_prefer_subreleased(collapse);
+    if (collapse) {
+      filler_.CollapseHugePages(kMaxCollapsesPerRelease);
+      while (FillerType::Tracker *pt = filler_.TakeEmptied()) {
+        ReleaseHugepage(pt);
+      }
+    }
+  }
+  ReturnFreedHugepages();
   return released;
 }
 
@@ -494,19 +1088,60 @@ static void BreakdownStatsInPbtxt(PbtxtRegion *hpaa, const BackingStats &s,
   usage.PrintI64("used", s.system_bytes - s.free_bytes - s.unmapped_bytes);
   usage.PrintI64("free", s.free_bytes);
   usage.PrintI64("unmapped", s.unmapped_bytes);
+  usage.PrintI64("lazily_freed", s.lazily_freed_bytes);
 }
 
 // public
 void HugePageAwareAllocator::Print(TCMalloc_Printer *out) { Print(out, true); }
 
+void HugePageAwareAllocator::MaybeSampleCoverage() {
+  const absl::Duration interval = Parameters::thp_coverage_sample_interval();
+  if (interval <= absl::ZeroDuration()) return;
+
+  HugePageCoverageSampler::Candidates candidates;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (!coverage_.Due(GetCurrentTimeNanos(), interval)) return;
+
+    HugeLength claimed[HugePageCoverageSampler::kNumComponents];
+    claimed[HugePageCoverageSampler::kFiller] = filler_.intact_hugepages();
+    claimed[HugePageCoverageSampler::kRegion] = regions_.backed();
+    claimed[HugePageCoverageSampler::kCache] = cache_.size();
+    candidates.Reset(claimed);
+    filler_.ForEachIntactHugePage([&](HugePage p) {
+      candidates.Offer(HugePageCoverageSampler::kFiller, p);
+    });
+    regions_.ForEachBackedHugePage([&](HugePage p) {
+      candidates.Offer(HugePageCoverageSampler::kRegion, p);
+    });
+    cache_.ForEachCachedHugePage([&](HugePage p) {
+      candidates.Offer(HugePageCoverageSampler::kCache, p);
+    });
+  }
+
+  // The candidates may be freed (or even unmapped) while we look at them;
+  // that only makes the sample a little stale.
+  SystemHugePageBacking backing;
+  candidates.Query(&backing);
+
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  coverage_.Record(candidates);
+}
+
 void HugePageAwareAllocator::Print(TCMalloc_Printer *out, bool everything) {
+  MaybeSampleCoverage();
   SmallSpanStats small;
   LargeSpanStats large;
   BackingStats bstats;
   PageAgeHistograms ages(absl::base_internal::CycleClock::Now());
+  absl::base_internal::SpinLockHolder c(&huge_cache_lock);
   absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  PublishCacheStats();
   bstats = stats();
   GetSpanStats(&small, &large, &ages);
+  alloc_.AddSpanStats(nullptr, nullptr, &ages);
+  cache_.AddSpanStats(nullptr, nullptr, &ages);
   PrintStats("HugePageAware", out, bstats, small, large, everything);
   out->printf(
       "\nHuge page aware allocator components:\n"
@@ -519,21 +1154,29 @@ void HugePageAwareAllocator::Print(TCMalloc_Printer *out, bool everything) {
   auto rstats = regions_.stats();
   BreakdownStats(out, rstats, "HugePageAware: region");
 
-  auto cstats = cache_.stats();
+  BackingStats astats, cstats;
+  PublishedCacheStats(&astats, &cstats);
   // Everything in the filler came from the cache -
   // adjust the totals so we see the amount used by the mutator.
   cstats.system_bytes -= fstats.system_bytes;
   BreakdownStats(out, cstats, "HugePageAware: cache ");
 
-  auto astats = alloc_.stats();
   // Everything in *all* components came from here -
   // so again adjust the totals.
   astats.system_bytes -= (fstats + rstats + cstats).system_bytes;
   BreakdownStats(out, astats, "HugePageAware: alloc ");
+  out->printf("HugePageAware: %6.1f MiB of unmapped space lazily freed\n",
+              BytesToMiB(bstats.lazily_freed_bytes));
   out->printf("\n");
 
   out->printf("HugePageAware: filler donations %zu\n",
               donated_huge_pages_.raw_num());
+  out->printf(
+      "HugePageAware: %zu spans resized in place (%zu shrunk), %zu remapped, "
+      "%zu bytes not copied\n",
+      resized_in_place_, shrunk_in_place_, remapped_,
+      resize_bytes_not_copied_);
+  coverage_.Print(out);
 
   // Component debug output
   // Filler is by far the most important; print (some) of it
@@ -549,7 +1192,10 @@ void HugePageAwareAllocator::Print(TCMalloc_Printer *out, bool everything) {
     out->printf("\n");
 
     // Use statistics
-    info_.Print(out);
+    {
+      absl::base_internal::SpinLockHolder s(&stats_lock_);
+      info_.Print(out);
+    }
 
     // and age tracking.
     ages.Print("HugePageAware", out);
@@ -560,11 +1206,16 @@ void HugePageAwareAllocator::Print(TCMalloc_Printer *out, bool everything) {
 }
 
 void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion *region) {
+  MaybeSampleCoverage();
   SmallSpanStats small;
   LargeSpanStats large;
   PageAgeHistograms ages(absl::base_internal::CycleClock::Now());
+  absl::base_internal::SpinLockHolder c(&huge_cache_lock);
   absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  PublishCacheStats();
   GetSpanStats(&small, &large, &ages);
+  alloc_.AddSpanStats(nullptr, nullptr, &ages);
+  cache_.AddSpanStats(nullptr, nullptr, &ages);
   PrintStatsInPbtxt(region, small, large, ages);
   {
     auto hpaa = region->CreateSubRegion("huge_page_allocator");
@@ -578,13 +1229,13 @@ void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion *region) {
     auto rstats = regions_.stats();
     BreakdownStatsInPbtxt(&hpaa, rstats, "region_usage");
 
-    auto cstats = cache_.stats();
+    BackingStats astats, cstats;
+    PublishedCacheStats(&astats, &cstats);
     // Everything in the filler came from the cache -
     // adjust the totals so we see the amount used by the mutator.
     cstats.system_bytes -= fstats.system_bytes;
     BreakdownStatsInPbtxt(&hpaa, cstats, "cache_usage");
 
-    auto astats = alloc_.stats();
     // Everything in *all* components came from here -
     // so again adjust the totals.
     astats.system_bytes -= (fstats + rstats + cstats).system_bytes;
@@ -596,38 +1247,48 @@ void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion *region) {
     alloc_.PrintInPbtxt(&hpaa);
 
     // Use statistics
-    info_.PrintInPbtxt(&hpaa, "hpaa_stat");
+    {
+      absl::base_internal::SpinLockHolder s(&stats_lock_);
+      info_.PrintInPbtxt(&hpaa, "hpaa_stat");
+    }
 
     hpaa.PrintI64("filler_donated_huge_pages", donated_huge_pages_.raw_num());
+    hpaa.PrintI64("spans_resized_in_place", resized_in_place_);
+    hpaa.PrintI64("spans_shrunk_in_place", shrunk_in_place_);
+    hpaa.PrintI64("spans_remapped", remapped_);
+    hpaa.PrintI64("resize_bytes_not_copied", resize_bytes_not_copied_);
+    coverage_.PrintInPbtxt(&hpaa);
   }
 }
 
-template <bool tagged>
-void *HugePageAwareAllocator::AllocAndReport(size_t bytes, size_t *actual,
-                                             size_t align) {
-  void *p = SystemAlloc(bytes, actual, align, tagged);
-  if (p == nullptr) return p;
-  const PageId page = PageIdContaining(p);
-  const Length page_len = BytesToLengthFloor(*actual);
-  Static::pagemap()->Ensure(page, page_len);
-  return p;
-}
-
-void *HugePageAwareAllocator::MetaDataAlloc(size_t bytes)
-    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
-  return Static::arena()->Alloc(bytes);
-}
-
 Length HugePageAwareAllocator::ReleaseAtLeastNPagesBreakingHugepages(Length n) {
   // We desparately need to release memory, and are willing to
-  // compromise on hugepage usage. That means releasing from the filler.
-  return filler_.ReleasePages(n, absl::ZeroDuration());
+  // compromise on hugepage usage. That means releasing from the filler, but
+  // first give up the warm reserve, which ReleaseAtLeastNPages leaves alone.
+  // The next RefillWarmReserve puts it back if there is room.
+  Length released;
+  {
+    absl::base_internal::SpinLockHolder c(&huge_cache_lock);
+    DrainFreedHugepages();
+    cache_.set_warm_reserve(NHugePages(0), populate_);
+    released = cache_.ReleaseCachedPages(HLFromPages(n)).in_pages();
+    PublishCacheStats();
+  }
+  if (released < n) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    released += ReleaseFromFiller(n - released, absl::ZeroDuration());
+  }
+  ReturnFreedHugepages();
+  return released;
 }
 
-void HugePageAwareAllocator::UnbackWithoutLock(void *start, size_t length) {
-  pageheap_lock.Unlock();
-  SystemRelease(start, length);
-  pageheap_lock.Lock();
+Length HugePageAwareAllocator::ReleaseFromFiller(
+    Length n, absl::Duration skip_subrelease_interval) {
+  Length released = filler_.ReleasePages(n, skip_subrelease_interval);
+  while (FillerType::Tracker *pt = filler_.TakeEmptied()) {
+    ReleaseHugepage(pt);
+  }
+  return released;
 }
 
 }  // namespace tcmalloc
@@ -17,11 +17,16 @@
 
 #include <stddef.h>
 
+#include <atomic>
+
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_allocator.h"
 #include "tcmalloc/huge_cache.h"
+#include "tcmalloc/huge_page_coverage.h"
 #include "tcmalloc/huge_page_filler.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/huge_region.h"
@@ -41,23 +46,65 @@ bool decide_subrelease();
 // and aggressively returns empty ones to the system.
 class HugePageAwareAllocator : public PageAllocatorInterface {
  public:
+  // Our filler and regions, and the trackers and spans we hand out, are
+  // guarded by pageheap_lock.  alloc_ and cache_ are guarded by
+  // huge_cache_lock instead, so that hugepages can be mapped, faulted in and
+  // unbacked without holding up every other page-level allocation.  When we
+  // need both, huge_cache_lock comes first, and we never touch alloc_ or
+  // cache_ with pageheap_lock held: their callbacks take it to allocate
+  // metadata.  So Delete(), which runs under pageheap_lock, queues the
+  // hugepages it frees for the next holder of huge_cache_lock to return to
+  // cache_ (see ReturnFreedHugepages()).
+  //
+  // Runs of whole hugepages straight from cache_ are the exception: nothing
+  // else shares their hugepages, so New() and DeleteWholeHugepages() handle
+  // them under huge_cache_lock alone, with spans from a stash of our own.
+  // What both kinds of allocation record, in info_ and the cache stats we
+  // publish, is guarded by stats_lock_, which is taken last of all.
   explicit HugePageAwareAllocator(bool tagged);
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
   // Caller should not pass "n == 0" -- instead, n should have
   // been rounded up already.
-  Span* New(Length n) ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+  Span* New(Length n)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
 
   // As New, but the returned span is aligned to a <align>-page boundary.
   // <align> must be a power of two.
   Span* NewAligned(Length n, Length align)
-      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
 
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
   void Delete(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
 
+  // If span is a run of whole hugepages straight from cache_, returns them
+  // there and returns true.  Otherwise returns false, leaving span for
+  // Delete().
+  // REQUIRES: as for Delete(), and span is not sampled.
+  bool DeleteWholeHugepages(Span* span)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
+  // Returns the hugepages Delete() has queued to cache_.  Callers of Delete()
+  // should call this once they have dropped pageheap_lock; otherwise the
+  // hugepages wait for our next allocation from cache_ or release.
+  void ReturnFreedHugepages()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
+  // Spans grow in place if the pages after them are free: on their hugepage
+  // in the filler, in their region, or, straight from our HugeCache (see
+  // AllocRawHugepages), into their donated slack or onto free hugepages,
+  // donating any new slack.  Spans of whole hugepages at least kMinRemap
+  // long can also, if may_move, be remapped onto a fresh range.  Shrinking
+  // always happens in place.
+  Span* Resize(Span* span, Length n, bool may_move)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
+
+  // Below this, copying is cheap enough that moving the page tables instead
+  // isn't worth the system call (and the TLB shootdown that comes with it).
+  static constexpr HugeLength kMinRemap = NHugePages(8);
+
   BackingStats stats() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
 
@@ -74,21 +121,27 @@ class HugePageAwareAllocator : public PageAllocatorInterface {
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
   Length ReleaseAtLeastNPages(Length num_pages)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
 
   Length ReleaseAtLeastNPagesBreakingHugepages(Length n)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
+  // Tops our cache up to Parameters::huge_cache_warm_reserve_bytes() of
+  // faulted-in hugepages.  Returns how many it had to add.
+  HugeLength RefillWarmReserve()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
 
   // Prints stats about the page heap to *out.
-  void Print(TCMalloc_Printer* out) ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+  void Print(TCMalloc_Printer* out)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
 
   // Print stats to *out, excluding long/likely uninteresting things
   // unless <everything> is true.
   void Print(TCMalloc_Printer* out, bool everything)
-      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
 
   void PrintInPbtxt(PbtxtRegion* region)
-      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock) override;
 
   HugeLength DonatedHugePages() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
@@ -101,10 +154,6 @@ class HugePageAwareAllocator : public PageAllocatorInterface {
   typedef HugePageFiller<PageTracker<SystemRelease>> FillerType;
   FillerType filler_;
 
-  // Calls SystemRelease, but with dropping of pageheap_lock around the call.
-  static void UnbackWithoutLock(void* start, size_t length)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-
   typedef HugeRegion<SystemRelease> Region;
   HugeRegionSet<Region> regions_;
 
@@ -115,12 +164,60 @@ class HugePageAwareAllocator : public PageAllocatorInterface {
 
   void SetTracker(HugePage p, FillerType::Tracker* pt);
 
-  template <bool tagged>
-  static void* AllocAndReport(size_t bytes, size_t* actual, size_t align)
+  HugeAllocator alloc_ ABSL_GUARDED_BY(huge_cache_lock);
+  HugeCache cache_ ABSL_GUARDED_BY(huge_cache_lock);
+
+  // Guards info_ and what we publish of alloc_ and cache_.  Nothing is
+  // acquired while holding it.
+  mutable absl::base_internal::SpinLock stats_lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+
+  // What alloc_ and cache_ hold, as of the last PublishCacheStats(), for
+  // stats() and GetLargeSpanStats() under pageheap_lock alone.
+  void PublishCacheStats() ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock)
+      ABSL_LOCKS_EXCLUDED(stats_lock_);
+  BackingStats alloc_stats_ ABSL_GUARDED_BY(stats_lock_);
+  BackingStats cache_stats_ ABSL_GUARDED_BY(stats_lock_);
+  LargeSpanStats cache_spans_ ABSL_GUARDED_BY(stats_lock_){};
+  // Sets *alloc and *cache to what we last published, with what is in freed_
+  // as if back in cache_.
+  void PublishedCacheStats(BackingStats* alloc, BackingStats* cache) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock)
+          ABSL_LOCKS_EXCLUDED(stats_lock_);
+
+  // info_ is shared with paths that hold only huge_cache_lock.
+  void RecordAlloc(PageId p, Length n) ABSL_LOCKS_EXCLUDED(stats_lock_);
+  void RecordFree(PageId p, Length n) ABSL_LOCKS_EXCLUDED(stats_lock_);
+
+  // Spans for the runs of whole hugepages we hand out straight from cache_,
+  // so that neither allocating nor freeing one needs pageheap_lock.  We take
+  // them from Static::span_allocator() and give them back kSpanBatch at a
+  // time.
+  static constexpr int kSpanBatch = 16;
+  SpanList spare_spans_ ABSL_GUARDED_BY(huge_cache_lock);
+  int num_spare_spans_ ABSL_GUARDED_BY(huge_cache_lock){0};
+  Span* NewWholeSpan(PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock)
+          ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  void DeleteWholeSpan(Span* span)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock)
+          ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // Set once we first carve a region.  Until then, a span of whole hugepages
+  // not on the filler came straight from cache_.
+  std::atomic<bool> has_regions_{false};
+
+  // Hugepages freed while we held only pageheap_lock, waiting to go back to
+  // cache_: one span each, ON_RETURNED_FREELIST if they were released.
+  SpanList freed_ ABSL_GUARDED_BY(pageheap_lock);
+  HugeLength freed_backed_ ABSL_GUARDED_BY(pageheap_lock);
+  HugeLength freed_released_ ABSL_GUARDED_BY(pageheap_lock);
+  // Whether freed_ may be non-empty, for a peek without pageheap_lock.
+  std::atomic<bool> has_freed_{false};
+  void QueueFreed(HugeRange r, bool released)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-  static void* MetaDataAlloc(size_t bytes);
-  HugeAllocator alloc_;
-  HugeCache cache_;
+  // Empties freed_ into cache_.
+  void DrainFreedHugepages() ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   // donated_huge_pages_ measures the number of huge pages contributed to the
   // filler from left overs of large huge page allocations.  When the large
@@ -129,12 +226,32 @@ class HugePageAwareAllocator : public PageAllocatorInterface {
   // get stuck in the filler).
   HugeLength donated_huge_pages_ ABSL_GUARDED_BY(pageheap_lock);
 
-  void GetSpanStats(SmallSpanStats* small, LargeSpanStats* large,
-                    PageAgeHistograms* ages);
+  // If Parameters::thp_coverage_sample_interval() has passed since the last
+  // time, checks a sample of our intact hugepages with the kernel.
+  void MaybeSampleCoverage()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+  HugePageCoverageSampler coverage_ ABSL_GUARDED_BY(pageheap_lock);
 
-  PageId RefillFiller(Length n, bool* from_released)
+  // Counts alloc_ and cache_ as of the last PublishCacheStats(), but not in
+  // ages, which need huge_cache_lock.
+  void GetSpanStats(SmallSpanStats* small, LargeSpanStats* large,
+                    PageAgeHistograms* ages)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // How much HugeCache::Release may leave for ReleaseAtLeastNPages to unback,
+  // from Parameters::huge_cache_deferred_unback_bytes().
+  static HugeLength DeferredUnbackLimit();
+  // How many hugepages our cache keeps faulted in, from
+  // Parameters::huge_cache_warm_reserve_bytes().  Tagged memory is rare
+  // enough not to be worth it.
+  HugeLength WarmReserve() const;
+  MemoryModifyFunction populate_;
+
+  // Takes a hugepage from cache_ for the filler, and allocates n pages from
+  // it.
+  Span* RefillFiller(Length n, bool* from_released)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
   // Allocate the first <n> from p, and contribute the rest to the filler.  If
   // "donated" is true, the contribution will be marked as coming from the
   // tail of a multi-hugepage alloc.  Returns the allocated section.
@@ -142,28 +259,86 @@ class HugePageAwareAllocator : public PageAllocatorInterface {
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   // Helpers for New().
 
-  Span* LockAndAlloc(Length n, bool* from_released);
+  Span* LockAndAlloc(Length n, bool* from_released)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+  // Backs s if needed.
+  void FinishNew(Span* s, bool from_released)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
 
   Span* AllocSmall(Length n, bool* from_released)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
   Span* AllocLarge(Length n, bool* from_released)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
   Span* AllocEnormous(Length n, bool* from_released)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
 
   Span* AllocRawHugepages(Length n, bool* from_released)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+  // Allocates n pages at the start of r, which we just took from cache_, and
+  // donates the slack to the filler.
+  Span* FinishRawHugepages(HugeRange r, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-
-  bool AddRegion() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-
+  // As FinishRawHugepages, for all of r, which leaves no slack.
+  Span* FinishWholeHugepages(HugeRange r)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(huge_cache_lock)
+          ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Whether AllocLarge should carve n pages out of a new region rather than
+  // straight from cache_.
+  bool ShouldAddRegion() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Tries to allocate n pages from a new region.
+  Span* AllocFromNewRegion(Length n, bool* from_released)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
+  // Queues the hugepage of pt, which the filler has emptied, to freed_.
   void ReleaseHugepage(FillerType::Tracker* pt)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Subreleases up to n pages from the filler, then releases any hugepages
+  // emptied while it did so.
+  Length ReleaseFromFiller(Length n, absl::Duration skip_subrelease_interval)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   // Return an allocation from a single hugepage.
   void DeleteFromHugepage(FillerType::Tracker* pt, PageId p, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Return [hp, hp + n), straight from the HugeCache, along with any slack
+  // we donated to the filler, to freed_.
+  void DeleteRawHugepages(HugePage hp, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Helpers for Resize(): resizes [p, p + old_n) to n pages where it is, if
+  // it can, setting *from_released iff the pages it grew onto need backing.
+  // If it first needs *needed from cache_, it returns false, leaving the rest
+  // to ResizeOnto() once our caller has them...
+  bool ResizeInPlace(PageId p, Length old_n, Length n, bool* from_released,
+                     HugeRange* needed)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // ...or queues them back if the span can no longer grow onto them.
+  bool ResizeOnto(PageId p, Length old_n, Length n, HugeRange needed,
+                  bool from_released)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Whether a span of old_n pages straight from cache_ can have the last of
+  // its hugepages, which starts at last, back whole: nobody else may be using
+  // the slack we donated from it.  ReclaimDonated() takes it back.
+  bool CanReclaimDonated(HugePage last, Length old_n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  void ReclaimDonated(HugePage last, Length old_n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  void RecordResize(PageId p, Length old_n, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // ...or moves span's hugepages onto a fresh range, growing it to n pages.
+  Span* Remap(Span* span, Length n)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+  // How many spans Resize() resized in place (and of those, shrunk) or
+  // remapped, and the bytes they held that nobody had to copy.
+  size_t resized_in_place_ ABSL_GUARDED_BY(pageheap_lock){0};
+  size_t shrunk_in_place_ ABSL_GUARDED_BY(pageheap_lock){0};
+  size_t remapped_ ABSL_GUARDED_BY(pageheap_lock){0};
+  size_t resize_bytes_not_copied_ ABSL_GUARDED_BY(pageheap_lock){0};
+
   // Finish an allocation request - give it a span and mark it in the pagemap.
-  Span* Finalize(Length n, PageId page);
+  Span* Finalize(Length n, PageId page)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 };
 
 }  // namespace tcmalloc
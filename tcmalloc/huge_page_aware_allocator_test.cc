@@ -21,6 +21,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <limits>
 #include <new>
@@ -141,8 +142,11 @@ class HugePageAwareAllocatorTest : public ::testing::Test {
   Span *AllocatorNew(Length n) { return allocator_->New(n); }
 
   void AllocatorDelete(Span *s) {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    allocator_->Delete(s);
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      allocator_->Delete(s);
+    }
+    allocator_->ReturnFreedHugepages();
   }
 
   Span *New(Length n) {
@@ -172,6 +176,25 @@ class HugePageAwareAllocatorTest : public ::testing::Test {
     }
   }
 
+  Span *Resize(Span *span, Length n, bool may_move) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    const Length old_n = span->num_pages();
+    Span *resized = allocator_->Resize(span, n, may_move);
+    if (resized == nullptr) {
+      EXPECT_EQ(old_n, span->num_pages());
+      return nullptr;
+    }
+    EXPECT_GE(resized->num_pages(), n);
+    auto i = ids_.find(span);
+    CHECK_CONDITION(i != ids_.end());
+    const size_t id = i->second;
+    ids_.erase(i);
+    CHECK_CONDITION(ids_.insert({resized, id}).second);
+    total_ += resized->num_pages() - old_n;
+    CheckStats();
+    return resized;
+  }
+
   // Mostly small things, some large ones.
   Length RandomAllocSize() {
     // TODO(b/128521238): scalable RNG
@@ -184,10 +207,7 @@ class HugePageAwareAllocatorTest : public ::testing::Test {
     return 1 + absl::LogUniform<int32_t>(rng_, 0, (1 << 9) - 1);
   }
 
-  Length ReleasePages(Length k) {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    return allocator_->ReleaseAtLeastNPages(k);
-  }
+  Length ReleasePages(Length k) { return allocator_->ReleaseAtLeastNPages(k); }
 
   std::string Print() {
     std::string ret;
@@ -313,6 +333,28 @@ TEST_F(HugePageAwareAllocatorTest, ReleasingLarge) {
   ASSERT_LE(kPagesPerHugePage, ReleasePages(kPagesPerHugePage));
 }
 
+TEST_F(HugePageAwareAllocatorTest, WarmReserve) {
+  const int64_t was = Parameters::huge_cache_warm_reserve_bytes();
+  Parameters::set_huge_cache_warm_reserve_bytes(4 * kHugePageSize);
+  EXPECT_LE(NHugePages(4) - allocator_->cache()->size(),
+            allocator_->RefillWarmReserve());
+  EXPECT_LE(NHugePages(4), allocator_->cache()->size());
+
+  // A hugepage allocation comes out of the reserve, which periodic release
+  // leaves alone...
+  Delete(New(kPagesPerHugePage));
+  ReleasePages(100 * kPagesPerHugePage);
+  EXPECT_EQ(NHugePages(4), allocator_->cache()->size());
+  EXPECT_THAT(Print(), HasSubstr("1 reserve hits, 0 reserve misses"));
+
+  // ...but not a desperate one.
+  EXPECT_LE(4 * kPagesPerHugePage,
+            allocator_->ReleaseAtLeastNPagesBreakingHugepages(
+                4 * kPagesPerHugePage));
+  EXPECT_EQ(NHugePages(0), allocator_->cache()->size());
+  Parameters::set_huge_cache_warm_reserve_bytes(was);
+}
+
 // For the moment, we have sub-hugepage-releasing disabled.
 TEST_F(HugePageAwareAllocatorTest, ReleasingSmall) {
   Parameters::set_hpaa_subrelease(true);
@@ -335,6 +377,26 @@ TEST_F(HugePageAwareAllocatorTest, ReleasingSmall) {
   }
 }
 
+TEST_F(HugePageAwareAllocatorTest, ThpCoverage) {
+  // Nothing is reported unless sampling is enabled.
+  Span *small = New(1);
+  EXPECT_THAT(PrintInPbTxt(), testing::Not(HasSubstr("thp_coverage")));
+
+  const absl::Duration was = Parameters::thp_coverage_sample_interval();
+  Parameters::set_thp_coverage_sample_interval(absl::Hours(1));
+  // Whether the kernel really gave us a hugepage varies, but the filler
+  // certainly claims one.
+  const std::string pbtxt = PrintInPbTxt();
+  EXPECT_THAT(pbtxt, HasSubstr("thp_coverage"));
+  EXPECT_THAT(pbtxt, HasSubstr(R"(type: FILLER
+        claimed_huge_pages: 1
+)"));
+  EXPECT_THAT(Print(), HasSubstr("HugePageAware: THP coverage (1 samples"));
+  Parameters::set_thp_coverage_sample_interval(was);
+
+  Delete(small);
+}
+
 TEST_F(HugePageAwareAllocatorTest, DonatedHugePages) {
   // This test verifies that we accurately measure the amount of RAM that we
   // donate to the huge page filler when making large allocations, including
@@ -519,6 +581,63 @@ TEST_F(HugePageAwareAllocatorTest, DonatedPageLists) {
   Delete(large);
 }
 
+TEST_F(HugePageAwareAllocatorTest, ResizeInPlace) {
+  // Leave 8 free hugepages in the cache, and take the first 2 of them.
+  Delete(New(8 * kPagesPerHugePage));
+  Span *span = New(2 * kPagesPerHugePage);
+  const HugePage start = HugePageContaining(span->first_page());
+  static_cast<Mark *>(span->start_address())->mark = 42;
+
+  // Growing takes free hugepages after it, donating the new slack.
+  ASSERT_EQ(span, Resize(span, 4 * kPagesPerHugePage + 1, false));
+  EXPECT_EQ(start, HugePageContaining(span->first_page()));
+  EXPECT_EQ(4 * kPagesPerHugePage + 1, span->num_pages());
+  EXPECT_EQ(42, static_cast<Mark *>(span->start_address())->mark);
+
+  // Not once the hugepages after it are taken.
+  Span *next = New(3 * kPagesPerHugePage);
+  EXPECT_EQ(start + NHugePages(5), HugePageContaining(next->first_page()));
+  EXPECT_EQ(nullptr, Resize(span, 6 * kPagesPerHugePage, false));
+
+  // Shrinking gives back the hugepages it no longer needs, and again donates
+  // the slack on its last one, which it can grow back into...
+  ASSERT_EQ(span, Resize(span, 2 * kPagesPerHugePage + 2, false));
+  EXPECT_EQ(2 * kPagesPerHugePage + 2, span->num_pages());
+  ASSERT_EQ(span, Resize(span, 2 * kPagesPerHugePage + 3, false));
+  EXPECT_EQ(2 * kPagesPerHugePage + 3, span->num_pages());
+
+  // ...as long as the filler hasn't put anything there.
+  Span *small = New(1);
+  ASSERT_EQ(span->last_page() + 1, small->first_page());
+  EXPECT_EQ(nullptr, Resize(span, 2 * kPagesPerHugePage + 4, false));
+  EXPECT_EQ(nullptr, Resize(span, 3 * kPagesPerHugePage, false));
+
+  // Spans in the filler likewise grow into free pages on their hugepage, and
+  // shrink.
+  Span *after = New(1);
+  ASSERT_EQ(small->first_page() + 1, after->first_page());
+  EXPECT_EQ(nullptr, Resize(small, 2, true));
+  Delete(after);
+  ASSERT_EQ(small, Resize(small, 3, false));
+  EXPECT_EQ(3, small->num_pages());
+  ASSERT_EQ(small, Resize(small, 1, false));
+  Span *reused = New(1);
+  EXPECT_EQ(small->first_page() + 1, reused->first_page());
+  Delete(reused);
+  Delete(small);
+
+  // Filling the last hugepage takes it back from the filler.
+  ASSERT_EQ(span, Resize(span, 3 * kPagesPerHugePage, false));
+  EXPECT_EQ(3 * kPagesPerHugePage, span->num_pages());
+  EXPECT_EQ(42, static_cast<Mark *>(span->start_address())->mark);
+
+  EXPECT_THAT(Print(), HasSubstr("6 spans resized in place (2 shrunk)"));
+  EXPECT_THAT(PrintInPbTxt(), HasSubstr("spans_resized_in_place: 6"));
+  EXPECT_THAT(PrintInPbTxt(), HasSubstr("spans_shrunk_in_place: 2"));
+  Delete(next);
+  Delete(span);
+}
+
 // We'd like to test OOM behavior but this, err, OOMs. :)
 // (Usable manually in controlled environments.
 TEST_F(HugePageAwareAllocatorTest, DISABLED_OOM) {
@@ -535,6 +654,153 @@ TEST_F(HugePageAwareAllocatorTest, DISABLED_OOM) {
   }
 }
 
+// Subreleases free pages scattered over many hugepages, which takes one
+// madvise per free range, while another thread keeps taking pageheap_lock.
+// Reports how long that thread had to wait and how often it got the lock
+// during each release.
+void BM_SubreleaseLockContention(benchmark::State &state) {
+  const bool was_subrelease = Parameters::hpaa_subrelease();
+  Parameters::set_hpaa_subrelease(true);
+  // HugePageAwareAllocator can't be destroyed cleanly; we leak it.
+  void *p = malloc(sizeof(HugePageAwareAllocator));
+  HugePageAwareAllocator *alloc = new (p) HugePageAwareAllocator(false);
+
+  const size_t kPages = state.range(0) * kPagesPerHugePage;
+  std::vector<Span *> live, dead;
+  live.reserve(kPages / 2);
+  dead.reserve(kPages / 2);
+
+  std::atomic<bool> releasing{false}, done{false};
+  std::atomic<int64_t> max_wait{0}, acquisitions{0};
+  std::thread prober([&]() {
+    while (!done.load(std::memory_order_relaxed)) {
+      const bool before = releasing.load(std::memory_order_relaxed);
+      const int64_t start = absl::GetCurrentTimeNanos();
+      pageheap_lock.Lock();
+      const int64_t wait = absl::GetCurrentTimeNanos() - start;
+      const bool after = releasing.load(std::memory_order_relaxed);
+      pageheap_lock.Unlock();
+      // We waited on a release, and (if after) it dropped the lock for us.
+      if (before && wait > max_wait.load(std::memory_order_relaxed)) {
+        max_wait.store(wait, std::memory_order_relaxed);
+      }
+      if (after) {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  });
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    // Fill fresh hugepages, and free every other page of them.
+    for (size_t i = 0; i < kPages; ++i) {
+      Span *s = alloc->New(1);
+      CHECK_CONDITION(s != nullptr);
+      (i % 2 == 0 ? live : dead).push_back(s);
+    }
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      for (Span *s : dead) alloc->Delete(s);
+    }
+    dead.clear();
+    state.ResumeTiming();
+
+    releasing = true;
+    alloc->ReleaseAtLeastNPages(kPages);
+    releasing = false;
+
+    state.PauseTiming();
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      for (Span *s : live) alloc->Delete(s);
+    }
+    // This also empties the cache, so that we only time the filler.
+    alloc->ReleaseAtLeastNPages(kPages);
+    live.clear();
+    state.ResumeTiming();
+  }
+
+  done = true;
+  prober.join();
+  Parameters::set_hpaa_subrelease(was_subrelease);
+
+  state.counters["max_wait_us"] = max_wait.load() / 1000.;
+  state.counters["lock_acquisitions_per_release"] =
+      static_cast<double>(acquisitions.load()) / state.iterations();
+}
+BENCHMARK(BM_SubreleaseLockContention)->Arg(16)->Arg(128)->UseRealTime();
+
+// Random-walks a set of (touched) multi-hugepage spans: each iteration
+// allocates a batch, then frees a random number of live spans, so the cache
+// often receives more than the next batch will take back.  Memory is
+// released periodically, as the background thread would.  Reports the
+// latency of the individual frees; the argument is
+// huge_cache_deferred_unback_bytes in MiB.
+void BM_LargeChurnFreeLatency(benchmark::State &state) {
+  const int64_t was_deferred = Parameters::huge_cache_deferred_unback_bytes();
+  Parameters::set_huge_cache_deferred_unback_bytes(state.range(0) << 20);
+  // HugePageAwareAllocator can't be destroyed cleanly; we leak it.
+  void *p = malloc(sizeof(HugePageAwareAllocator));
+  HugePageAwareAllocator *alloc = new (p) HugePageAwareAllocator(false);
+
+  absl::BitGen rng;
+  std::vector<Span *> live;
+  std::vector<int64_t> latencies;
+  for (auto _ : state) {
+    state.PauseTiming();
+    const size_t n = absl::Uniform<size_t>(rng, 0, 32);
+    for (size_t i = 0; i < n; ++i) {
+      const Length len = absl::Uniform<Length>(rng, 1, 8) * kPagesPerHugePage;
+      Span *s = alloc->New(len);
+      CHECK_CONDITION(s != nullptr);
+      char *start = static_cast<char *>(s->start_address());
+      for (size_t off = 0; off < s->bytes_in_span(); off += kHugePageSize) {
+        start[off] = 1;
+      }
+      live.push_back(s);
+    }
+    std::shuffle(live.begin(), live.end(), rng);
+    // Keep the live set bounded (at roughly 1 GiB.)
+    const size_t k = absl::Uniform<size_t>(
+        absl::IntervalClosed, rng, live.size() > 128 ? n : 0, live.size());
+    state.ResumeTiming();
+
+    for (size_t i = 0; i < k; ++i) {
+      Span *s = live.back();
+      live.pop_back();
+      const int64_t start = absl::GetCurrentTimeNanos();
+      {
+        absl::base_internal::SpinLockHolder h(&pageheap_lock);
+        alloc->Delete(s);
+      }
+      alloc->ReturnFreedHugepages();
+      latencies.push_back(absl::GetCurrentTimeNanos() - start);
+    }
+
+    state.PauseTiming();
+    alloc->ReleaseAtLeastNPages(0);
+    state.ResumeTiming();
+  }
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (Span *s : live) alloc->Delete(s);
+  }
+  alloc->ReturnFreedHugepages();
+  Parameters::set_huge_cache_deferred_unback_bytes(was_deferred);
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double q) {
+    return latencies[static_cast<size_t>(q * (latencies.size() - 1))] / 1000.;
+  };
+  state.counters["p50_us"] = percentile(0.5);
+  state.counters["p99_us"] = percentile(0.99);
+  state.counters["p999_us"] = percentile(0.999);
+  state.counters["p9999_us"] = percentile(0.9999);
+  state.counters["max_us"] = latencies.back() / 1000.;
+}
+BENCHMARK(BM_LargeChurnFreeLatency)->Arg(0)->Arg(256)->UseRealTime();
+
 struct MemoryBytes {
   uint64_t virt;
   uint64_t phys;
@@ -757,6 +1023,7 @@ class StatTest : public testing::Test {
       absl::base_internal::SpinLockHolder h(&pageheap_lock);
       alloc->Delete(s);
     }
+    alloc->ReturnFreedHugepages();
   }
 
   void CheckStats() {
@@ -829,7 +1096,6 @@ TEST_F(StatTest, Basic) {
 
     if (absl::Bernoulli(rng_, 1.0 / 3)) {
       Length k = absl::LogUniform<int32_t>(rng_, 0, (1 << 10) - 1) + 1;
-      absl::base_internal::SpinLockHolder h(&pageheap_lock);
       alloc->ReleaseAtLeastNPages(k);
     }
 
@@ -0,0 +1,257 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/huge_page_coverage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+
+namespace {
+
+// From <linux/fs.h> (Linux 6.7+); spelled out here as older headers lack it.
+struct PageRegion {
+  uint64_t start;
+  uint64_t end;
+  uint64_t categories;
+};
+
+struct PmScanArg {
+  uint64_t size;
+  uint64_t flags;
+  uint64_t start;
+  uint64_t end;
+  uint64_t walk_end;
+  uint64_t vec;
+  uint64_t vec_len;
+  uint64_t max_pages;
+  uint64_t category_inverted;
+  uint64_t category_mask;
+  uint64_t category_anyof_mask;
+  uint64_t return_mask;
+};
+
+constexpr unsigned long kPagemapScanIoctl = _IOWR('f', 16, PmScanArg);
+constexpr uint64_t kPageIsHuge = uint64_t{1} << 6;
+
+// From Documentation/admin-guide/mm/pagemap.rst.
+constexpr uint64_t kPagemapPresent = uint64_t{1} << 63;
+constexpr uint64_t kPagemapPfnMask = (uint64_t{1} << 55) - 1;
+constexpr uint64_t kKPageFlagsThp = uint64_t{1} << 22;
+
+const char *MethodName(HugePageBackingInterface::Method method) {
+  switch (method) {
+    case HugePageBackingInterface::kPagemapScan:
+      return "PAGEMAP_SCAN";
+    case HugePageBackingInterface::kKPageFlags:
+      return "KPAGEFLAGS";
+    case HugePageBackingInterface::kUnknown:
+      break;
+  }
+  return "UNKNOWN";
+}
+
+const char *ComponentName(HugePageCoverageSampler::Component c) {
+  switch (c) {
+    case HugePageCoverageSampler::kFiller:
+      return "FILLER";
+    case HugePageCoverageSampler::kRegion:
+      return "REGION";
+    case HugePageCoverageSampler::kCache:
+      return "CACHE";
+    case HugePageCoverageSampler::kNumComponents:
+      break;
+  }
+  return "UNKNOWN";
+}
+
+}  // namespace
+
+SystemHugePageBacking::~SystemHugePageBacking() {
+  if (pagemap_fd_ >= 0) close(pagemap_fd_);
+  if (kpageflags_fd_ >= 0) close(kpageflags_fd_);
+}
+
+int SystemHugePageBacking::IsHugePageBacked(HugePage p) {
+  if (!opened_) {
+    opened_ = true;
+    pagemap_fd_ = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    kpageflags_fd_ = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+  }
+  if (pagemap_fd_ < 0) return -1;
+
+  if (!scan_unsupported_) {
+    const int ret = ScanPagemap(p);
+    if (ret >= 0) {
+      method_ = kPagemapScan;
+      return ret;
+    }
+  }
+
+  if (kpageflags_fd_ >= 0) {
+    const int ret = LookupKPageFlags(p);
+    if (ret >= 0) {
+      method_ = kKPageFlags;
+      return ret;
+    }
+  }
+
+  return -1;
+}
+
+int SystemHugePageBacking::ScanPagemap(HugePage p) {
+  const uint64_t start = reinterpret_cast<uintptr_t>(p.start_addr());
+  const uint64_t end = start + kHugePageSize;
+
+  PageRegion region;
+  PmScanArg arg = {};
+  arg.size = sizeof(arg);
+  arg.start = start;
+  arg.end = end;
+  arg.vec = reinterpret_cast<uintptr_t>(&region);
+  arg.vec_len = 1;
+  arg.category_mask = kPageIsHuge;
+  arg.return_mask = kPageIsHuge;
+
+  const int ret = ioctl(pagemap_fd_, kPagemapScanIoctl, &arg);
+  if (ret < 0) {
+    if (errno == EINVAL || errno == ENOTTY) {
+      // Kernels before 6.7 don't know about this ioctl.
+      scan_unsupported_ = true;
+    }
+    return -1;
+  }
+
+  return (ret == 1 && region.start == start && region.end == end) ? 1 : 0;
+}
+
+int SystemHugePageBacking::LookupKPageFlags(HugePage p) {
+  const uint64_t vpn =
+      reinterpret_cast<uintptr_t>(p.start_addr()) / getpagesize();
+  uint64_t entry;
+  if (pread(pagemap_fd_, &entry, sizeof(entry), vpn * sizeof(entry)) !=
+      sizeof(entry)) {
+    return -1;
+  }
+  if ((entry & kPagemapPresent) == 0) return 0;
+
+  // Without CAP_SYS_ADMIN the kernel hides page frame numbers.
+  const uint64_t pfn = entry & kPagemapPfnMask;
+  if (pfn == 0) return -1;
+
+  uint64_t flags;
+  if (pread(kpageflags_fd_, &flags, sizeof(flags), pfn * sizeof(flags)) !=
+      sizeof(flags)) {
+    return -1;
+  }
+  return (flags & kKPageFlagsThp) != 0 ? 1 : 0;
+}
+
+HugeLength HugePageCoverageSampler::Coverage::actual() const {
+  if (sampled == 0) return NHugePages(0);
+  return NHugePages(claimed.raw_num() * backed / sampled);
+}
+
+void HugePageCoverageSampler::Candidates::Reset(
+    const HugeLength claimed[kNumComponents]) {
+  for (int c = 0; c < kNumComponents; ++c) {
+    claimed_[c] = claimed[c];
+    stride_[c] = std::max<size_t>(
+        1, (claimed[c].raw_num() + kMaxSamples - 1) / kMaxSamples);
+    offered_[c] = 0;
+    n_[c] = 0;
+  }
+  method_ = HugePageBackingInterface::kUnknown;
+}
+
+void HugePageCoverageSampler::Candidates::Offer(Component c, HugePage p) {
+  if (offered_[c]++ % stride_[c] != 0 || n_[c] == kMaxSamples) return;
+  pages_[c][n_[c]++] = p;
+}
+
+void HugePageCoverageSampler::Candidates::Query(
+    HugePageBackingInterface *backing) {
+  for (int c = 0; c < kNumComponents; ++c) {
+    for (int i = 0; i < n_[c]; ++i) {
+      result_[c][i] = backing->IsHugePageBacked(pages_[c][i]);
+    }
+  }
+  method_ = backing->method();
+}
+
+bool HugePageCoverageSampler::Due(int64_t now_ns, absl::Duration interval) {
+  if (started_ && now_ns - last_sample_ns_ < absl::ToInt64Nanoseconds(interval)) {
+    return false;
+  }
+  started_ = true;
+  last_sample_ns_ = now_ns;
+  return true;
+}
+
+void HugePageCoverageSampler::Record(const Candidates &candidates) {
+  for (int c = 0; c < kNumComponents; ++c) {
+    Coverage &coverage = coverage_[c];
+    coverage.claimed = candidates.claimed_[c];
+    coverage.sampled = 0;
+    coverage.backed = 0;
+    for (int i = 0; i < candidates.n_[c]; ++i) {
+      const int result = candidates.result_[c][i];
+      if (result < 0) continue;
+      coverage.sampled++;
+      if (result > 0) coverage.backed++;
+    }
+  }
+  method_ = candidates.method_;
+  samples_++;
+}
+
+void HugePageCoverageSampler::Print(TCMalloc_Printer *out) const {
+  if (samples_ == 0) return;
+  out->printf("HugePageAware: THP coverage (%zu samples, via %s):\n", samples_,
+              MethodName(method_));
+  for (int c = 0; c < kNumComponents; ++c) {
+    const Coverage &coverage = coverage_[c];
+    out->printf(
+        "HugePageAware: %-6s %zu hugepages claimed, ~%zu actual "
+        "(%zu of %zu checked)\n",
+        ComponentName(static_cast<Component>(c)), coverage.claimed.raw_num(),
+        coverage.actual().raw_num(), coverage.backed, coverage.sampled);
+  }
+}
+
+void HugePageCoverageSampler::PrintInPbtxt(PbtxtRegion *hpaa) const {
+  if (samples_ == 0) return;
+  auto region = hpaa->CreateSubRegion("thp_coverage");
+  region.PrintRaw("method", MethodName(method_));
+  region.PrintI64("num_samples", samples_);
+  for (int c = 0; c < kNumComponents; ++c) {
+    const Coverage &coverage = coverage_[c];
+    auto component = region.CreateSubRegion("component");
+    component.PrintRaw("type", ComponentName(static_cast<Component>(c)));
+    component.PrintI64("claimed_huge_pages", coverage.claimed.raw_num());
+    component.PrintI64("actual_huge_pages", coverage.actual().raw_num());
+    component.PrintI64("checked_huge_pages", coverage.sampled);
+    component.PrintI64("checked_thp_backed_huge_pages", coverage.backed);
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,145 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_HUGE_PAGE_COVERAGE_H_
+#define TCMALLOC_HUGE_PAGE_COVERAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/time/time.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+
+// Asks the kernel whether a hugepage is really mapped with a transparent
+// hugepage.  This is an interface so that it can be replaced for testing.
+class HugePageBackingInterface {
+ public:
+  enum Method { kUnknown, kPagemapScan, kKPageFlags };
+
+  HugePageBackingInterface() {}
+  virtual ~HugePageBackingInterface() {}
+
+  // Returns 1 if p is mapped with a THP, 0 if it is not (including if it is
+  // not resident at all), and -1 if we cannot tell.
+  virtual int IsHugePageBacked(HugePage p) = 0;
+
+  // The kernel interface the last successful IsHugePageBacked used.
+  virtual Method method() const = 0;
+
+ private:
+  HugePageBackingInterface(const HugePageBackingInterface &) = delete;
+  HugePageBackingInterface &operator=(const HugePageBackingInterface &) =
+      delete;
+};
+
+// Checks the real page tables of this process.  We prefer the PAGEMAP_SCAN
+// ioctl on /proc/self/pagemap (Linux 6.7+), which works without privileges.
+// Otherwise we look up the page frame in /proc/self/pagemap and its THP flag
+// in /proc/kpageflags, which requires CAP_SYS_ADMIN.  (/proc/self/smaps only
+// has AnonHugePages per mapping, which is too coarse to attribute to the
+// hugepages of individual components.)
+class SystemHugePageBacking final : public HugePageBackingInterface {
+ public:
+  SystemHugePageBacking() {}
+  ~SystemHugePageBacking() override;
+
+  int IsHugePageBacked(HugePage p) override;
+  Method method() const override { return method_; }
+
+ private:
+  int ScanPagemap(HugePage p);
+  int LookupKPageFlags(HugePage p);
+
+  int pagemap_fd_{-1};
+  int kpageflags_fd_{-1};
+  bool opened_{false};
+  bool scan_unsupported_{false};
+  Method method_{kUnknown};
+};
+
+// Estimates how much of the memory the hugepage-aware allocator believes to
+// be hugepage-backed actually is.  Each sample checks at most
+// kMaxSamples hugepages, spread evenly, from each component.
+//
+// Sampling happens in two phases so that the (slow) kernel queries can be
+// made without holding pageheap_lock: Offer() the candidates while holding
+// the lock, Query() without it, then Record() the results with it again.
+class HugePageCoverageSampler {
+ public:
+  enum Component { kFiller, kRegion, kCache, kNumComponents };
+  static constexpr int kMaxSamples = 64;
+
+  struct Coverage {
+    // Hugepages the component believed to be intact when last sampled.
+    HugeLength claimed;
+    // Of the hugepages we checked, how many the kernel could tell us about
+    // and how many of those were actually THP-backed.
+    size_t sampled{0};
+    size_t backed{0};
+
+    // Estimated number of claimed hugepages that really are THP-backed.
+    HugeLength actual() const;
+  };
+
+  // The candidates for one sample.
+  class Candidates {
+   public:
+    // Prepares to receive the intact hugepages of each component, given how
+    // many of them there are.
+    void Reset(const HugeLength claimed[kNumComponents]);
+    void Offer(Component c, HugePage p);
+
+    // Asks backing about each candidate.
+    void Query(HugePageBackingInterface *backing);
+
+   private:
+    friend class HugePageCoverageSampler;
+
+    HugeLength claimed_[kNumComponents];
+    size_t stride_[kNumComponents];
+    size_t offered_[kNumComponents];
+    int n_[kNumComponents];
+    HugePage pages_[kNumComponents][kMaxSamples];
+    int8_t result_[kNumComponents][kMaxSamples];
+    HugePageBackingInterface::Method method_;
+  };
+
+  HugePageCoverageSampler() {}
+
+  // Returns true (and records that a sample has started) if the last sample
+  // started at least interval before now.
+  bool Due(int64_t now_ns, absl::Duration interval);
+
+  void Record(const Candidates &candidates);
+
+  const Coverage &coverage(Component c) const { return coverage_[c]; }
+  size_t samples() const { return samples_; }
+
+  void Print(TCMalloc_Printer *out) const;
+  void PrintInPbtxt(PbtxtRegion *hpaa) const;
+
+ private:
+  Coverage coverage_[kNumComponents];
+  HugePageBackingInterface::Method method_{HugePageBackingInterface::kUnknown};
+  size_t samples_{0};
+  bool started_{false};
+  int64_t last_sample_ns_{0};
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_HUGE_PAGE_COVERAGE_H_
@@ -0,0 +1,169 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/huge_page_coverage.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+namespace {
+
+using Sampler = HugePageCoverageSampler;
+
+// Claims every hugepage whose index is a multiple of kEvery is THP-backed,
+// and that it can't tell for index 1.
+class FakeBacking : public HugePageBackingInterface {
+ public:
+  static constexpr size_t kEvery = 4;
+
+  int IsHugePageBacked(HugePage p) override {
+    queries_++;
+    if (p.index() == 1) return -1;
+    return p.index() % kEvery == 0 ? 1 : 0;
+  }
+  Method method() const override { return kPagemapScan; }
+
+  size_t queries_{0};
+};
+
+TEST(HugePageCoverageTest, EstimatesFromSample) {
+  // The filler has many more hugepages than we sample, the region a few and
+  // the cache none.
+  const HugeLength kFiller = NHugePages(Sampler::kMaxSamples * 10);
+  const HugeLength kRegion = NHugePages(8);
+  HugeLength claimed[Sampler::kNumComponents];
+  claimed[Sampler::kFiller] = kFiller;
+  claimed[Sampler::kRegion] = kRegion;
+  claimed[Sampler::kCache] = NHugePages(0);
+
+  Sampler::Candidates candidates;
+  candidates.Reset(claimed);
+  // Offering hugepages 2, 3, ... skips the page FakeBacking can't classify.
+  for (size_t i = 0; i < kFiller.raw_num(); ++i) {
+    candidates.Offer(Sampler::kFiller, HugePage{2 + i});
+  }
+  for (size_t i = 0; i < kRegion.raw_num(); ++i) {
+    candidates.Offer(Sampler::kRegion, HugePage{1 + i});
+  }
+
+  FakeBacking backing;
+  candidates.Query(&backing);
+  // The filler is subsampled; every region hugepage is checked.
+  EXPECT_EQ(Sampler::kMaxSamples + kRegion.raw_num(), backing.queries_);
+
+  Sampler sampler;
+  sampler.Record(candidates);
+  EXPECT_EQ(1, sampler.samples());
+
+  // Our stride (10) and FakeBacking's (4) line up every other sample.
+  const Sampler::Coverage &filler = sampler.coverage(Sampler::kFiller);
+  EXPECT_EQ(kFiller, filler.claimed);
+  EXPECT_EQ(Sampler::kMaxSamples, filler.sampled);
+  EXPECT_EQ(Sampler::kMaxSamples / 2, filler.backed);
+  EXPECT_EQ(kFiller / 2, filler.actual());
+
+  // Pages 1..8: page 1 is unknown, 4 and 8 are backed.
+  const Sampler::Coverage &region = sampler.coverage(Sampler::kRegion);
+  EXPECT_EQ(kRegion, region.claimed);
+  EXPECT_EQ(7, region.sampled);
+  EXPECT_EQ(2, region.backed);
+  EXPECT_EQ(NHugePages(kRegion.raw_num() * 2 / 7), region.actual());
+
+  const Sampler::Coverage &cache = sampler.coverage(Sampler::kCache);
+  EXPECT_EQ(NHugePages(0), cache.claimed);
+  EXPECT_EQ(0, cache.sampled);
+  EXPECT_EQ(NHugePages(0), cache.actual());
+
+  std::string buffer(4096, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    PbtxtRegion top(&printer, kTop, /*indent=*/0);
+    sampler.PrintInPbtxt(&top);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("method: PAGEMAP_SCAN"));
+  EXPECT_THAT(buffer, testing::HasSubstr(R"(type: FILLER
+      claimed_huge_pages: 640
+      actual_huge_pages: 320
+      checked_huge_pages: 64
+      checked_thp_backed_huge_pages: 32)"));
+}
+
+TEST(HugePageCoverageTest, RateLimited) {
+  Sampler sampler;
+  const absl::Duration kInterval = absl::Seconds(10);
+  const int64_t kStart = absl::ToInt64Nanoseconds(absl::Hours(1));
+
+  EXPECT_TRUE(sampler.Due(kStart, kInterval));
+  EXPECT_FALSE(sampler.Due(kStart, kInterval));
+  EXPECT_FALSE(
+      sampler.Due(kStart + absl::ToInt64Nanoseconds(absl::Seconds(9)),
+                  kInterval));
+  EXPECT_TRUE(sampler.Due(
+      kStart + absl::ToInt64Nanoseconds(absl::Seconds(10)), kInterval));
+}
+
+// Nothing to print until we have taken a sample.
+TEST(HugePageCoverageTest, NoSamples) {
+  Sampler sampler;
+  std::string buffer(1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    sampler.Print(&printer);
+    PbtxtRegion top(&printer, kTop, /*indent=*/0);
+    sampler.PrintInPbtxt(&top);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::Not(testing::HasSubstr("coverage")));
+}
+
+// Whether we get a THP depends on the kernel configuration, but the answers
+// must at least be consistent with what we mapped.
+TEST(HugePageCoverageTest, SystemBacking) {
+  const size_t kSize = 4 * kHugePageSize;
+  void *p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(p, MAP_FAILED);
+  const HugePage first = HugePageContaining(p) + NHugePages(1);
+  char *touched = static_cast<char *>(first.start_addr());
+#ifdef MADV_HUGEPAGE
+  madvise(touched, kHugePageSize, MADV_HUGEPAGE);
+#endif
+  memset(touched, 1, kHugePageSize);
+
+  SystemHugePageBacking backing;
+  const int result = backing.IsHugePageBacked(first);
+  EXPECT_GE(result, -1);
+  EXPECT_LE(result, 1);
+  if (result >= 0) {
+    EXPECT_NE(HugePageBackingInterface::kUnknown, backing.method());
+  }
+
+  // Never touched, so it cannot be backed by anything.
+  EXPECT_NE(1, backing.IsHugePageBacked(first + NHugePages(1)));
+
+  EXPECT_EQ(0, munmap(p, kSize));
+}
+
+}  // namespace
+}  // namespace tcmalloc
@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 #include <limits>
@@ -32,6 +33,7 @@
 #include "tcmalloc/internal/timeseries_tracker.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -205,6 +207,8 @@ class FillerStatsTracker {
     Length unmapped_pages = 0;
     Length used_pages_in_subreleased_huge_pages = 0;
     HugeLength huge_pages[kNumTypes];
+    // The skip-subrelease interval in effect; filled in by Report().
+    absl::Duration skip_subrelease_interval;
 
     HugeLength total_huge_pages() const {
       HugeLength total_huge_pages;
@@ -227,21 +231,29 @@ class FillerStatsTracker {
       : summary_interval_(summary_interval),
         window_(w),
         epoch_length_(window_ / kEpochs),
+        clock_(clock),
         tracker_(clock, w),
-        skipped_subrelease_correctness_(clock, w) {}
+        skipped_subrelease_correctness_(clock, w),
+        refaulted_subrelease_(clock, w) {}
 
   // Not copyable or movable
   FillerStatsTracker(const FillerStatsTracker &) = delete;
   FillerStatsTracker &operator=(const FillerStatsTracker &) = delete;
 
-  void Report(const FillerStats stats) {
+  void Report(FillerStats stats) {
+    stats.skip_subrelease_interval = last_peak_interval_;
     if (ABSL_PREDICT_FALSE(tracker_.Report(stats))) {
+      // Consider the peak within the just completed epoch to confirm the
+      // correctness of any recent subrelease decisions.
+      const Length peak = std::max(
+          stats.num_pages,
+          tracker_.GetEpochAtOffset(1).stats[kStatsAtMaxDemand].num_pages);
       if (ABSL_PREDICT_FALSE(pending_skipped().count > 0)) {
-        // Consider the peak within the just completed epoch to confirm the
-        // correctness of any recent subrelease decisions.
-        skipped_subrelease_correctness_.ReportUpdatedPeak(std::max(
-            stats.num_pages,
-            tracker_.GetEpochAtOffset(1).stats[kStatsAtMaxDemand].num_pages));
+        skipped_subrelease_correctness_.ReportUpdatedPeak(peak);
+      }
+      if (ABSL_PREDICT_FALSE(refaulted_subrelease_.pending_skipped().count >
+                             0)) {
+        refaulted_subrelease_.ReportUpdatedPeak(peak);
       }
     }
   }
@@ -304,6 +316,55 @@ class FillerStatsTracker {
     return skipped_subrelease_correctness_.pending_skipped();
   }
 
+  // Records that we subreleased pages while demand plus free pages stood at
+  // current_pages.  Should demand climb back to current_pages within the
+  // maximum adaptive interval, the kernel had to fault the pages back in, and
+  // a longer skip-subrelease interval would have avoided it.  Only tracked
+  // once AdaptiveSkipSubreleaseInterval has been used.
+  void ReportSubreleasedPages(Length pages, Length current_pages) {
+    if (pages == 0 || max_adaptive_interval_ == absl::ZeroDuration()) {
+      return;
+    }
+
+    refaulted_subrelease_.ReportSkippedSubreleasePages(pages, current_pages,
+                                                       max_adaptive_interval_);
+  }
+
+  // Subreleased pages (from ReportSubreleasedPages) and how many of them were
+  // needed again within the maximum adaptive interval.
+  inline typename SkippedSubreleaseCorrectnessTracker<
+      kEpochs>::SkippedSubreleaseDecision
+  subreleased() const {
+    return refaulted_subrelease_.total_skipped();
+  }
+
+  inline typename SkippedSubreleaseCorrectnessTracker<
+      kEpochs>::SkippedSubreleaseDecision
+  refaulted() const {
+    return refaulted_subrelease_.correctly_skipped();
+  }
+
+  // Returns the skip-subrelease interval to use, adapted within
+  // [min_interval, max_interval] to how our recent decisions turned out.
+  // Starting at min_interval, at most once per interval we:
+  //
+  // - double it, if kRefaultedFraction of the subreleased pages we have
+  //   resolved since the last step were faulted back in: a longer interval
+  //   would have kept the memory through the next peak.
+  // - otherwise halve it, if less than kCorrectlySkippedFraction of the
+  //   skipped pages we have resolved since were confirmed correct: we are
+  //   holding on to memory that demand does not come back for.
+  //
+  // max_interval is capped to the window of the tracker, which bounds how far
+  // back we can find peaks.
+  absl::Duration AdaptiveSkipSubreleaseInterval(absl::Duration min_interval,
+                                                absl::Duration max_interval);
+
+  // The number of times AdaptiveSkipSubreleaseInterval changed the interval.
+  size_t skip_subrelease_interval_changes() const {
+    return skip_subrelease_interval_changes_;
+  }
+
   // Returns the minimum number of free pages throughout the tracker period.
   // The first value of the pair is the number of all free pages, the second
   // value contains only the backed ones.
@@ -351,6 +412,8 @@ class FillerStatsTracker {
     static constexpr Length kDefaultValue = std::numeric_limits<Length>::max();
     Length min_free_pages = kDefaultValue;
     Length min_free_backed_pages = kDefaultValue;
+    // The longest skip-subrelease interval in effect during this epoch.
+    absl::Duration skip_subrelease_interval;
 
     static FillerStatsEntry Nil() { return FillerStatsEntry(); }
 
@@ -382,6 +445,8 @@ class FillerStatsTracker {
       min_free_pages =
           std::min(min_free_pages, e.free_pages + e.unmapped_pages);
       min_free_backed_pages = std::min(min_free_backed_pages, e.free_pages);
+      skip_subrelease_interval =
+          std::max(skip_subrelease_interval, e.skip_subrelease_interval);
     }
 
     bool empty() const { return min_free_pages == kDefaultValue; }
@@ -393,14 +458,92 @@ class FillerStatsTracker {
 
   const absl::Duration window_;
   const absl::Duration epoch_length_;
+  const ClockFunc clock_;
 
   TimeSeriesTracker<FillerStatsEntry, FillerStats, kEpochs> tracker_;
   SkippedSubreleaseCorrectnessTracker<kEpochs> skipped_subrelease_correctness_;
+  // Subreleases count as "correct" here if they were faulted back in.
+  SkippedSubreleaseCorrectnessTracker<kEpochs> refaulted_subrelease_;
 
   // Records the last peak_interval value, for reporting and debugging only.
   absl::Duration last_peak_interval_;
+
+  // State of AdaptiveSkipSubreleaseInterval.  The baselines are the resolved
+  // and confirmed pages as of the last step.
+  static constexpr double kRefaultedFraction = 0.25;
+  static constexpr double kCorrectlySkippedFraction = 0.5;
+  absl::Duration adaptive_interval_;
+  absl::Duration max_adaptive_interval_;
+  int64_t last_adapted_ns_ = 0;
+  size_t skip_subrelease_interval_changes_ = 0;
+  Length subreleased_resolved_base_ = 0;
+  Length refaulted_base_ = 0;
+  Length skipped_resolved_base_ = 0;
+  Length correctly_skipped_base_ = 0;
 };
 
+template <size_t kEpochs>
+absl::Duration FillerStatsTracker<kEpochs>::AdaptiveSkipSubreleaseInterval(
+    absl::Duration min_interval, absl::Duration max_interval) {
+  max_interval = std::min(max_interval, window_);
+  min_interval = std::min(min_interval, max_interval);
+  const int64_t now = clock_();
+  if (max_adaptive_interval_ == absl::ZeroDuration()) {
+    adaptive_interval_ = min_interval;
+    last_adapted_ns_ = now;
+  }
+  max_adaptive_interval_ = max_interval;
+  adaptive_interval_ = std::clamp(adaptive_interval_, min_interval,
+                                  max_interval);
+
+  if (absl::Nanoseconds(now - last_adapted_ns_) >=
+      std::max(adaptive_interval_, epoch_length_)) {
+    last_adapted_ns_ = now;
+
+    // Decisions still pending may yet go either way, so only look at those
+    // that were resolved since the last step.
+    const Length subreleased_resolved = refaulted_subrelease_.total_skipped()
+                                            .pages -
+                                        refaulted_subrelease_.pending_skipped()
+                                            .pages;
+    const Length skipped_resolved =
+        total_skipped().pages - pending_skipped().pages;
+    const auto delta = [](Length value, Length *base) {
+      const Length d = value > *base ? value - *base : 0;
+      *base = value;
+      return static_cast<double>(d);
+    };
+    const double subreleased_pages =
+        delta(subreleased_resolved, &subreleased_resolved_base_);
+    const double refaulted_pages = delta(refaulted().pages, &refaulted_base_);
+    const double skipped_pages =
+        delta(skipped_resolved, &skipped_resolved_base_);
+    const double correct_pages =
+        delta(correctly_skipped().pages, &correctly_skipped_base_);
+
+    absl::Duration next = adaptive_interval_;
+    if (subreleased_pages > 0 &&
+        refaulted_pages >= kRefaultedFraction * subreleased_pages) {
+      next = std::min(std::max(2 * adaptive_interval_, epoch_length_),
+                      max_interval);
+    } else if (skipped_pages > 0 &&
+               correct_pages < kCorrectlySkippedFraction * skipped_pages) {
+      next = adaptive_interval_ / 2;
+      // Intervals shorter than an epoch see no peaks other than the current
+      // one.
+      if (next < epoch_length_) next = min_interval;
+      next = std::max(next, min_interval);
+    }
+    if (next != adaptive_interval_) {
+      adaptive_interval_ = next;
+      skip_subrelease_interval_changes_++;
+    }
+  }
+
+  last_peak_interval_ = adaptive_interval_;
+  return adaptive_interval_;
+}
+
 template <size_t kEpochs>
 void FillerStatsTracker<kEpochs>::Print(TCMalloc_Printer *out) const {
   NumberOfFreePages free_pages = min_free_pages(summary_interval_);
@@ -465,6 +608,14 @@ void FillerStatsTracker<kEpochs>::Print(TCMalloc_Printer *out) const {
       " pages) were skipped due to recent (%llds) peaks.\n",
       total_skipped().count, total_skipped().pages,
       static_cast<long long>(absl::ToInt64Seconds(last_peak_interval_)));
+  if (max_adaptive_interval_ != absl::ZeroDuration()) {
+    out->printf(
+        "HugePageFiller: interval adapted %zu times (up to %llds); %zu of %zu "
+        "subreleased pages were faulted back in.\n",
+        skip_subrelease_interval_changes_,
+        static_cast<long long>(absl::ToInt64Seconds(max_adaptive_interval_)),
+        refaulted().pages, subreleased().pages);
+  }
 
   // Evaluate a/b, avoiding division by zero
   const auto safe_div = [](Length a, Length b) {
@@ -502,6 +653,16 @@ void FillerStatsTracker<kEpochs>::PrintInPbtxt(PbtxtRegion *hpaa) const {
                              correctly_skipped().count);
     skip_subrelease.PrintI64("pending_skipped_subrelease_count",
                              pending_skipped().count);
+    if (max_adaptive_interval_ != absl::ZeroDuration()) {
+      skip_subrelease.PrintI64(
+          "max_skipped_subrelease_interval_ms",
+          absl::ToInt64Milliseconds(max_adaptive_interval_));
+      skip_subrelease.PrintI64("skipped_subrelease_interval_changes",
+                               skip_subrelease_interval_changes_);
+      skip_subrelease.PrintI64("subreleased_pages", subreleased().pages);
+      skip_subrelease.PrintI64("refaulted_subreleased_pages",
+                               refaulted().pages);
+    }
   }
 
   auto filler_stats = hpaa->CreateSubRegion("filler_stats_timeseries");
@@ -526,6 +687,9 @@ void FillerStatsTracker<kEpochs>::PrintInPbtxt(PbtxtRegion *hpaa) const {
                         absl::ToInt64Milliseconds(absl::Nanoseconds(ts)));
         region.PrintI64("min_free_pages", e.min_free_pages);
         region.PrintI64("min_free_backed_pages", e.min_free_backed_pages);
+        region.PrintI64(
+            "skip_subrelease_interval_ms",
+            absl::ToInt64Milliseconds(e.skip_subrelease_interval));
         for (int i = 0; i < kNumStatsTypes; i++) {
           auto m = region.CreateSubRegion(labels[i]);
           FillerStats stats = e.stats[i];
@@ -554,17 +718,26 @@ template <MemoryModifyFunction Unback>
 class PageTracker : public TList<PageTracker<Unback>>::Elem {
  public:
   static void UnbackImpl(void *p, size_t size) { Unback(p, size); }
+  static void UnbackRangesImpl(const struct iovec *ranges, size_t n) {
+    UnbackRanges<Unback>(ranges, n);
+  }
 
   constexpr PageTracker(HugePage p, int64_t when)
       : location_(p),
         free_{},
         when_(when),
         released_count_(0),
-        donated_(false) {}
+        releasing_(0),
+        donated_(false),
+        broken_(false),
+        collapsing_(false),
+        span_class_(0) {}
 
   struct PageAllocation {
     PageId page;
     Length previously_unbacked;
+    // The subset of previously_unbacked that MarkReleased() released.
+    Length previously_eagerly_released;
   };
 
   // REQUIRES: there's a free range of at least n pages
@@ -576,9 +749,38 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   // REQUIRES: p was the result of a previous call to Get(n)
   void Put(PageId p, Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns true if [p, p + n), which must lie on our hugepage, is free.
+  bool IsFree(PageId p, Length n) const {
+    return free_.IsFree(p - location_.first_page(), n);
+  }
+
+  // REQUIRES: [p, p + n) is free and directly follows an allocation.
+  //
+  // Adds [p, p + n) to that allocation, returning the counts of previously
+  // unbacked pages in it as Get does.
+  PageAllocation Extend(PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // REQUIRES: [p, p + n) is the tail of an allocation starting before p.
+  //
+  // Frees [p, p + n), as Put would, but leaves the rest allocated.
+  void Trim(PageId p, Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Returns true if any unused pages have been returned-to-system.
   bool released() const { return released_count_ > 0; }
 
+  // Returns true if we have subreleased part of this hugepage since we last
+  // knew it to be backed by a kernel hugepage.  Reusing the released pages
+  // faults them back in as small pages, so the hugepage stays broken even once
+  // it is fully backed again, until it is collapsed.
+  bool broken() const { return broken_; }
+  void set_collapsed() { broken_ = false; }
+
+  // Set while HugePageFiller::CollapseHugePages works on this hugepage without
+  // pageheap_lock; until then it must not be subreleased or handed back.
+  bool collapsing() const { return collapsing_; }
+  void set_collapsing(bool value) { collapsing_ = value; }
+
   // Was this tracker donated from the tail of a multi-hugepage allocation?
   // Only up-to-date when the tracker is on a TrackerList in the Filler;
   // otherwise the value is meaningless.
@@ -587,6 +789,11 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   // when further allocations are made on the tracker.
   void set_donated(bool status) { donated_ = status; }
 
+  // Which span lengths the filler prefers to place here (see
+  // HugePageFiller::SpanClassFor).  Set when the tracker is contributed.
+  uint8_t span_class() const { return span_class_; }
+  void set_span_class(uint8_t c) { span_class_ = c; }
+
   // These statistics help us measure the fragmentation of a hugepage and
   // the desirability of allocating from this hugepage.
   Length longest_free_range() const { return free_.longest_free(); }
@@ -604,6 +811,22 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   // Returns the count of pages unbacked.
   Length ReleaseFree() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Like ReleaseFree(), but in two steps so that the pages can be returned to
+  // the system without holding pageheap_lock.  ReserveFree() marks the
+  // ranges of unused, still backed pages as used, so that they can neither be
+  // allocated nor leave us empty in the meantime, and calls f(index, n) for
+  // each.  If there are more than max_ranges it reserves none of them: a
+  // partly released hugepage would break FillerPartialRerelease::Return's
+  // invariant that released hugepages have no backed free pages.  Returns
+  // the number of pages reserved.
+  template <typename F>
+  Length ReserveFree(size_t max_ranges, F f)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Once [index, index + n), reserved by ReserveFree(), has been unbacked,
+  // marks it as free and released.
+  void CommitReleased(size_t index, size_t n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Return this allocation to the system, if policy warrants it.
   //
   // As of 3/2020 our policy is to rerelease:  Once we break a hugepage by
@@ -617,18 +840,30 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
       return;
     }
 
-    // Mark pages as released.
+    MarkReleased(p, n);
+    // TODO(b/122551676):  If release fails, we should not SetRange above.
+    ReleasePagesWithoutLock(p, n);
+  }
+
+  // Marks [p, p + n), just freed, as released, in preparation for releasing
+  // it.  Unlike ReleaseFree() and ReserveFree(), this records the pages as
+  // eagerly released, so that reusing them counts as a refault.
+  void MarkReleased(PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     size_t index = p - location_.first_page();
     ASSERT(released_by_page_.CountBits(index, n) == 0);
     released_by_page_.SetRange(index, n);
+    eagerly_released_by_page_.SetRange(index, n);
     released_count_ += n;
+    broken_ = true;
     ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage) ==
            released_count_);
-
-    // TODO(b/122551676):  If release fails, we should not SetRange above.
-    ReleasePagesWithoutLock(p, n);
   }
 
+  // Returns true if pages reserved by ReserveFree() are being released, after
+  // which we will be released().
+  bool releasing() const { return releasing_ > 0; }
+
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                     PageAgeHistograms *ages) const;
 
@@ -647,6 +882,9 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   //
   // TODO(b/151663108):  Logically, this is guarded by pageheap_lock.
   Bitmap<kPagesPerHugePage> released_by_page_;
+  // The subset of released_by_page_ released by MarkReleased(), as opposed to
+  // subrelease.
+  Bitmap<kPagesPerHugePage> eagerly_released_by_page_;
 
   // TODO(b/134691947): optimize computing this; it's on the fast path.
   int64_t when_;
@@ -657,13 +895,19 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   //
   // TODO(b/151663108):  Logically, this is guarded by pageheap_lock.
   uint16_t released_count_;
+  // Pages reserved by ReserveFree() but not yet CommitReleased().
+  uint16_t releasing_;
   bool donated_;
+  bool broken_;
+  bool collapsing_;
+  uint8_t span_class_;
 
-  void ReleasePages(PageId p, Length n) {
-    void *ptr = p.start_addr();
-    size_t byte_len = n << kPageShift;
-    Unback(ptr, byte_len);
-  }
+  // Marks [index, index + n), just allocated, as backed; returns how many of
+  // its pages were not.
+  PageAllocation ClearReleased(size_t index, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Ages when_ for n pages freed, of which "before" were already free.
+  void NoteFreed(Length before, Length n);
 
   void ReleasePagesWithoutLock(PageId p, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
@@ -677,6 +921,8 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   }
 };
 
+// The filler starts out with one of these and, if asked to, switches between
+// them at runtime (see HugePageFiller::AdaptPartialRerelease).
 enum class FillerPartialRerelease : bool {
   // Once we break a hugepage by returning a fraction of it, we return
   // *anything* unused.  This simplifies tracking.
@@ -691,6 +937,10 @@ enum class FillerPartialRerelease : bool {
   Retain,
 };
 
+// Asks the system to back [start, start + len) with a hugepage; returns true
+// on success.
+typedef bool (*MemoryCollapseFunction)(void *start, size_t len);
+
 // This tracks a set of unfilled hugepages, and fulfills allocations
 // with a goal of filling some hugepages as tightly as possible and emptying
 // out the remainder.
@@ -699,6 +949,8 @@ class HugePageFiller {
  public:
   HugePageFiller(FillerPartialRerelease partial_rerelease);
   HugePageFiller(FillerPartialRerelease partial_rerelease, ClockFunc clock);
+  HugePageFiller(FillerPartialRerelease partial_rerelease, ClockFunc clock,
+                 MemoryCollapseFunction collapse);
 
   typedef TrackerType Tracker;
 
@@ -717,6 +969,19 @@ class HugePageFiller {
   TrackerType *Put(TrackerType *pt, PageId p, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Grows [p, p + n) on *pt by the delta pages after it, if they are free;
+  // returns false, changing nothing, if not.  A donated tracker stays donated.
+  // REQUIRES: pt is owned by this object, and {pt, p, n} was the result of a
+  // previous TryGet (or is the virtual allocation of a donated tracker.)
+  bool TryExtend(TrackerType *pt, PageId p, Length n, Length delta)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // As Put, but only for the last delta pages of [p, p + n); the rest stays
+  // allocated, so pt can't become empty.
+  // REQUIRES: as for TryExtend, and delta < n.
+  void Trim(TrackerType *pt, PageId p, Length n, Length delta)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Contributes a tracker to the filler. If "donated," then the tracker is
   // marked as having come from the tail of a multi-hugepage allocation, which
   // causes it to be treated slightly differently.
@@ -728,6 +993,8 @@ class HugePageFiller {
   Length pages_allocated() const { return allocated_; }
   Length used_pages() const { return allocated_; }
   Length unmapped_pages() const { return unmapped_; }
+  // The subset of unmapped_pages() released lazily (see SystemReleaseIsLazy).
+  Length lazily_freed_pages() const { return lazily_freed_; }
   Length free_pages() const;
   Length used_pages_in_released() const { return n_used_released_; }
   Length used_pages_in_partial_released() const {
@@ -744,6 +1011,19 @@ class HugePageFiller {
   // *is* hugepage-backed!)
   double hugepage_frac() const;
 
+  // Hugepages that have not been subreleased (and so, as far as we know, are
+  // still backed by kernel hugepages), and a way to visit them.
+  HugeLength intact_hugepages() const {
+    return size() - regular_alloc_released_.size() -
+           regular_alloc_partial_released_.size();
+  }
+  template <typename F>
+  void ForEachIntactHugePage(F f) const {
+    auto loop = [&](const TrackerType *pt) { f(pt->location()); };
+    IterRegular(loop, 0);
+    donated_alloc_.Iter(loop, 0);
+  }
+
   // Returns the amount of memory to release if all remaining options of
   // releasing memory involve subreleasing pages.
   Length GetDesiredSubreleasePages(Length desired, Length total_released,
@@ -753,10 +1033,80 @@ class HugePageFiller {
   // Tries to release desired pages by iteratively releasing from the emptiest
   // possible hugepage and releasing its free memory to the system.  Return the
   // number of pages actually released.
+  //
+  // pageheap_lock is dropped while the pages are returned to the system.
+  // Should all remaining allocations on a hugepage be freed in the meantime,
+  // it leaves the filler, to be picked up with TakeEmptied().
   Length ReleasePages(Length desired,
                       absl::Duration skip_subrelease_after_peaks_interval)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns a hugepage emptied during ReleasePages or CollapseHugePages, or
+  // nullptr if there are none.  It should be disposed of like a hugepage returned by Put.
+  TrackerType *TakeEmptied() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Subreleased hugepages that have since been refilled: they are fully
+  // backed again, but by small pages.
+  HugeLength collapse_candidates() const { return collapse_candidates_; }
+
+  // Asks the system to collapse up to max of the collapse candidates, fullest
+  // first, back into real hugepages.  Returns the number restored.
+  //
+  // Each collapse copies a whole hugepage and can take a while, so we drop
+  // pageheap_lock for it.  The candidates stay on our lists meanwhile, but are
+  // not subreleased; one that is emptied meanwhile leaves the filler through
+  // TakeEmptied() once we are done.
+  HugeLength CollapseHugePages(HugeLength max)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Returns the interval to skip subreleasing after peaks for, adapted within
+  // [min_interval, max_interval] to whether recent subreleases had to be
+  // faulted back in and recent skips were justified.  See
+  // FillerStatsTracker::AdaptiveSkipSubreleaseInterval.
+  absl::Duration AdaptiveSkipSubreleaseInterval(absl::Duration min_interval,
+                                                absl::Duration max_interval)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    UpdateFillerStatsTracker();
+    return fillerstats_tracker_.AdaptiveSkipSubreleaseInterval(min_interval,
+                                                               max_interval);
+  }
+
+  // Switches partial_rerelease() between Return and Retain to suit the
+  // workload, looking at what happened since the last call at least
+  // kPartialRereleaseInterval ago:
+  //
+  // - Return becomes Retain if TryGet faulted back in at least
+  //   kRefaultedFraction as many pages as Put eagerly released onto
+  //   subreleased hugepages: we are paying a fault for each page we return.
+  //   Only pages Put released count; reusing subreleased ones does not.
+  // - Retain becomes Return if the free pages retained on partially released
+  //   hugepages exceed kMaxRetainedFraction of the filler.  These are released
+  //   first, which drops pageheap_lock and may empty hugepages (see
+  //   TakeEmptied()).
+  //
+  // Returns the number of pages released.
+  Length AdaptPartialRerelease() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  FillerPartialRerelease partial_rerelease() const {
+    return partial_rerelease_;
+  }
+  size_t partial_rerelease_switches() const {
+    return partial_rerelease_switches_;
+  }
+
+  // If set, TryGet prefers subreleased hugepages over intact ones, so that
+  // they fill up (and become collapse candidates) sooner.
+  void set_prefer_subreleased(bool value) { prefer_subreleased_ = value; }
+
+  // If set, hugepages are kept on separate lists by the length of the span
+  // they were first allocated for (see SpanClassFor), and TryGet only packs a
+  // span onto intact hugepages of its own class.  Quickly recycled single
+  // pages then stop churning in the holes between longer spans.  Hugepages
+  // contributed while this was unset are all of the single-page class.
+  void set_segregate_span_lengths(bool value) {
+    segregate_span_lengths_ = value;
+  }
+
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                     PageAgeHistograms *ages) const;
 
@@ -853,7 +1203,39 @@ class HugePageFiller {
   static size_t ListFor(Length longest, size_t chunk);
   static constexpr size_t kNumLists = kPagesPerHugePage * kChunks;
 
-  HintedTrackerLists<kNumLists> regular_alloc_;
+  // Span-length classes: single pages (most size classes) and everything
+  // longer.  Always 0 unless segregate_span_lengths_.
+  static constexpr size_t kSpanClasses = 2;
+  size_t SpanClassFor(Length n) const {
+    return segregate_span_lengths_ && n > 1 ? 1 : 0;
+  }
+  bool segregate_span_lengths_{false};
+
+  // Fully backed hugepages with small allocations, by span class.
+  HintedTrackerLists<kNumLists> regular_alloc_[kSpanClasses];
+  HugeLength regular_size() const {
+    HugeLength n = NHugePages(0);
+    for (const auto &lists : regular_alloc_) n += lists.size();
+    return n;
+  }
+  template <typename Functor>
+  void IterRegular(const Functor &func, size_t start) const {
+    for (const auto &lists : regular_alloc_) lists.Iter(func, start);
+  }
+  // Hugepages with no free pages at all.
+  HugeLength full_regular_size() const {
+    HugeLength n = NHugePages(0);
+    for (const auto &lists : regular_alloc_) {
+      // note kChunks, not kNumLists here--we're iterating *full* lists.
+      for (size_t chunk = 0; chunk < kChunks; ++chunk) {
+        n += NHugePages(lists[ListFor(/*longest=*/0, chunk)].length());
+      }
+    }
+    return n;
+  }
+  // Removes and returns the best regular hugepage of n's span class with at
+  // least n free pages, or nullptr if there is none.
+  TrackerType *GetLeastRegular(Length n);
   HintedTrackerLists<kPagesPerHugePage> donated_alloc_;
   // Partially released ones that we are trying to release.
   //
@@ -876,6 +1258,10 @@ class HugePageFiller {
   HintedTrackerLists<kNumLists> regular_alloc_partial_released_;
   HintedTrackerLists<kNumLists> regular_alloc_released_;
 
+  // Removes and returns the best previously released hugepage with at least n
+  // free pages, or nullptr if there is none.
+  TrackerType *GetLeastSubreleased(Length n);
+
   // RemoveFromFillerList pt from the appropriate HintedTrackerList.
   void RemoveFromFillerList(TrackerType *pt);
   // Put pt in the appropriate HintedTrackerList.
@@ -884,6 +1270,14 @@ class HugePageFiller {
   // multi-hugepage allocation.
   void DonateToFillerList(TrackerType *pt);
 
+  // Releases [p, p + n), about to be freed on pt, if our partial rerelease
+  // policy says to (see Put.)
+  void MaybeReleaseFreed(TrackerType *pt, PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Accounts for n pages freed on pt, as Put and Trim do.
+  void NoteFreed(TrackerType *pt, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // CompareForSubrelease identifies the worse candidate for subrelease, between
   // the choice of huge pages a and b.
   static bool CompareForSubrelease(TrackerType *a, TrackerType *b) {
@@ -906,13 +1300,47 @@ class HugePageFiller {
 
   // Release desired pages from the page trackers in candidates.  Returns the
   // number of pages released.
+  //
+  // The pages are reserved (see PageTracker::ReserveFree) and queued while
+  // holding pageheap_lock, then released all at once without it.  As that may
+  // free any of the candidates, we release from at most kMaxPendingReleases
+  // ranges per call.
   Length ReleaseCandidates(absl::Span<TrackerType *> candidates, Length desired)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  struct PendingRelease {
+    TrackerType *pt;
+    size_t index;
+    size_t n;
+  };
+  static constexpr size_t kMaxPendingReleases = kPagesPerHugePage / 2;
+
+  // pt, which is off our lists, has been emptied during ReleaseCandidates or
+  // CollapseHugePages; hand it over to TakeEmptied().
+  void RemoveEmptied(TrackerType *pt)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  TrackerList emptied_;
+
   HugeLength size_;
 
   Length allocated_;
   Length unmapped_;
+  Length lazily_freed_{0};
+  // Pages ReleaseCandidates is currently releasing without pageheap_lock.
+  // They count towards their tracker's used pages, but not allocated_.
+  Length releasing_{0};
+
+  // Note that n pages were just released to the system (and added to
+  // unmapped_), or that n unmapped pages were backed again or left the filler.
+  // We don't track which unmapped pages were freed lazily, so if the release
+  // mode changes at runtime lazily_freed_ is only an estimate.
+  void NoteReleased(Length n) {
+    if (SystemReleaseIsLazy()) lazily_freed_ += n;
+  }
+  void NoteUnreleased(Length n) {
+    lazily_freed_ -= std::min(lazily_freed_, n);
+    lazily_freed_ = std::min(lazily_freed_, unmapped_);
+  }
 
   // How much have we eagerly unmapped (in already released hugepages), but
   // not reported to ReleasePages calls?
@@ -920,6 +1348,34 @@ class HugePageFiller {
 
   FillerPartialRerelease partial_rerelease_;
 
+  // State of AdaptPartialRerelease().  The page counts are since its last
+  // evaluation.
+  static constexpr absl::Duration kPartialRereleaseInterval = absl::Minutes(1);
+  static constexpr double kRefaultedFraction = 0.5;
+  static constexpr double kMaxRetainedFraction = 0.125;
+  bool adaptive_partial_rerelease_{false};
+  size_t partial_rerelease_switches_{0};
+  int64_t partial_rerelease_evaluated_ns_{0};
+  Length eagerly_released_pages_{0};
+  Length refaulted_pages_{0};
+
+  // Free (but backed) pages on partially released hugepages.
+  Length retained_pages() const;
+
+  // Re-collapsing subreleased hugepages.  collapse_candidates_ counts the
+  // trackers on our lists for which IsCollapseCandidate() holds.
+  static bool IsCollapseCandidate(const TrackerType *pt) {
+    return pt->broken() && !pt->released();
+  }
+  MemoryCollapseFunction collapse_;
+  ClockFunc clock_;
+  bool prefer_subreleased_{false};
+  HugeLength collapse_candidates_;
+  size_t collapsed_{0};
+  size_t collapse_failures_{0};
+  int64_t collapse_ns_{0};
+  int64_t max_collapse_ns_{0};
+
   // Functionality related to time series tracking.
   void UpdateFillerStatsTracker();
   FillerStatsTracker<600> fillerstats_tracker_;
@@ -929,17 +1385,33 @@ template <MemoryModifyFunction Unback>
 inline typename PageTracker<Unback>::PageAllocation PageTracker<Unback>::Get(
     Length n) {
   size_t index = free_.FindAndMark(n);
+  return ClearReleased(index, n);
+}
+
+template <MemoryModifyFunction Unback>
+inline typename PageTracker<Unback>::PageAllocation
+PageTracker<Unback>::Extend(PageId p, Length n) {
+  size_t index = p - location_.first_page();
+  free_.Extend(index, n);
+  return ClearReleased(index, n);
+}
 
+template <MemoryModifyFunction Unback>
+inline typename PageTracker<Unback>::PageAllocation
+PageTracker<Unback>::ClearReleased(size_t index, Length n) {
   ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage) == released_count_);
 
   size_t unbacked = released_by_page_.CountBits(index, n);
   released_by_page_.ClearRange(index, n);
   ASSERT(released_count_ >= unbacked);
   released_count_ -= unbacked;
+  size_t eagerly_released = eagerly_released_by_page_.CountBits(index, n);
+  eagerly_released_by_page_.ClearRange(index, n);
+  ASSERT(eagerly_released <= unbacked);
 
   ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage) == released_count_);
-
-  return PageAllocation{location_.first_page() + index, unbacked};
+  return PageAllocation{location_.first_page() + index, Length(unbacked),
+                        Length(eagerly_released)};
 }
 
 template <MemoryModifyFunction Unback>
@@ -947,7 +1419,19 @@ inline void PageTracker<Unback>::Put(PageId p, Length n) {
   size_t index = p - location_.first_page();
   const Length before = free_.total_free();
   free_.Unmark(index, n);
+  NoteFreed(before, n);
+}
 
+template <MemoryModifyFunction Unback>
+inline void PageTracker<Unback>::Trim(PageId p, Length n) {
+  size_t index = p - location_.first_page();
+  const Length before = free_.total_free();
+  free_.Trim(index, n);
+  NoteFreed(before, n);
+}
+
+template <MemoryModifyFunction Unback>
+inline void PageTracker<Unback>::NoteFreed(Length before, Length n) {
   when_ = static_cast<int64_t>(
       (static_cast<double>(before) * when_ +
        static_cast<double>(n) * absl::base_internal::CycleClock::Now()) /
@@ -966,7 +1450,9 @@ inline Length PageTracker<Unback>::ReleaseFree() {
   // 1.  Identify the next range of still backed pages.
   // 2.  Iterate on the free_ tracker within this range.  For any free range
   //     found, mark these as unbacked.
-  // 3.  Release the subrange to the OS.
+  // 3.  Release the subrange to the OS (in batches.)
+  struct iovec batch[kMaxReleaseBatch];
+  size_t batched = 0;
   while (released_by_page_.NextFreeRange(index, &index, &n)) {
     size_t free_index;
     size_t free_n;
@@ -986,7 +1472,12 @@ inline Length PageTracker<Unback>::ReleaseFree() {
 
       PageId p = location_.first_page() + free_index;
       // TODO(b/122551676):  If release fails, we should not SetRange above.
-      ReleasePages(p, length);
+      batch[batched].iov_base = p.start_addr();
+      batch[batched].iov_len = length << kPageShift;
+      if (++batched == kMaxReleaseBatch) {
+        UnbackRanges<Unback>(batch, batched);
+        batched = 0;
+      }
 
       index = end;
       count += length;
@@ -996,14 +1487,66 @@ inline Length PageTracker<Unback>::ReleaseFree() {
       index += n;
     }
   }
+  UnbackRanges<Unback>(batch, batched);
 
   released_count_ += count;
+  if (count > 0) broken_ = true;
   ASSERT(released_count_ <= kPagesPerHugePage);
   ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage) == released_count_);
   when_ = absl::base_internal::CycleClock::Now();
   return count;
 }
 
+template <MemoryModifyFunction Unback>
+template <typename F>
+inline Length PageTracker<Unback>::ReserveFree(size_t max_ranges, F f) {
+  // As in ReleaseFree(), look for free ranges within the still backed ranges.
+  auto for_each_range = [this](auto g) {
+    size_t index = 0;
+    size_t n;
+    while (released_by_page_.NextFreeRange(index, &index, &n)) {
+      size_t free_index;
+      size_t free_n;
+      if (free_.NextFreeRange(index, &free_index, &free_n) &&
+          free_index < index + n) {
+        size_t end = std::min(free_index + free_n, index + n);
+        g(free_index, end - free_index);
+        index = end;
+      } else {
+        index += n;
+      }
+    }
+  };
+
+  size_t ranges = 0;
+  for_each_range([&](size_t, size_t) { ++ranges; });
+  if (ranges > max_ranges) return 0;
+
+  Length count = 0;
+  for_each_range([&](size_t index, size_t length) {
+    ASSERT(released_by_page_.CountBits(index, length) == 0);
+    free_.Mark(index, length);
+    releasing_ += length;
+    f(index, length);
+    count += length;
+  });
+  return count;
+}
+
+template <MemoryModifyFunction Unback>
+inline void PageTracker<Unback>::CommitReleased(size_t index, size_t n) {
+  ASSERT(released_by_page_.CountBits(index, n) == 0);
+  ASSERT(releasing_ >= n);
+  free_.Unmark(index, n);
+  releasing_ -= n;
+  released_by_page_.SetRange(index, n);
+  released_count_ += n;
+  broken_ = true;
+  ASSERT(released_count_ <= kPagesPerHugePage);
+  ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage) == released_count_);
+  when_ = absl::base_internal::CycleClock::Now();
+}
+
 template <MemoryModifyFunction Unback>
 inline void PageTracker<Unback>::AddSpanStats(SmallSpanStats *small,
                                               LargeSpanStats *large,
@@ -1075,13 +1618,24 @@ inline HugePageFiller<TrackerType>::HugePageFiller(
 template <class TrackerType>
 inline HugePageFiller<TrackerType>::HugePageFiller(
     FillerPartialRerelease partial_rerelease, ClockFunc clock)
+    : HugePageFiller(partial_rerelease, clock, SystemCollapse) {}
+
+template <class TrackerType>
+inline HugePageFiller<TrackerType>::HugePageFiller(
+    FillerPartialRerelease partial_rerelease, ClockFunc clock,
+    MemoryCollapseFunction collapse)
     : n_used_partial_released_(0),
       n_used_released_(0),
       size_(NHugePages(0)),
       allocated_(0),
       unmapped_(0),
       partial_rerelease_(partial_rerelease),
-      fillerstats_tracker_(clock, absl::Minutes(10), absl::Minutes(5)) {}
+      collapse_(collapse),
+      clock_(clock),
+      collapse_candidates_(NHugePages(0)),
+      fillerstats_tracker_(clock, absl::Minutes(10), absl::Minutes(5)) {
+  emptied_.Init();
+}
 
 template <class TrackerType>
 inline bool HugePageFiller<TrackerType>::TryGet(Length n,
@@ -1137,6 +1691,10 @@ inline bool HugePageFiller<TrackerType>::TryGet(Length n,
   //  - Among used freelists we prefer smaller longest_free_range
   //    with ties broken by (quantized) alloc counts
   //
+  // If prefer_subreleased_ is set we instead try previously released
+  // hugepages first: once one fills up again, CollapseHugePages can restore
+  // it to a real hugepage, and the sooner that happens the better.
+  //
   // We group hugepages by longest_free_range and quantized alloc count and
   // store each group in a TrackerList. All freshly-donated groups are stored
   // in a "donated" array and the groups with (possibly prior) small allocs are
@@ -1158,7 +1716,14 @@ inline bool HugePageFiller<TrackerType>::TryGet(Length n,
 
   bool was_released = false;
   do {
-    pt = regular_alloc_.GetLeast(ListFor(n, 0));
+    if (prefer_subreleased_) {
+      pt = GetLeastSubreleased(n);
+      if (pt) {
+        was_released = true;
+        break;
+      }
+    }
+    pt = GetLeastRegular(n);
     if (pt) {
       ASSERT(!pt->donated());
       break;
@@ -1167,28 +1732,20 @@ inline bool HugePageFiller<TrackerType>::TryGet(Length n,
     if (pt) {
       break;
     }
-    if (partial_rerelease_ == FillerPartialRerelease::Retain) {
-      pt = regular_alloc_partial_released_.GetLeast(ListFor(n, 0));
-      if (pt) {
-        ASSERT(!pt->donated());
-        was_released = true;
-        ASSERT(n_used_partial_released_ >= pt->used_pages());
-        n_used_partial_released_ -= pt->used_pages();
-        break;
-      }
-    }
-    pt = regular_alloc_released_.GetLeast(ListFor(n, 0));
+    pt = GetLeastSubreleased(n);
     if (pt) {
-      ASSERT(!pt->donated());
       was_released = true;
-      ASSERT(n_used_released_ >= pt->used_pages());
-      n_used_released_ -= pt->used_pages();
       break;
     }
 
     return false;
   } while (false);
   ASSERT(pt->longest_free_range() >= n);
+  if (IsCollapseCandidate(pt)) {
+    // GetLeast took pt off our lists without going through
+    // RemoveFromFillerList.
+    --collapse_candidates_;
+  }
   *hugepage = pt;
   auto page_allocation = pt->Get(n);
   *p = page_allocation.page;
@@ -1199,6 +1756,8 @@ inline bool HugePageFiller<TrackerType>::TryGet(Length n,
   (void)was_released;
   ASSERT(unmapped_ >= page_allocation.previously_unbacked);
   unmapped_ -= page_allocation.previously_unbacked;
+  NoteUnreleased(page_allocation.previously_unbacked);
+  refaulted_pages_ += page_allocation.previously_eagerly_released;
   // We're being used for an allocation, so we are no longer considered
   // donated by this point.
   ASSERT(!pt->donated());
@@ -1213,32 +1772,20 @@ inline bool HugePageFiller<TrackerType>::TryGet(Length n,
 template <class TrackerType>
 inline TrackerType *HugePageFiller<TrackerType>::Put(TrackerType *pt, PageId p,
                                                      Length n) {
-  // Consider releasing [p, p+n).  We do this here:
-  // * To unback the memory before we mark it as free.  When partially
-  //   unbacking, we release the pageheap_lock.  Another thread could see the
-  //   "free" memory and begin using it before we retake the lock.
-  // * To maintain maintain the invariant that
-  //     pt->released() => regular_alloc_released_.size() > 0 ||
-  //                       regular_alloc_partial_released_.size() > 0
-  //   We do this before removing pt from our lists, since another thread may
-  //   encounter our post-RemoveFromFillerList() update to
-  //   regular_alloc_released_.size() and regular_alloc_partial_released_.size()
-  //   while encountering pt.
-  if (partial_rerelease_ == FillerPartialRerelease::Return) {
-    pt->MaybeRelease(p, n);
-  }
+  MaybeReleaseFreed(pt, p, n);
 
   RemoveFromFillerList(pt);
 
   pt->Put(p, n);
-
-  allocated_ -= n;
-  if (partial_rerelease_ == FillerPartialRerelease::Return && pt->released()) {
-    unmapped_ += n;
-    unmapping_unaccounted_ += n;
-  }
+  NoteFreed(pt, n);
 
   if (pt->longest_free_range() == kPagesPerHugePage) {
+    if (pt->collapsing()) {
+      // CollapseHugePages still needs pt; it will pass it on to TakeEmptied().
+      // Until then, being off our lists, it gets no new allocations.
+      UpdateFillerStatsTracker();
+      return nullptr;
+    }
     --size_;
     if (pt->released()) {
       const Length free_pages = pt->free_pages();
@@ -1246,6 +1793,7 @@ inline TrackerType *HugePageFiller<TrackerType>::Put(TrackerType *pt, PageId p,
       ASSERT(free_pages >= released_pages);
       ASSERT(unmapped_ >= released_pages);
       unmapped_ -= released_pages;
+      NoteUnreleased(released_pages);
 
       if (free_pages > released_pages) {
         // We should only see a difference between free pages and released pages
@@ -1273,6 +1821,100 @@ inline TrackerType *HugePageFiller<TrackerType>::Put(TrackerType *pt, PageId p,
   return nullptr;
 }
 
+template <class TrackerType>
+inline bool HugePageFiller<TrackerType>::TryExtend(TrackerType *pt, PageId p,
+                                                   Length n, Length delta) {
+  ASSERT(delta > 0);
+  const PageId tail = p + n;
+  if (tail - pt->location().first_page() + delta > kPagesPerHugePage ||
+      !pt->IsFree(tail, delta)) {
+    return false;
+  }
+
+  const bool donated = pt->donated();
+  RemoveFromFillerList(pt);
+  const auto page_allocation = pt->Extend(tail, delta);
+  const Length unbacked = page_allocation.previously_unbacked;
+  if (donated) {
+    DonateToFillerList(pt);
+  } else {
+    AddToFillerList(pt);
+  }
+  allocated_ += delta;
+
+  ASSERT(unmapped_ >= unbacked);
+  unmapped_ -= unbacked;
+  NoteUnreleased(unbacked);
+  refaulted_pages_ += page_allocation.previously_eagerly_released;
+  UpdateFillerStatsTracker();
+  return true;
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::Trim(TrackerType *pt, PageId p,
+                                              Length n, Length delta) {
+  ASSERT(delta > 0 && delta < n);
+  const PageId tail = p + n - delta;
+  MaybeReleaseFreed(pt, tail, delta);
+
+  const bool donated = pt->donated();
+  RemoveFromFillerList(pt);
+  pt->Trim(tail, delta);
+  NoteFreed(pt, delta);
+  ASSERT(pt->longest_free_range() < kPagesPerHugePage);
+  if (donated && !pt->released()) {
+    DonateToFillerList(pt);
+  } else {
+    AddToFillerList(pt);
+  }
+  UpdateFillerStatsTracker();
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::MaybeReleaseFreed(TrackerType *pt,
+                                                           PageId p,
+                                                           Length n) {
+  // Consider releasing [p, p+n).  We do this here:
+  // * To unback the memory before we mark it as free.  When partially
+  //   unbacking, we release the pageheap_lock.  Another thread could see the
+  //   "free" memory and begin using it before we retake the lock.
+  // * To maintain maintain the invariant that
+  //     pt->released() => regular_alloc_released_.size() > 0 ||
+  //                       regular_alloc_partial_released_.size() > 0
+  //   We do this before removing pt from our lists, since another thread may
+  //   encounter our post-RemoveFromFillerList() update to
+  //   regular_alloc_released_.size() and regular_alloc_partial_released_.size()
+  //   while encountering pt.
+  if (partial_rerelease_ == FillerPartialRerelease::Return) {
+    if (!pt->released() && pt->releasing()) {
+      // ReleaseCandidates is releasing other pages of pt without the lock; it
+      // will be released() once that is done, so we should release [p, p+n)
+      // too.  That makes it released() right away, so it has to change lists
+      // before we drop the lock.
+      RemoveFromFillerList(pt);
+      pt->MarkReleased(p, n);
+      AddToFillerList(pt);
+
+      pageheap_lock.Unlock();
+      TrackerType::UnbackImpl(p.start_addr(), n << kPageShift);
+      pageheap_lock.Lock();
+    } else {
+      pt->MaybeRelease(p, n);
+    }
+  }
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::NoteFreed(TrackerType *pt, Length n) {
+  allocated_ -= n;
+  if (partial_rerelease_ == FillerPartialRerelease::Return && pt->released()) {
+    unmapped_ += n;
+    unmapping_unaccounted_ += n;
+    eagerly_released_pages_ += n;
+    NoteReleased(n);
+  }
+}
+
 template <class TrackerType>
 inline void HugePageFiller<TrackerType>::Contribute(TrackerType *pt,
                                                     bool donated) {
@@ -1280,6 +1922,7 @@ inline void HugePageFiller<TrackerType>::Contribute(TrackerType *pt,
   ASSERT(pt->released_pages() == 0);
 
   allocated_ += pt->used_pages();
+  pt->set_span_class(SpanClassFor(pt->used_pages()));
   if (donated) {
     DonateToFillerList(pt);
   } else {
@@ -1295,6 +1938,8 @@ inline int HugePageFiller<TrackerType>::SelectCandidates(
     absl::Span<TrackerType *> candidates, int current_candidates,
     const HintedTrackerLists<N> &tracker_list, size_t tracker_start) {
   auto PushCandidate = [&](TrackerType *pt) {
+    if (pt->collapsing()) return;
+
     // If we have few candidates, we can avoid creating a heap.
     //
     // In ReleaseCandidates(), we unconditionally sort the list and linearly
@@ -1334,11 +1979,15 @@ inline Length HugePageFiller<TrackerType>::ReleaseCandidates(
     absl::Span<TrackerType *> candidates, Length target) {
   absl::c_sort(candidates, CompareForSubrelease);
 
+  PendingRelease pending[kMaxPendingReleases];
+  size_t n_pending = 0;
   Length total_released = 0;
 #ifndef NDEBUG
   Length last = 0;
 #endif
-  for (int i = 0; i < candidates.size() && total_released < target; i++) {
+  for (int i = 0; i < candidates.size() && total_released < target &&
+                  n_pending < kMaxPendingReleases;
+       i++) {
     TrackerType *best = candidates[i];
     ASSERT(best != nullptr);
 
@@ -1349,16 +1998,88 @@ inline Length HugePageFiller<TrackerType>::ReleaseCandidates(
 #endif
 
     RemoveFromFillerList(best);
-    Length ret = best->ReleaseFree();
-    unmapped_ += ret;
-    ASSERT(unmapped_ >= best->released_pages());
-    total_released += ret;
+    total_released +=
+        best->ReserveFree(kMaxPendingReleases - n_pending,
+                          [&](size_t index, size_t n) {
+                            pending[n_pending++] = {best, index, n};
+                          });
     AddToFillerList(best);
   }
+  if (n_pending == 0) {
+    return 0;
+  }
+
+  releasing_ += total_released;
+  pageheap_lock.Unlock();
+  for (size_t i = 0; i < n_pending; i += kMaxReleaseBatch) {
+    struct iovec batch[kMaxReleaseBatch];
+    const size_t n = std::min(n_pending - i, kMaxReleaseBatch);
+    for (size_t j = 0; j < n; ++j) {
+      const PendingRelease &r = pending[i + j];
+      PageId p = r.pt->location().first_page() + r.index;
+      batch[j].iov_base = p.start_addr();
+      batch[j].iov_len = r.n << kPageShift;
+    }
+    TrackerType::UnbackRangesImpl(batch, n);
+  }
+  pageheap_lock.Lock();
+  releasing_ -= total_released;
+
+  // Each tracker's ranges are adjacent in pending.
+  for (size_t i = 0; i < n_pending;) {
+    TrackerType *pt = pending[i].pt;
+    RemoveFromFillerList(pt);
+    Length released = 0;
+    for (; i < n_pending && pending[i].pt == pt; ++i) {
+      pt->CommitReleased(pending[i].index, pending[i].n);
+      released += pending[i].n;
+    }
+    unmapped_ += released;
+    NoteReleased(released);
+    ASSERT(unmapped_ >= pt->released_pages());
+    if (pt->longest_free_range() == kPagesPerHugePage) {
+      RemoveEmptied(pt);
+    } else {
+      AddToFillerList(pt);
+    }
+  }
 
   return total_released;
 }
 
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::RemoveEmptied(TrackerType *pt) {
+  // As in Put().
+  --size_;
+  if (pt->released()) {
+    const Length free_pages = pt->free_pages();
+    const Length released_pages = pt->released_pages();
+    ASSERT(free_pages >= released_pages);
+    ASSERT(unmapped_ >= released_pages);
+    unmapped_ -= released_pages;
+    NoteUnreleased(released_pages);
+    if (free_pages > released_pages) {
+      // Pages freed onto pt while we released the others were retained.
+      ASSERT(partial_rerelease_ == FillerPartialRerelease::Retain);
+      pageheap_lock.Unlock();
+      TrackerType::UnbackImpl(pt->location().start_addr(), kHugePageSize);
+      pageheap_lock.Lock();
+
+      unmapping_unaccounted_ += free_pages - released_pages;
+    }
+  }
+  emptied_.prepend(pt);
+  UpdateFillerStatsTracker();
+}
+
+template <class TrackerType>
+inline TrackerType *HugePageFiller<TrackerType>::TakeEmptied() {
+  if (emptied_.empty()) return nullptr;
+  TrackerType *pt = emptied_.first();
+  emptied_.remove(pt);
+  return pt;
+}
+
 template <class TrackerType>
 inline Length HugePageFiller<TrackerType>::GetDesiredSubreleasePages(
     Length desired, Length total_released, absl::Duration peak_interval) {
@@ -1432,6 +2153,8 @@ inline Length HugePageFiller<TrackerType>::ReleasePages(
       return total_released;
     }
   }
+  const Length eagerly_released = total_released;
+  const Length current_pages = used_pages() + free_pages();
 
   // Optimize for releasing up to a huge page worth of small pages (scattered
   // over many parts of the filler).  Since we hold pageheap_lock, we cannot
@@ -1465,8 +2188,11 @@ inline Length HugePageFiller<TrackerType>::ReleasePages(
   // pages.
   while (total_released < desired) {
     CandidateArray candidates;
-    int n_candidates = SelectCandidates(absl::MakeSpan(candidates), 0,
-                                        regular_alloc_, kChunks);
+    int n_candidates = 0;
+    for (const auto &lists : regular_alloc_) {
+      n_candidates = SelectCandidates(absl::MakeSpan(candidates), n_candidates,
+                                      lists, kChunks);
+    }
     // TODO(b/138864853): Perhaps remove donated_alloc_ from here, it's not a
     // great candidate for partial release.
     n_candidates = SelectCandidates(absl::MakeSpan(candidates), n_candidates,
@@ -1481,9 +2207,203 @@ inline Length HugePageFiller<TrackerType>::ReleasePages(
     total_released += released;
   }
 
+  fillerstats_tracker_.ReportSubreleasedPages(
+      total_released - eagerly_released, current_pages);
+  return total_released;
+}
+
+template <class TrackerType>
+inline Length HugePageFiller<TrackerType>::retained_pages() const {
+  Length retained = 0;
+  regular_alloc_partial_released_.Iter(
+      [&](const TrackerType *pt) {
+        retained += pt->free_pages() - pt->released_pages();
+      },
+      0);
+  return retained;
+}
+
+template <class TrackerType>
+inline Length HugePageFiller<TrackerType>::AdaptPartialRerelease() {
+  const int64_t now = clock_();
+  if (!adaptive_partial_rerelease_) {
+    adaptive_partial_rerelease_ = true;
+    partial_rerelease_evaluated_ns_ = now;
+    eagerly_released_pages_ = 0;
+    refaulted_pages_ = 0;
+    return 0;
+  }
+  // Switching while ReleaseCandidates() has pages in flight would leave them
+  // on the wrong lists, so wait for a quiet moment.
+  if (releasing_ > 0 ||
+      absl::Nanoseconds(now - partial_rerelease_evaluated_ns_) <
+          kPartialRereleaseInterval) {
+    return 0;
+  }
+  partial_rerelease_evaluated_ns_ = now;
+  const Length eagerly_released = eagerly_released_pages_;
+  const Length refaulted = refaulted_pages_;
+  eagerly_released_pages_ = 0;
+  refaulted_pages_ = 0;
+
+  if (partial_rerelease_ == FillerPartialRerelease::Return) {
+    // Every released hugepage has all of its free pages released, so it is
+    // on the right list for Retain already.
+    if (eagerly_released >= kPagesPerHugePage &&
+        refaulted >= kRefaultedFraction * eagerly_released) {
+      partial_rerelease_ = FillerPartialRerelease::Retain;
+      partial_rerelease_switches_++;
+    }
+    return 0;
+  }
+
+  const Length retained = retained_pages();
+  if (retained < kPagesPerHugePage ||
+      retained <= kMaxRetainedFraction * size().in_pages()) {
+    return 0;
+  }
+
+  // Return requires regular_alloc_partial_released_ to be empty, so release
+  // what it retains.  Frees while we drop the lock may add to it again, in
+  // which case we try again next time.
+  Length total_released = 0;
+  while (!regular_alloc_partial_released_.empty()) {
+    std::array<TrackerType *, kPagesPerHugePage> candidates;
+    const int n_candidates = SelectCandidates(
+        absl::MakeSpan(candidates), 0, regular_alloc_partial_released_, 0);
+    const Length released =
+        ReleaseCandidates(absl::MakeSpan(candidates.data(), n_candidates),
+                          std::numeric_limits<Length>::max());
+    if (released == 0) {
+      break;
+    }
+    total_released += released;
+  }
+  if (regular_alloc_partial_released_.empty() && releasing_ == 0) {
+    ASSERT(n_used_partial_released_ == 0);
+    partial_rerelease_ = FillerPartialRerelease::Return;
+    partial_rerelease_switches_++;
+  }
+  // Pages we faulted back in before dropping our retained ones shouldn't count
+  // against Return.
+  eagerly_released_pages_ = 0;
+  refaulted_pages_ = 0;
   return total_released;
 }
 
+template <class TrackerType>
+inline TrackerType *HugePageFiller<TrackerType>::GetLeastRegular(Length n) {
+  if (segregate_span_lengths_) {
+    // Even when the other class has room, a fresh hugepage packs better in
+    // the long run: see the SegregatedSpanLengthsFragmentation test.
+    return regular_alloc_[SpanClassFor(n)].GetLeast(ListFor(n, 0));
+  }
+  // Hugepages contributed while we were segregating may still be on other
+  // lists.
+  for (auto &lists : regular_alloc_) {
+    if (TrackerType *pt = lists.GetLeast(ListFor(n, 0))) return pt;
+  }
+  return nullptr;
+}
+
+template <class TrackerType>
+inline TrackerType *HugePageFiller<TrackerType>::GetLeastSubreleased(
+    Length n) {
+  TrackerType *pt;
+  if (partial_rerelease_ == FillerPartialRerelease::Retain) {
+    pt = regular_alloc_partial_released_.GetLeast(ListFor(n, 0));
+    if (pt) {
+      ASSERT(!pt->donated());
+      ASSERT(n_used_partial_released_ >= pt->used_pages());
+      n_used_partial_released_ -= pt->used_pages();
+      return pt;
+    }
+  }
+  pt = regular_alloc_released_.GetLeast(ListFor(n, 0));
+  if (pt) {
+    ASSERT(!pt->donated());
+    ASSERT(n_used_released_ >= pt->used_pages());
+    n_used_released_ -= pt->used_pages();
+  }
+  return pt;
+}
+
+template <class TrackerType>
+inline HugeLength HugePageFiller<TrackerType>::CollapseHugePages(
+    HugeLength max) {
+  HugeLength collapsed = NHugePages(0);
+  if (collapse_candidates_ == NHugePages(0)) {
+    return collapsed;
+  }
+
+  // Candidates live on regular_alloc_ (they are fully backed), which starts
+  // with the full hugepages: the ones least likely to be subreleased again.
+  constexpr size_t kMaxCandidates = 16;
+  TrackerType *candidates[kMaxCandidates];
+  const size_t limit = std::min<size_t>(
+      kMaxCandidates, std::min(max, collapse_candidates_).raw_num());
+  size_t n = 0;
+  IterRegular(
+      [&](TrackerType *pt) {
+        // Skip those another thread is already collapsing.
+        if (n < limit && IsCollapseCandidate(pt) && !pt->collapsing()) {
+          pt->set_collapsing(true);
+          candidates[n++] = pt;
+        }
+      },
+      0);
+  ASSERT(n <= limit);
+
+  // Collapse without the lock.  Until we clear collapsing(), Put will not hand
+  // a candidate back (which could free its memory underneath us), nor will
+  // ReleasePages subrelease it.
+  bool restored[kMaxCandidates];
+  int64_t elapsed[kMaxCandidates];
+  size_t attempted = 0;
+  pageheap_lock.Unlock();
+  while (attempted < n) {
+    const int64_t start = clock_();
+    restored[attempted] =
+        collapse_(candidates[attempted]->location().start_addr(),
+                  kHugePageSize);
+    elapsed[attempted] = std::max<int64_t>(0, clock_() - start);
+    if (!restored[attempted++]) {
+      // Most likely the kernel could not find a free hugepage; trying the rest
+      // right away is unlikely to go better.
+      break;
+    }
+  }
+  pageheap_lock.Lock();
+
+  for (size_t i = 0; i < n; ++i) {
+    TrackerType *pt = candidates[i];
+    pt->set_collapsing(false);
+    const bool ok = i < attempted && restored[i];
+    if (i < attempted) {
+      collapse_ns_ += elapsed[i];
+      max_collapse_ns_ = std::max(max_collapse_ns_, elapsed[i]);
+      if (ok) {
+        ++collapsed_;
+        ++collapsed;
+      } else {
+        ++collapse_failures_;
+      }
+    }
+
+    if (pt->longest_free_range() == kPagesPerHugePage) {
+      // Emptied while we collapsed it, and so no longer on our lists.
+      RemoveEmptied(pt);
+    } else if (ok) {
+      // pt stays on the same list; only its candidacy changes.
+      ASSERT(IsCollapseCandidate(pt));
+      pt->set_collapsed();
+      --collapse_candidates_;
+    }
+  }
+
+  return collapsed;
+}
+
 template <class TrackerType>
 inline void HugePageFiller<TrackerType>::AddSpanStats(
     SmallSpanStats *small, LargeSpanStats *large,
@@ -1492,7 +2412,7 @@ inline void HugePageFiller<TrackerType>::AddSpanStats(
     pt->AddSpanStats(small, large, ages);
   };
   // We can skip the first kChunks lists as they are known to be 100% full.
-  regular_alloc_.Iter(loop, kChunks);
+  IterRegular(loop, kChunks);
   donated_alloc_.Iter(loop, 0);
 
   if (partial_rerelease_ == FillerPartialRerelease::Retain) {
@@ -1510,6 +2430,7 @@ inline BackingStats HugePageFiller<TrackerType>::stats() const {
   s.system_bytes = size_.in_bytes();
   s.free_bytes = free_pages() * kPageSize;
   s.unmapped_bytes = unmapped_pages() * kPageSize;
+  s.lazily_freed_bytes = lazily_freed_pages() * kPageSize;
   return s;
 }
 
@@ -1654,12 +2575,7 @@ inline void HugePageFiller<TrackerType>::Print(TCMalloc_Printer *out,
 
   HugeLength nrel =
       regular_alloc_released_.size() + regular_alloc_partial_released_.size();
-  HugeLength nfull = NHugePages(0);
-
-  // note kChunks, not kNumLists here--we're iterating *full* lists.
-  for (size_t chunk = 0; chunk < kChunks; ++chunk) {
-    nfull += NHugePages(regular_alloc_[ListFor(/*longest=*/0, chunk)].length());
-  }
+  const HugeLength nfull = full_regular_size();
   // A donated alloc full list is impossible because it would have never been
   // donated in the first place. (It's an even hugepage.)
   ASSERT(donated_alloc_[0].empty());
@@ -1693,12 +2609,35 @@ inline void HugePageFiller<TrackerType>::Print(TCMalloc_Printer *out,
       nrel.raw_num(), safe_div(unmapped_pages(), nrel.in_pages()));
   out->printf("HugePageFiller: %.4f of used pages hugepageable\n",
               hugepage_frac());
+  out->printf("HugePageFiller: %zu of released pages lazily freed\n",
+              lazily_freed_pages());
+  const size_t collapse_attempts = collapsed_ + collapse_failures_;
+  out->printf(
+      "HugePageFiller: %zu refilled hugepages awaiting collapse, %zu restored "
+      "(%zu failed), %.1f us/collapse (max %.1f us)\n",
+      collapse_candidates_.raw_num(), collapsed_, collapse_failures_,
+      collapse_attempts == 0 ? 0. : collapse_ns_ / 1e3 / collapse_attempts,
+      max_collapse_ns_ / 1e3);
+  if (adaptive_partial_rerelease_) {
+    out->printf(
+        "HugePageFiller: partial rerelease policy %s (adaptive, %zu switches), "
+        "%zu pages retained\n",
+        partial_rerelease_ == FillerPartialRerelease::Return ? "RETURN"
+                                                             : "RETAIN",
+        partial_rerelease_switches_, retained_pages());
+  }
+  if (segregate_span_lengths_) {
+    out->printf(
+        "HugePageFiller: by span length, %zu intact hugepages for single "
+        "pages, %zu for longer spans\n",
+        regular_alloc_[0].size().raw_num(), regular_alloc_[1].size().raw_num());
+  }
   if (!everything) return;
 
   // Compute some histograms of fullness.
   using ::tcmalloc::internal::UsageInfo;
   UsageInfo usage;
-  regular_alloc_.Iter(
+  IterRegular(
       [&](const TrackerType *pt) { usage.Record(pt, UsageInfo::kRegular); }, 0);
   donated_alloc_.Iter(
       [&](const TrackerType *pt) { usage.Record(pt, UsageInfo::kDonated); }, 0);
@@ -1729,12 +2668,7 @@ template <class TrackerType>
 inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion *hpaa) const {
   HugeLength nrel =
       regular_alloc_released_.size() + regular_alloc_partial_released_.size();
-  HugeLength nfull = NHugePages(0);
-
-  // note kChunks, not kNumLists here--we're iterating *full* lists.
-  for (size_t chunk = 0; chunk < kChunks; ++chunk) {
-    nfull += NHugePages(regular_alloc_[ListFor(/*longest=*/0, chunk)].length());
-  }
+  const HugeLength nfull = full_regular_size();
   // A donated alloc full list is impossible because it would have never been
   // donated in the first place. (It's an even hugepage.)
   ASSERT(donated_alloc_[0].empty());
@@ -1755,6 +2689,29 @@ inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion *hpaa) const {
       "filler_unmapped_bytes",
       static_cast<uint64_t>(nrel.raw_num() *
                           safe_div(unmapped_pages(), nrel.in_pages())));
+  hpaa->PrintI64("filler_lazily_freed_bytes",
+                 lazily_freed_pages() * kPageSize);
+  hpaa->PrintI64("filler_collapse_candidate_huge_pages",
+                 collapse_candidates_.raw_num());
+  hpaa->PrintI64("filler_collapsed_huge_pages", collapsed_);
+  hpaa->PrintI64("filler_collapse_failures", collapse_failures_);
+  hpaa->PrintI64("filler_collapse_total_ns", collapse_ns_);
+  hpaa->PrintI64("filler_collapse_max_ns", max_collapse_ns_);
+  if (adaptive_partial_rerelease_) {
+    hpaa->PrintRaw("filler_partial_rerelease",
+                   partial_rerelease_ == FillerPartialRerelease::Return
+                       ? "RETURN"
+                       : "RETAIN");
+    hpaa->PrintI64("filler_partial_rerelease_switches",
+                   partial_rerelease_switches_);
+    hpaa->PrintI64("filler_retained_bytes", retained_pages() * kPageSize);
+  }
+  if (segregate_span_lengths_) {
+    hpaa->PrintI64("filler_single_page_huge_pages",
+                   regular_alloc_[0].size().raw_num());
+    hpaa->PrintI64("filler_multi_page_huge_pages",
+                   regular_alloc_[1].size().raw_num());
+  }
   hpaa->PrintI64(
       "filler_hugepageable_used_bytes",
       static_cast<uint64_t>(hugepage_frac() *
@@ -1763,7 +2720,7 @@ inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion *hpaa) const {
   // Compute some histograms of fullness.
   using ::tcmalloc::internal::UsageInfo;
   UsageInfo usage;
-  regular_alloc_.Iter(
+  IterRegular(
       [&](const TrackerType *pt) { usage.Record(pt, UsageInfo::kRegular); }, 0);
   donated_alloc_.Iter(
       [&](const TrackerType *pt) { usage.Record(pt, UsageInfo::kDonated); }, 0);
@@ -1794,7 +2751,7 @@ inline void HugePageFiller<TrackerType>::UpdateFillerStatsTracker() {
        .unmapped_pages = unmapped_pages(),
        .used_pages_in_subreleased_huge_pages =
            n_used_partial_released_ + n_used_released_,
-       .huge_pages = {regular_alloc_.size(), donated_alloc_.size(),
+       .huge_pages = {regular_size(), donated_alloc_.size(),
                       regular_alloc_partial_released_.size(),
                       regular_alloc_released_.size()}});
 }
@@ -1831,13 +2788,17 @@ inline void HugePageFiller<TrackerType>::RemoveFromFillerList(TrackerType *pt) {
   Length longest = pt->longest_free_range();
   ASSERT(longest < kPagesPerHugePage);
 
+  if (IsCollapseCandidate(pt)) {
+    --collapse_candidates_;
+  }
+
   if (pt->donated()) {
     donated_alloc_.Remove(pt, longest);
   } else {
     size_t chunk = IndexFor(pt);
     size_t i = ListFor(longest, chunk);
     if (!pt->released()) {
-      regular_alloc_.Remove(pt, i);
+      regular_alloc_[pt->span_class()].Remove(pt, i);
     } else if (partial_rerelease_ == FillerPartialRerelease::Return ||
                pt->free_pages() <= pt->released_pages()) {
       regular_alloc_released_.Remove(pt, i);
@@ -1863,9 +2824,13 @@ inline void HugePageFiller<TrackerType>::AddToFillerList(TrackerType *pt) {
   // donated allocs.
   pt->set_donated(false);
 
+  if (IsCollapseCandidate(pt)) {
+    ++collapse_candidates_;
+  }
+
   size_t i = ListFor(longest, chunk);
   if (!pt->released()) {
-    regular_alloc_.Add(pt, i);
+    regular_alloc_[pt->span_class()].Add(pt, i);
   } else if (partial_rerelease_ == FillerPartialRerelease::Return ||
              pt->free_pages() == pt->released_pages()) {
     regular_alloc_released_.Add(pt, i);
@@ -1900,8 +2865,10 @@ inline double HugePageFiller<TrackerType>::hugepage_frac() const {
   ASSERT(n_used_partial_released_ >= 0);
   ASSERT(n_used_partial_released_ <=
          regular_alloc_partial_released_.size().in_pages());
-  const Length used_on_rel =
+  Length used_on_rel =
       (nrel >= unmapped ? nrel - unmapped : 0) + n_used_partial_released_;
+  // Pages being released count as used by their (possibly released) trackers.
+  used_on_rel -= std::min(used_on_rel, releasing_);
   ASSERT(used >= used_on_rel);
   const Length used_on_huge = used - used_on_rel;
 
@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include <cstdint>
+#include <functional>
 #include <iterator>
 #include <memory>
 #include <new>
@@ -39,6 +40,7 @@
 #include "absl/memory/memory.h"
 #include "absl/random/bernoulli_distribution.h"
 #include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 #include "absl/synchronization/blocking_counter.h"
 #include "absl/synchronization/mutex.h"
@@ -314,6 +316,36 @@ TEST_F(PageTrackerTest, ReleasingReturn) {
   Put(a3);
 }
 
+// Only pages released by MaybeRelease() count as eagerly released when we
+// reuse them.
+TEST_F(PageTrackerTest, EagerlyReleased) {
+  static const Length kAllocSize = kPagesPerHugePage / 4;
+  PAlloc a1 = Get(kAllocSize);
+  PAlloc a2 = Get(kAllocSize);
+  PAlloc a3 = Get(2 * kAllocSize);
+
+  Put(a2);
+  ExpectPages(a2);
+  EXPECT_EQ(kAllocSize, ReleaseFree());
+  mock_.VerifyAndClear();
+
+  ExpectPages(a1);
+  MaybeRelease(a1);
+  Put(a1);
+  mock_.VerifyAndClear();
+
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    auto allocation = tracker_.Get(2 * kAllocSize);
+    EXPECT_EQ(a1.p, allocation.page);
+    EXPECT_EQ(2 * kAllocSize, allocation.previously_unbacked);
+    EXPECT_EQ(kAllocSize, allocation.previously_eagerly_released);
+    EXPECT_EQ(0, tracker_.released_pages());
+    tracker_.Put(allocation.page, 2 * kAllocSize);
+  }
+  Put(a3);
+}
+
 TEST_F(PageTrackerTest, ReleasingRetain) {
   static const Length kAllocSize = kPagesPerHugePage / 4;
   PAlloc a1 = Get(kAllocSize - 3);
@@ -344,6 +376,64 @@ TEST_F(PageTrackerTest, ReleasingRetain) {
   mock_.VerifyAndClear();
 }
 
+TEST_F(PageTrackerTest, ReserveFree) {
+  static const Length kAllocSize = kPagesPerHugePage / 4;
+  PAlloc a1 = Get(kAllocSize - 3);
+  PAlloc a2 = Get(kAllocSize);
+  PAlloc a3 = Get(kAllocSize + 1);
+  PAlloc a4 = Get(kAllocSize + 2);
+
+  Put(a2);
+  Put(a4);
+  // Reserving pages doesn't release them (our caller does), but they are
+  // no longer free.
+  struct Range {
+    size_t index;
+    size_t n;
+  };
+  Range ranges[2];
+  size_t n_ranges = 0;
+  auto record = [&](size_t index, size_t n) {
+    ranges[n_ranges++] = {index, n};
+  };
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    // Both ranges or neither.
+    EXPECT_EQ(0, tracker_.ReserveFree(1, record));
+    EXPECT_EQ(0, n_ranges);
+    EXPECT_EQ(a2.n + a4.n, tracker_.ReserveFree(2, record));
+    EXPECT_EQ(0, tracker_.ReserveFree(2, record));
+  }
+  ASSERT_EQ(2, n_ranges);
+  EXPECT_EQ(a2.p - huge_.first_page(), ranges[0].index);
+  EXPECT_EQ(a2.n, ranges[0].n);
+  EXPECT_EQ(a4.p - huge_.first_page(), ranges[1].index);
+  EXPECT_EQ(a4.n, ranges[1].n);
+  EXPECT_EQ(kPagesPerHugePage, tracker_.used_pages());
+  EXPECT_EQ(0, tracker_.longest_free_range());
+  EXPECT_FALSE(tracker_.released());
+
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    for (size_t i = 0; i < n_ranges; ++i) {
+      tracker_.CommitReleased(ranges[i].index, ranges[i].n);
+    }
+  }
+  EXPECT_TRUE(tracker_.released());
+  EXPECT_TRUE(tracker_.broken());
+  EXPECT_EQ(a2.n + a4.n, tracker_.released_pages());
+  EXPECT_EQ(a2.n + a4.n, tracker_.free_pages());
+  EXPECT_EQ(a4.n, tracker_.longest_free_range());
+  mock_.VerifyAndClear();
+
+  // As with ReleaseFree, we now release anything returned to us.
+  ExpectPages(a1);
+  MaybeRelease(a1);
+  Put(a1);
+  mock_.VerifyAndClear();
+  Put(a3);
+}
+
 TEST_F(PageTrackerTest, Defrag) {
   absl::BitGen rng;
   const Length N = absl::GetFlag(FLAGS_page_tracker_defrag_lim);
@@ -634,6 +724,20 @@ class FillerTest : public testing::TestWithParam<FillerPartialRerelease> {
 
   static void Unback(void *p, size_t len) {}
 
+  // Takes 100us, and succeeds iff collapse_succeeds_.  Runs collapse_hook_,
+  // if set, meanwhile.
+  static bool Collapse(void *p, size_t len) {
+    CHECK_CONDITION(len == kHugePageSize);
+    CHECK_CONDITION(!pageheap_lock.IsHeld());
+    collapse_calls_++;
+    Advance(absl::Microseconds(100));
+    if (collapse_hook_) collapse_hook_();
+    return collapse_succeeds_;
+  }
+  static bool collapse_succeeds_;
+  static size_t collapse_calls_;
+  static std::function<void()> collapse_hook_;
+
   // Our templating approach lets us directly override certain functions
   // and have mocks without virtualization.  It's a bit funky but works.
   typedef PageTracker<BlockingUnback::Unback> FakeTracker;
@@ -665,7 +769,12 @@ class FillerTest : public testing::TestWithParam<FillerPartialRerelease> {
 
   HugePageFiller<FakeTracker> filler_;
 
-  FillerTest() : filler_(GetParam(), FakeClock) { ResetClock(); }
+  FillerTest() : filler_(GetParam(), FakeClock, Collapse) {
+    ResetClock();
+    collapse_succeeds_ = true;
+    collapse_calls_ = 0;
+    collapse_hook_ = nullptr;
+  }
 
   ~FillerTest() override {
     EXPECT_EQ(NHugePages(0), filler_.size());
@@ -769,6 +878,9 @@ class FillerTest : public testing::TestWithParam<FillerPartialRerelease> {
 };
 
 int64_t FillerTest::clock_{1234};
+bool FillerTest::collapse_succeeds_{true};
+size_t FillerTest::collapse_calls_{0};
+std::function<void()> FillerTest::collapse_hook_;
 
 TEST_P(FillerTest, Density) {
   absl::BitGen rng;
@@ -838,6 +950,47 @@ TEST_P(FillerTest, Release) {
   Delete(p5);
 }
 
+TEST_P(FillerTest, ExtendAndTrim) {
+  static const Length kAlloc = kPagesPerHugePage / 4;
+  PAlloc p1 = Allocate(kAlloc);
+  PAlloc p2 = Allocate(kAlloc);
+  ASSERT_EQ(p1.pt, p2.pt);
+  ASSERT_EQ(p1.p + kAlloc, p2.p);
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    EXPECT_FALSE(filler_.TryExtend(p1.pt, p1.p, p1.n, 1));
+    EXPECT_FALSE(filler_.TryExtend(p2.pt, p2.p, p2.n, 2 * kAlloc + 1));
+  }
+  Delete(p1);
+  // Release the free pages, some of which p2 is about to take back.
+  ASSERT_EQ(3 * kAlloc, ReleasePages(kMaxValidPages));
+  EXPECT_EQ(3 * kAlloc, filler_.unmapped_pages());
+
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    ASSERT_TRUE(filler_.TryExtend(p2.pt, p2.p, p2.n, 2 * kAlloc));
+  }
+  p2.n += 2 * kAlloc;
+  total_allocated_ += 2 * kAlloc;
+  Mark(p2);
+  CheckStats();
+  EXPECT_EQ(1, p2.pt->nallocs());
+  EXPECT_EQ(p2.n, filler_.pages_allocated());
+  EXPECT_EQ(kAlloc, filler_.unmapped_pages());
+
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    filler_.Trim(p2.pt, p2.p, p2.n, 2 * kAlloc + 1);
+  }
+  p2.n -= 2 * kAlloc + 1;
+  total_allocated_ -= 2 * kAlloc + 1;
+  CheckStats();
+  EXPECT_EQ(1, p2.pt->nallocs());
+  EXPECT_EQ(p2.n, filler_.pages_allocated());
+
+  EXPECT_TRUE(Delete(p2));
+}
+
 TEST_P(FillerTest, Fragmentation) {
   absl::BitGen rng;
   auto dist = EmpiricalDistribution(absl::GetFlag(FLAGS_frag_req_limit));
@@ -1158,6 +1311,291 @@ TEST_P(FillerTest, ReleaseWithReuse) {
   EXPECT_EQ(0, filler_.unmapped_pages());
 }
 
+TEST_P(FillerTest, CollapseRefilledHugePages) {
+  const Length N = kPagesPerHugePage;
+  auto CollapseHugePages = [&]() {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.CollapseHugePages(NHugePages(4));
+  };
+
+  // Break a hugepage by subreleasing half of it.
+  auto half1 = Allocate(N / 2);
+  auto half2 = Allocate(N / 2);
+  ASSERT_EQ(half1.pt, half2.pt);
+  Delete(half2);
+  ASSERT_EQ(N / 2, ReleasePages(N / 2));
+  EXPECT_TRUE(half1.pt->broken());
+  EXPECT_EQ(NHugePages(0), filler_.collapse_candidates());
+
+  // Nothing to do until it is fully backed again.
+  EXPECT_EQ(NHugePages(0), CollapseHugePages());
+  EXPECT_EQ(0, collapse_calls_);
+
+  half2 = Allocate(N / 2);
+  ASSERT_EQ(half1.pt, half2.pt);
+  EXPECT_EQ(NHugePages(1), filler_.collapse_candidates());
+
+  // A failed collapse leaves it a candidate.
+  collapse_succeeds_ = false;
+  EXPECT_EQ(NHugePages(0), CollapseHugePages());
+  EXPECT_EQ(1, collapse_calls_);
+  EXPECT_EQ(NHugePages(1), filler_.collapse_candidates());
+
+  collapse_succeeds_ = true;
+  EXPECT_EQ(NHugePages(1), CollapseHugePages());
+  EXPECT_EQ(2, collapse_calls_);
+  EXPECT_EQ(NHugePages(0), filler_.collapse_candidates());
+  EXPECT_FALSE(half1.pt->broken());
+
+  std::string buffer(1024 * 1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    filler_.Print(&printer, /*everything=*/false);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr(
+                          "HugePageFiller: 0 refilled hugepages awaiting "
+                          "collapse, 1 restored (1 failed), 100.0 us/collapse "
+                          "(max 100.0 us)\n"));
+
+  // Candidates that leave the filler are forgotten.
+  Delete(half2);
+  ASSERT_EQ(N / 2, ReleasePages(N / 2));
+  half2 = Allocate(N / 2);
+  EXPECT_EQ(NHugePages(1), filler_.collapse_candidates());
+  Delete(half1);
+  Delete(half2);
+  EXPECT_EQ(NHugePages(0), filler_.collapse_candidates());
+}
+
+// Collapsing drops pageheap_lock (Collapse checks), so the hugepage can be
+// emptied meanwhile; it then leaves the filler once the collapse is done.
+TEST_P(FillerTest, CollapseEmptiedHugePage) {
+  const Length N = kPagesPerHugePage;
+  auto half1 = Allocate(N / 2);
+  auto half2 = Allocate(N / 2);
+  ASSERT_EQ(half1.pt, half2.pt);
+  Delete(half2);
+  ASSERT_EQ(N / 2, ReleasePages(N / 2));
+  half2 = Allocate(N / 2);
+  ASSERT_EQ(half1.pt, half2.pt);
+  ASSERT_EQ(NHugePages(1), filler_.collapse_candidates());
+
+  collapse_hook_ = [&]() {
+    EXPECT_TRUE(half1.pt->collapsing());
+    EXPECT_FALSE(Delete(half1));
+    EXPECT_FALSE(Delete(half2));
+    // It is no longer ours to release.
+    EXPECT_EQ(0, ReleasePages(N));
+  };
+  FakeTracker *pt;
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    EXPECT_EQ(NHugePages(1), filler_.CollapseHugePages(NHugePages(4)));
+    pt = filler_.TakeEmptied();
+    EXPECT_EQ(nullptr, filler_.TakeEmptied());
+  }
+  EXPECT_EQ(1, collapse_calls_);
+  ASSERT_EQ(half1.pt, pt);
+  EXPECT_FALSE(pt->collapsing());
+  EXPECT_TRUE(pt->empty());
+  EXPECT_EQ(NHugePages(0), filler_.collapse_candidates());
+  EXPECT_EQ(NHugePages(0), filler_.size());
+  --hp_contained_;
+  delete pt;
+}
+
+TEST_P(FillerTest, PreferSubreleased) {
+  const Length N = kPagesPerHugePage;
+  // One hugepage with subreleased free space...
+  auto half1 = Allocate(N / 2);
+  auto half2 = Allocate(N / 2);
+  Delete(half2);
+  ASSERT_EQ(N / 2, ReleasePages(N / 2));
+  // ...and one that is fuller, but intact.
+  auto big = Allocate(N / 2 + 1);
+  ASSERT_NE(half1.pt, big.pt);
+
+  // By default we avoid the subreleased hugepage.
+  auto small = Allocate(1);
+  EXPECT_EQ(big.pt, small.pt);
+  Delete(small);
+
+  filler_.set_prefer_subreleased(true);
+  small = Allocate(1);
+  EXPECT_EQ(half1.pt, small.pt);
+  Delete(small);
+
+  Delete(half1);
+  Delete(big);
+}
+
+TEST_P(FillerTest, SegregateSpanLengths) {
+  for (bool segregate : {false, true}) {
+    SCOPED_TRACE(segregate);
+    filler_.set_segregate_span_lengths(segregate);
+    const Length N = kPagesPerHugePage;
+    // A hugepage opened by a longer span, and one by a single page.
+    auto long1 = Allocate(N / 2);
+    auto long2 = Allocate(N / 2);
+    auto page = Allocate(1);
+    ASSERT_EQ(long1.pt, long2.pt);
+    ASSERT_NE(long1.pt, page.pt);
+    Delete(long2);
+
+    // By default we pick the hugepage with the shortest free range, but
+    // segregated, single pages go with single pages...
+    auto small = Allocate(1);
+    EXPECT_EQ(segregate ? page.pt : long1.pt, small.pt);
+    // ...and longer spans with longer spans.
+    auto medium = Allocate(N / 4);
+    EXPECT_EQ(long1.pt, medium.pt);
+    // Even if that takes another hugepage.
+    auto big = Allocate(N / 2);
+    if (segregate) {
+      EXPECT_NE(page.pt, big.pt);
+      EXPECT_NE(long1.pt, big.pt);
+    } else {
+      EXPECT_EQ(page.pt, big.pt);
+    }
+
+    std::string buffer(1024 * 1024, '\0');
+    {
+      TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+      filler_.Print(&printer, /*everything=*/false);
+    }
+    buffer.resize(strlen(buffer.c_str()));
+    if (segregate) {
+      EXPECT_THAT(buffer, testing::HasSubstr(
+                              "HugePageFiller: by span length, 1 intact "
+                              "hugepages for single pages, 2 for longer "
+                              "spans\n"));
+    } else {
+      EXPECT_THAT(buffer, testing::Not(testing::HasSubstr("by span length")));
+    }
+
+    Delete(big);
+    Delete(medium);
+    Delete(small);
+    Delete(page);
+    Delete(long1);
+  }
+}
+
+// Single-page spans are mostly short-lived, and longer ones long-lived.
+// Compare how much memory is free, how much of that is stranded in non-full
+// hugepages, and how much of the heap stays on intact hugepages after
+// releasing it, with and without segregating spans by length.
+//
+// Letting either class of span use the other's hugepages when its own are
+// full (rather than opening a new one) turned out worse than not segregating
+// at all on every measure here.
+TEST_P(FillerTest, SegregatedSpanLengthsFragmentation) {
+  struct Result {
+    double slack;
+    double nonfull_free;
+    double hugepage_frac;
+  };
+  auto run = [&](bool segregate) {
+    HugePageFiller<FakeTracker> filler(GetParam(), FakeClock, Collapse);
+    filler.set_segregate_span_lengths(segregate);
+    std::mt19937 rng(1);
+    auto dist = EmpiricalDistribution(kPagesPerHugePage - 1);
+    std::vector<PAlloc> short_lived, long_lived;
+    const Length kTarget = NHugePages(256).in_pages();
+    Length live = 0;
+
+    auto alloc = [&]() {
+      PAlloc a;
+      a.n = std::max(1, dist(rng));
+      bool success;
+      {
+        absl::base_internal::SpinLockHolder l(&pageheap_lock);
+        success = filler.TryGet(a.n, &a.pt, &a.p);
+      }
+      if (!success) {
+        a.pt = new FakeTracker(GetBacking(),
+                               absl::base_internal::CycleClock::Now());
+        absl::base_internal::SpinLockHolder l(&pageheap_lock);
+        a.p = a.pt->Get(a.n).page;
+        filler.Contribute(a.pt, /*donated=*/false);
+      }
+      live += a.n;
+      (a.n == 1 ? short_lived : long_lived).push_back(a);
+    };
+    auto free = [&](std::vector<PAlloc> &v) {
+      std::swap(v[absl::Uniform<size_t>(rng, 0, v.size())], v.back());
+      const PAlloc a = v.back();
+      v.pop_back();
+      live -= a.n;
+      FakeTracker *pt;
+      {
+        absl::base_internal::SpinLockHolder l(&pageheap_lock);
+        pt = filler.Put(a.pt, a.p, a.n);
+      }
+      delete pt;
+    };
+    auto nonfull_free = [&]() {
+      absl::flat_hash_set<FakeTracker *> nonfull;
+      for (const auto *v : {&short_lived, &long_lived}) {
+        for (const PAlloc &a : *v) {
+          if (!a.pt->full()) nonfull.insert(a.pt);
+        }
+      }
+      Length free = 0;
+      for (FakeTracker *pt : nonfull) free += pt->free_pages();
+      return static_cast<double>(free) /
+             std::max<Length>(1, nonfull.size() * kPagesPerHugePage);
+    };
+
+    double slack = 0, stranded = 0;
+    size_t samples = 0;
+    for (int i = 0; i < 200 * 1000; ++i) {
+      if (live < kTarget) {
+        alloc();
+      } else if (!short_lived.empty() &&
+                 (long_lived.empty() || absl::Bernoulli(rng, 0.9))) {
+        free(short_lived);
+      } else {
+        free(long_lived);
+      }
+      if (i >= 50 * 1000 && i % 1000 == 0) {
+        slack += static_cast<double>(filler.free_pages()) /
+                 filler.size().in_pages();
+        stranded += nonfull_free();
+        samples++;
+      }
+    }
+
+    Result result;
+    result.slack = slack / samples;
+    result.nonfull_free = stranded / samples;
+    {
+      absl::base_internal::SpinLockHolder l(&pageheap_lock);
+      filler.ReleasePages(filler.free_pages(), absl::ZeroDuration());
+      // Nothing is freed concurrently, so nothing can have been emptied.
+      CHECK_CONDITION(filler.TakeEmptied() == nullptr);
+    }
+    result.hugepage_frac = filler.hugepage_frac();
+    for (auto *v : {&short_lived, &long_lived}) {
+      while (!v->empty()) free(*v);
+    }
+    return result;
+  };
+
+  const Result mixed = run(false);
+  const Result segregated = run(true);
+  printf("free: %.4f mixed, %.4f segregated\n", mixed.slack,
+         segregated.slack);
+  printf("free in non-full hugepages: %.4f mixed, %.4f segregated\n",
+         mixed.nonfull_free, segregated.nonfull_free);
+  printf("hugepage_frac after release: %.4f mixed, %.4f segregated\n",
+         mixed.hugepage_frac, segregated.hugepage_frac);
+  EXPECT_LE(segregated.slack, mixed.slack);
+  EXPECT_LE(segregated.nonfull_free, mixed.nonfull_free);
+  EXPECT_GE(segregated.hugepage_frac, mixed.hugepage_frac);
+}
+
 TEST_P(FillerTest, AvoidArbitraryQuarantineVMGrowth) {
   const Length N = kPagesPerHugePage;
   // Guarantee we have a ton of released pages go empty.
@@ -1298,6 +1736,59 @@ TEST_P(FillerTest, ParallelUnlockingSubrelease) {
   BlockingUnback::counter = nullptr;
 }
 
+TEST_P(FillerTest, ReleaseWithoutLock) {
+  // ReleasePages drops pageheap_lock while it unbacks memory.  The pages it is
+  // releasing must stay out of reach in the meantime, even if everything else
+  // on their hugepage is freed.
+  constexpr Length N = kPagesPerHugePage;
+  auto a1 = AllocateRaw(N / 2);
+  auto a2 = AllocateRaw(N / 4);
+  ASSERT_EQ(a1.pt, a2.pt);
+
+  absl::Mutex mu;
+  mu.Lock();
+  absl::BlockingCounter counter(1);
+  BlockingUnback::counter = &counter;
+
+  Length released = 0;
+  std::thread t([&]() {
+    BlockingUnback::set_lock(&mu);
+    released = ReleasePages(kMaxValidPages);
+  });
+  counter.Wait();
+  BlockingUnback::counter = nullptr;
+
+  // t is blocked unbacking the last N / 4 pages of the hugepage, without
+  // holding pageheap_lock.  We can't allocate them...
+  auto a3 = AllocateRaw(N / 4);
+  EXPECT_NE(a1.pt, a3.pt);
+  EXPECT_TRUE(DeleteRaw(a3));
+  // ...nor does freeing everything else make the hugepage empty.
+  EXPECT_FALSE(DeleteRaw(a1));
+  EXPECT_FALSE(DeleteRaw(a2));
+  EXPECT_EQ(NHugePages(1), filler_.size());
+
+  mu.Unlock();
+  t.join();
+  EXPECT_EQ(N / 4, released);
+
+  // Once t is done, the hugepage is empty and leaves the filler.
+  EXPECT_EQ(NHugePages(0), filler_.size());
+  EXPECT_EQ(0, filler_.used_pages());
+  EXPECT_EQ(0, filler_.unmapped_pages());
+  FakeTracker *pt;
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    pt = filler_.TakeEmptied();
+    EXPECT_EQ(nullptr, filler_.TakeEmptied());
+  }
+  ASSERT_EQ(a1.pt, pt);
+  EXPECT_TRUE(pt->released());
+  EXPECT_EQ(kPagesPerHugePage, pt->longest_free_range());
+  --hp_contained_;
+  delete pt;
+}
+
 TEST_P(FillerTest, SkipSubrelease) {
   // This test is sensitive to the number of pages per hugepage, as we are
   // printing raw stats.
@@ -1394,6 +1885,159 @@ HugePageFiller: 25.0000% of decisions confirmed correct, 0 pending (25.0000% of
 )"));
 }
 
+// Subreleasing memory that demand soon comes back for should lengthen an
+// adaptive skip-subrelease interval, so that the next such trough is skipped.
+TEST_P(FillerTest, AdaptiveSkipSubrelease) {
+  const Length N = kPagesPerHugePage;
+  const absl::Duration kMinInterval = absl::Minutes(2);
+  const absl::Duration kMaxInterval = absl::Minutes(8);
+  const auto adapt = [&]() {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.AdaptiveSkipSubreleaseInterval(kMinInterval, kMaxInterval);
+  };
+
+  PAlloc half = Allocate(N / 2);
+  PAlloc tiny = Allocate(N / 2);
+  PAlloc peak = Allocate(N);
+  Delete(peak);
+  Advance(absl::Minutes(5));
+  Delete(half);
+
+  // The peak is older than the interval we start with, so we subrelease...
+  absl::Duration interval = adapt();
+  EXPECT_EQ(kMinInterval, interval);
+  EXPECT_EQ(N / 2, ReleasePages(10 * N, interval));
+
+  // ...only for demand to come back for it.
+  Advance(absl::Minutes(2));
+  PAlloc peak2 = Allocate(N);
+  Advance(absl::Seconds(1));
+  Delete(peak2);
+
+  interval = adapt();
+  EXPECT_EQ(2 * kMinInterval, interval);
+  // Too soon to take another step.
+  EXPECT_EQ(2 * kMinInterval, adapt());
+
+  // The same trough now is within the interval of the peak.
+  PAlloc half2 = Allocate(N / 2);
+  Delete(half2);
+  EXPECT_EQ(0, ReleasePages(10 * N, interval));
+
+  std::string buffer(1024 * 1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    filler_.Print(&printer, /*everything=*/true);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer,
+              testing::HasSubstr(absl::StrCat(
+                  "HugePageFiller: interval adapted 1 times (up to 480s); ",
+                  N / 2, " of ", N / 2,
+                  " subreleased pages were faulted back in.\n")));
+
+  Delete(tiny);
+}
+
+// Each instantiation starts out with its own policy and checks that we switch
+// away from it when it doesn't suit the workload.
+TEST_P(FillerTest, AdaptPartialRerelease) {
+  const Length N = kPagesPerHugePage;
+  const auto adapt = [&]() {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.AdaptPartialRerelease();
+  };
+  const auto print = [&]() {
+    std::string buffer(1024 * 1024, '\0');
+    {
+      TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+      filler_.Print(&printer, /*everything=*/false);
+    }
+    buffer.resize(strlen(buffer.c_str()));
+    return buffer;
+  };
+
+  EXPECT_EQ(0, adapt());
+
+  if (GetParam() == FillerPartialRerelease::Return) {
+    PAlloc a = Allocate(N / 2);
+    PAlloc b = Allocate(N / 2);
+    Delete(b);
+    EXPECT_EQ(N / 2, ReleasePages(N / 2));
+
+    // Pages we free onto the subreleased hugepage are released right away,
+    // only to be faulted back in by the next allocation.
+    for (int i = 0; i < 4; ++i) {
+      PAlloc c = Allocate(N / 4);
+      Delete(c);
+      EXPECT_EQ(N / 2, filler_.unmapped_pages());
+    }
+    EXPECT_EQ(0, adapt());
+    EXPECT_EQ(FillerPartialRerelease::Return, filler_.partial_rerelease());
+
+    Advance(absl::Minutes(1));
+    EXPECT_EQ(0, adapt());
+    EXPECT_EQ(FillerPartialRerelease::Retain, filler_.partial_rerelease());
+    EXPECT_EQ(1, filler_.partial_rerelease_switches());
+
+    // Now we hang on to them instead.
+    PAlloc c = Allocate(N / 4);
+    Delete(c);
+    EXPECT_EQ(N / 4, filler_.unmapped_pages());
+    EXPECT_EQ(N / 4, filler_.free_pages());
+    EXPECT_THAT(print(), testing::HasSubstr(absl::StrCat(
+                             "HugePageFiller: partial rerelease policy RETAIN "
+                             "(adaptive, 1 switches), ",
+                             N / 4, " pages retained\n")));
+
+    Delete(a);
+  } else {
+    // Partially release several hugepages, then retain most of what we fault
+    // back in on each of them.
+    std::vector<PAlloc> as, bs, cs;
+    for (int i = 0; i < 8; ++i) {
+      as.push_back(Allocate(N / 2));
+      bs.push_back(Allocate(N / 2));
+    }
+    for (const PAlloc &b : bs) {
+      Delete(b);
+    }
+    EXPECT_EQ(4 * N, ReleasePages(4 * N));
+    for (int i = 0; i < 8; ++i) {
+      cs.push_back(Allocate(3 * N / 8));
+    }
+    for (const PAlloc &c : cs) {
+      Delete(c);
+    }
+    EXPECT_EQ(3 * N, filler_.free_pages());
+    EXPECT_EQ(N, filler_.unmapped_pages());
+    EXPECT_EQ(0, adapt());
+    EXPECT_EQ(FillerPartialRerelease::Retain, filler_.partial_rerelease());
+    EXPECT_THAT(print(), testing::HasSubstr(absl::StrCat(
+                             "HugePageFiller: partial rerelease policy RETAIN "
+                             "(adaptive, 0 switches), ",
+                             3 * N, " pages retained\n")));
+
+    // That is too much memory to hold on to: release it and stop retaining.
+    Advance(absl::Minutes(1));
+    EXPECT_EQ(3 * N, adapt());
+    EXPECT_EQ(FillerPartialRerelease::Return, filler_.partial_rerelease());
+    EXPECT_EQ(1, filler_.partial_rerelease_switches());
+    EXPECT_EQ(0, filler_.free_pages());
+    EXPECT_EQ(4 * N, filler_.unmapped_pages());
+    EXPECT_EQ(0, filler_.used_pages_in_partial_released());
+
+    // From now on, frees onto subreleased hugepages are released eagerly.
+    PAlloc c = Allocate(N / 4);
+    Delete(c);
+    EXPECT_EQ(0, filler_.free_pages());
+
+    for (const PAlloc &a : as) {
+      Delete(a);
+    }
+  }
+}
+
 class FillerStatsTrackerTest : public testing::Test {
  private:
   static int64_t clock_;
@@ -1517,6 +2161,7 @@ HugePageFiller: 0.0000% of decisions confirmed correct, 0 pending (0.0000% of pa
       timestamp_ms: 0
       min_free_pages: 11
       min_free_backed_pages: 1
+      skip_subrelease_interval_ms: 0
       at_minimum_demand {
         num_pages: 1
         regular_huge_pages: 5
@@ -1555,6 +2200,7 @@ HugePageFiller: 0.0000% of decisions confirmed correct, 0 pending (0.0000% of pa
       timestamp_ms: 300000
       min_free_pages: 210
       min_free_backed_pages: 200
+      skip_subrelease_interval_ms: 0
       at_minimum_demand {
         num_pages: 100
         regular_huge_pages: 9
@@ -1593,6 +2239,7 @@ HugePageFiller: 0.0000% of decisions confirmed correct, 0 pending (0.0000% of pa
       timestamp_ms: 337500
       min_free_pages: 110
       min_free_backed_pages: 100
+      skip_subrelease_interval_ms: 0
       at_minimum_demand {
         num_pages: 200
         regular_huge_pages: 14
@@ -1784,6 +2431,61 @@ std::vector<FillerTest::PAlloc> FillerTest::GenerateInterestingAllocs() {
 
 // Test the output of Print(). This is something of a change-detector test,
 // but that's not all bad in this case.
+TEST_F(FillerStatsTrackerTest, AdaptiveSkipSubreleaseInterval) {
+  const absl::Duration kMinInterval = absl::Minutes(1);
+  const absl::Duration kMaxInterval = absl::Minutes(8);
+
+  EXPECT_EQ(kMinInterval,
+            tracker_.AdaptiveSkipSubreleaseInterval(kMinInterval, kMaxInterval));
+
+  // Subrelease down from a peak, which demand then comes back to.
+  GenerateDemandPoint(1000, 0);
+  Advance(absl::Minutes(1));
+  GenerateDemandPoint(100, 900);
+  tracker_.ReportSubreleasedPages(900, 1000);
+  Advance(absl::Minutes(1));
+  GenerateDemandPoint(1000, 0);
+  Advance(absl::Minutes(1));
+  GenerateDemandPoint(1000, 0);
+  EXPECT_EQ(tracker_.subreleased().pages, 900);
+  EXPECT_EQ(tracker_.refaulted().pages, 900);
+
+  EXPECT_EQ(2 * kMinInterval,
+            tracker_.AdaptiveSkipSubreleaseInterval(kMinInterval, kMaxInterval));
+  EXPECT_EQ(tracker_.skip_subrelease_interval_changes(), 1);
+
+  // Skip a subrelease for a peak that never comes back.
+  Advance(absl::Minutes(1));
+  GenerateDemandPoint(200, 800);
+  tracker_.ReportSkippedSubreleasePages(500, 1000, 2 * kMinInterval);
+  for (int i = 0; i < 3; ++i) {
+    Advance(absl::Minutes(1));
+    GenerateDemandPoint(200, 800);
+  }
+  EXPECT_EQ(tracker_.correctly_skipped().pages, 0);
+  EXPECT_EQ(tracker_.pending_skipped().pages, 0);
+
+  EXPECT_EQ(kMinInterval,
+            tracker_.AdaptiveSkipSubreleaseInterval(kMinInterval, kMaxInterval));
+  EXPECT_EQ(tracker_.skip_subrelease_interval_changes(), 2);
+  // Never below the minimum.
+  Advance(absl::Minutes(5));
+  EXPECT_EQ(kMinInterval,
+            tracker_.AdaptiveSkipSubreleaseInterval(kMinInterval, kMaxInterval));
+
+  // The interval in effect shows up in the time series.
+  std::string buffer(1024 * 1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    PbtxtRegion region(&printer, kTop, /*indent=*/0);
+    tracker_.PrintInPbtxt(&region);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("skip_subrelease_interval_ms: 120000"));
+  EXPECT_THAT(buffer, testing::HasSubstr("skipped_subrelease_interval_changes: 2"));
+  EXPECT_THAT(buffer, testing::HasSubstr("refaulted_subreleased_pages: 900"));
+}
+
 TEST_P(FillerTest, Print) {
   if (kPagesPerHugePage != 256) {
     // The output is hardcoded on this assumption, and dynamically calculating
@@ -1808,6 +2510,8 @@ HugePageFiller: among non-fulls, 0.3398 free
 HugePageFiller: 499 used pages in subreleased hugepages (0 of them in partially released)
 HugePageFiller: 2 hugepages partially released, 0.0254 released
 HugePageFiller: 0.7187 of used pages hugepageable
+HugePageFiller: 0 of released pages lazily freed
+HugePageFiller: 0 refilled hugepages awaiting collapse, 0 restored (0 failed), 0.0 us/collapse (max 0.0 us)
 
 HugePageFiller: fullness histograms
 
@@ -1915,6 +2619,12 @@ TEST_P(FillerTest, PrintInPbtxt) {
   filler_used_pages_in_subreleased: 499
   filler_used_pages_in_partial_released: 0
   filler_unmapped_bytes: 0
+  filler_lazily_freed_bytes: 0
+  filler_collapse_candidate_huge_pages: 0
+  filler_collapsed_huge_pages: 0
+  filler_collapse_failures: 0
+  filler_collapse_total_ns: 0
+  filler_collapse_max_ns: 0
   filler_hugepageable_used_bytes: 10444800
   filler_tracker {
     type: REGULAR
@@ -3388,6 +4098,7 @@ TEST_P(FillerTest, PrintInPbtxt) {
       timestamp_ms: 0
       min_free_pages: 0
       min_free_backed_pages: 0
+      skip_subrelease_interval_ms: 0
       at_minimum_demand {
         num_pages: 0
         regular_huge_pages: 0
@@ -16,6 +16,7 @@
 #define TCMALLOC_HUGE_REGION_H_
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 
@@ -25,6 +26,7 @@
 #include "tcmalloc/internal/linked_list.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -60,6 +62,17 @@ class HugeRegion : public TList<HugeRegion<Unback>>::Elem {
   // REQUIRES: [p, p + n) was the result of a previous MaybeGet.
   void Put(PageId p, Length n, bool release);
 
+  // If the delta pages after [p, p + n) are free, add them to it, setting
+  // *from_released = true iff any of them are currently unbacked.
+  // Returns false, changing nothing, otherwise.
+  // REQUIRES: [p, p + n) was the result of a previous MaybeGet.
+  bool MaybeExtend(PageId p, Length n, Length delta, bool *from_released);
+
+  // Return the last delta pages of [p, p + n) for new allocations, releasing
+  // any hugepages made empty.
+  // REQUIRES: [p, p + n) was the result of a previous MaybeGet; delta < n.
+  void Trim(PageId p, Length n, Length delta);
+
   // Release any hugepages that are unused but backed.
   HugeLength Release();
 
@@ -72,11 +85,19 @@ class HugeRegion : public TList<HugeRegion<Unback>>::Elem {
     return size().in_pages() - unmapped_pages() - used_pages();
   }
   Length unmapped_pages() const { return (size() - nbacked_).in_pages(); }
+  Length lazily_freed_pages() const { return nlazily_freed_.in_pages(); }
 
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
                     PageAgeHistograms *ages) const;
 
   HugeLength backed() const;
+  HugeLength nbacked() const { return nbacked_; }
+  template <typename F>
+  void ForEachBackedHugePage(F f) const {
+    for (int i = 0; i < kNumHugePages; ++i) {
+      if (backed_[i]) f(location_.start() + NHugePages(i));
+    }
+  }
 
   void Print(TCMalloc_Printer *out) const;
   void PrintInPbtxt(PbtxtRegion *detail) const;
@@ -120,6 +141,9 @@ class HugeRegion : public TList<HugeRegion<Unback>>::Elem {
   // Is this hugepage backed?
   bool backed_[kNumHugePages];
   HugeLength nbacked_;
+  // Was this (unbacked) hugepage released lazily (see SystemReleaseIsLazy)?
+  bool lazily_freed_[kNumHugePages];
+  HugeLength nlazily_freed_;
   int64_t whens_[kNumHugePages];
   HugeLength total_unbacked_{NHugePages(0)};
 };
@@ -139,6 +163,15 @@ class HugeRegionSet {
   // Return an allocation to a region (if one matches!)
   bool MaybePut(PageId p, Length n);
 
+  // Is p located in one of our regions?
+  bool contains(PageId p);
+
+  // Grow or shrink an allocation in place (see HugeRegion::MaybeExtend and
+  // HugeRegion::Trim.)  Both return false if no region holds it; MaybeExtend
+  // also does if the pages after it are not free.
+  bool MaybeExtend(PageId p, Length n, Length delta, bool *from_released);
+  bool MaybeTrim(PageId p, Length n, Length delta);
+
   // Add region to the set.
   void Contribute(Region *region);
 
@@ -146,6 +179,21 @@ class HugeRegionSet {
   // we managed to release.
   HugeLength Release();
 
+  // Backed hugepages across all regions, and a way to visit them.
+  HugeLength backed() const {
+    HugeLength n;
+    for (Region *region : list_) {
+      n += region->nbacked();
+    }
+    return n;
+  }
+  template <typename F>
+  void ForEachBackedHugePage(F f) const {
+    for (Region *region : list_) {
+      region->ForEachBackedHugePage(f);
+    }
+  }
+
   void Print(TCMalloc_Printer *out) const;
   void PrintInPbtxt(PbtxtRegion *hpaa) const;
   void AddSpanStats(SmallSpanStats *small, LargeSpanStats *large,
@@ -217,7 +265,9 @@ inline HugeRegion<Unback>::HugeRegion(HugeRange r)
       location_(r),
       pages_used_{},
       backed_{},
-      nbacked_(NHugePages(0)) {
+      nbacked_(NHugePages(0)),
+      lazily_freed_{},
+      nlazily_freed_(NHugePages(0)) {
   int64_t now = absl::base_internal::CycleClock::Now();
   for (int i = 0; i < kNumHugePages; ++i) {
     whens_[i] = now;
@@ -250,6 +300,29 @@ inline void HugeRegion<Unback>::Put(PageId p, Length n, bool release) {
   Dec(p, n, release);
 }
 
+template <MemoryModifyFunction Unback>
+inline bool HugeRegion<Unback>::MaybeExtend(PageId p, Length n, Length delta,
+                                            bool *from_released) {
+  const PageId tail = p + n;
+  const size_t index = tail - location_.start().first_page();
+  if (index + delta > size().in_pages() || !tracker_.IsFree(index, delta)) {
+    return false;
+  }
+  tracker_.Extend(index, delta);
+
+  Inc(tail, delta, from_released);
+  return true;
+}
+
+template <MemoryModifyFunction Unback>
+inline void HugeRegion<Unback>::Trim(PageId p, Length n, Length delta) {
+  ASSERT(delta < n);
+  const PageId tail = p + n - delta;
+  tracker_.Trim(tail - location_.start().first_page(), delta);
+
+  Dec(tail, delta, /*release=*/true);
+}
+
 // Release any hugepages that are unused but backed.
 template <MemoryModifyFunction Unback>
 inline HugeLength HugeRegion<Unback>::Release() {
@@ -371,6 +444,7 @@ inline BackingStats HugeRegion<Unback>::stats() const {
   s.system_bytes = location_.len().in_bytes();
   s.free_bytes = free_pages() * kPageSize;
   s.unmapped_bytes = unmapped_pages() * kPageSize;
+  s.lazily_freed_bytes = lazily_freed_pages() * kPageSize;
   return s;
 }
 
@@ -387,6 +461,10 @@ inline void HugeRegion<Unback>::Inc(PageId p, Length n, bool *from_released) {
       backed_[i] = true;
       should_back = true;
       ++nbacked_;
+      if (lazily_freed_[i]) {
+        lazily_freed_[i] = false;
+        --nlazily_freed_;
+      }
       whens_[i] = now;
     }
     pages_used_[i] += here;
@@ -426,6 +504,9 @@ inline void HugeRegion<Unback>::Dec(PageId p, Length n, bool release) {
 template <MemoryModifyFunction Unback>
 inline void HugeRegion<Unback>::UnbackHugepages(bool should[kNumHugePages]) {
   const int64_t now = absl::base_internal::CycleClock::Now();
+  const bool lazy = SystemReleaseIsLazy();
+  struct iovec batch[kMaxReleaseBatch];
+  size_t batched = 0;
   size_t i = 0;
   while (i < kNumHugePages) {
     if (!should[i]) {
@@ -435,17 +516,25 @@ inline void HugeRegion<Unback>::UnbackHugepages(bool should[kNumHugePages]) {
     size_t j = i;
     while (j < kNumHugePages && should[j]) {
       backed_[j] = false;
+      lazily_freed_[j] = lazy;
       whens_[j] = now;
       j++;
     }
 
     HugeLength hl = NHugePages(j - i);
     nbacked_ -= hl;
+    if (lazy) nlazily_freed_ += hl;
     HugePage p = location_.start() + NHugePages(i);
-    Unback(p.start_addr(), hl.in_bytes());
+    batch[batched].iov_base = p.start_addr();
+    batch[batched].iov_len = hl.in_bytes();
+    if (++batched == kMaxReleaseBatch) {
+      UnbackRanges<Unback>(batch, batched);
+      batched = 0;
+    }
     total_unbacked_ += hl;
     i = j;
   }
+  UnbackRanges<Unback>(batch, batched);
 }
 
 // If available, return a range of n free pages, setting *from_released =
@@ -477,6 +566,43 @@ inline bool HugeRegionSet<Region>::MaybePut(PageId p, Length n) {
   return false;
 }
 
+template <typename Region>
+inline bool HugeRegionSet<Region>::contains(PageId p) {
+  for (Region *region : list_) {
+    if (region->contains(p)) return true;
+  }
+  return false;
+}
+
+template <typename Region>
+inline bool HugeRegionSet<Region>::MaybeExtend(PageId p, Length n,
+                                               Length delta,
+                                               bool *from_released) {
+  for (Region *region : list_) {
+    if (region->contains(p)) {
+      if (!region->MaybeExtend(p, n, delta, from_released)) return false;
+      Fix(region);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template <typename Region>
+inline bool HugeRegionSet<Region>::MaybeTrim(PageId p, Length n,
+                                             Length delta) {
+  for (Region *region : list_) {
+    if (region->contains(p)) {
+      region->Trim(p, n, delta);
+      Fix(region);
+      return true;
+    }
+  }
+
+  return false;
+}
+
 // Add region to the set.
 template <typename Region>
 inline void HugeRegionSet<Region>::Contribute(Region *region) {
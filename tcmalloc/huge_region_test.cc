@@ -194,6 +194,41 @@ TEST_F(HugeRegionTest, ReqsBacking) {
   }
 }
 
+TEST_F(HugeRegionTest, ExtendAndTrim) {
+  mock_ = absl::make_unique<StrictMock<MockBackingInterface>>();
+  const Length n = kPagesPerHugePage;
+  Alloc a = Allocate(n / 2);
+  Alloc b = Allocate(n / 4);
+  ASSERT_EQ(a.p + a.n, b.p);
+
+  // Not while b is in the way...
+  bool from_released;
+  EXPECT_FALSE(region_.MaybeExtend(a.p, a.n, 1, &from_released));
+  Delete(b);
+  // ...but then onto its pages, and further, backing the second hugepage.
+  ASSERT_TRUE(region_.MaybeExtend(a.p, a.n, n / 4, &from_released));
+  EXPECT_FALSE(from_released);
+  a.n += n / 4;
+  ASSERT_TRUE(region_.MaybeExtend(a.p, a.n, n, &from_released));
+  EXPECT_TRUE(from_released);
+  a.n += n;
+  Mark(a);
+  EXPECT_EQ(a.n, region_.used_pages());
+  EXPECT_EQ(NHugePages(2), region_.backed());
+
+  // Trimming it back releases the hugepage it no longer uses.
+  ExpectUnback({p_ + NHugePages(1), NHugePages(1)});
+  region_.Trim(a.p, a.n, n + n / 4 + 1);
+  CheckMock();
+  a.n -= n + n / 4 + 1;
+  EXPECT_EQ(a.n, region_.used_pages());
+  EXPECT_EQ(NHugePages(1), region_.backed());
+
+  ExpectUnback({p_, NHugePages(1)});
+  DeleteUnback(a);
+  CheckMock();
+}
+
 TEST_F(HugeRegionTest, Release) {
   mock_ = absl::make_unique<StrictMock<MockBackingInterface>>();
   const Length n = kPagesPerHugePage;
@@ -0,0 +1,160 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/cgroup_memory.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "tcmalloc/internal/util.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+namespace {
+
+// Reads all of path into buf, NUL-terminated.  Returns the contents, or an
+// empty view if the file can't be read or doesn't fit.
+absl::string_view ReadFile(const char* path, char* buf, size_t size) {
+  int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return absl::string_view();
+  }
+  ssize_t rc = signal_safe_read(fd, buf, size - 1, nullptr);
+  signal_safe_close(fd);
+  if (rc <= 0 || rc >= size - 1) {
+    return absl::string_view();
+  }
+  buf[rc] = '\0';
+  return absl::string_view(buf, rc);
+}
+
+// Reads a memory.max or memory.high file: a number of bytes, or "max".
+bool ReadLimit(const char* path, size_t* limit) {
+  char buf[64];
+  absl::string_view contents =
+      absl::StripAsciiWhitespace(ReadFile(path, buf, sizeof(buf)));
+  if (contents == "max") {
+    *limit = SIZE_MAX;
+    return true;
+  }
+  uint64_t value;
+  if (!absl::SimpleAtoi(contents, &value)) {
+    return false;
+  }
+  *limit = std::min<uint64_t>(value, SIZE_MAX);
+  return true;
+}
+
+// Finds our cgroup v2 path (the "0::" entry) in /proc/self/cgroup.  Without
+// one, we take the root: that is what a cgroup namespace shows us anyway.
+absl::string_view SelfCgroup(char* buf, size_t size) {
+  absl::string_view contents = ReadFile("/proc/self/cgroup", buf, size);
+  while (!contents.empty()) {
+    absl::string_view line = contents.substr(0, contents.find('\n'));
+    contents.remove_prefix(std::min(line.size() + 1, contents.size()));
+    if (absl::ConsumePrefix(&line, "0::")) {
+      return line;
+    }
+  }
+  return "/";
+}
+
+}  // namespace
+
+bool GetCgroupMemoryLimits(const char* root, CgroupMemoryLimits* limits) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  char buf[PATH_MAX];
+  return GetCgroupMemoryLimits(root, SelfCgroup(buf, sizeof(buf)), limits);
+}
+
+bool GetCgroupMemoryLimits(const char* root, absl::string_view cgroup,
+                           CgroupMemoryLimits* limits) {
+  limits->max = SIZE_MAX;
+  limits->high = SIZE_MAX;
+  bool found = false;
+  char path[PATH_MAX];
+  const size_t root_len = strlen(root);
+  // Walk up from our cgroup: a parent's limits constrain us as much as our
+  // own.
+  while (true) {
+    while (!cgroup.empty() && cgroup.back() == '/') cgroup.remove_suffix(1);
+    if (root_len + cgroup.size() + sizeof("/memory.high") <= sizeof(path)) {
+      memcpy(path, root, root_len);
+      memcpy(path + root_len, cgroup.data(), cgroup.size());
+      char* file = path + root_len + cgroup.size();
+
+      size_t limit;
+      strcpy(file, "/memory.max");
+      if (ReadLimit(path, &limit)) {
+        limits->max = std::min(limits->max, limit);
+        found = true;
+      }
+      strcpy(file, "/memory.high");
+      if (ReadLimit(path, &limit)) {
+        limits->high = std::min(limits->high, limit);
+        found = true;
+      }
+    }
+    const size_t slash = cgroup.rfind('/');
+    if (slash == absl::string_view::npos) break;
+    cgroup = cgroup.substr(0, slash);
+  }
+  return found;
+}
+
+bool GetMemoryPressure(const char* path, MemoryPressure* pressure) {
+  char buf[256];
+  absl::string_view contents = ReadFile(path, buf, sizeof(buf));
+  bool some = false, full = false;
+  while (!contents.empty()) {
+    absl::string_view line = contents.substr(0, contents.find('\n'));
+    contents.remove_prefix(std::min(line.size() + 1, contents.size()));
+    // e.g. "some avg10=1.23 avg60=0.45 avg300=0.10 total=123456"
+    double* avg10;
+    if (absl::ConsumePrefix(&line, "some ")) {
+      avg10 = &pressure->some_avg10;
+      some = true;
+    } else if (absl::ConsumePrefix(&line, "full ")) {
+      avg10 = &pressure->full_avg10;
+      full = true;
+    } else {
+      continue;
+    }
+    if (!absl::ConsumePrefix(&line, "avg10=") ||
+        !absl::SimpleAtod(line.substr(0, line.find(' ')), avg10)) {
+      return false;
+    }
+  }
+  // We only insist on "some", as files in this format needn't have "full".
+  if (!full) pressure->full_avg10 = 0;
+  return some;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
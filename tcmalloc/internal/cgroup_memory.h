@@ -0,0 +1,58 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_CGROUP_MEMORY_H_
+#define TCMALLOC_INTERNAL_CGROUP_MEMORY_H_
+
+#include <stddef.h>
+
+#include "absl/strings/string_view.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The cgroup v2 memory limits that apply to this process, in bytes.  Either
+// is SIZE_MAX if no cgroup sets it.
+struct CgroupMemoryLimits {
+  size_t max;   // memory.max: beyond this, the kernel OOM-kills us.
+  size_t high;  // memory.high: beyond this, the kernel throttles and reclaims.
+};
+
+// Reads memory.max and memory.high in our cgroup (as /proc/self/cgroup names
+// it) and each of its ancestors, in the cgroup v2 hierarchy mounted at root
+// (usually /sys/fs/cgroup), and returns the tightest of each.  Returns false if
+// none of those directories has either file.  Does not allocate.
+bool GetCgroupMemoryLimits(const char* root, CgroupMemoryLimits* limits);
+
+// As above, for the given cgroup (e.g. "/system.slice/foo.service") rather
+// than our own.
+bool GetCgroupMemoryLimits(const char* root, absl::string_view cgroup,
+                           CgroupMemoryLimits* limits);
+
+// Pressure stall information for memory, as in /proc/pressure/memory or a
+// cgroup's memory.pressure: the share of the last 10 seconds, in percent, in
+// which some, or all, non-idle tasks were stalled waiting for memory.
+struct MemoryPressure {
+  double some_avg10;
+  double full_avg10;
+};
+
+// Reads the file at path in that format.  Returns false if it can't be read,
+// e.g. because the kernel doesn't track pressure.  Does not allocate.
+bool GetMemoryPressure(const char* path, MemoryPressure* pressure);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_INTERNAL_CGROUP_MEMORY_H_
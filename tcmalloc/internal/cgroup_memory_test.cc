@@ -0,0 +1,121 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/cgroup_memory.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Builds a fake cgroup v2 hierarchy in a fresh directory.
+class CgroupMemoryTest : public ::testing::Test {
+ protected:
+  CgroupMemoryTest() {
+    std::string dir = std::filesystem::temp_directory_path() /
+                      "cgroup_memory_test.XXXXXX";
+    root_ = mkdtemp(&dir[0]);
+  }
+
+  ~CgroupMemoryTest() override { std::filesystem::remove_all(root_); }
+
+  void Write(const std::string& cgroup, const std::string& file,
+             const std::string& contents) {
+    std::filesystem::create_directories(root_ + cgroup);
+    std::ofstream(root_ + cgroup + "/" + file) << contents;
+  }
+
+  std::string root_;
+};
+
+TEST_F(CgroupMemoryTest, NoLimits) {
+  CgroupMemoryLimits limits;
+  EXPECT_FALSE(GetCgroupMemoryLimits(root_.c_str(), &limits));
+  EXPECT_FALSE(GetCgroupMemoryLimits("/nonexistent", &limits));
+}
+
+TEST_F(CgroupMemoryTest, ReadsLimits) {
+  Write("", "memory.max", "1073741824\n");
+  Write("", "memory.high", "max\n");
+  CgroupMemoryLimits limits;
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), &limits));
+  EXPECT_EQ(1073741824, limits.max);
+  EXPECT_EQ(SIZE_MAX, limits.high);
+
+  Write("", "memory.high", "805306368\n");
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), &limits));
+  EXPECT_EQ(1073741824, limits.max);
+  EXPECT_EQ(805306368, limits.high);
+
+  // Garbage is ignored.
+  Write("", "memory.max", "lots\n");
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), &limits));
+  EXPECT_EQ(SIZE_MAX, limits.max);
+  EXPECT_EQ(805306368, limits.high);
+}
+
+TEST_F(CgroupMemoryTest, TightestOfAncestors) {
+  Write("/jobs", "memory.max", "2147483648\n");
+  Write("/jobs", "memory.high", "1073741824\n");
+  Write("/jobs/ours", "memory.max", "1610612736\n");
+  Write("/jobs/ours", "memory.high", "max\n");
+  // A sibling's limits don't apply to us.
+  Write("/jobs/theirs", "memory.max", "4096\n");
+
+  CgroupMemoryLimits limits;
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), "/jobs/ours", &limits));
+  EXPECT_EQ(1610612736, limits.max);
+  EXPECT_EQ(1073741824, limits.high);
+
+  // The root's limits apply to everyone.
+  Write("", "memory.high", "536870912\n");
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), "/jobs/ours/", &limits));
+  EXPECT_EQ(536870912, limits.high);
+  ASSERT_TRUE(GetCgroupMemoryLimits(root_.c_str(), &limits));
+  EXPECT_EQ(536870912, limits.high);
+}
+
+TEST_F(CgroupMemoryTest, ReadsPressure) {
+  const std::string path = root_ + "/memory.pressure";
+  MemoryPressure pressure;
+  EXPECT_FALSE(GetMemoryPressure(path.c_str(), &pressure));
+
+  Write("", "memory.pressure",
+        "some avg10=12.50 avg60=3.00 avg300=0.75 total=1234567\n"
+        "full avg10=4.25 avg60=1.00 avg300=0.25 total=345678\n");
+  ASSERT_TRUE(GetMemoryPressure(path.c_str(), &pressure));
+  EXPECT_EQ(12.5, pressure.some_avg10);
+  EXPECT_EQ(4.25, pressure.full_avg10);
+
+  Write("", "memory.pressure",
+        "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+  ASSERT_TRUE(GetMemoryPressure(path.c_str(), &pressure));
+  EXPECT_EQ(0, pressure.some_avg10);
+  EXPECT_EQ(0, pressure.full_avg10);
+
+  Write("", "memory.pressure", "some avg10=lots\n");
+  EXPECT_FALSE(GetMemoryPressure(path.c_str(), &pressure));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -20,26 +20,61 @@
 
 extern "C" {
 
+ABSL_ATTRIBUTE_WEAK double TCMalloc_Internal_GetCgroupMemoryLimitFraction();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetFillerAdaptivePartialRerelease();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetFillerSegregateSpanLengths();
 ABSL_ATTRIBUTE_WEAK uint64_t TCMalloc_Internal_GetHeapSizeHardLimit();
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetHPAASubrelease();
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetHugeCacheDeferredUnbackBytes();
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetHugeCacheWarmReserveBytes();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetHugePageCollapseEnabled();
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetLargeRunCacheBytes();
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetLazyPerCpuCachesEnabled();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMadviseFreeEnabled();
+ABSL_ATTRIBUTE_WEAK double
+TCMalloc_Internal_GetMemoryPressureReleaseThreshold();
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetPageRunCacheBytes();
 ABSL_ATTRIBUTE_WEAK double
 TCMalloc_Internal_GetPeakSamplingHeapGrowthFraction();
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesEnabled();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPopulateOnBackEnabled();
 ABSL_ATTRIBUTE_WEAK size_t TCMalloc_Internal_GetStats(char* buffer,
                                                       size_t buffer_length);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCgroupMemoryLimitFraction(
+    double v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetFillerAdaptivePartialRerelease(
+    bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetFillerSegregateSpanLengths(
+    bool v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetGuardedSamplingRate(int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHeapSizeHardLimit(uint64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHPAASubrelease(bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHugeCacheDeferredUnbackBytes(
+    int64_t v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHugeCacheWarmReserveBytes(
+    int64_t v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHugePageCollapseEnabled(bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetLargeRunCacheBytes(int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetLazyPerCpuCachesEnabled(bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMadviseFreeEnabled(bool v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMaxPerCpuCacheSize(int32_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMaxTotalThreadCacheBytes(int64_t v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMemoryPressureReleaseThreshold(
+    double v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPageRunCacheBytes(int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(
     double v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesEnabled(bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPopulateOnBackEnabled(bool v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProfileSamplingRate(int64_t v);
 ABSL_ATTRIBUTE_WEAK void
 TCMalloc_Internal_SetHugePageFillerSkipSubreleaseInterval(absl::Duration v);
+ABSL_ATTRIBUTE_WEAK void
+TCMalloc_Internal_SetHugePageFillerSkipSubreleaseMaxInterval(absl::Duration v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetThpCoverageSampleInterval(
+    absl::Duration v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetUnmapIdleAddressSpaceInterval(
+    absl::Duration v);
 }
 
 #endif  // TCMALLOC_INTERNAL_PARAMETER_ACCESSORS_H_
@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <climits>
 #include <limits>
 #include <type_traits>
@@ -70,6 +71,9 @@ class Bitmap {
   // Returns index of the first {true, false} bit >= index, or N if none.
   size_t FindSet(size_t index) const;
   size_t FindClear(size_t index) const;
+  // As above, but only looks below limit, returning limit if there is none.
+  size_t FindSet(size_t index, size_t limit) const;
+  size_t FindClear(size_t index, size_t limit) const;
 
   // Returns index of the first {set, clear} bit in [index, 0] or -1 if none.
   ssize_t FindSetBackwards(size_t index) const;
@@ -92,7 +96,7 @@ class Bitmap {
   void SetRangeValue(size_t index, size_t n);
 
   template <bool Goal>
-  size_t FindValue(size_t index) const;
+  size_t FindValue(size_t index, size_t limit) const;
   template <bool Goal>
   ssize_t FindValueBackwards(size_t index) const;
 };
@@ -100,11 +104,23 @@ class Bitmap {
 // Tracks allocations in a range of items of fixed size.  Supports
 // finding an unset range of a given length, while keeping track of
 // the largest remaining unmarked length.
+//
+// When N spans more than one block of kBlockBits, we also keep a summary tree
+// over the blocks (a complete binary tree, one leaf per block).  Each node
+// records the free prefix, suffix and longest free range of the bits below
+// it, and which power-of-two length classes its inner free ranges (those
+// bounded by marked bits on both sides within the node) fall into.  Best fit
+// then looks at the smallest class that can hold n bits, and only descends
+// into subtrees holding a range of that class, rather than scanning every
+// free range in the bitmap.  Marking or unmarking n bits re-summarizes
+// O(n / kBlockBits + log N) nodes.
 template <size_t N>
 class RangeTracker {
  public:
   constexpr RangeTracker()
-      : bits_{}, longest_free_(N), nused_(0), nallocs_(0) {}
+      : bits_{}, summary_{}, longest_free_(0), nused_(0), nallocs_(0) {
+    InitSummary();
+  }
 
   size_t size() const;
   // Number of bits marked
@@ -122,10 +138,28 @@ class RangeTracker {
   // Chooses by best fit.
   size_t FindAndMark(size_t n);
 
+  // REQUIRES: the range [index, index + n) is entirely clear.
+  // Marks it, counting it as one allocation.
+  void Mark(size_t index, size_t n);
+
   // REQUIRES: the range [index, index + n) is fully marked, and
   // was the returned value from a call to FindAndMark.
   // Unmarks it.
   void Unmark(size_t index, size_t n);
+
+  // Returns true if the range [index, index + n) is entirely clear.
+  bool IsFree(size_t index, size_t n) const;
+
+  // REQUIRES: the range [index, index + n) is entirely clear and directly
+  // follows a live allocation.
+  // Marks it as part of that allocation, leaving allocs() unchanged.
+  void Extend(size_t index, size_t n);
+
+  // REQUIRES: the range [index, index + n) is fully marked and is the tail of
+  // a live allocation starting before index.
+  // Unmarks it, leaving allocs() unchanged.
+  void Trim(size_t index, size_t n);
+
   // If there is at least one free range at or after <start>,
   // put it in *index, *length and return true; else return false.
   bool NextFreeRange(size_t start, size_t *index, size_t *length) const;
@@ -166,6 +200,70 @@ class RangeTracker {
   // we keep various stats in the range [0, N]; make them as small as possible.
   using Count = typename UnsignedTypeFittingSize::type;
 
+  static_assert(N <= std::numeric_limits<uint32_t>::max(),
+                "length classes must fit in a uint64_t");
+
+  // Free ranges within some span of bits: the one starting at its first bit,
+  // the one ending at its last, and the longest anywhere in it.  Bit c of
+  // classes is set if an inner free range has LengthClass c.
+  struct Summary {
+    Count prefix;
+    Count suffix;
+    Count longest;
+    uint64_t classes;
+  };
+
+  // A hugepage's worth of pages (the common use) fits in one block.  There we
+  // just scan the bitmap, and keep no summaries beyond longest_free_.
+  static constexpr size_t kBlockBits = 512;
+  static constexpr size_t kBlocks = (N + kBlockBits - 1) / kBlockBits;
+  static constexpr size_t RoundUpToPowerOf2(size_t n) {
+    size_t p = 1;
+    while (p < n) p *= 2;
+    return p;
+  }
+  // The tree is stored as an implicit heap: the root is node 0, node i has
+  // children 2i + 1 and 2i + 2, and block b is node kLeaves - 1 + b.  Leaves
+  // past the last block cover no bits.
+  static constexpr size_t kLeaves = RoundUpToPowerOf2(kBlocks);
+  static constexpr size_t kNodes = 2 * kLeaves - 1;
+
+  // First bit of block b, or N if there is no such block.
+  static constexpr size_t BlockStart(size_t b) {
+    return std::min(b * kBlockBits, N);
+  }
+  // Half-octaves: [1], [2], [3], [4, 5], [6, 7], [8, 11], [12, 15], ...
+  static size_t LengthClass(size_t len) {
+    const size_t log = Bitops::FindLastSet(len);
+    return log == 0 ? 0 : 2 * log + ((len >> (log - 1)) & 1);
+  }
+
+  // Sets every node as if all bits were clear.
+  constexpr void InitSummary();
+
+  // For a single block: a scan over all free ranges.
+  size_t ScanAndMark(size_t n);
+  void UpdateLongestAfterMark(size_t index, size_t n);
+  void UpdateLongestAfterUnmark(size_t index, size_t n);
+
+  static Summary Combine(const Summary &left, size_t left_len,
+                         const Summary &right, size_t right_len);
+  // Recomputes the nodes covering bits [index, index + n).
+  void Resummarize(size_t index, size_t n);
+  void SummarizeBlock(size_t b);
+
+  // Returns the index of the shortest (then lowest) free range of at least n
+  // bits, or N if there is none.
+  size_t SummaryBestFit(size_t n) const;
+  // Looks for a better fit among the inner ranges of length class c under
+  // node, which is the k-th at a level whose nodes span width blocks.  Stops
+  // looking once *best_len == n.
+  void BestFitInClass(size_t n, size_t c, size_t node, size_t k, size_t width,
+                      size_t *best_index, size_t *best_len) const;
+
+  struct NoSummaries {};
+  typename std::conditional<kBlocks == 1, NoSummaries, Summary[kNodes]>::type
+      summary_;
   Count longest_free_;
   Count nused_;
   Count nallocs_;
@@ -199,7 +297,21 @@ inline size_t RangeTracker<N>::allocs() const {
 template <size_t N>
 inline size_t RangeTracker<N>::FindAndMark(size_t n) {
   ASSERT(n > 0);
+  if constexpr (kBlocks == 1) {
+    return ScanAndMark(n);
+  } else {
+    const size_t index = SummaryBestFit(n);
+    CHECK_CONDITION(index < N);
+    bits_.SetRange(index, n);
+    Resummarize(index, n);
+    nused_ += n;
+    nallocs_++;
+    return index;
+  }
+}
 
+template <size_t N>
+inline size_t RangeTracker<N>::ScanAndMark(size_t n) {
   // We keep the two longest ranges in the bitmap since we might allocate
   // from one.
   size_t longest_len = 0;
@@ -242,15 +354,82 @@ inline size_t RangeTracker<N>::FindAndMark(size_t n) {
   return best_index;
 }
 
+// REQUIRES: the range [index, index + n) is entirely clear.
+// Marks it, counting it as one allocation.
+template <size_t N>
+inline void RangeTracker<N>::Mark(size_t index, size_t n) {
+  ASSERT(n > 0);
+  ASSERT(bits_.FindSet(index) >= index + n);
+  if constexpr (kBlocks == 1) {
+    UpdateLongestAfterMark(index, n);
+  } else {
+    bits_.SetRange(index, n);
+    Resummarize(index, n);
+  }
+  nused_ += n;
+  nallocs_++;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::UpdateLongestAfterMark(size_t index, size_t n) {
+  // The free range we are marking part of.
+  const size_t lim = bits_.FindSet(index + n - 1);
+  const size_t start = bits_.FindSetBackwards(index) + 1;
+
+  bits_.SetRange(index, n);
+
+  const size_t longest_free = longest_free_;
+  if (lim - start < longest_free) return;
+  // We split a longest free range; if there is another, that's still the
+  // longest.  Otherwise find the new one.
+  size_t longest_len = 0;
+  size_t i = 0, len;
+  while (bits_.NextFreeRange(i, &i, &len)) {
+    if (len == longest_free) return;
+    longest_len = std::max(longest_len, len);
+    i += len;
+  }
+  longest_free_ = longest_len;
+}
+
 // REQUIRES: the range [index, index + n) is fully marked.
 // Unmarks it.
 template <size_t N>
 inline void RangeTracker<N>::Unmark(size_t index, size_t n) {
   ASSERT(bits_.FindClear(index) >= index + n);
   bits_.ClearRange(index, n);
+  if constexpr (kBlocks == 1) {
+    UpdateLongestAfterUnmark(index, n);
+  } else {
+    Resummarize(index, n);
+  }
   nused_ -= n;
   nallocs_--;
+}
+
+template <size_t N>
+inline bool RangeTracker<N>::IsFree(size_t index, size_t n) const {
+  ASSERT(index + n <= N);
+  return bits_.FindSet(index, index + n) == index + n;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Extend(size_t index, size_t n) {
+  ASSERT(index > 0 && bits_.GetBit(index - 1));
+  Mark(index, n);
+  nallocs_--;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Trim(size_t index, size_t n) {
+  ASSERT(index > 0 && bits_.GetBit(index - 1));
+  Unmark(index, n);
+  nallocs_++;
+}
 
+template <size_t N>
+inline void RangeTracker<N>::UpdateLongestAfterUnmark(size_t index,
+                                                      size_t n) {
   // We just opened up a new free range--it might be the longest.
   size_t lim = bits_.FindSet(index + n - 1);
   index = bits_.FindSetBackwards(index) + 1;
@@ -271,9 +450,172 @@ inline bool RangeTracker<N>::NextFreeRange(size_t start, size_t *index,
 template <size_t N>
 inline void RangeTracker<N>::Clear() {
   bits_.Clear();
+  InitSummary();
   nallocs_ = 0;
   nused_ = 0;
+}
+
+template <size_t N>
+constexpr void RangeTracker<N>::InitSummary() {
   longest_free_ = N;
+  if constexpr (kBlocks > 1) {
+    size_t first = 0;
+    for (size_t width = kLeaves; width > 0; width /= 2) {
+      const size_t nodes = kLeaves / width;
+      for (size_t k = 0; k < nodes; ++k) {
+        const Count len = BlockStart((k + 1) * width) - BlockStart(k * width);
+        summary_[first + k] = {len, len, len, 0};
+      }
+      first += nodes;
+    }
+  }
+}
+
+template <size_t N>
+inline typename RangeTracker<N>::Summary RangeTracker<N>::Combine(
+    const Summary &left, size_t left_len, const Summary &right,
+    size_t right_len) {
+  Summary s;
+  s.prefix = left.prefix == left_len ? left_len + right.prefix : left.prefix;
+  s.suffix =
+      right.suffix == right_len ? right_len + left.suffix : right.suffix;
+  const size_t middle = size_t{left.suffix} + right.prefix;
+  s.longest = std::max<size_t>({left.longest, right.longest, middle});
+  s.classes = left.classes | right.classes;
+  // The range around the midpoint is inner to us unless it reaches an edge.
+  if (middle > 0 && left.suffix < left_len && right.prefix < right_len) {
+    s.classes |= uint64_t{1} << LengthClass(middle);
+  }
+  return s;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Resummarize(size_t index, size_t n) {
+  ASSERT(n > 0);
+  size_t lo = index / kBlockBits;
+  size_t hi = (index + n - 1) / kBlockBits;
+  for (size_t b = lo; b <= hi; ++b) {
+    SummarizeBlock(b);
+  }
+
+  size_t first = kLeaves - 1;
+  for (size_t width = 2; width <= kLeaves; width *= 2) {
+    lo /= 2;
+    hi /= 2;
+    first = (first - 1) / 2;
+    for (size_t k = lo; k <= hi; ++k) {
+      const size_t begin = BlockStart(k * width);
+      const size_t mid = BlockStart(k * width + width / 2);
+      const size_t end = BlockStart((k + 1) * width);
+      const size_t node = first + k;
+      summary_[node] = Combine(summary_[2 * node + 1], mid - begin,
+                               summary_[2 * node + 2], end - mid);
+    }
+  }
+  longest_free_ = summary_[0].longest;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::SummarizeBlock(size_t b) {
+  const size_t begin = BlockStart(b);
+  const size_t end = BlockStart(b + 1);
+  Summary &s = summary_[kLeaves - 1 + b];
+  const size_t first = bits_.FindSet(begin, end);
+  if (first == end) {
+    const Count len = end - begin;
+    s = {len, len, len, 0};
+    return;
+  }
+  const size_t last = bits_.FindSetBackwards(end - 1);
+  size_t longest = std::max(first - begin, end - 1 - last);
+  uint64_t classes = 0;
+  size_t i = first;
+  while (i < last && (i = bits_.FindClear(i, last)) < last) {
+    // Bit last is set, so this range ends before it.
+    const size_t j = bits_.FindSet(i, last);
+    longest = std::max(longest, j - i);
+    classes |= uint64_t{1} << LengthClass(j - i);
+    i = j;
+  }
+  s.prefix = first - begin;
+  s.suffix = end - 1 - last;
+  s.longest = longest;
+  s.classes = classes;
+}
+
+template <size_t N>
+inline size_t RangeTracker<N>::SummaryBestFit(size_t n) const {
+  const Summary &root = summary_[0];
+  // The ranges at either end of the bitmap aren't inner to anything.
+  uint64_t classes = root.classes;
+  if (root.prefix > 0) classes |= uint64_t{1} << LengthClass(root.prefix);
+  if (root.suffix > 0) classes |= uint64_t{1} << LengthClass(root.suffix);
+  // Ranges in n's class may be too short; in any larger class, they all fit
+  // and the first class we find has the best.
+  classes &= ~uint64_t{0} << LengthClass(n);
+
+  size_t best_index = N;
+  size_t best_len = N + 1;
+  while (classes != 0 && best_index == N) {
+    const size_t c = Bitops::FindFirstSet(classes);
+    classes &= classes - 1;
+    // In address order, so that ties go to the lowest.
+    if (root.prefix >= n && LengthClass(root.prefix) == c) {
+      best_index = 0;
+      best_len = root.prefix;
+    }
+    BestFitInClass(n, c, 0, 0, kLeaves, &best_index, &best_len);
+    if (root.suffix >= n && root.suffix < best_len &&
+        LengthClass(root.suffix) == c) {
+      best_index = N - root.suffix;
+      best_len = root.suffix;
+    }
+  }
+  return best_index;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::BestFitInClass(size_t n, size_t c, size_t node,
+                                            size_t k, size_t width,
+                                            size_t *best_index,
+                                            size_t *best_len) const {
+  if (!(summary_[node].classes & (uint64_t{1} << c)) || *best_len == n) {
+    return;
+  }
+  const size_t begin = BlockStart(k * width);
+  const size_t end = BlockStart((k + 1) * width);
+  if (width == 1) {
+    // Ranges touching either end of the block aren't inner to it.
+    size_t i = bits_.FindSet(begin, end);
+    while (i < end && (i = bits_.FindClear(i, end)) < end) {
+      const size_t j = bits_.FindSet(i, end);
+      if (j == end) return;
+      const size_t len = j - i;
+      if (len >= n && len < *best_len && LengthClass(len) == c) {
+        *best_index = i;
+        *best_len = len;
+        if (len == n) return;
+      }
+      i = j;
+    }
+    return;
+  }
+
+  // In address order: the left half, the range around the midpoint, then the
+  // right half.
+  const size_t left = 2 * node + 1;
+  const size_t right = left + 1;
+  BestFitInClass(n, c, left, 2 * k, width / 2, best_index, best_len);
+  const size_t mid = BlockStart(k * width + width / 2);
+  const size_t start = mid - summary_[left].suffix;
+  const size_t limit = mid + summary_[right].prefix;
+  const size_t len = limit - start;
+  if (start > begin && limit < end && len >= n && len < *best_len &&
+      LengthClass(len) == c) {
+    *best_index = start;
+    *best_len = len;
+  }
+  BestFitInClass(n, c, right, 2 * k + 1, width / 2, best_index, best_len);
 }
 
 // Count the set bits [from, to) in the i-th word to Value.
@@ -449,12 +791,22 @@ inline bool Bitmap<N>::NextFreeRange(size_t start, size_t *index,
 
 template <size_t N>
 inline size_t Bitmap<N>::FindSet(size_t index) const {
-  return FindValue<true>(index);
+  return FindValue<true>(index, N);
 }
 
 template <size_t N>
 inline size_t Bitmap<N>::FindClear(size_t index) const {
-  return FindValue<false>(index);
+  return FindValue<false>(index, N);
+}
+
+template <size_t N>
+inline size_t Bitmap<N>::FindSet(size_t index, size_t limit) const {
+  return FindValue<true>(index, limit);
+}
+
+template <size_t N>
+inline size_t Bitmap<N>::FindClear(size_t index, size_t limit) const {
+  return FindValue<false>(index, limit);
 }
 
 template <size_t N>
@@ -476,18 +828,20 @@ inline void Bitmap<N>::Clear() {
 
 template <size_t N>
 template <bool Goal>
-inline size_t Bitmap<N>::FindValue(size_t index) const {
+inline size_t Bitmap<N>::FindValue(size_t index, size_t limit) const {
+  ASSERT(limit <= N);
+  if (index >= limit) return limit;
   size_t offset = index % kWordSize;
   size_t word = index / kWordSize;
-  ASSERT(word < kWords);
+  const size_t last_word = (limit - 1) / kWordSize;
   size_t here = bits_[word];
   if (!Goal) here = ~here;
   size_t mask = ~static_cast<size_t>(0) << offset;
   here &= mask;
   while (here == 0) {
     ++word;
-    if (word >= kWords) {
-      return N;
+    if (word > last_word) {
+      return limit;
     }
     here = bits_[word];
     if (!Goal) here = ~here;
@@ -495,9 +849,7 @@ inline size_t Bitmap<N>::FindValue(size_t index) const {
 
   word *= kWordSize;
   size_t ret = Bitops::FindFirstSet(here) + word;
-  if (kDeadBits > 0) {
-    if (ret > N) ret = N;
-  }
+  if (ret > limit) ret = limit;
   return ret;
 }
 
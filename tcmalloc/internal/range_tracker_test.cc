@@ -20,8 +20,10 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "benchmark/benchmark.h"
 #include "absl/base/attributes.h"
 #include "absl/container/fixed_array.h"
+#include "absl/memory/memory.h"
 #include "absl/random/distributions.h"
 #include "absl/random/random.h"
 
@@ -160,6 +162,18 @@ TEST_F(BitmapTest, FindClear) {
               ElementsAre(252, 251, 196, 195, 128, 63, 15, 14, 7, 0));
 }
 
+TEST_F(BitmapTest, FindWithLimit) {
+  Bitmap<253> map;
+  map.SetRange(70, 60);
+  EXPECT_EQ(70, map.FindSet(0, 100));
+  EXPECT_EQ(65, map.FindSet(0, 65));
+  EXPECT_EQ(64, map.FindSet(64, 64));
+  EXPECT_EQ(130, map.FindClear(70, 200));
+  EXPECT_EQ(128, map.FindClear(70, 128));
+  EXPECT_EQ(253, map.FindSet(130, 253));
+  EXPECT_EQ(5, map.FindClear(5, 6));
+}
+
 TEST_F(BitmapTest, CountBits) {
   Bitmap<253> map;
   map.SetRange(0, 253);
@@ -265,5 +279,217 @@ TEST_F(RangeTrackerTest, Trivial) {
   EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 300)));
 }
 
+TEST_F(RangeTrackerTest, Mark) {
+  range_.Mark(100, 50);
+  EXPECT_EQ(50, range_.used());
+  EXPECT_EQ(1, range_.allocs());
+  EXPECT_EQ(kBits - 150, range_.longest_free());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 100), Pair(150, kBits - 150)));
+  // Not the longest range.
+  range_.Mark(0, 10);
+  EXPECT_EQ(kBits - 150, range_.longest_free());
+  // Splits the longest range.
+  range_.Mark(500, 1);
+  EXPECT_EQ(kBits - 501, range_.longest_free());
+  EXPECT_EQ(3, range_.allocs());
+
+  range_.Unmark(500, 1);
+  range_.Unmark(100, 50);
+  range_.Unmark(0, 10);
+  EXPECT_EQ(0, range_.used());
+  EXPECT_EQ(kBits, range_.longest_free());
+}
+
+// The best fit search RangeTracker used to make: a scan of every free range.
+template <size_t N>
+size_t ScanBestFit(const Bitmap<N> &bits, size_t n) {
+  size_t best_index = N;
+  size_t best_len = N + 1;
+  size_t index = 0, len;
+  while (bits.NextFreeRange(index, &index, &len)) {
+    if (len >= n && len < best_len) {
+      best_index = index;
+      best_len = len;
+    }
+    index += len;
+  }
+  return best_index;
+}
+
+template <size_t N>
+size_t ScanLongestFree(const Bitmap<N> &bits) {
+  size_t longest = 0;
+  size_t index = 0, len;
+  while (bits.NextFreeRange(index, &index, &len)) {
+    longest = std::max(longest, len);
+    index += len;
+  }
+  return longest;
+}
+
+// Runs random FindAndMark, Mark and Unmark calls against a RangeTracker and a
+// plain Bitmap, checking that the summary tree leads to the same choices.
+template <size_t N>
+void CheckAgainstScan(size_t max_len, int iters) {
+  absl::BitGen rng;
+  auto range = absl::make_unique<RangeTracker<N>>();
+  auto bits = absl::make_unique<Bitmap<N>>();
+  std::vector<std::pair<size_t, size_t>> allocs;
+  for (int i = 0; i < iters; ++i) {
+    const size_t n =
+        absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, max_len);
+    const double p = absl::Uniform(rng, 0.0, 1.0);
+    if (p < 0.5 && n <= range->longest_free()) {
+      const size_t index = range->FindAndMark(n);
+      ASSERT_EQ(ScanBestFit(*bits, n), index) << i;
+      bits->SetRange(index, n);
+      allocs.push_back({index, n});
+    } else if (p < 0.6) {
+      // Mark part of whatever free range comes next.
+      size_t index = absl::Uniform<size_t>(rng, 0, N), len;
+      if (!bits->NextFreeRange(index, &index, &len)) continue;
+      index += absl::Uniform<size_t>(rng, 0, len);
+      len = std::min(n, bits->FindSet(index) - index);
+      range->Mark(index, len);
+      bits->SetRange(index, len);
+      allocs.push_back({index, len});
+    } else if (!allocs.empty()) {
+      const size_t k = absl::Uniform<size_t>(rng, 0, allocs.size());
+      std::swap(allocs[k], allocs.back());
+      range->Unmark(allocs.back().first, allocs.back().second);
+      bits->ClearRange(allocs.back().first, allocs.back().second);
+      allocs.pop_back();
+    }
+    ASSERT_EQ(ScanLongestFree(*bits), range->longest_free()) << i;
+  }
+  EXPECT_EQ(allocs.size(), range->allocs());
+  for (const auto &a : allocs) range->Unmark(a.first, a.second);
+  EXPECT_EQ(N, range->longest_free());
+  EXPECT_EQ(0, range->used());
+}
+
+TEST_F(RangeTrackerTest, ExtendAndTrim) {
+  range_.Mark(100, 50);
+  range_.Mark(200, 10);
+  EXPECT_TRUE(range_.IsFree(150, 50));
+  EXPECT_FALSE(range_.IsFree(150, 51));
+
+  // Growing and shrinking an allocation doesn't count as another one.
+  range_.Extend(150, 50);
+  EXPECT_EQ(110, range_.used());
+  EXPECT_EQ(2, range_.allocs());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 100), Pair(210, kBits - 210)));
+  range_.Trim(120, 80);
+  EXPECT_EQ(30, range_.used());
+  EXPECT_EQ(2, range_.allocs());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 100), Pair(120, 80),
+                                        Pair(210, kBits - 210)));
+
+  range_.Unmark(100, 20);
+  range_.Unmark(200, 10);
+  EXPECT_EQ(0, range_.allocs());
+  EXPECT_EQ(kBits, range_.longest_free());
+}
+
+TEST(RangeTrackerSummaryTest, OneBlock) {
+  CheckAgainstScan<256>(64, 20000);
+  // Every PageTracker carries one of these; it has no room for summaries.
+  EXPECT_LE(sizeof(RangeTracker<256>),
+            sizeof(Bitmap<256>) + 4 * sizeof(uint16_t));
+}
+
+TEST(RangeTrackerSummaryTest, PartialBlocks) {
+  CheckAgainstScan<1017>(300, 20000);
+  // Ranges spanning several blocks, and leaves past the last block.
+  CheckAgainstScan<5000>(1200, 20000);
+}
+
+TEST(RangeTrackerSummaryTest, HugeRegionSized) {
+  CheckAgainstScan<131072>(2048, 5000);
+}
+
+// Fills the range with random lengths up to max_len, then frees every other
+// one, leaving roughly N / max_len free ranges.  Returns what is still marked.
+template <size_t N>
+std::vector<std::pair<size_t, size_t>> Fragment(RangeTracker<N> *range,
+                                                size_t max_len,
+                                                absl::BitGen &rng) {
+  std::vector<std::pair<size_t, size_t>> allocs;
+  while (true) {
+    const size_t n =
+        absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, max_len);
+    if (n > range->longest_free()) break;
+    allocs.push_back({range->FindAndMark(n), n});
+  }
+  std::vector<std::pair<size_t, size_t>> kept;
+  for (size_t i = 0; i < allocs.size(); ++i) {
+    if (i % 2 == 0) {
+      range->Unmark(allocs[i].first, allocs[i].second);
+    } else {
+      kept.push_back(allocs[i]);
+    }
+  }
+  return kept;
+}
+
+template <size_t N>
+std::vector<size_t> RandomLengths(size_t max_len, absl::BitGen &rng) {
+  std::vector<size_t> lengths(4096);
+  for (size_t &n : lengths) {
+    n = absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, max_len);
+  }
+  return lengths;
+}
+
+template <size_t N, size_t kMaxLen>
+void BM_FindAndMark(benchmark::State &state) {
+  absl::BitGen rng;
+  auto range = absl::make_unique<RangeTracker<N>>();
+  Fragment(range.get(), kMaxLen, rng);
+  const std::vector<size_t> lengths = RandomLengths<N>(kMaxLen, rng);
+
+  size_t i = 0;
+  for (auto _ : state) {
+    const size_t n = lengths[i++ % lengths.size()];
+    if (n > range->longest_free()) continue;
+    const size_t index = range->FindAndMark(n);
+    range->Unmark(index, n);
+  }
+}
+
+// The same, as RangeTracker did it before it kept a summary: a scan of all
+// free ranges to find the best fit, and another to find the longest.
+template <size_t N, size_t kMaxLen>
+void BM_FindAndMarkScan(benchmark::State &state) {
+  absl::BitGen rng;
+  auto range = absl::make_unique<RangeTracker<N>>();
+  auto bits = absl::make_unique<Bitmap<N>>();
+  for (const auto &a : Fragment(range.get(), kMaxLen, rng)) {
+    bits->SetRange(a.first, a.second);
+  }
+  const std::vector<size_t> lengths = RandomLengths<N>(kMaxLen, rng);
+
+  size_t i = 0;
+  for (auto _ : state) {
+    const size_t n = lengths[i++ % lengths.size()];
+    const size_t index = ScanBestFit(*bits, n);
+    if (index == N) continue;
+    bits->SetRange(index, n);
+    bits->ClearRange(index, n);
+    // As Unmark did, to see whether we opened a new longest range.
+    benchmark::DoNotOptimize(bits->FindSet(index + n - 1));
+    benchmark::DoNotOptimize(bits->FindSetBackwards(index));
+  }
+}
+
+// A hugepage of 8 KiB pages, as in HugePageFiller, and a 1 GiB HugeRegion
+// cut up into many short free ranges or fewer longer ones.
+BENCHMARK_TEMPLATE(BM_FindAndMark, 256, 32);
+BENCHMARK_TEMPLATE(BM_FindAndMarkScan, 256, 32);
+BENCHMARK_TEMPLATE(BM_FindAndMark, 131072, 512);
+BENCHMARK_TEMPLATE(BM_FindAndMarkScan, 131072, 512);
+BENCHMARK_TEMPLATE(BM_FindAndMark, 131072, 4096);
+BENCHMARK_TEMPLATE(BM_FindAndMarkScan, 131072, 4096);
+
 }  // namespace
 }  // namespace tcmalloc
@@ -84,6 +84,10 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ReleaseMemoryToSystem(
     size_t bytes);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMemoryLimit(
     const tcmalloc::MallocExtension::MemoryLimit* limit);
+ABSL_ATTRIBUTE_WEAK bool MallocExtension_Internal_AddMemoryPressureCallback(
+    tcmalloc::MallocExtension::MemoryPressureCallback callback);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_RemoveMemoryPressureCallback(
+    tcmalloc::MallocExtension::MemoryPressureCallback callback);
 
 ABSL_ATTRIBUTE_WEAK size_t
 MallocExtension_Internal_GetAllocatedSize(const void* ptr);
@@ -0,0 +1,159 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/large_run_cache.h"
+
+#include "tcmalloc/parameters.h"
+
+namespace tcmalloc {
+
+LargeRunCache::LargeRunCache(ClockFunc clock) : clock_(clock) {
+  for (Bucket& b : buckets_) {
+    b.spans.Init();
+    b.length = 0;
+    b.pages = 0;
+    b.hits = 0;
+    b.misses = 0;
+    b.evicted_pages = 0;
+  }
+}
+
+Span* LargeRunCache::Get(Length n) {
+  if (n > kMaxHugePages.in_pages() || cached_bytes() == 0) return nullptr;
+
+  Bucket& b = buckets_[BucketIndex(n)];
+  Span* span = nullptr;
+  {
+    absl::base_internal::SpinLockHolder h(&b.lock);
+    if (b.length == 0) return nullptr;
+    for (Span* s : b.spans) {
+      if (s->num_pages() == n) {
+        span = s;
+        break;
+      }
+    }
+    if (span == nullptr) {
+      b.misses++;
+      return nullptr;
+    }
+    b.spans.remove(span);
+    b.length--;
+    b.pages -= n;
+    b.hits++;
+  }
+  cached_bytes_.fetch_sub(n * kPageSize, std::memory_order_relaxed);
+
+  span->Init(span->first_page(), n);
+  return span;
+}
+
+bool LargeRunCache::Put(Span* span) {
+  const Length n = span->num_pages();
+  if (n > kMaxHugePages.in_pages()) return false;
+  if (span->first_page().index() % kPagesPerHugePage != 0) return false;
+  const int64_t limit = Parameters::large_run_cache_bytes();
+  if (limit <= 0) return false;
+
+  const size_t bytes = n * kPageSize;
+  if (cached_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes >
+      static_cast<size_t>(limit)) {
+    cached_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    overflows_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  Bucket& b = buckets_[BucketIndex(n)];
+  span->set_freelist_added_time(clock_());
+  absl::base_internal::SpinLockHolder h(&b.lock);
+  b.spans.prepend(span);
+  b.length++;
+  b.pages += n;
+  return true;
+}
+
+Span* LargeRunCache::PopIfOlder(Bucket* b, int64_t cutoff) {
+  Span* span;
+  {
+    absl::base_internal::SpinLockHolder h(&b->lock);
+    if (b->length == 0) return nullptr;
+    span = b->spans.last();
+    if (static_cast<int64_t>(span->freelist_added_time()) > cutoff) {
+      return nullptr;
+    }
+    b->spans.remove(span);
+    b->length--;
+    b->pages -= span->num_pages();
+    b->evicted_pages += span->num_pages();
+  }
+  cached_bytes_.fetch_sub(span->num_pages() * kPageSize,
+                          std::memory_order_relaxed);
+  return span;
+}
+
+void LargeRunCache::AddSpanStats(LargeSpanStats* result) const {
+  for (const Bucket& b : buckets_) {
+    absl::base_internal::SpinLockHolder h(&b.lock);
+    result->spans += b.length;
+    result->normal_pages += b.pages;
+  }
+}
+
+void LargeRunCache::Print(TCMalloc_Printer* out) const {
+  size_t spans = 0;
+  Length pages = 0, evicted = 0;
+  int64_t hits = 0, misses = 0;
+  for (const Bucket& b : buckets_) {
+    absl::base_internal::SpinLockHolder h(&b.lock);
+    spans += b.length;
+    pages += b.pages;
+    evicted += b.evicted_pages;
+    hits += b.hits;
+    misses += b.misses;
+  }
+  out->printf(
+      "LargeRunCache: %zu spans (%.1f MiB) cached; %lld hits, %lld misses, "
+      "%lld overflows, %.1f MiB evicted\n",
+      spans, pages * kPageSize / 1048576.0, static_cast<long long>(hits),
+      static_cast<long long>(misses),
+      static_cast<long long>(overflows_.load(std::memory_order_relaxed)),
+      evicted * kPageSize / 1048576.0);
+  for (size_t i = 0; i < kMaxHugePages.raw_num(); ++i) {
+    const Bucket& b = buckets_[i];
+    absl::base_internal::SpinLockHolder h(&b.lock);
+    if (b.length == 0 && b.hits == 0) continue;
+    out->printf(
+        "LargeRunCache: %3zu hugepages: %zu spans, %lld hits, %lld misses\n",
+        i + 1, b.length, static_cast<long long>(b.hits),
+        static_cast<long long>(b.misses));
+  }
+}
+
+void LargeRunCache::PrintInPbtxt(PbtxtRegion* region) const {
+  auto cache = region->CreateSubRegion("large_run_cache");
+  cache.PrintI64("cached_bytes", cached_bytes());
+  cache.PrintI64("overflows", overflows_.load(std::memory_order_relaxed));
+  for (size_t i = 0; i < kMaxHugePages.raw_num(); ++i) {
+    const Bucket& b = buckets_[i];
+    absl::base_internal::SpinLockHolder h(&b.lock);
+    if (b.length == 0 && b.hits == 0) continue;
+    auto bucket = cache.CreateSubRegion("bucket");
+    bucket.PrintI64("huge_pages", i + 1);
+    bucket.PrintI64("spans", b.length);
+    bucket.PrintI64("hits", b.hits);
+    bucket.PrintI64("misses", b.misses);
+    bucket.PrintI64("evicted_bytes", b.evicted_pages * kPageSize);
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,126 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_LARGE_RUN_CACHE_H_
+#define TCMALLOC_LARGE_RUN_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/timeseries_tracker.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/stats.h"
+
+namespace tcmalloc {
+
+// Keeps recently freed, hugepage-aligned large spans (up to 64 MiB) whole and
+// backed, so that a program cycling through multi-MiB buffers can get the
+// same ranges back without going through pageheap_lock, huge_cache_lock or
+// any HugeRegion/HugeCache bookkeeping.
+//
+// Spans are bucketed by their length in hugepages, each bucket with its own
+// lock; a span is only handed out for a request of exactly its length.  As
+// with PageRunCache, cached spans remain allocated from the page heap's point
+// of view.  The total is bounded by Parameters::large_run_cache_bytes(), and
+// Evict() hands back spans that have sat in the cache for too long.
+class LargeRunCache {
+ public:
+  // Longest span we cache.
+  static constexpr HugeLength kMaxHugePages =
+      NHugePages((size_t{64} << 20) / kHugePageSize);
+  // Evict() takes anything cached longer than this, by default.
+  static constexpr absl::Duration kMaxAge = absl::Seconds(1);
+
+  explicit LargeRunCache(ClockFunc clock = GetCurrentTimeNanos);
+
+  // Returns a cached span of exactly n pages, reinitialized as a fresh
+  // allocation, or nullptr.
+  Span* Get(Length n);
+
+  // Takes ownership of span if it is hugepage-aligned, no longer than
+  // kMaxHugePages, and fits in our budget.  Returns false (leaving span to
+  // the caller) otherwise.  May be called with or without pageheap_lock.
+  bool Put(Span* span);
+
+  // Removes spans cached for at least max_age (all of them, if zero), passing
+  // each to release(span).  No lock of ours is held while release runs.
+  // Returns the number of pages removed.
+  template <typename Release>
+  Length Evict(absl::Duration max_age, Release release);
+
+  size_t cached_bytes() const {
+    return cached_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Adds the cached spans to *result, as backed free spans.
+  void AddSpanStats(LargeSpanStats* result) const;
+
+  void Print(TCMalloc_Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  struct Bucket {
+    Bucket()
+        : lock(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+    mutable absl::base_internal::SpinLock lock;
+    // Most recently freed first.
+    SpanList spans;
+    size_t length;
+    Length pages;
+    int64_t hits;
+    // Lookups that found spans of this many hugepages, but none of our length.
+    int64_t misses;
+    int64_t evicted_pages;
+  };
+
+  static size_t BucketIndex(Length n) { return HLFromPages(n).raw_num() - 1; }
+
+  // Removes the oldest span in b if it was cached at or before cutoff.
+  Span* PopIfOlder(Bucket* b, int64_t cutoff);
+
+  ClockFunc clock_;
+  Bucket buckets_[kMaxHugePages.raw_num()];
+  std::atomic<size_t> cached_bytes_{0};
+  // Puts refused for want of budget.
+  std::atomic<int64_t> overflows_{0};
+};
+
+template <typename Release>
+Length LargeRunCache::Evict(absl::Duration max_age, Release release) {
+  if (cached_bytes() == 0) return 0;
+
+  const int64_t cutoff = clock_() - absl::ToInt64Nanoseconds(max_age);
+  Length evicted = 0;
+  for (Bucket& b : buckets_) {
+    // Drop the bucket lock before release, which may drop and retake
+    // pageheap_lock; Put may run with pageheap_lock already held.
+    while (Span* span = PopIfOlder(&b, cutoff)) {
+      evicted += span->num_pages();
+      release(span);
+    }
+  }
+  return evicted;
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_LARGE_RUN_CACHE_H_
@@ -0,0 +1,199 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/large_run_cache.h"
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/memory/memory.h"
+#include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/stats.h"
+
+namespace tcmalloc {
+namespace {
+
+class LargeRunCacheTest : public testing::Test {
+ protected:
+  static constexpr size_t kBudget = 8 * kHugePageSize;
+
+  LargeRunCacheTest() : cache_(absl::make_unique<LargeRunCache>(FakeClock)) {
+    Static::InitIfNecessary();
+    clock_ = 1234;
+    before_ = Parameters::large_run_cache_bytes();
+    Parameters::set_large_run_cache_bytes(kBudget);
+  }
+
+  ~LargeRunCacheTest() override {
+    Parameters::set_large_run_cache_bytes(before_);
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (Span* s : spans_) Span::Delete(s);
+  }
+
+  static int64_t FakeClock() { return clock_; }
+  static void Advance(absl::Duration d) {
+    clock_ += absl::ToInt64Nanoseconds(d);
+  }
+
+  // The cache never looks at the pages themselves, so they needn't exist.
+  // Each span starts on its own hugepage.
+  Span* NewSpan(Length n) {
+    Span* s;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      s = Span::New(next_.first_page(), n);
+    }
+    next_ += HLFromPages(n) + NHugePages(1);
+    spans_.push_back(s);
+    return s;
+  }
+
+  Length EvictAll() {
+    return cache_->Evict(absl::ZeroDuration(), [](Span*) {});
+  }
+
+  static int64_t clock_;
+  std::unique_ptr<LargeRunCache> cache_;
+  int64_t before_;
+  HugePage next_{HugePage{1 << 10}};
+  std::vector<Span*> spans_;
+};
+
+int64_t LargeRunCacheTest::clock_;
+
+TEST_F(LargeRunCacheTest, ExactLengthsOnly) {
+  const Length n = kPagesPerHugePage + 1;
+  Span* s = NewSpan(n);
+  ASSERT_TRUE(cache_->Put(s));
+  EXPECT_EQ(n * kPageSize, cache_->cached_bytes());
+
+  // Same bucket, different length.
+  EXPECT_EQ(nullptr, cache_->Get(n + 1));
+  EXPECT_EQ(nullptr, cache_->Get(2 * kPagesPerHugePage));
+  Span* t = cache_->Get(n);
+  ASSERT_EQ(s, t);
+  EXPECT_EQ(n, t->num_pages());
+  EXPECT_EQ(Span::IN_USE, t->location());
+  EXPECT_EQ(nullptr, cache_->Get(n));
+  EXPECT_EQ(0, cache_->cached_bytes());
+
+  // Several of the same length come back most recent first.
+  Span* a = NewSpan(3 * kPagesPerHugePage);
+  Span* b = NewSpan(3 * kPagesPerHugePage);
+  ASSERT_TRUE(cache_->Put(a));
+  ASSERT_TRUE(cache_->Put(b));
+  EXPECT_EQ(b, cache_->Get(3 * kPagesPerHugePage));
+  EXPECT_EQ(a, cache_->Get(3 * kPagesPerHugePage));
+}
+
+TEST_F(LargeRunCacheTest, Refuses) {
+  // Not hugepage-aligned.
+  Span* s = NewSpan(kPagesPerHugePage);
+  s->set_first_page(s->first_page() + 1);
+  EXPECT_FALSE(cache_->Put(s));
+
+  // Too long.
+  EXPECT_FALSE(cache_->Put(NewSpan((LargeRunCache::kMaxHugePages +
+                                    NHugePages(1))
+                                       .in_pages())));
+
+  // Over budget: eight hugepages fit, but not a ninth.
+  ASSERT_TRUE(cache_->Put(NewSpan(5 * kPagesPerHugePage)));
+  ASSERT_TRUE(cache_->Put(NewSpan(3 * kPagesPerHugePage)));
+  EXPECT_FALSE(cache_->Put(NewSpan(1 * kPagesPerHugePage)));
+  EXPECT_EQ(kBudget, cache_->cached_bytes());
+
+  // Disabled.
+  EXPECT_NE(nullptr, cache_->Get(3 * kPagesPerHugePage));
+  Parameters::set_large_run_cache_bytes(0);
+  EXPECT_FALSE(cache_->Put(NewSpan(1 * kPagesPerHugePage)));
+  EXPECT_EQ(5 * kPagesPerHugePage, EvictAll());
+}
+
+TEST_F(LargeRunCacheTest, EvictsByAge) {
+  std::vector<Span*> evicted;
+  auto release = [&](Span* s) { evicted.push_back(s); };
+
+  Span* old1 = NewSpan(2 * kPagesPerHugePage);
+  Span* old2 = NewSpan(2 * kPagesPerHugePage);
+  Span* other = NewSpan(kPagesPerHugePage);
+  ASSERT_TRUE(cache_->Put(old1));
+  ASSERT_TRUE(cache_->Put(old2));
+  ASSERT_TRUE(cache_->Put(other));
+  Advance(absl::Milliseconds(600));
+  Span* young = NewSpan(2 * kPagesPerHugePage);
+  ASSERT_TRUE(cache_->Put(young));
+  Advance(absl::Milliseconds(600));
+
+  EXPECT_EQ(5 * kPagesPerHugePage,
+            cache_->Evict(LargeRunCache::kMaxAge, release));
+  EXPECT_THAT(evicted, testing::UnorderedElementsAre(old1, old2, other));
+  EXPECT_EQ(young, cache_->Get(2 * kPagesPerHugePage));
+  EXPECT_EQ(0, cache_->cached_bytes());
+  EXPECT_EQ(0, cache_->Evict(absl::ZeroDuration(), release));
+}
+
+TEST_F(LargeRunCacheTest, Stats) {
+  ASSERT_TRUE(cache_->Put(NewSpan(2 * kPagesPerHugePage)));
+  ASSERT_TRUE(cache_->Put(NewSpan(2 * kPagesPerHugePage + 3)));
+  EXPECT_NE(nullptr, cache_->Get(2 * kPagesPerHugePage + 3));
+  EXPECT_EQ(nullptr, cache_->Get(2 * kPagesPerHugePage - 1));
+
+  LargeSpanStats large;
+  memset(&large, 0, sizeof(large));
+  cache_->AddSpanStats(&large);
+  EXPECT_EQ(1, large.spans);
+  EXPECT_EQ(2 * kPagesPerHugePage, large.normal_pages);
+  EXPECT_EQ(0, large.returned_pages);
+
+  std::string buffer(1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    cache_->Print(&printer);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("LargeRunCache: 1 spans ("));
+  EXPECT_THAT(buffer, testing::HasSubstr("1 hits, 1 misses, 0 overflows"));
+  EXPECT_THAT(buffer, testing::HasSubstr("LargeRunCache:   2 hugepages: "
+                                         "1 spans, 0 hits, 1 misses"));
+  EXPECT_THAT(buffer, testing::HasSubstr("LargeRunCache:   3 hugepages: "
+                                         "0 spans, 1 hits, 0 misses"));
+
+  buffer.assign(1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    PbtxtRegion top(&printer, kTop, /*indent=*/0);
+    cache_->PrintInPbtxt(&top);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("huge_pages: 2"));
+  EXPECT_THAT(buffer, testing::HasSubstr("hits: 1"));
+
+  EXPECT_EQ(2 * kPagesPerHugePage, EvictAll());
+}
+
+}  // namespace
+}  // namespace tcmalloc
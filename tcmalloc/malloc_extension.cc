@@ -225,6 +225,25 @@ void MallocExtension::SetMemoryLimit(
 #endif
 }
 
+bool MallocExtension::AddMemoryPressureCallback(
+    MemoryPressureCallback callback) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_AddMemoryPressureCallback != nullptr) {
+    return MallocExtension_Internal_AddMemoryPressureCallback(callback);
+  }
+#endif
+  return false;
+}
+
+void MallocExtension::RemoveMemoryPressureCallback(
+    MemoryPressureCallback callback) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_RemoveMemoryPressureCallback != nullptr) {
+    MallocExtension_Internal_RemoveMemoryPressureCallback(callback);
+  }
+#endif
+}
+
 int64_t MallocExtension::GetProfileSamplingRate() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_GetProfileSamplingRate != nullptr) {
@@ -436,3 +455,8 @@ tcmalloc_size_returning_operator_new_aligned_nothrow(
 }
 
 #endif  // _LIBCPP_VERSION && __cpp_aligned_new
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE bool tcmalloc_try_resize(
+    void*, size_t) noexcept {
+  return false;
+}
@@ -219,6 +219,12 @@ class MallocExtension final
   //      virtual memory usage, and depending on the OS, typically
   //      do not count towards physical memory usage.
   //
+  // "tcmalloc.pageheap_lazily_freed_bytes"
+  //      The subset of "tcmalloc.pageheap_unmapped_bytes" released with
+  //      MADV_FREE.  The OS reclaims these lazily, so until it needs the
+  //      memory they still count towards physical memory usage, but
+  //      reusing them does not incur a page fault.
+  //
   //  "tcmalloc.per_cpu_caches_active"
   //      Whether tcmalloc is using per-CPU caches (1 or 0 respectively).
   // -------------------------------------------------------------------
@@ -289,7 +295,11 @@ class MallocExtension final
     // the OS as needed to stay under it if possible.
     //
     // If hard is set, crash if returning memory is unable to get below the
-    // limit.
+    // limit.  Otherwise the limit is soft: what the page heap can release
+    // without breaking up hugepages goes at once, and anything more is left
+    // to the next allocation off the fast path.  That empties the per-CPU and
+    // transfer caches, breaks up hugepages, and as a last resort calls any
+    // MemoryPressureCallbacks.
     //
     // Note:  limit=SIZE_T_MAX implies no limit.
     size_t limit = std::numeric_limits<size_t>::max();
@@ -299,6 +309,19 @@ class MallocExtension final
   static MemoryLimit GetMemoryLimit();
   static void SetMemoryLimit(const MemoryLimit& limit);
 
+  // Called when TCMalloc is over a soft (not hard) memory limit and has given
+  // back all the free memory it can of its own.  bytes is how far over the
+  // limit it still is.  A callback should free what it can of its caches; it
+  // runs on whichever thread's allocation found TCMalloc over the limit, with
+  // no TCMalloc locks held, and may allocate and free memory.
+  typedef void (*MemoryPressureCallback)(size_t bytes);
+
+  // Registers callback.  Returns false if the malloc implementation doesn't
+  // support callbacks, or already has as many as it can hold.
+  static bool AddMemoryPressureCallback(MemoryPressureCallback callback);
+  // Unregisters callback.  It may still be running on another thread.
+  static void RemoveMemoryPressureCallback(MemoryPressureCallback callback);
+
   // Gets the sampling rate.  Returns a value < 0 if unknown.
   static int64_t GetProfileSamplingRate();
   // Sets the sampling rate for heap profiles.  TCMalloc samples approximately
@@ -502,6 +525,19 @@ tcmalloc::sized_ptr_t tcmalloc_size_returning_operator_new_aligned_nothrow(
 
 #endif  // _LIBCPP_VERSION && __cpp_aligned_new
 
+// Tries to resize the allocation at `ptr` to `new_size` bytes without moving
+// it.  On success, returns true: `ptr` then holds at least `new_size` usable
+// bytes, and may be freed (sized or not) as an allocation of `new_size`.
+// Otherwise returns false, leaving the allocation as it was; realloc() would
+// have to copy it.
+//
+// TCMalloc resizes allocations larger than its size classes in place when the
+// pages after them are free, or when shrinking them.  Smaller allocations can
+// only take on sizes within their own size class.
+//
+// The default weak implementation always returns false.
+bool tcmalloc_try_resize(void* ptr, size_t new_size) noexcept;
+
 }  // extern "C"
 
 #ifndef MALLOCX_LG_ALIGN
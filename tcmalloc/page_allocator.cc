@@ -14,8 +14,12 @@
 
 #include "tcmalloc/page_allocator.h"
 
+#include <algorithm>
+#include <limits>
 #include <new>
 
+#include "absl/base/internal/cycleclock.h"
+#include "absl/strings/numbers.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
@@ -70,6 +74,24 @@ bool want_hpaa() {
   return use;
 }
 
+double decide_cgroup_memory_limit_fraction() {
+  const char *e = tcmalloc::tcmalloc_internal::thread_safe_getenv(
+      "TCMALLOC_CGROUP_MEMORY_LIMIT_FRACTION");
+  double fraction;
+  if (e == nullptr || !absl::SimpleAtod(e, &fraction) || fraction < 0 ||
+      fraction > 1) {
+    if (e != nullptr) Log(kLog, __FILE__, __LINE__, "bad env var", e);
+    return 0;
+  }
+  return fraction;
+}
+
+static const char *CgroupRoot() {
+  const char *e =
+      tcmalloc::tcmalloc_internal::thread_safe_getenv("TCMALLOC_CGROUP_ROOT");
+  return e != nullptr ? e : "/sys/fs/cgroup";
+}
+
 PageAllocator::PageAllocator() {
   const bool kUseHPAA = want_hpaa();
   if (kUseHPAA) {
@@ -83,48 +105,200 @@ PageAllocator::PageAllocator() {
     tagged_impl_ = new (&choices_[1].ph) PageHeap(/*tagged=*/true);
     alg_ = PAGE_HEAP;
   }
+
+  // We are only being constructed, so there is no limit of anyone else's to
+  // respect.
+  const double fraction = Parameters::cgroup_memory_limit_fraction();
+  if (fraction > 0) {
+    tcmalloc_internal::CgroupMemoryLimits limits;
+    const bool found =
+        tcmalloc_internal::GetCgroupMemoryLimits(CgroupRoot(), &limits);
+    ApplyCgroupLimits(found, limits, fraction);
+    cgroup_checked_ = absl::base_internal::CycleClock::Now();
+  }
 }
 
-void PageAllocator::ShrinkToUsageLimit() {
+void PageAllocator::UpdateCgroupLimit(bool force) {
+  // Serializes readers of the cgroup files, who hold no lock of ours.
+  ABSL_CONST_INIT static absl::base_internal::SpinLock cgroup_lock(
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+  absl::base_internal::SpinLockHolder l(&cgroup_lock);
+
+  const double fraction = Parameters::cgroup_memory_limit_fraction();
+  const int64_t now = absl::base_internal::CycleClock::Now();
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (fraction <= 0 && cgroup_fraction_ <= 0) return;
+    if (!force && fraction == cgroup_fraction_ &&
+        now - cgroup_checked_ < absl::base_internal::CycleClock::Frequency()) {
+      return;
+    }
+  }
+
+  tcmalloc_internal::CgroupMemoryLimits limits;
+  bool found = false;
+  if (fraction > 0) {
+    found = tcmalloc_internal::GetCgroupMemoryLimits(CgroupRoot(), &limits);
+  }
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  ApplyCgroupLimits(found, limits, fraction);
+  cgroup_checked_ = now;
+}
+
+void PageAllocator::ApplyCgroupLimits(
+    bool found, const tcmalloc_internal::CgroupMemoryLimits &limits,
+    double fraction) {
+  constexpr size_t kNoLimit = std::numeric_limits<size_t>::max();
+  size_t limit = kNoLimit;
+  if (!found) {
+    cgroup_limits_ = {kNoLimit, kNoLimit};
+  } else {
+    cgroup_limits_ = limits;
+    const size_t bound = std::min(limits.high, limits.max);
+    if (fraction > 0 && bound != kNoLimit) {
+      limit = static_cast<size_t>(bound * fraction);
+    }
+  }
+  cgroup_found_ = found;
+  cgroup_fraction_ = fraction;
+  cgroup_limit_ = limit;
+  UpdateLimit();
+}
+
+void PageAllocator::UpdateLimit() {
+  if (cgroup_limit_ < user_limit_) {
+    limit_ = cgroup_limit_;
+    limit_is_hard_ = false;
+  } else {
+    limit_ = user_limit_;
+    limit_is_hard_ = user_limit_is_hard_;
+  }
+  has_limit_.store(limit_ != std::numeric_limits<size_t>::max(),
+                   std::memory_order_relaxed);
+}
+
+Length PageAllocator::PagesOverLimit() {
   if (limit_ == std::numeric_limits<size_t>::max()) {
-    return;
+    return 0;
   }
   BackingStats s = stats();
   size_t backed = s.system_bytes - s.unmapped_bytes + Static::metadata_bytes();
   if (backed <= limit_) {
-    // We're already fine.
-    return;
+    return 0;
   }
-
-  limit_hits_++;
   const size_t overage = backed - limit_;
-  const Length pages = (overage + kPageSize - 1) / kPageSize;
+  return (overage + kPageSize - 1) / kPageSize;
+}
+
+void PageAllocator::CheckUsageLimit() {
+  if (limit_ != std::numeric_limits<size_t>::max() && PagesOverLimit() > 0) {
+    over_limit_.store(true, std::memory_order_relaxed);
+  }
+}
+
+void PageAllocator::CheckSoftLimit() {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  if (!limit_is_hard_ && PagesOverLimit() > 0) {
+    soft_limit_pressure_.store(true, std::memory_order_relaxed);
+  }
+}
+
+void PageAllocator::ShrinkToUsageLimit() {
+  Length pages;
+  bool is_hard;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    pages = PagesOverLimit();
+    if (pages == 0) {
+      // We're already fine.
+      return;
+    }
+    limit_hits_++;
+    is_hard = limit_is_hard_;
+  }
+
+  if (!is_hard) {
+    // Hugepages are worth breaking up only once the caches above us have
+    // given back what they can, and we can't take their locks here.
+    ReleaseCached(pages);
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (PagesOverLimit() > 0) {
+      soft_limit_pressure_.store(true, std::memory_order_relaxed);
+    }
+    return;
+  }
   if (ShrinkHardBy(pages)) {
     return;
   }
 
   // We're still not below limit.
-  if (limit_is_hard_) {
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
     limit_ = std::numeric_limits<decltype(limit_)>::max();
-    Log(kCrash, __FILE__, __LINE__,
-        "Hit hard tcmalloc heap limit (e.g. --tcmalloc_heap_size_hard_limit). "
-        "Aborting.\nIt was most likely set to catch "
-        "allocations that would crash the process anyway. "
-    );
   }
+  Log(kCrash, __FILE__, __LINE__,
+      "Hit hard tcmalloc heap limit (e.g. --tcmalloc_heap_size_hard_limit). "
+      "Aborting.\nIt was most likely set to catch "
+      "allocations that would crash the process anyway. "
+  );
+}
+
+HugeLength PageAllocator::RefillWarmReserves() {
+  if (alg_ != HPAA || Parameters::huge_cache_warm_reserve_bytes() <= 0) {
+    return NHugePages(0);
+  }
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (limit_ != std::numeric_limits<size_t>::max()) {
+      // The reserve is the first thing we'd release to get under the limit,
+      // so don't bother faulting it in when that is where we're headed anyway.
+      const BackingStats s = stats();
+      const size_t backed =
+          s.system_bytes - s.unmapped_bytes + Static::metadata_bytes();
+      const size_t reserve = Parameters::huge_cache_warm_reserve_bytes();
+      if (backed + 2 * reserve > limit_) return NHugePages(0);
+    }
+  }
+
+  return static_cast<HugePageAwareAllocator *>(untagged_impl_)
+      ->RefillWarmReserve();
+}
+
+Length PageAllocator::ReleaseCached(Length n) {
+  // Cached runs can't be released where they are.
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    FlushPageRunCache(/*all=*/true);
+    EvictLargeRunCache(absl::ZeroDuration());
+  }
+  return ReleaseAtLeastNPages(n);
+}
 
-  // Print logs once.
-  static bool warned = false;
-  if (warned) return;
-  warned = true;
-  Log(kLogWithStack, __FILE__, __LINE__, "Couldn't respect usage limit of ",
-      limit_, "and OOM is likely to follow.");
+Length PageAllocator::ReleaseBreakingHugepages(Length n) {
+  if (alg_ != HPAA) return 0;
+  Length ret = static_cast<HugePageAwareAllocator *>(untagged_impl_)
+                   ->ReleaseAtLeastNPagesBreakingHugepages(n);
+  if (ret < n) {
+    ret += static_cast<HugePageAwareAllocator *>(tagged_impl_)
+               ->ReleaseAtLeastNPagesBreakingHugepages(n - ret);
+  }
+  return ret;
 }
 
 bool PageAllocator::ShrinkHardBy(Length pages) {
-  Length ret = ReleaseAtLeastNPages(pages);
+  // The release counts include credit for pages the filler let go of eagerly,
+  // possibly long ago, so only our usage says whether we got under the limit.
+  ReleaseCached(pages);
   if (alg_ == HPAA) {
-    if (pages <= ret) {
+    size_t limit;
+    bool is_hard;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      pages = PagesOverLimit();
+      limit = limit_;
+      is_hard = limit_is_hard_;
+    }
+    if (pages == 0) {
       // We released target amount.
       return true;
     }
@@ -132,23 +306,19 @@ bool PageAllocator::ShrinkHardBy(Length pages) {
     // At this point, we have no choice but to break up hugepages.
     // However, if the client has turned off subrelease, and is using hard
     // limits, then respect desire to do no subrelease ever.
-    if (limit_is_hard_ && !Parameters::hpaa_subrelease()) return false;
+    if (is_hard && !Parameters::hpaa_subrelease()) return false;
 
     static bool warned_hugepages = false;
     if (!warned_hugepages) {
       Log(kLogWithStack, __FILE__, __LINE__, "Couldn't respect usage limit of ",
-          limit_, "without breaking hugepages - performance will drop");
+          limit, "without breaking hugepages - performance will drop");
       warned_hugepages = true;
     }
-    ret += static_cast<HugePageAwareAllocator *>(untagged_impl_)
-               ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
-    if (ret < pages) {
-      ret += static_cast<HugePageAwareAllocator *>(tagged_impl_)
-                 ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
-    }
+    ReleaseBreakingHugepages(pages);
   }
   // Return "true", if we got back under the limit.
-  return (pages <= ret);
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return PagesOverLimit() == 0;
 }
 
 }  // namespace tcmalloc
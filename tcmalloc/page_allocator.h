@@ -18,19 +18,29 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#include <atomic>
 #include <utility>
 
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/internal/cgroup_memory.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/large_run_cache.h"
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/page_heap.h"
+#include "tcmalloc/page_run_cache.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
 
 namespace tcmalloc {
 
+// The default for Parameters::cgroup_memory_limit_fraction(), from
+// TCMALLOC_CGROUP_MEMORY_LIMIT_FRACTION.
+double decide_cgroup_memory_limit_fraction();
+
 class PageAllocator {
  public:
   PageAllocator();
@@ -47,12 +57,49 @@ class PageAllocator {
   Span* NewAligned(Length n, Length align, bool tagged)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
-  // Delete the span "[p, p+n-1]".
+  // Delete the span "[p, p+n-1]".  Callers should ReturnFreedHugepages() once
+  // they have dropped pageheap_lock.
   // REQUIRES: span was returned by earlier call to New() with the same value of
   //           "tagged" and has not yet been deleted.
   void Delete(Span* span, bool tagged)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // As Delete, for the spans the hugepage-aware allocator can take back
+  // without pageheap_lock (see HugePageAwareAllocator::DeleteWholeHugepages).
+  // Returns false if span is not one of them; the caller still has to
+  // Delete() it.
+  // REQUIRES: span is not sampled.
+  bool DeleteWithoutLock(Span* span, bool tagged)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // With the hugepage-aware allocator, returns the hugepages Delete() freed to
+  // the HugeCaches (see HugePageAwareAllocator::ReturnFreedHugepages()).
+  void ReturnFreedHugepages()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock, huge_cache_lock);
+
+  // Resizes span to n pages (or, growing, at least n) without copying it, if
+  // the allocator it came from can (see PageAllocatorInterface::Resize).
+  // Returns the span now covering them, or nullptr if span is as it was.
+  Span* Resize(Span* span, Length n, bool may_move, bool tagged)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // As Delete, but tries to keep span in the current CPU's PageRunCache, or
+  // if it is large, our LargeRunCache, instead; neither needs pageheap_lock.
+  // Returns false if it didn't, in which case the caller still has to
+  // Delete() span.
+  // REQUIRES: span is not registered with a size class.
+  bool DeleteToCache(Span* span, bool tagged);
+
+  // Deletes the runs our PageRunCache has not handed out since the last call
+  // (or all of them, if "all").  Returns the number of pages deleted.
+  Length FlushPageRunCache(bool all)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Deletes the large spans cached for at least max_age (or all of them, if
+  // zero).  Returns the number of pages deleted.
+  Length EvictLargeRunCache(absl::Duration max_age)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   BackingStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   void GetSmallSpanStats(SmallSpanStats* result)
@@ -68,7 +115,12 @@ class PageAllocator {
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
   Length ReleaseAtLeastNPages(Length num_pages)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Refills the warm reserve of the untagged HugeCache (see
+  // Parameters::huge_cache_warm_reserve_bytes()), unless doing so would
+  // crowd our usage limit.  Returns the number of hugepages added.
+  HugeLength RefillWarmReserves() ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   // Prints stats about the page heap to *out.
   void Print(TCMalloc_Printer* out, bool tagged)
@@ -76,13 +128,69 @@ class PageAllocator {
   void PrintInPbtxt(PbtxtRegion* region, bool tagged)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
+  // Sets our own limit.  We enforce the tighter of it and the one we follow
+  // from our cgroup (see UpdateCgroupLimit), which limit() returns; the
+  // limit is hard only if ours is, and is the tighter.
   void set_limit(size_t limit, bool is_hard) ABSL_LOCKS_EXCLUDED(pageheap_lock);
   std::pair<size_t, bool> limit() const ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // What set_limit last set.
+  std::pair<size_t, bool> user_limit() const
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
   int64_t limit_hits() const ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
-  // If we have a usage limit set, ensure we're not violating it from our latest
-  // allocation.
-  void ShrinkToUsageLimit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // With Parameters::cgroup_memory_limit_fraction() set, keeps a soft limit at
+  // that fraction of the memory.high (or, if tighter, memory.max) of our cgroup
+  // v2 hierarchy, mounted at $TCMALLOC_CGROUP_ROOT or /sys/fs/cgroup.  Rereads
+  // those at most once a second, unless forced.  Reads files, so call it when
+  // releasing memory, not on allocation.
+  void UpdateCgroupLimit(bool force) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // The cgroup limits we last read, and whether we found any.
+  bool cgroup_limits(tcmalloc_internal::CgroupMemoryLimits* limits) const
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // If we have a usage limit set and our latest allocation took us over it,
+  // notes that for MaybeShrinkToUsageLimit().  Releasing memory would hold up
+  // everyone else waiting for pageheap_lock, so we leave that to whoever
+  // allocated, once they have dropped it.
+  void CheckUsageLimit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // As CheckUsageLimit, for allocations made without pageheap_lock: if we
+  // have any limit, leaves it to MaybeShrinkToUsageLimit() to find out.
+  void CheckUsageLimitWithoutLock() {
+    if (has_limit_.load(std::memory_order_relaxed)) {
+      over_limit_.store(true, std::memory_order_relaxed);
+    }
+  }
+  void MaybeShrinkToUsageLimit() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // If we have a usage limit set, ensure we're not violating it.
+  void ShrinkToUsageLimit() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Over a soft limit, ShrinkToUsageLimit releases only what the page
+  // allocators hold free without breaking up hugepages.  Anything more is left
+  // to the caller of TakeSoftLimitPressure, which returns (and clears) whether
+  // that happened, and which should work through the caches above us, holding
+  // none of our locks, before it resorts to ReleaseBreakingHugepages.
+  bool soft_limit_pressure() const {
+    return soft_limit_pressure_.load(std::memory_order_relaxed);
+  }
+  bool TakeSoftLimitPressure() {
+    return soft_limit_pressure_.exchange(false, std::memory_order_relaxed);
+  }
+  // Sets soft_limit_pressure() if we are over a soft limit, whether or not an
+  // allocation has found us there: the limit may have come down, or the last
+  // reclaim fallen short, with nothing allocated since.
+  void CheckSoftLimit() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Returns the number of pages by which backed memory exceeds our limit.
+  Length PagesOverLimit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Tries to release at least n pages, first of what the run caches and
+  // HugeCaches hold, then, with the hugepage-aware allocator, of free pages on
+  // partly-used hugepages.  Returns the number of pages released, which may
+  // include pages released eagerly since the last call; use PagesOverLimit()
+  // to learn whether it was enough.
+  Length ReleaseCached(Length n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  Length ReleaseBreakingHugepages(Length n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   const PageAllocInfo& info(bool tagged) const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
@@ -95,10 +203,16 @@ class PageAllocator {
   Algorithm algorithm() const { return alg_; }
 
  private:
-  bool ShrinkHardBy(Length pages) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  bool ShrinkHardBy(Length pages) ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   PageAllocatorInterface* impl(bool tagged) const;
 
+  // Whether spans of n pages may go through run_cache_.
+  bool Cacheable(Length n, bool tagged) const;
+  // Likewise for large_cache_, which takes only untagged runs of whole
+  // hugepages from the hugepage-aware allocator.
+  bool LargeCacheable(Length n, bool tagged) const;
+
   union Choices {
     Choices() : dummy(0) {}
     ~Choices() {}
@@ -110,31 +224,137 @@ class PageAllocator {
   PageAllocatorInterface* tagged_impl_;
   Algorithm alg_;
 
+  PageRunCache run_cache_;
+  LargeRunCache large_cache_;
+
+  // What set_limit set.
+  bool user_limit_is_hard_{false};
+  size_t user_limit_{std::numeric_limits<size_t>::max()};
+  // The tighter of that and cgroup_limit_: the max size of backed spans we
+  // will attempt to maintain.
   bool limit_is_hard_{false};
-  // Max size of backed spans we will attempt to maintain.
   size_t limit_{std::numeric_limits<size_t>::max()};
   // The number of times the limit has been hit.
   int64_t limit_hits_{0};
+  // Whether limit_ is set at all, for CheckUsageLimitWithoutLock.
+  std::atomic<bool> has_limit_{false};
+  // Set by CheckUsageLimit.
+  std::atomic<bool> over_limit_{false};
+  // Set when we are over a soft limit that ShrinkToUsageLimit couldn't get
+  // under.
+  std::atomic<bool> soft_limit_pressure_{false};
+
+  // Sets limit_ and limit_is_hard_ from user_limit_ and cgroup_limit_.
+  void UpdateLimit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Sets cgroup_limit_ from cgroup limits read by UpdateCgroupLimit.
+  void ApplyCgroupLimits(bool found,
+                         const tcmalloc_internal::CgroupMemoryLimits& limits,
+                         double fraction)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  bool cgroup_found_{false};
+  tcmalloc_internal::CgroupMemoryLimits cgroup_limits_{
+      std::numeric_limits<size_t>::max(), std::numeric_limits<size_t>::max()};
+  double cgroup_fraction_{0};
+  // The soft limit we follow from cgroup_limits_, if any.
+  size_t cgroup_limit_{std::numeric_limits<size_t>::max()};
+  // When UpdateCgroupLimit last read them, in cycles.
+  int64_t cgroup_checked_{0};
 };
 
 inline PageAllocatorInterface* PageAllocator::impl(bool tagged) const {
   return tagged ? tagged_impl_ : untagged_impl_;
 }
 
+inline bool PageAllocator::Cacheable(Length n, bool tagged) const {
+  return n <= PageRunCache::kMaxRunPages;
+}
+
+inline bool PageAllocator::LargeCacheable(Length n, bool tagged) const {
+  return alg_ == HPAA && !tagged && n > PageRunCache::kMaxRunPages &&
+         n <= LargeRunCache::kMaxHugePages.in_pages();
+}
+
+inline void PageAllocator::MaybeShrinkToUsageLimit() {
+  if (ABSL_PREDICT_FALSE(over_limit_.load(std::memory_order_relaxed)) &&
+      over_limit_.exchange(false, std::memory_order_relaxed)) {
+    ShrinkToUsageLimit();
+  }
+}
+
 inline Span* PageAllocator::New(Length n, bool tagged) {
-  return impl(tagged)->New(n);
+  if (Cacheable(n, tagged)) {
+    if (Span* span = run_cache_.Get(n, tagged)) return span;
+  } else if (LargeCacheable(n, tagged)) {
+    if (Span* span = large_cache_.Get(n)) return span;
+  }
+  Span* span = impl(tagged)->New(n);
+  MaybeShrinkToUsageLimit();
+  return span;
 }
 
 inline Span* PageAllocator::NewAligned(Length n, Length align, bool tagged) {
-  return impl(tagged)->NewAligned(n, align);
+  if (align <= 1) return New(n, tagged);
+  // Everything in large_cache_ is hugepage-aligned.
+  if (align <= kPagesPerHugePage && LargeCacheable(n, tagged)) {
+    if (Span* span = large_cache_.Get(n)) return span;
+  }
+  Span* span = impl(tagged)->NewAligned(n, align);
+  MaybeShrinkToUsageLimit();
+  return span;
 }
 
 inline void PageAllocator::Delete(Span* span, bool tagged) {
   impl(tagged)->Delete(span);
 }
 
+inline bool PageAllocator::DeleteWithoutLock(Span* span, bool tagged) {
+  if (alg_ != HPAA) return false;
+  return static_cast<HugePageAwareAllocator*>(impl(tagged))
+      ->DeleteWholeHugepages(span);
+}
+
+inline void PageAllocator::ReturnFreedHugepages() {
+  if (alg_ != HPAA) return;
+  static_cast<HugePageAwareAllocator*>(untagged_impl_)->ReturnFreedHugepages();
+  static_cast<HugePageAwareAllocator*>(tagged_impl_)->ReturnFreedHugepages();
+}
+
+inline Span* PageAllocator::Resize(Span* span, Length n, bool may_move,
+                                   bool tagged) {
+  Span* resized = impl(tagged)->Resize(span, n, may_move);
+  MaybeShrinkToUsageLimit();
+  return resized;
+}
+
+inline bool PageAllocator::DeleteToCache(Span* span, bool tagged) {
+  const Length n = span->num_pages();
+  if (Cacheable(n, tagged)) return run_cache_.Put(span, tagged);
+  if (LargeCacheable(n, tagged)) return large_cache_.Put(span);
+  return false;
+}
+
+inline Length PageAllocator::FlushPageRunCache(bool all) {
+  return run_cache_.Flush(all, [this](Span* span, bool tagged)
+                                   ABSL_NO_THREAD_SAFETY_ANALYSIS {
+                                     Delete(span, tagged);
+                                   });
+}
+
+inline Length PageAllocator::EvictLargeRunCache(absl::Duration max_age) {
+  return large_cache_.Evict(
+      max_age, [this](Span* span) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+        Delete(span, /*tagged=*/false);
+      });
+}
+
 inline BackingStats PageAllocator::stats() const {
-  return untagged_impl_->stats() + tagged_impl_->stats();
+  BackingStats s = untagged_impl_->stats() + tagged_impl_->stats();
+  // Cached runs are allocated as far as our impls know, but free to us.
+  s.free_bytes +=
+      run_cache_.cached_pages() * kPageSize + large_cache_.cached_bytes();
+  return s;
 }
 
 inline void PageAllocator::GetSmallSpanStats(SmallSpanStats* result) {
@@ -142,6 +362,7 @@ inline void PageAllocator::GetSmallSpanStats(SmallSpanStats* result) {
   untagged_impl_->GetSmallSpanStats(&untagged);
   tagged_impl_->GetSmallSpanStats(&tagged);
   *result = untagged + tagged;
+  run_cache_.AddSpanStats(result);
 }
 
 inline void PageAllocator::GetLargeSpanStats(LargeSpanStats* result) {
@@ -149,9 +370,17 @@ inline void PageAllocator::GetLargeSpanStats(LargeSpanStats* result) {
   untagged_impl_->GetLargeSpanStats(&untagged);
   tagged_impl_->GetLargeSpanStats(&tagged);
   *result = untagged + tagged;
+  large_cache_.AddSpanStats(result);
 }
 
 inline Length PageAllocator::ReleaseAtLeastNPages(Length num_pages) {
+  // We're called periodically, which is as good a time as any to return
+  // the runs nobody has wanted lately, and they may well be released below.
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    FlushPageRunCache(/*all=*/false);
+    EvictLargeRunCache(LargeRunCache::kMaxAge);
+  }
   Length released = untagged_impl_->ReleaseAtLeastNPages(num_pages);
   if (released < num_pages) {
     released += tagged_impl_->ReleaseAtLeastNPages(num_pages - released);
@@ -166,19 +395,27 @@ inline void PageAllocator::Print(TCMalloc_Printer* out, bool tagged) {
   impl(tagged)->Print(out);
   if (tagged) {
     out->printf(">>>>>>> End tagged page allocator <<<<<<<\n");
+    return;
   }
+  run_cache_.Print(out);
+  if (alg_ == HPAA) large_cache_.Print(out);
 }
 
 inline void PageAllocator::PrintInPbtxt(PbtxtRegion* region, bool tagged) {
   PbtxtRegion pa = region->CreateSubRegion("page_allocator");
   pa.PrintBool("tagged", tagged);
   impl(tagged)->PrintInPbtxt(&pa);
+  if (!tagged) {
+    run_cache_.PrintInPbtxt(&pa);
+    if (alg_ == HPAA) large_cache_.PrintInPbtxt(&pa);
+  }
 }
 
 inline void PageAllocator::set_limit(size_t limit, bool is_hard) {
   absl::base_internal::SpinLockHolder h(&pageheap_lock);
-  limit_ = limit;
-  limit_is_hard_ = is_hard;
+  user_limit_ = limit;
+  user_limit_is_hard_ = is_hard;
+  UpdateLimit();
 }
 
 inline std::pair<size_t, bool> PageAllocator::limit() const {
@@ -186,6 +423,18 @@ inline std::pair<size_t, bool> PageAllocator::limit() const {
   return {limit_, limit_is_hard_};
 }
 
+inline std::pair<size_t, bool> PageAllocator::user_limit() const {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return {user_limit_, user_limit_is_hard_};
+}
+
+inline bool PageAllocator::cgroup_limits(
+    tcmalloc_internal::CgroupMemoryLimits* limits) const {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  *limits = cgroup_limits_;
+  return cgroup_found_;
+}
+
 inline int64_t PageAllocator::limit_hits() const {
   absl::base_internal::SpinLockHolder h(&pageheap_lock);
   return limit_hits_;
@@ -52,6 +52,17 @@ class PageAllocatorInterface {
   virtual void Delete(Span* span)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
 
+  // Resizes span, which New() returned, to n pages without copying its
+  // contents: in place, or if growing and may_move, by moving its memory
+  // elsewhere wholesale.  Returns the span now covering them (span itself, or
+  // one that replaces it, carrying over any sample), which may have more than
+  // n pages; or nullptr, leaving span untouched, if that can't be done
+  // cheaply.  Not all implementations try.
+  virtual Span* Resize(Span* span, Length n, bool may_move)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    return nullptr;
+  }
+
   virtual BackingStats stats() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
 
@@ -68,7 +79,7 @@ class PageAllocatorInterface {
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
   virtual Length ReleaseAtLeastNPages(Length num_pages)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) = 0;
 
   // Prints stats about the page heap to *out.
   virtual void Print(TCMalloc_Printer* out)
@@ -83,7 +94,8 @@ class PageAllocatorInterface {
   const PageAllocInfo& info() const { return info_; }
 
  protected:
-  PageAllocInfo info_ ABSL_GUARDED_BY(pageheap_lock);
+  // Guarded by pageheap_lock, unless the implementation says otherwise.
+  PageAllocInfo info_;
   PageMap* pagemap_;
 
   bool tagged_;  // Whether this heap manages tagged or untagged memory.
@@ -18,23 +18,32 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
 #include <new>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <vector>
 
+#include "benchmark/benchmark.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/base/macros.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/util.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/page_allocator_test_util.h"
+#include "tcmalloc/page_run_cache.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
 
@@ -67,14 +76,15 @@ class PageAllocatorTest : public testing::Test {
     return allocator_->NewAligned(n, align, /*tagged=*/false);
   }
   void Delete(Span *s) {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    allocator_->Delete(s, /*tagged=*/false);
+    if (allocator_->DeleteWithoutLock(s, /*tagged=*/false)) return;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      allocator_->Delete(s, /*tagged=*/false);
+    }
+    allocator_->ReturnFreedHugepages();
   }
 
-  Length Release(Length n) {
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    return allocator_->ReleaseAtLeastNPages(n);
-  }
+  Length Release(Length n) { return allocator_->ReleaseAtLeastNPages(n); }
 
   std::string Print() {
     std::vector<char> buf(1024 * 1024);
@@ -138,5 +148,375 @@ TEST_F(PageAllocatorTest, PrintIt) {
   EXPECT_THAT(output, testing::ContainsRegex("stats on allocation sizes"));
 }
 
+// Spans too large for the filler take their hugepages from the HugeCache under
+// huge_cache_lock; small and large spans must still be safe to use side by
+// side.
+TEST_F(PageAllocatorTest, SmallAndLargeSpansFromThreads) {
+  if (allocator_->algorithm() != PageAllocator::HPAA) {
+    GTEST_SKIP() << "Only the hugepage-aware allocator has a HugeCache";
+  }
+
+  const Length kSizes[] = {1, 3, kPagesPerHugePage / 2,
+                           kPagesPerHugePage / 2 + 1,
+                           kPagesPerHugePage, 3 * kPagesPerHugePage + 5};
+  const int kThreads = 4;
+  const int kIters = 200;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::vector<Span *> spans;
+      for (int i = 0; i < kIters; ++i) {
+        const Length n = kSizes[(i + t) % ABSL_ARRAYSIZE(kSizes)];
+        Span *s = New(n);
+        CHECK_CONDITION(s != nullptr);
+        CHECK_CONDITION(s->num_pages() == n);
+        // Touch both ends, so overlapping spans would trample each other.
+        memset(s->start_address(), t, kPageSize);
+        memset(s->last_page().start_addr(), t, kPageSize);
+        spans.push_back(s);
+        if (i % 3 == 2) {
+          for (Span *done : spans) {
+            CHECK_CONDITION(*static_cast<char *>(done->start_address()) == t);
+            Delete(done);
+          }
+          spans.clear();
+        }
+      }
+      for (Span *s : spans) Delete(s);
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    BackingStats stats = allocator_->stats();
+    EXPECT_EQ(stats.system_bytes, stats.free_bytes + stats.unmapped_bytes);
+  }
+}
+
+// Whole-hugepage spans go back to the HugeCache without pageheap_lock, and
+// come out of it again; spans with slack still need Delete().
+TEST_F(PageAllocatorTest, WholeHugepagesWithoutLock) {
+  if (allocator_->algorithm() != PageAllocator::HPAA) {
+    GTEST_SKIP() << "Only the hugepage-aware allocator has a HugeCache";
+  }
+
+  const Length n = 2 * kPagesPerHugePage;
+  Span *s = New(n);
+  ASSERT_NE(nullptr, s);
+  const PageId first = s->first_page();
+  EXPECT_EQ(s, Static::pagemap()->GetDescriptor(first));
+  ASSERT_TRUE(allocator_->DeleteWithoutLock(s, /*tagged=*/false));
+
+  Span *t = New(n);
+  ASSERT_NE(nullptr, t);
+  EXPECT_EQ(first, t->first_page());
+  EXPECT_EQ(n, t->num_pages());
+  EXPECT_EQ(t, Static::pagemap()->GetDescriptor(first));
+  ASSERT_TRUE(allocator_->DeleteWithoutLock(t, /*tagged=*/false));
+
+  Span *slack = New(n + 1);
+  ASSERT_NE(nullptr, slack);
+  EXPECT_FALSE(allocator_->DeleteWithoutLock(slack, /*tagged=*/false));
+  Delete(slack);
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    BackingStats stats = allocator_->stats();
+    EXPECT_EQ(stats.system_bytes, stats.free_bytes + stats.unmapped_bytes);
+  }
+}
+
+// A cached run is still allocated as far as the pagemap is concerned, and
+// comes back as the same span.
+TEST_F(PageAllocatorTest, RunCacheKeepsPagemap) {
+  const int64_t before = Parameters::page_run_cache_bytes();
+  Parameters::set_page_run_cache_bytes(64 * kPageSize);
+  // Stay in one shard.
+  tcmalloc_internal::ScopedAffinityMask mask(
+      tcmalloc_internal::AllowedCpus()[0]);
+
+  const Length n = 3;
+  Span *s = New(n);
+  ASSERT_NE(nullptr, s);
+  const PageId first = s->first_page();
+  EXPECT_EQ(s, Static::pagemap()->GetDescriptor(first));
+
+  BackingStats stats;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    stats = allocator_->stats();
+  }
+  ASSERT_TRUE(allocator_->DeleteToCache(s, /*tagged=*/false));
+  EXPECT_EQ(s, Static::pagemap()->GetDescriptor(first));
+  SmallSpanStats small;
+  size_t free_bytes;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    free_bytes = allocator_->stats().free_bytes;
+    allocator_->GetSmallSpanStats(&small);
+  }
+  EXPECT_EQ(stats.free_bytes + n * kPageSize, free_bytes);
+  EXPECT_LE(1, small.normal_length[n]);
+
+  // Other lengths and tags don't get it.
+  Span *other = New(n + 1);
+  EXPECT_NE(s, other);
+  Delete(other);
+  Span *tagged = allocator_->New(n, /*tagged=*/true);
+  EXPECT_NE(s, tagged);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_->Delete(tagged, /*tagged=*/true);
+  }
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    stats = allocator_->stats();
+  }
+  Span *t = New(n);
+  EXPECT_EQ(s, t);
+  EXPECT_EQ(first, t->first_page());
+  EXPECT_EQ(n, t->num_pages());
+  EXPECT_EQ(Span::IN_USE, t->location());
+  EXPECT_FALSE(t->sampled());
+  EXPECT_EQ(t, Static::pagemap()->GetDescriptor(first));
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    free_bytes = allocator_->stats().free_bytes;
+  }
+  EXPECT_EQ(stats.free_bytes - n * kPageSize, free_bytes);
+
+  // Flushing puts it back in the page heap for real.
+  ASSERT_TRUE(allocator_->DeleteToCache(t, /*tagged=*/false));
+  Length flushed, flushed_again;
+  size_t nalloc, nfree;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    flushed = allocator_->FlushPageRunCache(/*all=*/true);
+    flushed_again = allocator_->FlushPageRunCache(/*all=*/true);
+    nalloc = allocator_->info(/*tagged=*/false).counts_for(n).nalloc;
+    nfree = allocator_->info(/*tagged=*/false).counts_for(n).nfree;
+  }
+  EXPECT_EQ(n, flushed);
+  EXPECT_EQ(0, flushed_again);
+  EXPECT_EQ(nalloc, nfree);
+  EXPECT_THAT(Print(), testing::HasSubstr("PageRunCache:"));
+
+  Parameters::set_page_run_cache_bytes(before);
+}
+
+// Runs bounce between threads' shards and the page heap; none may ever be
+// handed out twice.
+TEST_F(PageAllocatorTest, RunCacheFromThreads) {
+  const int64_t before = Parameters::page_run_cache_bytes();
+  Parameters::set_page_run_cache_bytes(32 * kPageSize);
+
+  const int kThreads = 4;
+  const int kIters = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::vector<Span *> spans;
+      for (int i = 0; i < kIters; ++i) {
+        const Length n = 1 + (i + t) % PageRunCache::kMaxRunPages;
+        Span *s = New(n);
+        CHECK_CONDITION(s != nullptr);
+        CHECK_CONDITION(s->num_pages() == n);
+        CHECK_CONDITION(Static::pagemap()->GetDescriptor(s->first_page()) ==
+                        s);
+        memset(s->start_address(), t, n * kPageSize);
+        spans.push_back(s);
+        if (i % 4 == 3) {
+          for (Span *done : spans) {
+            const char *c = static_cast<char *>(done->start_address());
+            CHECK_CONDITION(c[0] == t);
+            CHECK_CONDITION(c[done->num_pages() * kPageSize - 1] == t);
+            if (!allocator_->DeleteToCache(done, /*tagged=*/false)) {
+              Delete(done);
+            }
+          }
+          spans.clear();
+        }
+        if (i % 500 == 0) {
+          absl::base_internal::SpinLockHolder h(&pageheap_lock);
+          allocator_->FlushPageRunCache(/*all=*/false);
+        }
+      }
+      for (Span *s : spans) Delete(s);
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_->FlushPageRunCache(/*all=*/true);
+    BackingStats stats = allocator_->stats();
+    EXPECT_EQ(stats.system_bytes, stats.free_bytes + stats.unmapped_bytes);
+  }
+
+  Parameters::set_page_run_cache_bytes(before);
+}
+
+// Freed multi-MiB spans stay whole and backed, and come back for requests
+// of the same length, until they are evicted to the hugepage-aware allocator.
+TEST_F(PageAllocatorTest, LargeRunCacheReuses) {
+  if (allocator_->algorithm() != PageAllocator::HPAA) {
+    GTEST_SKIP() << "Only the hugepage-aware allocator caches large spans";
+  }
+  const int64_t before = Parameters::large_run_cache_bytes();
+  Parameters::set_large_run_cache_bytes(16 << 20);
+
+  const Length n = 2 * kPagesPerHugePage + 7;
+  Span *s = New(n);
+  ASSERT_NE(nullptr, s);
+  const PageId first = s->first_page();
+  memset(s->start_address(), 1, n * kPageSize);
+  ASSERT_TRUE(allocator_->DeleteToCache(s, /*tagged=*/false));
+  EXPECT_EQ(s, Static::pagemap()->GetDescriptor(first));
+
+  LargeSpanStats large;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_->GetLargeSpanStats(&large);
+  }
+  EXPECT_LE(n, large.normal_pages);
+
+  // Same bucket, but not the same length.
+  Span *other = New(n + 1);
+  EXPECT_NE(s, other);
+  Delete(other);
+
+  Span *t = NewAligned(n, kPagesPerHugePage);
+  EXPECT_EQ(s, t);
+  EXPECT_EQ(first, t->first_page());
+  EXPECT_EQ(n, t->num_pages());
+  EXPECT_EQ(Span::IN_USE, t->location());
+  EXPECT_EQ(t, Static::pagemap()->GetDescriptor(first));
+  // Backing was never given up.
+  EXPECT_EQ(1, *static_cast<char *>(t->last_page().start_addr()));
+
+  ASSERT_TRUE(allocator_->DeleteToCache(t, /*tagged=*/false));
+  Length evicted, evicted_again;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    // Not old enough yet.
+    evicted = allocator_->EvictLargeRunCache(absl::Hours(1));
+    evicted_again = allocator_->EvictLargeRunCache(absl::ZeroDuration());
+  }
+  EXPECT_EQ(0, evicted);
+  EXPECT_EQ(n, evicted_again);
+  EXPECT_THAT(Print(), testing::HasSubstr("LargeRunCache:"));
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    BackingStats stats = allocator_->stats();
+    EXPECT_EQ(stats.system_bytes, stats.free_bytes + stats.unmapped_bytes);
+  }
+  Parameters::set_large_run_cache_bytes(before);
+}
+
+// Half the threads allocate spans small enough for the filler, half larger
+// ones, which take whole hugepages from the HugeCache under huge_cache_lock
+// alone.
+void BM_SmallAndLargeSpans(benchmark::State &state) {
+  static PageAllocator *allocator = []() {
+    Static::InitIfNecessary();
+    void *p = malloc(sizeof(PageAllocator));
+    return new (p) PageAllocator;
+  }();
+  static std::atomic<int> next_thread{0};
+  const bool large = next_thread.fetch_add(1) % 2 == 1;
+  const Length n = large ? 2 * kPagesPerHugePage : 4;
+
+  for (auto _ : state) {
+    Span *s = allocator->New(n, /*tagged=*/false);
+    CHECK_CONDITION(s != nullptr);
+    if (allocator->DeleteWithoutLock(s, /*tagged=*/false)) continue;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      allocator->Delete(s, /*tagged=*/false);
+    }
+    allocator->ReturnFreedHugepages();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SmallAndLargeSpans)->ThreadRange(2, 16)->UseRealTime();
+
+// Short spans churning through New and Delete, as central freelists and
+// sampled allocations do, with the page run cache off (0) or on (KiB per
+// CPU).
+void BM_ShortSpanChurn(benchmark::State &state) {
+  static PageAllocator *allocator = []() {
+    Static::InitIfNecessary();
+    void *p = malloc(sizeof(PageAllocator));
+    return new (p) PageAllocator;
+  }();
+  Parameters::set_page_run_cache_bytes(state.range(0) << 10);
+  const int kLive = 16;
+  Span *live[kLive] = {};
+
+  int i = 0;
+  for (auto _ : state) {
+    Span *&slot = live[i % kLive];
+    if (slot != nullptr &&
+        !allocator->DeleteToCache(slot, /*tagged=*/false)) {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      allocator->Delete(slot, /*tagged=*/false);
+    }
+    slot = allocator->New(1 + i % PageRunCache::kMaxRunPages,
+                          /*tagged=*/false);
+    CHECK_CONDITION(slot != nullptr);
+    ++i;
+  }
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (Span *s : live) {
+      if (s != nullptr) allocator->Delete(s, /*tagged=*/false);
+    }
+    allocator->FlushPageRunCache(/*all=*/true);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ShortSpanChurn)
+    ->Arg(0)
+    ->Arg(512)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Multi-MiB buffers allocated and freed in a loop, with the large run cache
+// off (0) or on (MiB).
+void BM_LargeSpanChurn(benchmark::State &state) {
+  static PageAllocator *allocator = []() {
+    Static::InitIfNecessary();
+    void *p = malloc(sizeof(PageAllocator));
+    return new (p) PageAllocator;
+  }();
+  Parameters::set_large_run_cache_bytes(state.range(0) << 20);
+  const Length kSizes[] = {2 * kPagesPerHugePage, 4 * kPagesPerHugePage + 1,
+                           8 * kPagesPerHugePage};
+
+  int i = 0;
+  for (auto _ : state) {
+    Span *s = allocator->New(kSizes[i++ % ABSL_ARRAYSIZE(kSizes)],
+                             /*tagged=*/false);
+    CHECK_CONDITION(s != nullptr);
+    if (!allocator->DeleteToCache(s, /*tagged=*/false)) {
+      {
+        absl::base_internal::SpinLockHolder h(&pageheap_lock);
+        allocator->Delete(s, /*tagged=*/false);
+      }
+      allocator->ReturnFreedHugepages();
+    }
+  }
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator->EvictLargeRunCache(absl::ZeroDuration());
+  }
+  allocator->ReturnFreedHugepages();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LargeSpanChurn)->Arg(0)->Arg(64)->ThreadRange(1, 4)->UseRealTime();
+
 }  // namespace
 }  // namespace tcmalloc
@@ -46,6 +46,9 @@ PageHeap::PageHeap(PageMap* map, bool tagged)
       release_index_(kMaxPages) {
   large_.normal.Init();
   large_.returned.Init();
+  node_allocator_.Init(Static::arena());
+  large_normal_.Init(&node_allocator_);
+  large_returned_.Init(&node_allocator_);
   for (int i = 0; i < kMaxPages; i++) {
     free_[i].normal.Init();
     free_[i].returned.Init();
@@ -57,7 +60,8 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n, bool* from_returned) {
   ASSERT(n > 0);
 
   // Find first size >= n that has a non-empty list
-  for (Length s = n; s < kMaxPages; s++) {
+  const Length s = n < kMaxPages ? nonempty_.FindSet(n) : kMaxPages;
+  if (s < kMaxPages) {
     SpanList* ll = &free_[s].normal;
     // If we're lucky, ll is non-empty, meaning it has a suitable span.
     if (!ll->empty()) {
@@ -65,13 +69,12 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n, bool* from_returned) {
       *from_returned = false;
       return Carve(ll->first(), n);
     }
-    // Alternatively, maybe there's a usable returned span.
+    // Otherwise there's a usable returned span.
     ll = &free_[s].returned;
-    if (!ll->empty()) {
-      ASSERT(ll->first()->location() == Span::ON_RETURNED_FREELIST);
-      *from_returned = true;
-      return Carve(ll->first(), n);
-    }
+    ASSERT(!ll->empty());
+    ASSERT(ll->first()->location() == Span::ON_RETURNED_FREELIST);
+    *from_returned = true;
+    return Carve(ll->first(), n);
   }
   // No luck in free lists, our last chance is in a larger class.
   return AllocLarge(n, from_returned);  // May be NULL
@@ -82,15 +85,15 @@ Span* PageHeap::AllocateSpan(Length n, bool* from_returned) {
   Span* result = SearchFreeAndLargeLists(n, from_returned);
   if (result != nullptr) return result;
 
-  // Grow the heap and try again.
-  if (!GrowHeap(n)) {
-    ASSERT(Check());
-    return nullptr;
-  }
-
-  result = SearchFreeAndLargeLists(n, from_returned);
-  // our new memory should be unbacked
-  ASSERT(*from_returned);
+  // Grow the heap and try again.  GrowHeap drops pageheap_lock, so another
+  // thread may have beaten us to the new memory; if so, grow again.
+  do {
+    if (!GrowHeap(n)) {
+      ASSERT(Check());
+      return nullptr;
+    }
+    result = SearchFreeAndLargeLists(n, from_returned);
+  } while (result == nullptr);
   return result;
 }
 
@@ -101,7 +104,7 @@ Span* PageHeap::New(Length n) {
   {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
     result = AllocateSpan(n, &from_returned);
-    if (result) Static::page_allocator()->ShrinkToUsageLimit();
+    if (result) Static::page_allocator()->CheckUsageLimit();
     if (result) info_.RecordAlloc(result->first_page(), result->num_pages());
   }
 
@@ -193,28 +196,114 @@ Span* PageHeap::NewAligned(Length n, Length align) {
 
 Span* PageHeap::AllocLarge(Length n, bool* from_returned) {
   // find the best span (closest to n in size).
-  // The following loops implements address-ordered best-fit.
-  Span* best = nullptr;
+  // The trees are in address-ordered best-fit order, so this is the better of
+  // their first fits.
+  Span* best = large_normal_.LowerBound(n);
+  *from_returned = false;
+  ASSERT(!best || best->location() == Span::ON_NORMAL_FREELIST);
+
+  // Look in the released tree in case it has a better fit
+  Span* span = large_returned_.LowerBound(n);
+  ASSERT(!span || span->location() == Span::ON_RETURNED_FREELIST);
+  if (span != nullptr && IsSpanBetter(span, best, n)) {
+    best = span;
+    *from_returned = true;
+  }
 
-  // Search through normal list
-  for (Span* span : large_.normal) {
-    ASSERT(span->location() == Span::ON_NORMAL_FREELIST);
-    if (IsSpanBetter(span, best, n)) {
-      best = span;
-      *from_returned = false;
+  return best == nullptr ? nullptr : Carve(best, n);
+}
+
+// A 64-bit mix of the span's address, so that priorities are spread however
+// the spans are laid out.
+static uint64_t TreapPriority(const Span* span) {
+  uint64_t x = span->first_page().index();
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+bool PageHeap::LargeSpanTree::Less(const Span* a, const Span* b) {
+  if (a->num_pages() != b->num_pages()) {
+    return a->num_pages() < b->num_pages();
+  }
+  return a->first_page() < b->first_page();
+}
+
+void PageHeap::LargeSpanTree::Split(Node* t, const Span* span, Node** less,
+                                    Node** rest) {
+  while (t != nullptr) {
+    if (Less(t->span, span)) {
+      *less = t;
+      less = &t->right;
+      t = t->right;
+    } else {
+      *rest = t;
+      rest = &t->left;
+      t = t->left;
     }
   }
+  *less = nullptr;
+  *rest = nullptr;
+}
 
-  // Search through released list in case it has a better fit
-  for (Span* span : large_.returned) {
-    ASSERT(span->location() == Span::ON_RETURNED_FREELIST);
-    if (IsSpanBetter(span, best, n)) {
-      best = span;
-      *from_returned = true;
+PageHeap::LargeSpanTree::Node* PageHeap::LargeSpanTree::Join(Node* a,
+                                                             Node* b) {
+  Node* root;
+  Node** link = &root;
+  while (a != nullptr && b != nullptr) {
+    if (a->priority >= b->priority) {
+      *link = a;
+      link = &a->right;
+      a = a->right;
+    } else {
+      *link = b;
+      link = &b->left;
+      b = b->left;
     }
   }
+  *link = (a != nullptr) ? a : b;
+  return root;
+}
 
-  return best == nullptr ? nullptr : Carve(best, n);
+void PageHeap::LargeSpanTree::Insert(Span* span) {
+  Node* node = alloc_->New();
+  node->span = span;
+  node->priority = TreapPriority(span);
+  // Descend to where node's priority puts it, then split what was there
+  // around it.
+  Node** link = &root_;
+  while (*link != nullptr && (*link)->priority >= node->priority) {
+    link = Less(span, (*link)->span) ? &(*link)->left : &(*link)->right;
+  }
+  Split(*link, span, &node->left, &node->right);
+  *link = node;
+}
+
+void PageHeap::LargeSpanTree::Remove(Span* span) {
+  Node** link = &root_;
+  while ((*link)->span != span) {
+    link = Less(span, (*link)->span) ? &(*link)->left : &(*link)->right;
+    ASSERT(*link != nullptr);
+  }
+  Node* node = *link;
+  *link = Join(node->left, node->right);
+  alloc_->Delete(node);
+}
+
+Span* PageHeap::LargeSpanTree::LowerBound(Length n) const {
+  Span* best = nullptr;
+  for (Node* t = root_; t != nullptr;) {
+    if (t->span->num_pages() >= n) {
+      best = t->span;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return best;
 }
 
 Span* PageHeap::Carve(Span* span, Length n) {
@@ -319,8 +408,8 @@ void PageHeap::MergeIntoFreeList(Span* span) {
 
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
-  SpanListPair* list =
-      (span->num_pages() < kMaxPages) ? &free_[span->num_pages()] : &large_;
+  const Length n = span->num_pages();
+  SpanListPair* list = (n < kMaxPages) ? &free_[n] : &large_;
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes += span->bytes_in_span();
     list->normal.prepend(span);
@@ -328,16 +417,35 @@ void PageHeap::PrependToFreeList(Span* span) {
     stats_.unmapped_bytes += span->bytes_in_span();
     list->returned.prepend(span);
   }
+
+  if (n < kMaxPages) {
+    nonempty_.SetBit(n);
+  } else if (span->location() == Span::ON_NORMAL_FREELIST) {
+    large_normal_.Insert(span);
+  } else {
+    large_returned_.Insert(span);
+  }
 }
 
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
+  const Length n = span->num_pages();
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= span->bytes_in_span();
   } else {
     stats_.unmapped_bytes -= span->bytes_in_span();
   }
   span->RemoveFromList();
+
+  if (n < kMaxPages) {
+    if (free_[n].normal.empty() && free_[n].returned.empty()) {
+      nonempty_.ClearBit(n);
+    }
+  } else if (span->location() == Span::ON_NORMAL_FREELIST) {
+    large_normal_.Remove(span);
+  } else {
+    large_returned_.Remove(span);
+  }
 }
 
 Length PageHeap::ReleaseLastNormalSpan(SpanListPair* slist) {
@@ -377,6 +485,7 @@ Length PageHeap::ReleaseLastNormalSpan(SpanListPair* slist) {
 }
 
 Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
   Length released_pages = 0;
   Length prev_released_pages = -1;
 
@@ -427,8 +536,12 @@ void PageHeap::GetLargeSpanStats(LargeSpanStats* result) {
 
 bool PageHeap::GrowHeap(Length n) {
   if (n > kMaxValidPages) return false;
+  // Nobody can see the new memory until we add it to our free lists, so we
+  // map it without holding pageheap_lock.
   size_t actual_size;
+  pageheap_lock.Unlock();
   void* ptr = SystemAlloc(n << kPageShift, &actual_size, kPageSize, tagged_);
+  pageheap_lock.Lock();
   if (ptr == nullptr) return false;
   n = BytesToLengthFloor(actual_size);
 
@@ -456,7 +569,9 @@ bool PageHeap::GrowHeap(Length n) {
     // We could not allocate memory within the pagemap.
     // Note the following leaks virtual memory, but at least it gets rid of
     // the underlying physical memory.
+    pageheap_lock.Unlock();
     SystemRelease(ptr, actual_size);
+    pageheap_lock.Lock();
     return false;
   }
 }
@@ -464,6 +579,7 @@ bool PageHeap::GrowHeap(Length n) {
 bool PageHeap::Check() {
   ASSERT(free_[0].normal.empty());
   ASSERT(free_[0].returned.empty());
+  ASSERT(!nonempty_.GetBit(0));
   return true;
 }
 
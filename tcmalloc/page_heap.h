@@ -19,7 +19,9 @@
 
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/range_tracker.h"
 #include "tcmalloc/page_allocator_interface.h"
+#include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
 
@@ -73,7 +75,7 @@ class PageHeap : public PageAllocatorInterface {
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
   Length ReleaseAtLeastNPages(Length num_pages)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
   // Prints stats about the page heap to *out.
   void Print(TCMalloc_Printer* out) ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
@@ -91,18 +93,67 @@ class PageHeap : public PageAllocatorInterface {
     SpanList returned;
   };
 
+  // An index of free spans of length >= kMaxPages, ordered by length and then
+  // address, so the address-ordered best fit for n pages is the first span of
+  // length >= n.  A treap whose nodes live beside the spans (the spans' own
+  // links hold them on large_), with priorities hashed from their addresses.
+  class LargeSpanTree {
+   public:
+    struct Node {
+      Node* left;
+      Node* right;
+      Span* span;
+      uint64_t priority;
+    };
+
+    void Init(PageHeapAllocator<Node>* alloc) {
+      alloc_ = alloc;
+      root_ = nullptr;
+    }
+
+    void Insert(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+    void Remove(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+    // Returns the first span of length >= n, or nullptr if there is none.
+    Span* LowerBound(Length n) const
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+   private:
+    // (length, address) order.
+    static bool Less(const Span* a, const Span* b);
+
+    // Splits t into spans less than span, and the rest.
+    static void Split(Node* t, const Span* span, Node** less, Node** rest);
+    // Joins trees where everything in a comes before everything in b.
+    static Node* Join(Node* a, Node* b);
+
+    PageHeapAllocator<Node>* alloc_;
+    Node* root_;
+  };
+
   // List of free spans of length >= kMaxPages
   SpanListPair large_ ABSL_GUARDED_BY(pageheap_lock);
 
+  // large_.normal and large_.returned, ordered for best fit.
+  LargeSpanTree large_normal_ ABSL_GUARDED_BY(pageheap_lock);
+  LargeSpanTree large_returned_ ABSL_GUARDED_BY(pageheap_lock);
+  PageHeapAllocator<LargeSpanTree::Node> node_allocator_
+      ABSL_GUARDED_BY(pageheap_lock);
+
   // Array mapping from span length to a doubly linked list of free spans
   SpanListPair free_[kMaxPages] ABSL_GUARDED_BY(pageheap_lock);
 
+  // Bit s is set iff free_[s] has a span on either of its lists.
+  Bitmap<kMaxPages> nonempty_ ABSL_GUARDED_BY(pageheap_lock);
+
   // Statistics on system, free, and unmapped bytes
   BackingStats stats_ ABSL_GUARDED_BY(pageheap_lock);
 
   Span* SearchFreeAndLargeLists(Length n, bool* from_returned)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Adds at least n pages from the system to the returned free lists.  Drops
+  // pageheap_lock while it does so.
   bool GrowHeap(Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // REQUIRES: span->length >= n
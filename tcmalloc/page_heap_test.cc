@@ -17,12 +17,16 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <memory>
 #include <new>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "benchmark/benchmark.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/memory/memory.h"
+#include "absl/random/random.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/static_vars.h"
@@ -57,10 +61,54 @@ static void Delete(tcmalloc::PageHeap* ph, tcmalloc::Span* s)
 }
 
 static Length Release(tcmalloc::PageHeap* ph, Length n) {
-  absl::base_internal::SpinLockHolder h(&tcmalloc::pageheap_lock);
   return ph->ReleaseAtLeastNPages(n);
 }
 
+// Allocates whatever ph has free, so that it has nothing free and all future
+// frees are of spans the caller chose.
+static void Drain(tcmalloc::PageHeap* ph) {
+  for (;;) {
+    SmallSpanStats small;
+    LargeSpanStats large;
+    {
+      absl::base_internal::SpinLockHolder h(&tcmalloc::pageheap_lock);
+      ph->GetSmallSpanStats(&small);
+      ph->GetLargeSpanStats(&large);
+    }
+    Length n = 0;
+    for (Length s = 1; s < kMaxPages && n == 0; ++s) {
+      if (small.normal_length[s] + small.returned_length[s] > 0) n = s;
+    }
+    if (n == 0 && large.spans > 0) n = kMaxPages;
+    if (n == 0) return;
+    ph->New(n);
+  }
+}
+
+// Allocates spans of the given lengths, each between two allocated pages,
+// then frees them, so that they are ph's only free spans.  Each comes from a
+// fresh kMinSystemAlloc of its own, so must be at most two pages shorter.
+static std::vector<PageId> Fragment(tcmalloc::PageHeap* ph,
+                                    const std::vector<Length>& lengths) {
+  std::vector<tcmalloc::Span*> spans;
+  for (Length n : lengths) {
+    CHECK_CONDITION(n + 2 <= kMinSpanLength);
+    // With nothing else free, these carve up a new allocation from one end,
+    // the separators either side of the span.
+    Drain(ph);
+    ph->New(1);
+    spans.push_back(ph->New(n));
+    ph->New(1);
+  }
+  Drain(ph);
+  std::vector<PageId> starts;
+  for (tcmalloc::Span* s : spans) {
+    starts.push_back(s->first_page());
+    Delete(ph, s);
+  }
+  return starts;
+}
+
 class PageHeapTest : public ::testing::Test {
  public:
   PageHeapTest() {
@@ -106,5 +154,101 @@ TEST_F(PageHeapTest, Stats) {
   free(memory);
 }
 
+// Both small and large requests take the shortest free span that fits, and
+// the lowest such.
+TEST_F(PageHeapTest, BestFit) {
+  auto pagemap = absl::make_unique<tcmalloc::PageMap>();
+  void* memory = calloc(1, sizeof(tcmalloc::PageHeap));
+  tcmalloc::PageHeap* ph = new (memory) tcmalloc::PageHeap(pagemap.get(),
+                                                           /*tagged=*/false);
+
+  const std::vector<PageId> starts =
+      Fragment(ph, {5, 7, 9, kMaxPages + 40, kMaxPages + 10, kMaxPages + 100,
+                    kMaxPages + 10});
+  const PageId lower = std::min(starts[4], starts[6]);
+  const PageId upper = std::max(starts[4], starts[6]);
+  EXPECT_EQ(lower, ph->New(kMaxPages + 5)->first_page());
+  EXPECT_EQ(upper, ph->New(kMaxPages + 5)->first_page());
+  EXPECT_EQ(starts[3], ph->New(kMaxPages + 20)->first_page());
+  EXPECT_EQ(starts[5], ph->New(kMaxPages + 60)->first_page());
+  // Left over: 5, 5, 5, 7, 9, 20 and 40 pages.
+  EXPECT_EQ(starts[1], ph->New(6)->first_page());
+  EXPECT_EQ(starts[2], ph->New(8)->first_page());
+  EXPECT_EQ(starts[5] + kMaxPages + 60, ph->New(30)->first_page());
+  Length system_pages;
+  {
+    absl::base_internal::SpinLockHolder h(&tcmalloc::pageheap_lock);
+    system_pages = ph->stats().system_bytes >> kPageShift;
+  }
+  CheckStats(ph, system_pages, 3 * 5 + 20 + 1 + 1 + 10, 0);
+
+  free(memory);
+}
+
+// A PageHeap whose free memory is num_spans spans of random lengths in
+// [min, max], which the benchmarks allocate from and free back to.  Without
+// an index, finding a large span's best fit means looking at all of them.
+class FragmentedHeap {
+ public:
+  FragmentedHeap(size_t num_spans, Length min, Length max)
+      : pagemap_(absl::make_unique<tcmalloc::PageMap>()),
+        memory_(calloc(1, sizeof(tcmalloc::PageHeap))) {
+    Static::InitIfNecessary();
+    ph_ = new (memory_) tcmalloc::PageHeap(pagemap_.get(), /*tagged=*/false);
+    absl::BitGen rng;
+    std::vector<Length> lengths;
+    for (size_t i = 0; i < num_spans; ++i) {
+      lengths.push_back(
+          absl::Uniform<Length>(absl::IntervalClosed, rng, min, max));
+    }
+    Fragment(ph_, lengths);
+    for (size_t i = 0; i < 4096; ++i) {
+      requests_.push_back(
+          absl::Uniform<Length>(absl::IntervalClosed, rng, min, max));
+    }
+  }
+
+  // The heap's memory stays mapped, as it would in a PageHeap that lived as
+  // long as the process.
+  ~FragmentedHeap() { free(memory_); }
+
+  tcmalloc::PageHeap* ph() { return ph_; }
+  Length request(size_t i) const { return requests_[i % requests_.size()]; }
+
+ private:
+  std::unique_ptr<tcmalloc::PageMap> pagemap_;
+  void* memory_;
+  tcmalloc::PageHeap* ph_;
+  std::vector<Length> requests_;
+};
+
+void BM_NewDeleteSmall(benchmark::State& state) {
+  FragmentedHeap heap(state.range(0), 1, kMaxPages - 1);
+  size_t i = 0;
+  for (auto _ : state) {
+    Delete(heap.ph(), heap.ph()->New(heap.request(i++)));
+  }
+}
+BENCHMARK(BM_NewDeleteSmall)->Range(64, 4096);
+
+void BM_NewDeleteLarge(benchmark::State& state) {
+  FragmentedHeap heap(state.range(0), kMaxPages, 2 * kMaxPages - 2);
+  size_t i = 0;
+  for (auto _ : state) {
+    Delete(heap.ph(), heap.ph()->New(heap.request(i++)));
+  }
+}
+BENCHMARK(BM_NewDeleteLarge)->Range(64, 4096);
+
+void BM_NewAlignedDeleteLarge(benchmark::State& state) {
+  FragmentedHeap heap(state.range(0), kMaxPages, 2 * kMaxPages - 2);
+  size_t i = 0;
+  for (auto _ : state) {
+    Delete(heap.ph(),
+           heap.ph()->NewAligned(heap.request(i++) / 2, kMaxPages / 4));
+  }
+}
+BENCHMARK(BM_NewAlignedDeleteLarge)->Range(64, 4096);
+
 }  // namespace
 }  // namespace tcmalloc
@@ -0,0 +1,143 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/page_run_cache.h"
+
+#include <algorithm>
+
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/parameters.h"
+
+namespace tcmalloc {
+
+PageRunCache::PageRunCache() {
+  for (Shard& shard : shards_) {
+    shard.pages = 0;
+    for (auto& lists : shard.lists) {
+      for (List& list : lists) {
+        list.spans.Init();
+        list.length = 0;
+        list.low_water = 0;
+      }
+    }
+    shard.hits = 0;
+    shard.misses = 0;
+    shard.overflows = 0;
+    shard.flushed_pages = 0;
+  }
+}
+
+PageRunCache::Shard* PageRunCache::CurrentShard() {
+  // Migrating right after this is harmless: the shard lock keeps us correct,
+  // and we only lose a little locality.
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  return &shards_[cpu >= 0 ? cpu % kNumShards : 0];
+}
+
+Span* PageRunCache::Get(Length n, bool tagged) {
+  if (n > kMaxRunPages || cached_pages() == 0) return nullptr;
+
+  Shard* shard = CurrentShard();
+  Span* span;
+  {
+    absl::base_internal::SpinLockHolder h(&shard->lock);
+    List& list = shard->lists[tagged][n - 1];
+    if (list.length == 0) {
+      shard->misses++;
+      return nullptr;
+    }
+    span = list.spans.first();
+    list.spans.remove(span);
+    list.length--;
+    list.low_water = std::min(list.low_water, list.length);
+    shard->pages -= n;
+    shard->hits++;
+  }
+  cached_pages_.fetch_sub(n, std::memory_order_relaxed);
+
+  ASSERT(span->num_pages() == n);
+  span->Init(span->first_page(), n);
+  return span;
+}
+
+bool PageRunCache::Put(Span* span, bool tagged) {
+  const Length n = span->num_pages();
+  if (n > kMaxRunPages) return false;
+  const int64_t bytes = Parameters::page_run_cache_bytes();
+  if (bytes <= 0) return false;
+  const Length limit = BytesToLengthFloor(bytes);
+
+  Shard* shard = CurrentShard();
+  {
+    absl::base_internal::SpinLockHolder h(&shard->lock);
+    if (shard->pages + n > limit) {
+      shard->overflows++;
+      return false;
+    }
+    List& list = shard->lists[tagged][n - 1];
+    list.spans.prepend(span);
+    list.length++;
+    shard->pages += n;
+  }
+  cached_pages_.fetch_add(n, std::memory_order_relaxed);
+  return true;
+}
+
+void PageRunCache::AddSpanStats(SmallSpanStats* result) const {
+  for (const Shard& shard : shards_) {
+    absl::base_internal::SpinLockHolder h(&shard.lock);
+    for (const auto& lists : shard.lists) {
+      for (Length n = 1; n <= kMaxRunPages && n < kMaxPages; ++n) {
+        result->normal_length[n] += lists[n - 1].length;
+      }
+    }
+  }
+}
+
+PageRunCache::Totals PageRunCache::Sum() const {
+  Totals t;
+  for (const Shard& shard : shards_) {
+    absl::base_internal::SpinLockHolder h(&shard.lock);
+    t.pages += shard.pages;
+    t.shards += shard.pages > 0;
+    t.hits += shard.hits;
+    t.misses += shard.misses;
+    t.overflows += shard.overflows;
+    t.flushed_pages += shard.flushed_pages;
+  }
+  return t;
+}
+
+void PageRunCache::Print(TCMalloc_Printer* out) const {
+  const Totals t = Sum();
+  out->printf(
+      "PageRunCache: %zu pages (%.1f MiB) cached in %d of %d shards; "
+      "%lld hits, %lld misses, %lld overflows, %lld pages flushed\n",
+      t.pages, t.pages * kPageSize / 1048576.0, t.shards, kNumShards,
+      static_cast<long long>(t.hits), static_cast<long long>(t.misses),
+      static_cast<long long>(t.overflows),
+      static_cast<long long>(t.flushed_pages));
+}
+
+void PageRunCache::PrintInPbtxt(PbtxtRegion* region) const {
+  const Totals t = Sum();
+  auto cache = region->CreateSubRegion("page_run_cache");
+  cache.PrintI64("cached_bytes", t.pages * kPageSize);
+  cache.PrintI64("hits", t.hits);
+  cache.PrintI64("misses", t.misses);
+  cache.PrintI64("overflows", t.overflows);
+  cache.PrintI64("flushed_bytes", t.flushed_pages * kPageSize);
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,154 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_PAGE_RUN_CACHE_H_
+#define TCMALLOC_PAGE_RUN_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/spinlock.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/stats.h"
+
+namespace tcmalloc {
+
+// Keeps recently freed short runs of pages in per-CPU shards, so that the
+// spans we allocate and free most often (central freelist spans, sampled
+// objects, smallish large allocations) can change hands without
+// pageheap_lock.
+//
+// A cached span is still allocated as far as the page heap is concerned and
+// keeps its pagemap entries; we only decide who gets it next.  Each shard
+// holds at most Parameters::page_run_cache_bytes(), and Flush() hands back
+// whatever sat unused since the previous Flush().
+class PageRunCache {
+ public:
+  // Longest run we cache.
+  static constexpr Length kMaxRunPages = 8;
+  // CPUs share shards modulo this.
+  static constexpr int kNumShards = 64;
+
+  PageRunCache();
+
+  // Returns a cached run of exactly n pages, reinitialized as a fresh
+  // allocation, or nullptr.
+  Span* Get(Length n, bool tagged);
+
+  // Takes ownership of span if it is short enough and the current CPU's shard
+  // has room for it.  Returns false (leaving span to the caller) otherwise.
+  // May be called with or without pageheap_lock.
+  bool Put(Span* span, bool tagged);
+
+  // Removes runs from the cache, passing each to release(span, tagged): all of
+  // them if "all", otherwise only those that were not needed since the last
+  // call.  Returns the number of pages removed.  release runs with a shard
+  // lock held, so it must not come back into the cache.
+  template <typename Release>
+  Length Flush(bool all, Release release);
+
+  // Pages currently cached, over all shards.
+  Length cached_pages() const {
+    return cached_pages_.load(std::memory_order_relaxed);
+  }
+
+  // Adds the cached runs to *result, as backed free spans.
+  void AddSpanStats(SmallSpanStats* result) const;
+
+  void Print(TCMalloc_Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  struct List {
+    SpanList spans;
+    size_t length;
+    // Minimum of length since the last Flush().
+    size_t low_water;
+  };
+
+  // Not cacheline-aligned, since PageAllocator isn't, but large enough that
+  // neighbouring shards share at most one line.
+  struct Shard {
+    Shard()
+        : lock(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+    mutable absl::base_internal::SpinLock lock;
+    Length pages;
+    // Indexed by [tagged][n - 1].
+    List lists[2][kMaxRunPages];
+    int64_t hits;
+    // Lookups that found the cache non-empty, but not our list.
+    int64_t misses;
+    // Puts refused because the shard was full.
+    int64_t overflows;
+    int64_t flushed_pages;
+  };
+
+  struct Totals {
+    Length pages = 0;
+    int shards = 0;
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t overflows = 0;
+    int64_t flushed_pages = 0;
+  };
+
+  Totals Sum() const;
+
+  // A shard for the CPU we are running on (or were, a moment ago).
+  Shard* CurrentShard();
+
+  Shard shards_[kNumShards];
+  std::atomic<Length> cached_pages_{0};
+};
+
+template <typename Release>
+Length PageRunCache::Flush(bool all, Release release) {
+  if (cached_pages() == 0) return 0;
+
+  Length flushed = 0;
+  for (Shard& shard : shards_) {
+    absl::base_internal::SpinLockHolder h(&shard.lock);
+    if (shard.pages == 0) continue;
+    const Length before = shard.pages;
+    for (int tagged = 0; tagged < 2; ++tagged) {
+      for (Length i = 0; i < kMaxRunPages; ++i) {
+        List& list = shard.lists[tagged][i];
+        size_t evict = all ? list.length : list.low_water;
+        while (evict-- > 0) {
+          // The oldest runs sit at the back.
+          Span* span = list.spans.last();
+          list.spans.remove(span);
+          list.length--;
+          shard.pages -= i + 1;
+          flushed += i + 1;
+          release(span, tagged != 0);
+        }
+        list.low_water = list.length;
+      }
+    }
+    shard.flushed_pages += before - shard.pages;
+  }
+  cached_pages_.fetch_sub(flushed, std::memory_order_relaxed);
+  return flushed;
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_PAGE_RUN_CACHE_H_
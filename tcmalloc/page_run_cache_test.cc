@@ -0,0 +1,197 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/page_run_cache.h"
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/util.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/stats.h"
+
+namespace tcmalloc {
+namespace {
+
+class PageRunCacheTest : public testing::Test {
+ protected:
+  static constexpr Length kBudget = 16;
+
+  PageRunCacheTest()
+      : mask_(tcmalloc_internal::AllowedCpus()[0]),
+        cache_(absl::make_unique<PageRunCache>()) {
+    Static::InitIfNecessary();
+    before_ = Parameters::page_run_cache_bytes();
+    Parameters::set_page_run_cache_bytes(kBudget * kPageSize);
+  }
+
+  ~PageRunCacheTest() override {
+    Parameters::set_page_run_cache_bytes(before_);
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (Span* s : spans_) Span::Delete(s);
+  }
+
+  // The cache never looks at the pages themselves, so they needn't exist.
+  Span* NewSpan(Length n) {
+    Span* s;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      s = Span::New(next_, n);
+    }
+    next_ += n;
+    spans_.push_back(s);
+    return s;
+  }
+
+  Length FlushAll() {
+    return cache_->Flush(/*all=*/true, [](Span*, bool) {});
+  }
+
+  // Keeps us in one shard.
+  tcmalloc_internal::ScopedAffinityMask mask_;
+  std::unique_ptr<PageRunCache> cache_;
+  int64_t before_;
+  PageId next_{1 << 20};
+  std::vector<Span*> spans_;
+};
+
+TEST_F(PageRunCacheTest, GetReturnsWhatWasPut) {
+  std::vector<Span*> put;
+  for (Length n = 1; n <= 4; ++n) {
+    Span* s = NewSpan(n);
+    ASSERT_TRUE(cache_->Put(s, /*tagged=*/false));
+    put.push_back(s);
+  }
+  EXPECT_EQ(10, cache_->cached_pages());
+
+  // Exact lengths only, and tags are kept apart.
+  EXPECT_EQ(nullptr, cache_->Get(5, /*tagged=*/false));
+  EXPECT_EQ(nullptr, cache_->Get(2, /*tagged=*/true));
+  for (Length n = 4; n >= 1; --n) {
+    Span* s = cache_->Get(n, /*tagged=*/false);
+    ASSERT_EQ(put[n - 1], s);
+    EXPECT_EQ(n, s->num_pages());
+    EXPECT_EQ(Span::IN_USE, s->location());
+    EXPECT_EQ(nullptr, cache_->Get(n, /*tagged=*/false));
+  }
+  EXPECT_EQ(0, cache_->cached_pages());
+
+  // Most recently freed first.
+  Span* a = NewSpan(2);
+  Span* b = NewSpan(2);
+  ASSERT_TRUE(cache_->Put(a, /*tagged=*/true));
+  ASSERT_TRUE(cache_->Put(b, /*tagged=*/true));
+  EXPECT_EQ(b, cache_->Get(2, /*tagged=*/true));
+  EXPECT_EQ(a, cache_->Get(2, /*tagged=*/true));
+}
+
+TEST_F(PageRunCacheTest, Bounded) {
+  EXPECT_FALSE(cache_->Put(NewSpan(PageRunCache::kMaxRunPages + 1),
+                           /*tagged=*/false));
+
+  Length cached = 0;
+  while (cache_->Put(NewSpan(3), /*tagged=*/false)) cached += 3;
+  EXPECT_EQ(kBudget / 3 * 3, cached);
+  EXPECT_EQ(cached, cache_->cached_pages());
+  // A shorter run may still fit.
+  EXPECT_TRUE(cache_->Put(NewSpan(1), /*tagged=*/false));
+
+  // Disabled, we take nothing but still hand out what we have.
+  Parameters::set_page_run_cache_bytes(0);
+  EXPECT_FALSE(cache_->Put(NewSpan(1), /*tagged=*/false));
+  EXPECT_NE(nullptr, cache_->Get(3, /*tagged=*/false));
+  EXPECT_EQ(cached - 2, FlushAll());
+}
+
+TEST_F(PageRunCacheTest, FlushTakesIdleRuns) {
+  std::vector<Span*> released;
+  auto release = [&](Span* s, bool tagged) {
+    EXPECT_FALSE(tagged);
+    released.push_back(s);
+  };
+
+  Span* spans[4];
+  for (Span*& s : spans) {
+    s = NewSpan(1);
+    ASSERT_TRUE(cache_->Put(s, /*tagged=*/false));
+  }
+  // Nothing has been idle for a whole interval yet.
+  EXPECT_EQ(0, cache_->Flush(/*all=*/false, release));
+
+  // Only one of the four was needed since.
+  Span* s = cache_->Get(1, /*tagged=*/false);
+  ASSERT_TRUE(cache_->Put(s, /*tagged=*/false));
+  EXPECT_EQ(3, cache_->Flush(/*all=*/false, release));
+  // Oldest first.
+  EXPECT_THAT(released, testing::ElementsAre(spans[0], spans[1], spans[2]));
+  EXPECT_EQ(1, cache_->cached_pages());
+  EXPECT_EQ(s, cache_->Get(1, /*tagged=*/false));
+  ASSERT_TRUE(cache_->Put(s, /*tagged=*/false));
+
+  EXPECT_EQ(1, cache_->Flush(/*all=*/true, release));
+  EXPECT_EQ(0, cache_->cached_pages());
+  EXPECT_EQ(0, cache_->Flush(/*all=*/true, release));
+}
+
+TEST_F(PageRunCacheTest, Stats) {
+  ASSERT_TRUE(cache_->Put(NewSpan(2), /*tagged=*/false));
+  ASSERT_TRUE(cache_->Put(NewSpan(2), /*tagged=*/true));
+  ASSERT_TRUE(cache_->Put(NewSpan(5), /*tagged=*/false));
+  EXPECT_NE(nullptr, cache_->Get(5, /*tagged=*/false));
+  EXPECT_EQ(nullptr, cache_->Get(3, /*tagged=*/false));
+
+  SmallSpanStats small;
+  memset(&small, 0, sizeof(small));
+  cache_->AddSpanStats(&small);
+  EXPECT_EQ(2, small.normal_length[2]);
+  EXPECT_EQ(0, small.normal_length[5]);
+
+  std::string buffer(1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    cache_->Print(&printer);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("PageRunCache: 4 pages ("));
+  EXPECT_THAT(buffer, testing::HasSubstr("cached in 1 of 64 shards; 1 hits, "
+                                         "1 misses, 0 overflows"));
+
+  buffer.assign(1024, '\0');
+  {
+    TCMalloc_Printer printer(&*buffer.begin(), buffer.size());
+    PbtxtRegion top(&printer, kTop, /*indent=*/0);
+    cache_->PrintInPbtxt(&top);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr(absl::StrCat(
+                          "cached_bytes: ", 4 * kPageSize)));
+  EXPECT_THAT(buffer, testing::HasSubstr("hits: 1"));
+
+  EXPECT_EQ(4, FlushAll());
+}
+
+}  // namespace
+}  // namespace tcmalloc
@@ -19,6 +19,7 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
 
 namespace tcmalloc {
 
@@ -42,6 +43,12 @@ void PageMap::UnregisterSizeClass(Span* span) {
   }
 }
 
+size_t PageMap::ReleaseLeaves(PageId p, Length n) {
+  return map_.ReleaseLeaves(p.index(), n, [](void* leaf, size_t bytes) {
+    SystemReleaseMetadata(leaf, bytes);
+  });
+}
+
 void PageMap::MapRootWithSmallPages() {
   constexpr size_t kHugePageMask = ~(kHugePageSize - 1);
   uintptr_t begin = reinterpret_cast<uintptr_t>(map_.RootAddress());
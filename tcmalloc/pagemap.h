@@ -173,6 +173,29 @@ class PageMap2 {
     return true;
   }
 
+  // Passes each leaf that covers nothing outside [start, start + n), which
+  // must no longer be in use, to release(leaf, bytes), which may discard its
+  // memory.  The leaves stay where they are, to be faulted back in when
+  // [start, start + n) is used again.  As they never come to cover other
+  // keys, a lock-free lookup racing with this reads either the stale entry
+  // for its own page or zero.
+  // Returns the bytes of leaves passed to release.
+  template <typename Release>
+  size_t ReleaseLeaves(Number start, size_t n, Release release) {
+    size_t released = 0;
+    const Number end = start + n;
+    for (Number key = (start + kLeafLength - 1) & ~Number{kLeafLength - 1};
+         key + kLeafLength <= end; key += kLeafLength) {
+      const Number i1 = key >> kLeafBits;
+      if (i1 >= kRootLength) break;
+      Leaf* leaf = root_[i1];
+      if (leaf == nullptr) continue;
+      release(leaf, sizeof(Leaf));
+      released += sizeof(Leaf);
+    }
+    return released;
+  }
+
   size_t bytes_used() const {
     // Account for size of root node, etc.
     return bytes_used_ + sizeof(*this);
@@ -347,6 +370,25 @@ class PageMap3 {
     return true;
   }
 
+  // As PageMap2::ReleaseLeaves.  Mid-level nodes are left alone.
+  template <typename Release>
+  size_t ReleaseLeaves(Number start, size_t n, Release release) {
+    size_t released = 0;
+    const Number end = start + n;
+    for (Number key = (start + kLeafLength - 1) & ~Number{kLeafLength - 1};
+         key + kLeafLength <= end; key += kLeafLength) {
+      const Number i1 = key >> (kLeafBits + kMidBits);
+      const Number i2 = (key >> kLeafBits) & (kMidLength - 1);
+      if (i1 >= kRootLength) break;
+      if (root_[i1] == nullptr) continue;
+      Leaf* leaf = root_[i1]->leafs[i2];
+      if (leaf == nullptr) continue;
+      release(leaf, sizeof(Leaf));
+      released += sizeof(Leaf);
+    }
+    return released;
+  }
+
   size_t bytes_used() const { return bytes_used_ + sizeof(*this); }
 
   constexpr size_t RootSize() const { return sizeof(root_); }
@@ -370,6 +412,12 @@ class PageMap {
     return map_.Ensure(p.index(), n);
   }
 
+  // Releases the memory of the leaves that cover only [p, p + n), which we
+  // are giving back to the OS, until we use the range again.  Returns the
+  // bytes of leaves released.
+  size_t ReleaseLeaves(PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Mark an allocated span as being used for small objects of the
   // specified size-class.
   // REQUIRES: span was returned by an earlier call to PageAllocator::New()
@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -59,6 +60,9 @@ class PageMapTest : public ::testing::TestWithParam<int> {
     ptrs()->clear();
   }
 
+ protected:
+  static size_t allocs() { return ptrs()->size(); }
+
  private:
   static std::vector<void*>* ptrs() {
     static std::vector<void*>* ret = new std::vector<void*>();
@@ -134,6 +138,39 @@ TEST_P(PageMapTest, RandomAccess) {
   }
 }
 
+TEST_P(PageMapTest, ReleaseLeaves) {
+  constexpr intptr_t kLeaf = 1 << 15;
+  map->Ensure(0, 4 * kLeaf);
+  for (intptr_t i = 0; i < 4 * kLeaf; i += kLeaf / 2) {
+    map->set_with_sizeclass(i, span(i), sc(i));
+  }
+  const size_t bytes = map->bytes_used();
+  const size_t allocated = allocs();
+
+  // Only the leaves wholly inside the range are released, and they stay put.
+  std::vector<void*> released;
+  const size_t released_bytes =
+      map->ReleaseLeaves(100, 3 * kLeaf, [&](void* leaf, size_t bytes) {
+        released.push_back(leaf);
+        memset(leaf, 0, bytes);
+      });
+  EXPECT_EQ(2, released.size());
+  EXPECT_LT(0, released_bytes);
+  EXPECT_EQ(bytes, map->bytes_used());
+  EXPECT_EQ(span(0), map->get(0));
+  EXPECT_EQ(nullptr, map->get(kLeaf));
+  EXPECT_EQ(nullptr, map->get(2 * kLeaf + kLeaf / 2));
+  EXPECT_EQ(span(3 * kLeaf), map->get(3 * kLeaf));
+  EXPECT_EQ(0, map->ReleaseLeaves(0, kLeaf - 1, [](void*, size_t) {}));
+
+  // Using the range again needs no new leaves.
+  ASSERT_TRUE(map->Ensure(kLeaf, 2 * kLeaf));
+  EXPECT_EQ(bytes, map->bytes_used());
+  EXPECT_EQ(allocated, allocs());
+  map->set_with_sizeclass(kLeaf, span(kLeaf), sc(kLeaf));
+  EXPECT_EQ(span(kLeaf), map->get(kLeaf));
+}
+
 INSTANTIATE_TEST_SUITE_P(Limits, PageMapTest, ::testing::Values(100, 1 << 20));
 
 // Surround pagemap with unused memory. This isolates it so that it does not
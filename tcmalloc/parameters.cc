@@ -17,6 +17,7 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/page_allocator.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/thread_cache.h"
 
@@ -29,10 +30,16 @@ static std::atomic<bool>* hpaa_subrelease_ptr() {
   return &v;
 }
 
+// Likewise, as the default comes from the environment.
+static std::atomic<double>* cgroup_memory_limit_fraction_ptr() {
+  static std::atomic<double> v(decide_cgroup_memory_limit_fraction());
+  return &v;
+}
+
 uint64_t Parameters::heap_size_hard_limit() {
   size_t amount;
   bool is_hard;
-  std::tie(amount, is_hard) = Static::page_allocator()->limit();
+  std::tie(amount, is_hard) = Static::page_allocator()->user_limit();
   if (!is_hard) {
     amount = 0;
   }
@@ -43,6 +50,14 @@ void Parameters::set_heap_size_hard_limit(uint64_t value) {
   TCMalloc_Internal_SetHeapSizeHardLimit(value);
 }
 
+double Parameters::cgroup_memory_limit_fraction() {
+  return cgroup_memory_limit_fraction_ptr()->load(std::memory_order_relaxed);
+}
+
+void Parameters::set_cgroup_memory_limit_fraction(double value) {
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(value);
+}
+
 bool Parameters::hpaa_subrelease() {
   return hpaa_subrelease_ptr()->load(std::memory_order_relaxed);
 }
@@ -51,14 +66,29 @@ void Parameters::set_hpaa_subrelease(bool value) {
   TCMalloc_Internal_SetHPAASubrelease(value);
 }
 
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::filler_adaptive_partial_rerelease_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::filler_segregate_span_lengths_(
+    false);
 ABSL_CONST_INIT std::atomic<int64_t> Parameters::guarded_sampling_rate_(
     50 * kDefaultProfileSamplingRate);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::huge_cache_deferred_unback_bytes_(0);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::huge_cache_warm_reserve_bytes_(0);
+ABSL_CONST_INIT std::atomic<bool> Parameters::hugepage_collapse_enabled_(
+    false);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::large_run_cache_bytes_(0);
 ABSL_CONST_INIT std::atomic<bool> Parameters::lazy_per_cpu_caches_enabled_(
     true);
+ABSL_CONST_INIT std::atomic<bool> Parameters::madvise_free_enabled_(false);
 ABSL_CONST_INIT std::atomic<int32_t> Parameters::max_per_cpu_cache_size_(
     kMaxCpuCacheSize);
 ABSL_CONST_INIT std::atomic<int64_t> Parameters::max_total_thread_cache_bytes_(
     kDefaultOverallThreadCacheSize);
+ABSL_CONST_INIT std::atomic<double>
+    Parameters::memory_pressure_release_threshold_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::page_run_cache_bytes_(0);
 ABSL_CONST_INIT std::atomic<double>
     Parameters::peak_sampling_heap_growth_fraction_(1.25);
 ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_enabled_(
@@ -69,12 +99,20 @@ ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_enabled_(
 #endif
 );
 
+ABSL_CONST_INIT std::atomic<bool> Parameters::populate_on_back_enabled_(false);
+
 ABSL_CONST_INIT std::atomic<int64_t> Parameters::profile_sampling_rate_(
     kDefaultProfileSamplingRate
 );
 
 ABSL_CONST_INIT std::atomic<int64_t>
     Parameters::filler_skip_subrelease_interval_ns_(0);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::filler_skip_subrelease_max_interval_ns_(0);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::thp_coverage_sample_interval_ns_(0);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::unmap_idle_address_space_interval_ns_(0);
 
 }  // namespace tcmalloc
 
@@ -104,6 +142,18 @@ void MallocExtension_Internal_SetMaxTotalThreadCacheBytes(int64_t value) {
   tcmalloc::Parameters::set_max_total_thread_cache_bytes(value);
 }
 
+double TCMalloc_Internal_GetCgroupMemoryLimitFraction() {
+  return tcmalloc::Parameters::cgroup_memory_limit_fraction();
+}
+
+bool TCMalloc_Internal_GetFillerAdaptivePartialRerelease() {
+  return tcmalloc::Parameters::filler_adaptive_partial_rerelease();
+}
+
+bool TCMalloc_Internal_GetFillerSegregateSpanLengths() {
+  return tcmalloc::Parameters::filler_segregate_span_lengths();
+}
+
 uint64_t TCMalloc_Internal_GetHeapSizeHardLimit() {
   return tcmalloc::Parameters::heap_size_hard_limit();
 }
@@ -112,10 +162,38 @@ bool TCMalloc_Internal_GetHPAASubrelease() {
   return tcmalloc::Parameters::hpaa_subrelease();
 }
 
+int64_t TCMalloc_Internal_GetHugeCacheDeferredUnbackBytes() {
+  return tcmalloc::Parameters::huge_cache_deferred_unback_bytes();
+}
+
+int64_t TCMalloc_Internal_GetHugeCacheWarmReserveBytes() {
+  return tcmalloc::Parameters::huge_cache_warm_reserve_bytes();
+}
+
+bool TCMalloc_Internal_GetHugePageCollapseEnabled() {
+  return tcmalloc::Parameters::hugepage_collapse();
+}
+
+int64_t TCMalloc_Internal_GetLargeRunCacheBytes() {
+  return tcmalloc::Parameters::large_run_cache_bytes();
+}
+
 bool TCMalloc_Internal_GetLazyPerCpuCachesEnabled() {
   return tcmalloc::Parameters::lazy_per_cpu_caches();
 }
 
+bool TCMalloc_Internal_GetMadviseFreeEnabled() {
+  return tcmalloc::Parameters::madvise_free();
+}
+
+double TCMalloc_Internal_GetMemoryPressureReleaseThreshold() {
+  return tcmalloc::Parameters::memory_pressure_release_threshold();
+}
+
+int64_t TCMalloc_Internal_GetPageRunCacheBytes() {
+  return tcmalloc::Parameters::page_run_cache_bytes();
+}
+
 double TCMalloc_Internal_GetPeakSamplingHeapGrowthFraction() {
   return tcmalloc::Parameters::peak_sampling_heap_growth_fraction();
 }
@@ -124,11 +202,34 @@ bool TCMalloc_Internal_GetPerCpuCachesEnabled() {
   return tcmalloc::Parameters::per_cpu_caches();
 }
 
+bool TCMalloc_Internal_GetPopulateOnBackEnabled() {
+  return tcmalloc::Parameters::populate_on_back();
+}
+
+void TCMalloc_Internal_SetFillerAdaptivePartialRerelease(bool v) {
+  tcmalloc::Parameters::filler_adaptive_partial_rerelease_.store(
+      v, std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetFillerSegregateSpanLengths(bool v) {
+  tcmalloc::Parameters::filler_segregate_span_lengths_.store(
+      v, std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetGuardedSamplingRate(int64_t v) {
   tcmalloc::Parameters::guarded_sampling_rate_.store(v,
                                                      std::memory_order_relaxed);
 }
 
+void TCMalloc_Internal_SetCgroupMemoryLimitFraction(double v) {
+  // Ensure that page allocator is set up.
+  tcmalloc::Static::InitIfNecessary();
+
+  tcmalloc::cgroup_memory_limit_fraction_ptr()->store(
+      v, std::memory_order_relaxed);
+  tcmalloc::Static::page_allocator()->UpdateCgroupLimit(/*force=*/true);
+}
+
 // update_lock guards changes via SetHeapSizeHardLimit.
 ABSL_CONST_INIT static absl::base_internal::SpinLock update_lock(
     absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
@@ -146,7 +247,8 @@ void TCMalloc_Internal_SetHeapSizeHardLimit(uint64_t value) {
     active = true;
   }
 
-  bool currently_hard = tcmalloc::Static::page_allocator()->limit().second;
+  bool currently_hard =
+      tcmalloc::Static::page_allocator()->user_limit().second;
   if (active || currently_hard) {
     // Avoid resetting limit when current limit is soft.
     tcmalloc::Static::page_allocator()->set_limit(limit, active /* is_hard */);
@@ -159,11 +261,36 @@ void TCMalloc_Internal_SetHPAASubrelease(bool v) {
   tcmalloc::hpaa_subrelease_ptr()->store(v, std::memory_order_relaxed);
 }
 
+void TCMalloc_Internal_SetHugeCacheDeferredUnbackBytes(int64_t v) {
+  tcmalloc::Parameters::huge_cache_deferred_unback_bytes_.store(
+      v, std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetHugeCacheWarmReserveBytes(int64_t v) {
+  tcmalloc::Parameters::huge_cache_warm_reserve_bytes_.store(
+      v, std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetHugePageCollapseEnabled(bool v) {
+  tcmalloc::Parameters::hugepage_collapse_enabled_.store(
+      v, std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetLargeRunCacheBytes(int64_t v) {
+  tcmalloc::Parameters::large_run_cache_bytes_.store(v,
+                                                     std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetLazyPerCpuCachesEnabled(bool v) {
   tcmalloc::Parameters::lazy_per_cpu_caches_enabled_.store(
       v, std::memory_order_relaxed);
 }
 
+void TCMalloc_Internal_SetMadviseFreeEnabled(bool v) {
+  tcmalloc::Parameters::madvise_free_enabled_.store(v,
+                                                    std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetMaxPerCpuCacheSize(int32_t v) {
   tcmalloc::Parameters::max_per_cpu_cache_size_.store(
       v, std::memory_order_relaxed);
@@ -177,6 +304,16 @@ void TCMalloc_Internal_SetMaxTotalThreadCacheBytes(int64_t v) {
   tcmalloc::ThreadCache::set_overall_thread_cache_size(v);
 }
 
+void TCMalloc_Internal_SetMemoryPressureReleaseThreshold(double v) {
+  tcmalloc::Parameters::memory_pressure_release_threshold_.store(
+      v, std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetPageRunCacheBytes(int64_t v) {
+  tcmalloc::Parameters::page_run_cache_bytes_.store(v,
+                                                    std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(double v) {
   tcmalloc::Parameters::peak_sampling_heap_growth_fraction_.store(
       v, std::memory_order_relaxed);
@@ -187,6 +324,11 @@ void TCMalloc_Internal_SetPerCpuCachesEnabled(bool v) {
       v, std::memory_order_relaxed);
 }
 
+void TCMalloc_Internal_SetPopulateOnBackEnabled(bool v) {
+  tcmalloc::Parameters::populate_on_back_enabled_.store(
+      v, std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetProfileSamplingRate(int64_t v) {
   tcmalloc::Parameters::profile_sampling_rate_.store(v,
                                                      std::memory_order_relaxed);
@@ -198,4 +340,20 @@ void TCMalloc_Internal_SetHugePageFillerSkipSubreleaseInterval(
       absl::ToInt64Nanoseconds(v), std::memory_order_relaxed);
 }
 
+void TCMalloc_Internal_SetHugePageFillerSkipSubreleaseMaxInterval(
+    absl::Duration v) {
+  tcmalloc::Parameters::filler_skip_subrelease_max_interval_ns_.store(
+      absl::ToInt64Nanoseconds(v), std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetThpCoverageSampleInterval(absl::Duration v) {
+  tcmalloc::Parameters::thp_coverage_sample_interval_ns_.store(
+      absl::ToInt64Nanoseconds(v), std::memory_order_relaxed);
+}
+
+void TCMalloc_Internal_SetUnmapIdleAddressSpaceInterval(absl::Duration v) {
+  tcmalloc::Parameters::unmap_idle_address_space_interval_ns_.store(
+      absl::ToInt64Nanoseconds(v), std::memory_order_relaxed);
+}
+
 }  // extern "C"
@@ -35,6 +35,12 @@ class Parameters {
   static bool hpaa_subrelease();
   static void set_hpaa_subrelease(bool value);
 
+  // If positive, we keep a soft memory limit at this fraction of our cgroup's
+  // memory.high (or memory.max), following them as they change.  See
+  // PageAllocator::UpdateCgroupLimit.
+  static double cgroup_memory_limit_fraction();
+  static void set_cgroup_memory_limit_fraction(double value);
+
   static int64_t guarded_sampling_rate() {
     return guarded_sampling_rate_.load(std::memory_order_relaxed);
   }
@@ -67,6 +73,16 @@ class Parameters {
     TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(value);
   }
 
+  // Bytes of freed hugepage-aligned spans of up to 64 MiB we may keep whole
+  // for reuse, or 0 to disable.
+  static int64_t large_run_cache_bytes() {
+    return large_run_cache_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_large_run_cache_bytes(int64_t value) {
+    TCMalloc_Internal_SetLargeRunCacheBytes(value);
+  }
+
   static bool lazy_per_cpu_caches() {
     return lazy_per_cpu_caches_enabled_.load(std::memory_order_relaxed);
   }
@@ -91,32 +107,169 @@ class Parameters {
     TCMalloc_Internal_SetProfileSamplingRate(value);
   }
 
+  static int64_t huge_cache_deferred_unback_bytes() {
+    return huge_cache_deferred_unback_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_huge_cache_deferred_unback_bytes(int64_t value) {
+    TCMalloc_Internal_SetHugeCacheDeferredUnbackBytes(value);
+  }
+
+  static int64_t huge_cache_warm_reserve_bytes() {
+    return huge_cache_warm_reserve_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_huge_cache_warm_reserve_bytes(int64_t value) {
+    TCMalloc_Internal_SetHugeCacheWarmReserveBytes(value);
+  }
+
+  static bool hugepage_collapse() {
+    return hugepage_collapse_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_hugepage_collapse(bool value) {
+    TCMalloc_Internal_SetHugePageCollapseEnabled(value);
+  }
+
+  static bool filler_adaptive_partial_rerelease() {
+    return filler_adaptive_partial_rerelease_.load(std::memory_order_relaxed);
+  }
+
+  static void set_filler_adaptive_partial_rerelease(bool value) {
+    TCMalloc_Internal_SetFillerAdaptivePartialRerelease(value);
+  }
+
+  static bool filler_segregate_span_lengths() {
+    return filler_segregate_span_lengths_.load(std::memory_order_relaxed);
+  }
+
+  static void set_filler_segregate_span_lengths(bool value) {
+    TCMalloc_Internal_SetFillerSegregateSpanLengths(value);
+  }
+
+  static bool madvise_free() {
+    return madvise_free_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_madvise_free(bool value) {
+    TCMalloc_Internal_SetMadviseFreeEnabled(value);
+  }
+
+  // Bytes of short page runs each CPU may keep cached after they are freed,
+  // or 0 to send them straight back to the page heap.
+  static int64_t page_run_cache_bytes() {
+    return page_run_cache_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_page_run_cache_bytes(int64_t value) {
+    TCMalloc_Internal_SetPageRunCacheBytes(value);
+  }
+
+  static bool populate_on_back() {
+    return populate_on_back_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_populate_on_back(bool value) {
+    TCMalloc_Internal_SetPopulateOnBackEnabled(value);
+  }
+
+  static absl::Duration thp_coverage_sample_interval() {
+    return absl::Nanoseconds(
+        thp_coverage_sample_interval_ns_.load(std::memory_order_relaxed));
+  }
+
+  static void set_thp_coverage_sample_interval(absl::Duration value) {
+    TCMalloc_Internal_SetThpCoverageSampleInterval(value);
+  }
+
   static absl::Duration filler_skip_subrelease_interval() {
     return absl::Nanoseconds(
         filler_skip_subrelease_interval_ns_.load(std::memory_order_relaxed));
   }
 
+  // If longer than filler_skip_subrelease_interval, the filler adapts the
+  // interval it actually uses between the two.
+  static absl::Duration filler_skip_subrelease_max_interval() {
+    return absl::Nanoseconds(filler_skip_subrelease_max_interval_ns_.load(
+        std::memory_order_relaxed));
+  }
+
+  static void set_filler_skip_subrelease_max_interval(absl::Duration value) {
+    TCMalloc_Internal_SetHugePageFillerSkipSubreleaseMaxInterval(value);
+  }
+
+  // If positive, we release memory more aggressively while tasks stall on
+  // memory for at least this percentage of the time (see
+  // MallocExtension_Internal_ReleaseMemoryToSystem).
+  static double memory_pressure_release_threshold() {
+    return memory_pressure_release_threshold_.load(std::memory_order_relaxed);
+  }
+
+  static void set_memory_pressure_release_threshold(double value) {
+    TCMalloc_Internal_SetMemoryPressureReleaseThreshold(value);
+  }
+
+  // Free hugepage ranges unused for this long have their address space
+  // unmapped, and the pagemap leaves covering them released; zero disables.
+  static absl::Duration unmap_idle_address_space_interval() {
+    return absl::Nanoseconds(unmap_idle_address_space_interval_ns_.load(
+        std::memory_order_relaxed));
+  }
+
+  static void set_unmap_idle_address_space_interval(absl::Duration value) {
+    TCMalloc_Internal_SetUnmapIdleAddressSpaceInterval(value);
+  }
+
  private:
+  friend void ::TCMalloc_Internal_SetFillerAdaptivePartialRerelease(bool v);
+  friend void ::TCMalloc_Internal_SetFillerSegregateSpanLengths(bool v);
   friend void ::TCMalloc_Internal_SetGuardedSamplingRate(int64_t v);
   friend void ::TCMalloc_Internal_SetHPAASubrelease(bool v);
+  friend void ::TCMalloc_Internal_SetHugeCacheDeferredUnbackBytes(int64_t v);
+  friend void ::TCMalloc_Internal_SetHugeCacheWarmReserveBytes(int64_t v);
+  friend void ::TCMalloc_Internal_SetHugePageCollapseEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetLargeRunCacheBytes(int64_t v);
   friend void ::TCMalloc_Internal_SetLazyPerCpuCachesEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetMadviseFreeEnabled(bool v);
   friend void ::TCMalloc_Internal_SetMaxPerCpuCacheSize(int32_t v);
   friend void ::TCMalloc_Internal_SetMaxTotalThreadCacheBytes(int64_t v);
+  friend void ::TCMalloc_Internal_SetMemoryPressureReleaseThreshold(double v);
+  friend void ::TCMalloc_Internal_SetPageRunCacheBytes(int64_t v);
   friend void ::TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(double v);
   friend void ::TCMalloc_Internal_SetPerCpuCachesEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetPopulateOnBackEnabled(bool v);
   friend void ::TCMalloc_Internal_SetProfileSamplingRate(int64_t v);
 
   friend void ::TCMalloc_Internal_SetHugePageFillerSkipSubreleaseInterval(
       absl::Duration v);
+  friend void ::TCMalloc_Internal_SetHugePageFillerSkipSubreleaseMaxInterval(
+      absl::Duration v);
+  friend void ::TCMalloc_Internal_SetThpCoverageSampleInterval(
+      absl::Duration v);
+  friend void ::TCMalloc_Internal_SetUnmapIdleAddressSpaceInterval(
+      absl::Duration v);
 
+  static std::atomic<bool> filler_adaptive_partial_rerelease_;
+  static std::atomic<bool> filler_segregate_span_lengths_;
   static std::atomic<int64_t> guarded_sampling_rate_;
+  static std::atomic<int64_t> huge_cache_deferred_unback_bytes_;
+  static std::atomic<int64_t> huge_cache_warm_reserve_bytes_;
+  static std::atomic<bool> hugepage_collapse_enabled_;
+  static std::atomic<int64_t> large_run_cache_bytes_;
   static std::atomic<bool> lazy_per_cpu_caches_enabled_;
+  static std::atomic<bool> madvise_free_enabled_;
   static std::atomic<int32_t> max_per_cpu_cache_size_;
   static std::atomic<int64_t> max_total_thread_cache_bytes_;
+  static std::atomic<double> memory_pressure_release_threshold_;
+  static std::atomic<int64_t> page_run_cache_bytes_;
   static std::atomic<double> peak_sampling_heap_growth_fraction_;
   static std::atomic<bool> per_cpu_caches_enabled_;
+  static std::atomic<bool> populate_on_back_enabled_;
   static std::atomic<int64_t> profile_sampling_rate_;
   static std::atomic<int64_t> filler_skip_subrelease_interval_ns_;
+  static std::atomic<int64_t> filler_skip_subrelease_max_interval_ns_;
+  static std::atomic<int64_t> thp_coverage_sample_interval_ns_;
+  static std::atomic<int64_t> unmap_idle_address_space_interval_ns_;
 };
 
 }  // namespace tcmalloc
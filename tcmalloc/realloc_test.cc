@@ -26,6 +26,7 @@
 #include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
 #include "absl/random/random.h"
+#include "tcmalloc/malloc_extension.h"
 
 namespace tcmalloc {
 namespace {
@@ -100,5 +101,124 @@ TEST(ReallocTest, AlignedAllocRealloc) {
   }
 }
 
+TEST(ReallocTest, LargeGrowth) {
+  // Large enough that the page allocator may grow or move them without a
+  // copy; it must keep their contents either way.
+  size_t size = 4 << 20;
+  unsigned char* p = static_cast<unsigned char*>(malloc(size));
+  Fill(p, size);
+  while (size < (64 << 20)) {
+    // A growing buffer's usual steps, and one that isn't a multiple of pages.
+    for (size_t next : {size + size / 2 + 1, 2 * size}) {
+      p = static_cast<unsigned char*>(realloc(p, next));
+      ASSERT_NE(nullptr, p);
+      ExpectValid(p, size);
+      Fill(p, next);
+      size = next;
+    }
+  }
+  free(p);
+}
+
+TEST(ReallocTest, LargeShrink) {
+  // Large allocations that stay large may shrink in place; they must keep
+  // what's left of their contents either way.
+  size_t size = 16 << 20;
+  unsigned char* p = static_cast<unsigned char*>(malloc(size));
+  Fill(p, size);
+  while (size > (1 << 20)) {
+    for (size_t next : {size / 2 - 1, size / 3}) {
+      p = static_cast<unsigned char*>(realloc(p, next));
+      ASSERT_NE(nullptr, p);
+      ExpectValid(p, next);
+      size = next;
+    }
+  }
+  free(p);
+}
+
+TEST(ReallocTest, TryResize) {
+  EXPECT_FALSE(tcmalloc_try_resize(nullptr, 100));
+
+  // Small objects can't leave their size class.
+  void* small = malloc(100);
+  EXPECT_FALSE(tcmalloc_try_resize(small, 1 << 20));
+  free(small);
+
+  // Large ones never move, and whether or not they resize, keep their
+  // contents and have room for their size.  (Freeing a bigger one first
+  // leaves free memory after them, so they mostly can.)
+  free(malloc(64 << 20));
+  size_t size = 4 << 20;
+  unsigned char* p = static_cast<unsigned char*>(malloc(size));
+  Fill(p, size);
+  for (size_t next : {size + 8192, size_t{8} << 20, size_t{6} << 20,
+                      size_t{3} << 20, size_t{512} << 10, size_t{16} << 20}) {
+    if (tcmalloc_try_resize(p, next)) {
+      ExpectValid(p, std::min(size, next));
+      Fill(p, next);
+      size = next;
+    }
+    EXPECT_GE(MallocExtension::GetAllocatedSize(p), size);
+    ExpectValid(p, size);
+  }
+  // Nor can they become small ones.
+  EXPECT_FALSE(tcmalloc_try_resize(p, 100));
+  sdallocx(p, size, 0);
+}
+
+TEST(ReallocTest, TryResizeSampled) {
+  // Sample everything, so the heap profile has the allocation at each size.
+  const int64_t rate = MallocExtension::GetProfileSamplingRate();
+  MallocExtension::SetProfileSamplingRate(1);
+  auto samples_of = [](size_t size) {
+    int64_t count = 0;
+    MallocExtension::SnapshotCurrent(ProfileType::kHeap)
+        .Iterate([&](const Profile::Sample& s) {
+          if (s.requested_size == size) count += s.count;
+        });
+    return count;
+  };
+
+  // Odd sizes, which nothing else is likely to allocate.
+  free(malloc(64 << 20));
+  size_t size = (4 << 20) + 123;
+  void* p = malloc(size);
+  for (size_t next : {(8 << 20) + 321, (3 << 20) + 213}) {
+    if (tcmalloc_try_resize(p, next)) {
+      // Whatever was sampled at the old size went with it.
+      EXPECT_EQ(0, samples_of(size));
+      size = next;
+    }
+  }
+  free(p);
+  EXPECT_EQ(0, samples_of(size));
+
+  MallocExtension::SetProfileSamplingRate(rate);
+}
+
+// Grows a buffer from 1 MiB to state.range(0) bytes by doubling, writing to
+// each new page as a vector filling up would.
+void BM_ReallocDoubling(benchmark::State& state) {
+  const size_t max = state.range(0);
+  for (auto _ : state) {
+    size_t size = 1 << 20;
+    char* p = static_cast<char*>(malloc(size));
+    memset(p, 1, size);
+    while (size < max) {
+      p = static_cast<char*>(realloc(p, 2 * size));
+      for (size_t i = size; i < 2 * size; i += 4096) p[i] = 1;
+      size *= 2;
+    }
+    benchmark::DoNotOptimize(p);
+    free(p);
+  }
+  state.SetBytesProcessed(state.iterations() * max);
+}
+BENCHMARK(BM_ReallocDoubling)
+    ->RangeMultiplier(4)
+    ->Range(16 << 20, int64_t{4} << 30)
+    ->Unit(benchmark::kMillisecond);
+
 }  // namespace
 }  // namespace tcmalloc
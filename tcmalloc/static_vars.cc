@@ -41,6 +41,8 @@ namespace tcmalloc {
 // IF YOU ADD TO THIS LIST, ADD TO STATIC_VAR_SIZE TOO!
 ABSL_CONST_INIT absl::base_internal::SpinLock pageheap_lock(
     absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+ABSL_CONST_INIT absl::base_internal::SpinLock huge_cache_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
 ABSL_CONST_INIT Arena Static::arena_;
 SizeMap ABSL_CACHELINE_ALIGNED Static::sizemap_;
 ABSL_CONST_INIT TransferCache Static::transfer_cache_[kNumClasses];
@@ -65,14 +67,14 @@ size_t Static::metadata_bytes() {
   // -- I'd like to put all the above in a struct and take that
   // struct's size.  But we can't due to linking issues.
   const size_t static_var_size =
-      sizeof(pageheap_lock) + sizeof(arena_) + sizeof(sizemap_) +
-      sizeof(transfer_cache_) + sizeof(cpu_cache_) + sizeof(span_allocator_) +
-      sizeof(stacktrace_allocator_) + sizeof(threadcache_allocator_) +
-      sizeof(sampled_objects_) + sizeof(bucket_allocator_) +
-      sizeof(inited_) + sizeof(cpu_cache_active_) + sizeof(page_allocator_) +
-      sizeof(pagemap_) + sizeof(sampled_objects_size_) +
-      sizeof(peak_heap_tracker_) + sizeof(guarded_page_lock) +
-      sizeof(guardedpage_allocator_);
+      sizeof(pageheap_lock) + sizeof(huge_cache_lock) + sizeof(arena_) +
+      sizeof(sizemap_) + sizeof(transfer_cache_) + sizeof(cpu_cache_) +
+      sizeof(span_allocator_) + sizeof(stacktrace_allocator_) +
+      sizeof(threadcache_allocator_) + sizeof(sampled_objects_) +
+      sizeof(bucket_allocator_) + sizeof(inited_) + sizeof(cpu_cache_active_) +
+      sizeof(page_allocator_) + sizeof(pagemap_) +
+      sizeof(sampled_objects_size_) + sizeof(peak_heap_tracker_) +
+      sizeof(guarded_page_lock) + sizeof(guardedpage_allocator_);
 
   const size_t allocated = arena()->bytes_allocated() +
                            AddressRegionFactory::InternalBytesAllocated();
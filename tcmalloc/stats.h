@@ -30,15 +30,23 @@ namespace tcmalloc {
 int64_t GetCurrentTimeNanos();
 
 struct BackingStats {
-  BackingStats() : system_bytes(0), free_bytes(0), unmapped_bytes(0) {}
+  BackingStats()
+      : system_bytes(0),
+        free_bytes(0),
+        unmapped_bytes(0),
+        lazily_freed_bytes(0) {}
   uint64_t system_bytes;    // Total bytes allocated from system
   uint64_t free_bytes;      // Total bytes on normal freelists
   uint64_t unmapped_bytes;  // Total bytes on returned freelists
+  // The subset of unmapped_bytes that was released with MADV_FREE and may
+  // still be resident until the kernel reclaims it.
+  uint64_t lazily_freed_bytes;
 
   BackingStats &operator+=(BackingStats rhs) {
     system_bytes += rhs.system_bytes;
     free_bytes += rhs.free_bytes;
     unmapped_bytes += rhs.unmapped_bytes;
+    lazily_freed_bytes += rhs.lazily_freed_bytes;
     return *this;
   }
 };
@@ -18,6 +18,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -29,12 +31,15 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/sampler.h"
 
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
@@ -43,6 +48,19 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
+// MADV_POPULATE_WRITE (Linux 5.14) and MADV_COLLAPSE (Linux 6.1) are missing
+// from older headers.
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+#if defined(__linux__) && !defined(MADV_COLLAPSE)
+#define MADV_COLLAPSE 25
+#endif
+// Likewise MREMAP_DONTUNMAP (Linux 5.7).
+#if defined(__linux__) && !defined(MREMAP_DONTUNMAP)
+#define MREMAP_DONTUNMAP 4
+#endif
+
 // Solaris has a bug where it doesn't declare madvise() for C++.
 //    http://www.opensolaris.org/jive/thread.jspa?threadID=21035&tstart=0
 #if defined(__sun) && defined(__SVR4)
@@ -126,12 +144,48 @@ class MmapRegionFactory : public AddressRegionFactory {
   size_t GetStats(absl::Span<char> buffer) override;
   size_t GetStatsInPbtxt(absl::Span<char> buffer) override;
 
+ protected:
+  // Lets subclasses add to GetStats (or, with pbtxt, GetStatsInPbtxt).
+  virtual void PrintMore(TCMalloc_Printer* out, bool pbtxt) {}
+
  private:
   std::atomic<int64_t> bytes_reserved_{0};
 };
 std::aligned_storage<sizeof(MmapRegionFactory),
                      alignof(MmapRegionFactory)>::type mmap_space;
 
+// The built-in factory once ReserveAddressSpace has been called.  Its regions
+// are those of MmapRegionFactory, but RegionManager carves their address space
+// out of one contiguous reservation made up front, at the cost of an
+// mprotect() each rather than an mmap().  Keeping the heap together also keeps
+// the pagemap leaves that cover it few and densely used.
+class ReservedRegionFactory final : public MmapRegionFactory {
+ public:
+  ReservedRegionFactory(uintptr_t start, size_t size)
+      : start_(start), end_(start + size), next_(start) {}
+
+  // Takes size bytes aligned to alignment from what is left of the
+  // reservation, or returns nullptr if they don't fit.
+  void* Carve(size_t size, size_t alignment);
+
+  // Returns true if [start, start + size) overlaps the reservation.
+  bool Overlaps(uintptr_t start, size_t size) const {
+    return start < end_ && start_ < start + size;
+  }
+
+ private:
+  void PrintMore(TCMalloc_Printer* out, bool pbtxt) override;
+
+  const uintptr_t start_;
+  const uintptr_t end_;
+  uintptr_t next_;
+  // Requests that didn't fit, and were reserved with mmap() instead.
+  int64_t overflows_{0};
+};
+std::aligned_storage<sizeof(ReservedRegionFactory),
+                     alignof(ReservedRegionFactory)>::type reserved_space;
+ReservedRegionFactory* reserved_factory = nullptr;
+
 class RegionManager {
  public:
   std::pair<void*, size_t> Alloc(size_t size, size_t alignment, bool tagged);
@@ -147,6 +201,10 @@ class RegionManager {
   // Then returns a pointer to the new memory.
   std::pair<void*, size_t> Allocate(size_t size, size_t alignment, bool tagged);
 
+  // Reserves address space for a new region: from reserved_factory, if it is
+  // in use and has room, else with MmapAligned.
+  void* Reserve(size_t size, size_t alignment, bool tagged);
+
   AddressRegion* untagged_region_{nullptr};
   AddressRegion* tagged_region_{nullptr};
 };
@@ -198,6 +256,7 @@ size_t MmapRegionFactory::GetStats(absl::Span<char> buffer) {
   constexpr double MiB = 1048576.0;
   printer.printf("MmapSysAllocator: %lld bytes (%.1f MiB) reserved\n",
                  allocated, allocated / MiB);
+  PrintMore(&printer, false);
 
   size_t required = printer.SpaceRequired();
   // SpaceRequired includes the null terminator.
@@ -212,6 +271,7 @@ size_t MmapRegionFactory::GetStatsInPbtxt(absl::Span<char> buffer) {
   TCMalloc_Printer printer(buffer.data(), buffer.size());
   long long allocated = bytes_reserved_.load(std::memory_order_relaxed);
   printer.printf("mmap_sys_allocator: %lld\n", allocated);
+  PrintMore(&printer, true);
 
   size_t required = printer.SpaceRequired();
   // SpaceRequired includes the null terminator.
@@ -222,6 +282,43 @@ size_t MmapRegionFactory::GetStatsInPbtxt(absl::Span<char> buffer) {
   return required;
 }
 
+void* ReservedRegionFactory::Carve(size_t size, size_t alignment) {
+  const uintptr_t result = RoundUp(next_, alignment);
+  if (result < next_ || result > end_ || end_ - result < size) {
+    overflows_++;
+    return nullptr;
+  }
+  next_ = result + size;
+  return reinterpret_cast<void*>(result);
+}
+
+void ReservedRegionFactory::PrintMore(TCMalloc_Printer* out, bool pbtxt) {
+  const size_t total = end_ - start_;
+  const size_t carved = next_ - start_;
+  if (pbtxt) {
+    out->printf("up_front_reservation_bytes: %zu\n", total);
+    out->printf("up_front_reservation_carved_bytes: %zu\n", carved);
+    out->printf("up_front_reservation_overflows: %lld\n",
+                static_cast<long long>(overflows_));
+    return;
+  }
+  constexpr double GiB = 1024.0 * 1024.0 * 1024.0;
+  out->printf(
+      "MmapSysAllocator: %.1f of %.1f GiB up-front reservation carved at %p, "
+      "%lld requests mapped outside it\n",
+      carved / GiB, total / GiB, reinterpret_cast<void*>(start_),
+      static_cast<long long>(overflows_));
+}
+
+void* RegionManager::Reserve(size_t size, size_t alignment, bool tagged) {
+  // The reservation is untagged, so cold memory always maps its own.
+  if (!tagged && reserved_factory != nullptr &&
+      region_factory == reserved_factory) {
+    if (void* ptr = reserved_factory->Carve(size, alignment)) return ptr;
+  }
+  return MmapAligned(size, alignment, tagged);
+}
+
 std::pair<void*, size_t> RegionManager::Alloc(size_t request_size,
                                               size_t alignment, bool tagged) {
   // We do not support size or alignment larger than kTagMask.
@@ -237,7 +334,7 @@ std::pair<void*, size_t> RegionManager::Alloc(size_t request_size,
     size_t size = RoundUp(request_size, kMinSystemAlloc);
     if (size < request_size) return {nullptr, 0};
     alignment = std::max(alignment, preferred_alignment);
-    void* ptr = MmapAligned(size, alignment, tagged);
+    void* ptr = Reserve(size, alignment, tagged);
     if (!ptr) return {nullptr, 0};
     auto region_type = tagged ? AddressRegionFactory::UsageHint::kInfrequent
                               : AddressRegionFactory::UsageHint::kNormal;
@@ -270,7 +367,7 @@ std::pair<void*, size_t> RegionManager::Allocate(size_t size, size_t alignment,
 
   // Allocation failed so we need to reserve more memory.
   // Reserve new region and try allocation again.
-  void* ptr = MmapAligned(kMinMmapAlloc, kMinMmapAlloc, tagged);
+  void* ptr = Reserve(kMinMmapAlloc, kMinMmapAlloc, tagged);
   if (!ptr) return {nullptr, 0};
   auto region_type = tagged ? AddressRegionFactory::UsageHint::kInfrequent
                             : AddressRegionFactory::UsageHint::kNormal;
@@ -282,6 +379,55 @@ std::pair<void*, size_t> RegionManager::Allocate(size_t size, size_t alignment,
   return region->Alloc(size, alignment);
 }
 
+// Parses TCMALLOC_RESERVE_ADDRESS_SPACE: a number of bytes, optionally
+// followed by K, M, G or T.  Returns 0 if it is unset or malformed.
+size_t ReservationFromEnvironment() {
+  const char* e = tcmalloc_internal::thread_safe_getenv(
+      "TCMALLOC_RESERVE_ADDRESS_SPACE");
+  if (e == nullptr) return 0;
+  size_t n = 0;
+  for (; *e >= '0' && *e <= '9'; ++e) {
+    if (n > kTagMask) return 0;
+    n = n * 10 + (*e - '0');
+  }
+  int shift = 0;
+  switch (*e) {
+    case '\0':
+      break;
+    case 'K':
+      shift = 10;
+      break;
+    case 'M':
+      shift = 20;
+      break;
+    case 'G':
+      shift = 30;
+      break;
+    case 'T':
+      shift = 40;
+      break;
+    default:
+      return 0;
+  }
+  if (shift != 0 && *++e != '\0') return 0;
+  if (n > (kTagMask >> shift)) return 0;
+  return n << shift;
+}
+
+// REQUIRES: spinlock is held.
+void* ReserveAddressSpaceLocked(size_t bytes) {
+  if (reserved_factory != nullptr) return nullptr;
+  bytes = RoundUp(bytes, kMinMmapAlloc);
+  if (bytes == 0 || bytes > kTagMask) return nullptr;
+  void* ptr = MmapAligned(bytes, kMinMmapAlloc, /*tagged=*/false);
+  if (ptr == nullptr) return nullptr;
+  reserved_factory = new (&reserved_space)
+      ReservedRegionFactory(reinterpret_cast<uintptr_t>(ptr), bytes);
+  region_manager->DiscardMappedRegions();
+  region_factory = reserved_factory;
+  return ptr;
+}
+
 void InitSystemAllocatorIfNecessary() {
   if (region_factory) return;
   pagesize = getpagesize();
@@ -292,10 +438,57 @@ void InitSystemAllocatorIfNecessary() {
   preferred_alignment = std::max(pagesize, kMinSystemAlloc);
   region_manager = new (&region_manager_space) RegionManager();
   region_factory = new (&mmap_space) MmapRegionFactory();
+  if (const size_t reserve = ReservationFromEnvironment()) {
+    if (ReserveAddressSpaceLocked(reserve) == nullptr) {
+      Log(kLog, __FILE__, __LINE__,
+          "TCMALLOC_RESERVE_ADDRESS_SPACE: reservation failed (bytes)",
+          reserve);
+    }
+  }
 }
 
 ABSL_CONST_INIT std::atomic<int> system_release_errors = ATOMIC_VAR_INIT(0);
 
+// For GetSystemReleaseStats().
+ABSL_CONST_INIT std::atomic<int64_t> system_release_ranges(0);
+ABSL_CONST_INIT std::atomic<int64_t> system_release_bytes(0);
+ABSL_CONST_INIT std::atomic<int64_t> system_release_syscalls(0);
+ABSL_CONST_INIT std::atomic<int64_t> system_release_batched_syscalls(0);
+ABSL_CONST_INIT std::atomic<int64_t> system_release_cycles(0);
+
+void NoteReleased(size_t ranges, size_t bytes, int64_t start_cycles) {
+  system_release_ranges.fetch_add(ranges, std::memory_order_relaxed);
+  system_release_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  system_release_cycles.fetch_add(
+      absl::base_internal::CycleClock::Now() - start_cycles,
+      std::memory_order_relaxed);
+}
+
+// Rounds [*start, *start + *length) inwards to whole pages; returns false if
+// that leaves nothing.
+bool RoundInToPages(void** start, size_t* length) {
+  const size_t pagemask = pagesize - 1;
+
+  size_t new_start = reinterpret_cast<size_t>(*start);
+  size_t end = new_start + *length;
+  size_t new_end = end;
+
+  // Round up the starting address and round down the ending address
+  // to be page aligned:
+  new_start = (new_start + pagesize - 1) & ~pagemask;
+  new_end = new_end & ~pagemask;
+
+  ASSERT((new_start & pagemask) == 0);
+  ASSERT((new_end & pagemask) == 0);
+  ASSERT(new_start >= reinterpret_cast<size_t>(*start));
+  ASSERT(new_end <= end);
+
+  if (new_end <= new_start) return false;
+  *start = reinterpret_cast<void*>(new_start);
+  *length = new_end - new_start;
+  return true;
+}
+
 }  // namespace
 
 void* SystemAlloc(size_t bytes, size_t* actual_bytes, size_t alignment,
@@ -327,8 +520,48 @@ void* SystemAlloc(size_t bytes, size_t* actual_bytes, size_t alignment,
   return result;
 }
 
-static bool ReleasePages(void* start, size_t length) {
+// Returns true if the running kernel accepts MADV_FREE (Linux 4.5+).  An
+// empty, page-aligned range is validated but otherwise ignored, so probing
+// this way has no side effects.
+static bool MadviseFreeSupported() {
+#ifdef MADV_FREE
+  static const bool supported = [] {
+    void* probe = reinterpret_cast<void*>(getpagesize());
+    return madvise(probe, 0, MADV_FREE) == 0;
+  }();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+bool SystemReleaseIsLazy() {
+  return Parameters::madvise_free() && MadviseFreeSupported();
+}
+
+// Set once MADV_REMOVE has worked for us, which means some of our memory is a
+// shared file mapping rather than anonymous.
+ABSL_CONST_INIT static std::atomic<bool> madvise_remove_works(false);
+
+static int Madvise(void* start, size_t length, int advice) {
   int ret;
+  do {
+    system_release_syscalls.fetch_add(1, std::memory_order_relaxed);
+    ret = madvise(start, length, advice);
+  } while (ret == -1 && errno == EAGAIN);
+  return ret;
+}
+
+static bool ReleasePages(void* start, size_t length) {
+#ifdef MADV_FREE
+  // MADV_FREE only marks the pages as reclaimable: they stay resident until
+  // the kernel is under memory pressure, and touching them again before then
+  // neither faults nor zeroes.  If it fails (for example, on mlocked memory)
+  // fall through to the eager path below.
+  if (SystemReleaseIsLazy() && Madvise(start, length, MADV_FREE) == 0) {
+    return true;
+  }
+#endif
   // Note -- ignoring most return codes, because if this fails it
   // doesn't matter...
   // Moreover, MADV_REMOVE *will* fail (with EINVAL) on anonymous memory,
@@ -336,21 +569,14 @@ static bool ReleasePages(void* start, size_t length) {
 #ifdef MADV_REMOVE
   // MADV_REMOVE deletes any backing storage for non-anonymous memory
   // (tmpfs).
-  do {
-    ret = madvise(start, length, MADV_REMOVE);
-  } while (ret == -1 && errno == EAGAIN);
-
-  if (ret == 0) {
+  if (Madvise(start, length, MADV_REMOVE) == 0) {
+    madvise_remove_works.store(true, std::memory_order_relaxed);
     return true;
   }
 #endif
 #ifdef MADV_DONTNEED
   // MADV_DONTNEED drops page table info and any anonymous pages.
-  do {
-    ret = madvise(start, length, MADV_DONTNEED);
-  } while (ret == -1 && errno == EAGAIN);
-
-  if (ret == 0) {
+  if (Madvise(start, length, MADV_DONTNEED) == 0) {
     return true;
   }
 #endif
@@ -358,59 +584,234 @@ static bool ReleasePages(void* start, size_t length) {
   return false;
 }
 
+// Releases [start, start + length), which must be page aligned.
+static void ReleaseRange(void* start, size_t length) {
+  if (!ReleasePages(start, length)) {
+    // Try unlocking.
+    int ret;
+    do {
+      ret = munlock(start, length);
+    } while (ret == -1 && errno == EAGAIN);
+
+    if (ret != 0 || !ReleasePages(start, length)) {
+      // If we fail to munlock *or* fail our second attempt at madvise,
+      // increment our failure count.
+      system_release_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+namespace {
+
+#if defined(__linux__) && defined(SYS_process_madvise) && \
+    defined(SYS_pidfd_open) && defined(MADV_DONTNEED)
+#define TCMALLOC_HAVE_PROCESS_MADVISE 1
+
+// process_madvise(2) takes a pidfd for the target process.  Recent kernels
+// understand PIDFD_SELF_THREAD_GROUP; on others we open one for ourselves
+// (and again in a forked child, whose inherited one refers to its parent.)
+constexpr int kPidfdSelf = -10001;
+
+ABSL_CONST_INIT absl::base_internal::SpinLock pidfd_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+ABSL_CONST_INIT std::atomic<bool> pidfd_self_unsupported(false);
+int pidfd = -1;
+pid_t pidfd_pid = 0;
+
+int SelfPidfd() {
+  if (!pidfd_self_unsupported.load(std::memory_order_relaxed)) {
+    return kPidfdSelf;
+  }
+  const pid_t pid = getpid();
+  absl::base_internal::SpinLockHolder h(&pidfd_lock);
+  if (pidfd_pid != pid) {
+    if (pidfd >= 0) close(pidfd);
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    pidfd_pid = pid;
+  }
+  return pidfd;
+}
+
+enum class BatchSupport { kUnknown, kSupported, kUnsupported };
+// Before Linux 6.13, process_madvise only accepts advice (like MADV_COLD)
+// that does not destroy data.
+ABSL_CONST_INIT std::atomic<BatchSupport> batch_support(BatchSupport::kUnknown);
+
+// Applies advice to ranges[0, n) with one process_madvise; returns how many
+// of them (from the start) it applied to.
+size_t ProcessMadvise(const struct iovec* ranges, size_t n, int advice) {
+  ssize_t ret;
+  for (;;) {
+    const int fd = SelfPidfd();
+    if (fd == -1) return 0;
+    system_release_syscalls.fetch_add(1, std::memory_order_relaxed);
+    system_release_batched_syscalls.fetch_add(1, std::memory_order_relaxed);
+    ret = syscall(SYS_process_madvise, fd, ranges, n, advice, 0);
+    if (ret == -1 && errno == EBADF && fd == kPidfdSelf) {
+      pidfd_self_unsupported.store(true, std::memory_order_relaxed);
+      continue;
+    }
+    if (ret == -1 && errno == EAGAIN) continue;
+    break;
+  }
+  if (ret <= 0) return 0;
+
+  // The kernel stops at the first range it fails on.
+  size_t applied = ret;
+  size_t i = 0;
+  while (i < n && applied >= ranges[i].iov_len) {
+    applied -= ranges[i].iov_len;
+    ++i;
+  }
+  return i;
+}
+
+// Releases as many of ranges[0, n) (from the start) as it can in one batch,
+// the way ReleasePages would; returns how many.
+size_t ReleaseBatch(const struct iovec* ranges, size_t n) {
+  if (batch_support.load(std::memory_order_relaxed) ==
+      BatchSupport::kUnsupported) {
+    return 0;
+  }
+
+  size_t released = 0;
+#ifdef MADV_FREE
+  if (SystemReleaseIsLazy()) {
+    released = ProcessMadvise(ranges, n, MADV_FREE);
+  }
+#endif
+#ifdef MADV_REMOVE
+  // This fails on the anonymous memory we usually have.  Don't waste the
+  // system call unless we have seen otherwise.
+  if (released < n && madvise_remove_works.load(std::memory_order_relaxed)) {
+    released += ProcessMadvise(ranges + released, n - released, MADV_REMOVE);
+  }
+#endif
+  if (released < n) {
+    const int saved_errno = errno;
+    const size_t dontneed =
+        ProcessMadvise(ranges + released, n - released, MADV_DONTNEED);
+    if (dontneed == 0 && released == 0 &&
+        batch_support.load(std::memory_order_relaxed) ==
+            BatchSupport::kUnknown &&
+        (errno == EINVAL || errno == ENOSYS || errno == EPERM ||
+         errno == EBADF)) {
+      batch_support.store(BatchSupport::kUnsupported,
+                          std::memory_order_relaxed);
+      errno = saved_errno;
+      return 0;
+    }
+    released += dontneed;
+  }
+  if (released > 0) {
+    batch_support.store(BatchSupport::kSupported, std::memory_order_relaxed);
+  }
+  return released;
+}
+#endif  // __linux__ && SYS_process_madvise && ...
+
+}  // namespace
+
 int SystemReleaseErrors() {
   return system_release_errors.load(std::memory_order_relaxed);
 }
 
+SystemReleaseStats GetSystemReleaseStats() {
+  SystemReleaseStats stats;
+  stats.ranges = system_release_ranges.load(std::memory_order_relaxed);
+  stats.bytes = system_release_bytes.load(std::memory_order_relaxed);
+  stats.syscalls = system_release_syscalls.load(std::memory_order_relaxed);
+  stats.batched_syscalls =
+      system_release_batched_syscalls.load(std::memory_order_relaxed);
+  stats.seconds =
+      system_release_cycles.load(std::memory_order_relaxed) /
+      absl::base_internal::CycleClock::Frequency();
+  return stats;
+}
+
 void SystemRelease(void* start, size_t length) {
   int saved_errno = errno;
 #if defined(MADV_DONTNEED) || defined(MADV_REMOVE)
-  const size_t pagemask = pagesize - 1;
+  const int64_t start_cycles = absl::base_internal::CycleClock::Now();
+  if (RoundInToPages(&start, &length)) {
+    ReleaseRange(start, length);
+    NoteReleased(1, length, start_cycles);
+  }
+#endif
+  errno = saved_errno;
+}
 
-  size_t new_start = reinterpret_cast<size_t>(start);
-  size_t end = new_start + length;
-  size_t new_end = end;
+void SystemReleaseMetadata(void* start, size_t length) {
+#ifdef MADV_DONTNEED
+  int saved_errno = errno;
+  if (RoundInToPages(&start, &length)) {
+    int ret;
+    do {
+      ret = madvise(start, length, MADV_DONTNEED);
+    } while (ret == -1 && errno == EAGAIN);
+  }
+  errno = saved_errno;
+#endif
+}
 
-  // Round up the starting address and round down the ending address
-  // to be page aligned:
-  new_start = (new_start + pagesize - 1) & ~pagemask;
-  new_end = new_end & ~pagemask;
+void SystemReleaseRanges(const struct iovec* ranges, size_t n) {
+  if (n <= 1) {
+    if (n == 1) SystemRelease(ranges[0].iov_base, ranges[0].iov_len);
+    return;
+  }
 
-  ASSERT((new_start & pagemask) == 0);
-  ASSERT((new_end & pagemask) == 0);
-  ASSERT(new_start >= reinterpret_cast<size_t>(start));
-  ASSERT(new_end <= end);
+  int saved_errno = errno;
+#if defined(MADV_DONTNEED) || defined(MADV_REMOVE)
+  const int64_t start_cycles = absl::base_internal::CycleClock::Now();
+  struct iovec batch[kMaxReleaseBatch];
+  size_t released = 0;
+  size_t bytes = 0;
+  while (n > 0) {
+    size_t len = 0;
+    for (; n > 0 && len < kMaxReleaseBatch; ++ranges, --n) {
+      struct iovec r = *ranges;
+      if (RoundInToPages(&r.iov_base, &r.iov_len)) {
+        batch[len++] = r;
+      }
+    }
 
-  if (new_end > new_start) {
-    void* new_ptr = reinterpret_cast<void*>(new_start);
-    size_t new_length = new_end - new_start;
-
-    if (!ReleasePages(new_ptr, new_length)) {
-      // Try unlocking.
-      int ret;
-      do {
-        ret = munlock(reinterpret_cast<char*>(new_start), new_end - new_start);
-      } while (ret == -1 && errno == EAGAIN);
-
-      if (ret != 0 || !ReleasePages(new_ptr, new_length)) {
-        // If we fail to munlock *or* fail our second attempt at madvise,
-        // increment our failure count.
-        system_release_errors.fetch_add(1, std::memory_order_relaxed);
+    size_t i = 0;
+    while (i < len) {
+#ifdef TCMALLOC_HAVE_PROCESS_MADVISE
+      const size_t done = len - i > 1 ? ReleaseBatch(batch + i, len - i) : 0;
+#else
+      const size_t done = 0;
+#endif
+      if (done == 0) {
+        // Release the one the kernel would not (or everything, one at a time,
+        // if it can't batch.)
+        ReleaseRange(batch[i].iov_base, batch[i].iov_len);
+        bytes += batch[i].iov_len;
+        ++i;
+        continue;
       }
+      for (size_t j = i; j < i + done; ++j) {
+        bytes += batch[j].iov_len;
+      }
+      i += done;
     }
+    released += len;
   }
+  NoteReleased(released, bytes, start_cycles);
 #endif
   errno = saved_errno;
 }
 
 void SystemBack(void* start, size_t length) {
-  // TODO(b/134694141): use madvise when we have better support for that;
-  // taking faults is not free.
-
-  // TODO(b/134694141): enable this, if we can avoid causing trouble for apps
-  // that routinely make large mallocs they never touch (sigh).
-  return;
+  // Populating memory is not free, and causes trouble for apps that
+  // routinely make large mallocs they never touch (sigh), so this is opt-in.
+  if (!Parameters::populate_on_back()) {
+    return;
+  }
+  SystemPopulate(start, length);
+}
 
+void SystemPopulate(void* start, size_t length) {
   // Strictly speaking, not everything uses 4K pages.  However, we're
   // not asking the OS for anything actually page-related, just taking
   // a fault on every "page".  If the real page size is bigger, we do
@@ -418,18 +819,138 @@ void SystemBack(void* start, size_t length) {
   static const size_t kHardwarePageSize = 4 * 1024;
   CHECK_CONDITION(reinterpret_cast<intptr_t>(start) % kHardwarePageSize == 0);
   CHECK_CONDITION(length % kHardwarePageSize == 0);
+
+  int saved_errno = errno;
+#ifdef MADV_POPULATE_WRITE
+  // A single call faults in the whole range, without taking (and returning
+  // from) a fault per page, and gives the kernel the chance to back aligned
+  // hugepages with THPs.
+  ABSL_CONST_INIT static std::atomic<bool> unsupported(false);
+  if (!unsupported.load(std::memory_order_relaxed)) {
+    int ret;
+    do {
+      ret = madvise(start, length, MADV_POPULATE_WRITE);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 0 || errno != EINVAL) {
+      // Other errors (like ENOMEM) would just recur if we touched the pages
+      // ourselves; leave them to the application's first access.
+      errno = saved_errno;
+      return;
+    }
+    // The kernel predates MADV_POPULATE_WRITE.
+    unsupported.store(true, std::memory_order_relaxed);
+  }
+#endif
+
+  // Write to every page, without changing its contents: the range may
+  // share hugepages with memory that other threads are using.
   const size_t num_pages = length / kHardwarePageSize;
+  char* p = static_cast<char*>(start);
+  for (size_t i = 0; i < num_pages; ++i, p += kHardwarePageSize) {
+    __atomic_fetch_or(reinterpret_cast<size_t*>(p), 0, __ATOMIC_RELAXED);
+  }
+  errno = saved_errno;
+}
 
-  struct PageStruct {
-    volatile size_t data[kHardwarePageSize / sizeof(size_t)];
-  };
-  CHECK_CONDITION(sizeof(PageStruct) == kHardwarePageSize);
+bool SystemCollapse(void* start, size_t length) {
+#ifdef MADV_COLLAPSE
+  ABSL_CONST_INIT static std::atomic<bool> unsupported(false);
+  if (unsupported.load(std::memory_order_relaxed)) {
+    return false;
+  }
 
-  PageStruct* ps = reinterpret_cast<PageStruct*>(start);
-  PageStruct* limit = ps + num_pages;
-  for (; ps < limit; ++ps) {
-    ps->data[0] = 0;
+  // EAGAIN is transient, but we'd rather try again on a later call than spin
+  // on something this expensive.  EINVAL means the kernel predates
+  // MADV_COLLAPSE (or THP is disabled outright).
+  int saved_errno = errno;
+  const int ret = madvise(start, length, MADV_COLLAPSE);
+  if (ret != 0 && errno == EINVAL) {
+    unsupported.store(true, std::memory_order_relaxed);
   }
+  errno = saved_errno;
+  return ret == 0;
+#else
+  return false;
+#endif
+}
+
+// Set once SetRegionFactory installs a factory of someone else's.  Memory it
+// handed out stays in use after any later switch back, so this never clears.
+ABSL_CONST_INIT static std::atomic<bool> foreign_regions(false);
+
+bool SystemUnmap(void* start, size_t length) {
+  CHECK_CONDITION(reinterpret_cast<uintptr_t>(start) % kHugePageSize == 0);
+  CHECK_CONDITION(length % kHugePageSize == 0);
+  // The range may belong to someone else's region, which is theirs to unmap.
+  if (foreign_regions.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  bool reserved;
+  {
+    absl::base_internal::SpinLockHolder lock_holder(&spinlock);
+    reserved = reserved_factory != nullptr &&
+               reserved_factory->Overlaps(reinterpret_cast<uintptr_t>(start),
+                                          length);
+  }
+
+  int saved_errno = errno;
+  bool ok;
+  if (reserved) {
+    // A hole in the reservation is one any mmap() could land in.  Mapping
+    // fresh inaccessible pages over the range frees its memory just the same
+    // but keeps the address space ours.
+    ok = mmap(start, length, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1,
+              0) != MAP_FAILED;
+    if (!ok) {
+      Log(kLog, __FILE__, __LINE__, "mmap() failed (ptr, size, error)",
+          start, length, strerror(errno));
+    }
+  } else {
+    ok = munmap(start, length) == 0;
+    if (!ok) {
+      Log(kLog, __FILE__, __LINE__, "munmap() failed (ptr, size, error)",
+          start, length, strerror(errno));
+    }
+  }
+  errno = saved_errno;
+  return ok;
+}
+
+bool SystemRemap(void* from, size_t length, void* to) {
+  CHECK_CONDITION(reinterpret_cast<uintptr_t>(from) % kHugePageSize == 0);
+  CHECK_CONDITION(reinterpret_cast<uintptr_t>(to) % kHugePageSize == 0);
+  CHECK_CONDITION(length % kHugePageSize == 0);
+#if defined(__linux__) && defined(MREMAP_MAYMOVE) && defined(MREMAP_FIXED)
+  ABSL_CONST_INIT static std::atomic<bool> unsupported(false);
+  if (unsupported.load(std::memory_order_relaxed) ||
+      foreign_regions.load(std::memory_order_relaxed)) {
+    return false;
+  }
+
+  // Keeping the source mapped means no other mapping can land in the hole a
+  // plain move would leave in our address space.  EINVAL means the kernel
+  // predates MREMAP_DONTUNMAP; anything else (like EFAULT, for a range that
+  // spans two mappings the kernel kept apart) is particular to these ranges.
+  int saved_errno = errno;
+  void* ret = mremap(from, length, length,
+                     MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, to);
+  if (ret == MAP_FAILED && errno == EINVAL) {
+    unsupported.store(true, std::memory_order_relaxed);
+  }
+  errno = saved_errno;
+  if (ret == MAP_FAILED) return false;
+  ASSERT(ret == to);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void* ReserveAddressSpace(size_t bytes) {
+  absl::base_internal::SpinLockHolder lock_holder(&spinlock);
+  InitSystemAllocatorIfNecessary();
+  return ReserveAddressSpaceLocked(bytes);
 }
 
 AddressRegionFactory* GetRegionFactory() {
@@ -443,6 +964,10 @@ void SetRegionFactory(AddressRegionFactory* factory) {
   InitSystemAllocatorIfNecessary();
   region_manager->DiscardMappedRegions();
   region_factory = factory;
+  if (factory != reinterpret_cast<MmapRegionFactory*>(&mmap_space) &&
+      factory != reserved_factory) {
+    foreign_regions.store(true, std::memory_order_relaxed);
+  }
 }
 
 static uintptr_t RandomMmapHint(size_t size, size_t alignment, bool tagged) {
@@ -19,6 +19,8 @@
 #define TCMALLOC_SYSTEM_ALLOC_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/span.h"
@@ -59,13 +61,86 @@ int SystemReleaseErrors();
 // be released, partial pages will not.)
 void SystemRelease(void *start, size_t length);
 
+// As SystemRelease, for memory holding tcmalloc's own metadata rather than
+// pages it hands out: it is always released eagerly, and neither counts
+// toward SystemReleaseStats nor changes any page release statistics.
+void SystemReleaseMetadata(void *start, size_t length);
+
+// The most ranges SystemReleaseRanges hands the kernel at once.
+constexpr size_t kMaxReleaseBatch = 64;
+
+// Like calling SystemRelease on each of ranges[0, n), but with fewer system
+// calls: where the kernel allows (process_madvise(2) with MADV_DONTNEED,
+// Linux 6.13+) it releases up to kMaxReleaseBatch ranges per call.  It falls
+// back to SystemRelease for each range the kernel would not release, or for
+// all of them if it cannot batch.
+void SystemReleaseRanges(const struct iovec *ranges, size_t n);
+
+// Cumulative statistics on SystemRelease and SystemReleaseRanges.
+struct SystemReleaseStats {
+  int64_t ranges;            // Ranges released.
+  int64_t bytes;             // Bytes in them.
+  int64_t syscalls;          // madvise and process_madvise calls made.
+  int64_t batched_syscalls;  // The process_madvise ones.
+  double seconds;            // Time spent releasing.
+};
+
+SystemReleaseStats GetSystemReleaseStats();
+
+// Returns true if SystemRelease currently releases memory lazily (with
+// MADV_FREE, see Parameters::madvise_free()).  Lazily released pages remain
+// resident, and are charged to the process, until the kernel needs them;
+// reusing them before that point avoids the fault and zeroing costs.
+bool SystemReleaseIsLazy();
+
 // This call is the inverse of SystemRelease: the pages in this range
-// are in use and should be faulted in.  (In principle this is a
-// best-effort hint, but in practice we will unconditionally fault the
-// range.)
+// are in use and should be faulted in.  It is a best-effort hint, and does
+// nothing unless Parameters::populate_on_back() is set.  Existing contents
+// are preserved.
 // REQUIRES: [start, start + length) is a range aligned to 4KiB boundaries.
 void SystemBack(void *start, size_t length);
 
+// As SystemBack, but regardless of Parameters::populate_on_back().
+void SystemPopulate(void *start, size_t length);
+
+// Asks the kernel to synchronously replace the small pages backing
+// [start, start + length) with transparent hugepages (MADV_COLLAPSE, Linux
+// 6.1+).  This is expensive: the kernel allocates a hugepage and copies the
+// existing contents into it.  Returns false if the kernel does not support
+// it, or could not collapse the range.
+// REQUIRES: [start, start + length) is hugepage-aligned and fully backed.
+bool SystemCollapse(void *start, size_t length);
+
+// Unmaps [start, start + length), which SystemAlloc returned (in whole or in
+// part), giving up the address space as well as any memory behind it.  The
+// range is never handed out again by SystemAlloc, though the kernel may reuse
+// its addresses for a later mapping--unless they are in the ReserveAddressSpace
+// reservation, which keeps them, inaccessible.  Returns false if the kernel
+// refused, or if a region factory of someone else's was ever installed, since
+// the range may be one of its regions.
+// REQUIRES: [start, start + length) is aligned to hugepage boundaries.
+bool SystemUnmap(void *start, size_t length);
+
+// Moves the memory behind [from, from + length) to [to, to + length) without
+// copying it, by having the kernel move the page tables (mremap(2) with
+// MREMAP_DONTUNMAP, Linux 5.7+).  Whatever was mapped at the destination is
+// discarded; the source stays mapped, but its pages are released, as if by
+// SystemRelease.  Returns false, leaving both ranges as they were, if the
+// kernel cannot do it, or if memory may have come from an AddressRegionFactory
+// other than our own (whose mappings mremap might not handle, or break).
+// REQUIRES: both ranges are aligned to hugepage boundaries, were returned by
+// SystemAlloc, and do not overlap.
+bool SystemRemap(void *from, size_t length, void *to);
+
+// Reserves bytes (rounded up to whole kMinMmapAlloc units) of untagged
+// address space with one mmap(PROT_NONE), and installs a built-in
+// AddressRegionFactory whose regions are carved out of it with mprotect()
+// alone, until it runs out.  Tagged memory is still mapped as it is needed.
+// Setting TCMALLOC_RESERVE_ADDRESS_SPACE (in bytes, with an optional K, M, G or
+// T suffix; e.g. "64G") does this at startup.  Returns the start of the
+// reservation, or nullptr if it failed or one was already made.
+void *ReserveAddressSpace(size_t bytes);
+
 // Returns the current address region factory.
 AddressRegionFactory *GetRegionFactory();
 
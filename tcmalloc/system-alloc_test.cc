@@ -16,17 +16,28 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 #include <limits>
 #include <new>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "benchmark/benchmark.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_allocator.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
 
 namespace tcmalloc {
 namespace {
@@ -132,5 +143,366 @@ TEST(Basic, RetryFailTest) {
   free(q);
 }
 
+TEST(ReserveAddressSpace, CarvesUntaggedRegions) {
+  AddressRegionFactory* before = MallocExtension::GetRegionFactory();
+  constexpr size_t kReserve = 4 * kMinMmapAlloc;
+  void* start = ReserveAddressSpace(kReserve - 1);
+  ASSERT_NE(nullptr, start);
+  EXPECT_EQ(nullptr, ReserveAddressSpace(kReserve));
+  EXPECT_FALSE(IsTaggedMemory(start));
+  EXPECT_NE(before, MallocExtension::GetRegionFactory());
+  const uintptr_t lo = reinterpret_cast<uintptr_t>(start);
+  const uintptr_t hi = lo + kReserve;
+
+  // Untagged memory now comes out of the reservation, and is usable...
+  for (int i = 0; i < 3; ++i) {
+    size_t actual;
+    void* p = SystemAlloc(kMinSystemAlloc, &actual, kMinSystemAlloc, false);
+    ASSERT_NE(nullptr, p);
+    EXPECT_LE(lo, reinterpret_cast<uintptr_t>(p));
+    EXPECT_LE(reinterpret_cast<uintptr_t>(p) + actual, hi);
+    memset(p, 0xab, actual);
+  }
+
+  // ...but tagged memory does not.
+  size_t actual;
+  void* t = SystemAlloc(kMinSystemAlloc, &actual, kMinSystemAlloc, true);
+  ASSERT_NE(nullptr, t);
+  EXPECT_TRUE(IsTaggedMemory(t));
+  EXPECT_TRUE(reinterpret_cast<uintptr_t>(t) < lo ||
+              reinterpret_cast<uintptr_t>(t) >= hi);
+
+  std::string stats(4096, '\0');
+  stats.resize(MallocExtension::GetRegionFactory()->GetStats(
+      absl::MakeSpan(&stats[0], stats.size())));
+  EXPECT_NE(std::string::npos, stats.find("up-front reservation carved"))
+      << stats;
+
+  MallocExtension::SetRegionFactory(before);
+}
+
+// Released memory must remain usable whichever way it was released: eagerly
+// released pages read back as zero, lazily released (MADV_FREE) ones either
+// keep their old contents or are zeroed, page by page.
+TEST(SystemRelease, LazyAndEager) {
+  const size_t kHardwarePageSize = 4 * 1024;
+  const size_t kSize = 2 * kHugePageSize;
+  const bool was_lazy = Parameters::madvise_free();
+
+  for (bool lazy : {false, true}) {
+    SCOPED_TRACE(lazy);
+    Parameters::set_madvise_free(lazy);
+    if (!lazy) {
+      EXPECT_FALSE(SystemReleaseIsLazy());
+    }
+
+    void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(p, MAP_FAILED);
+    unsigned char* c = static_cast<unsigned char*>(p);
+    memset(c, 0xab, kSize);
+
+    const int errors = SystemReleaseErrors();
+    SystemRelease(p, kSize);
+    EXPECT_EQ(errors, SystemReleaseErrors());
+
+    for (size_t page = 0; page < kSize; page += kHardwarePageSize) {
+      const unsigned char expected = c[page];
+      if (SystemReleaseIsLazy()) {
+        EXPECT_TRUE(expected == 0 || expected == 0xab) << page;
+      } else {
+        EXPECT_EQ(expected, 0) << page;
+      }
+      for (size_t i = page; i < page + kHardwarePageSize; ++i) {
+        ASSERT_EQ(c[i], expected) << i;
+      }
+    }
+
+    // Reusing the memory must work (and must not be undone by the kernel).
+    memset(c, 0xcd, kSize);
+    for (size_t i = 0; i < kSize; ++i) {
+      ASSERT_EQ(c[i], 0xcd) << i;
+    }
+
+    EXPECT_EQ(munmap(p, kSize), 0);
+  }
+
+  Parameters::set_madvise_free(was_lazy);
+}
+
+// Whether or not the kernel lets us batch, every range must be released
+// (and nothing else), and the statistics must add up.
+TEST(SystemRelease, Ranges) {
+  const size_t kHardwarePageSize = 4 * 1024;
+  // More than fits in one batch.
+  const size_t kRanges = 3 * kMaxReleaseBatch + 1;
+  const size_t kSize = 2 * kRanges * kHardwarePageSize;
+  const bool was_lazy = Parameters::madvise_free();
+  Parameters::set_madvise_free(false);
+
+  void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(p, MAP_FAILED);
+  unsigned char* c = static_cast<unsigned char*>(p);
+  memset(c, 0xab, kSize);
+
+  // Every other page.
+  struct iovec ranges[kRanges];
+  for (size_t i = 0; i < kRanges; ++i) {
+    ranges[i].iov_base = c + 2 * i * kHardwarePageSize;
+    ranges[i].iov_len = kHardwarePageSize;
+  }
+
+  const int errors = SystemReleaseErrors();
+  const SystemReleaseStats before = GetSystemReleaseStats();
+  SystemReleaseRanges(ranges, kRanges);
+  const SystemReleaseStats after = GetSystemReleaseStats();
+  EXPECT_EQ(errors, SystemReleaseErrors());
+
+  for (size_t i = 0; i < kSize; ++i) {
+    const bool released = (i / kHardwarePageSize) % 2 == 0;
+    ASSERT_EQ(c[i], released ? 0 : 0xab) << i;
+  }
+
+  EXPECT_EQ(kRanges, after.ranges - before.ranges);
+  EXPECT_EQ(kRanges * kHardwarePageSize, after.bytes - before.bytes);
+  EXPECT_GE(after.seconds, before.seconds);
+  const int64_t batched = after.batched_syscalls - before.batched_syscalls;
+  const int64_t syscalls = after.syscalls - before.syscalls;
+  EXPECT_GE(syscalls, batched);
+  if (batched > 0) {
+    EXPECT_LT(syscalls, kRanges / 4);
+  } else {
+    EXPECT_GE(syscalls, kRanges);
+  }
+
+  EXPECT_EQ(munmap(p, kSize), 0);
+  Parameters::set_madvise_free(was_lazy);
+}
+
+// Whether the kernel can collapse the range depends on its version and
+// configuration, but either way the contents must survive.
+TEST(SystemCollapse, PreservesContents) {
+  const size_t kSize = 2 * kHugePageSize;
+  void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(p, MAP_FAILED);
+  unsigned char* aligned = static_cast<unsigned char*>(
+      (HugePageContaining(p) + NHugePages(1)).start_addr());
+  ASSERT_LE(aligned + kHugePageSize, static_cast<unsigned char*>(p) + kSize);
+
+  for (size_t i = 0; i < kHugePageSize; ++i) {
+    aligned[i] = i % 251;
+  }
+  SystemCollapse(aligned, kHugePageSize);
+  for (size_t i = 0; i < kHugePageSize; ++i) {
+    ASSERT_EQ(aligned[i], i % 251) << i;
+  }
+
+  EXPECT_EQ(munmap(p, kSize), 0);
+}
+
+// The kernel may not be able to move them (nor will we, once a test has
+// installed a region factory of its own), but either way neither range may
+// lose its contents.
+TEST(SystemRemap, MovesOrLeavesContents) {
+  const size_t kSize = 4 * kHugePageSize;
+  void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(p, MAP_FAILED);
+  unsigned char* from = static_cast<unsigned char*>(
+      (HugePageContaining(p) + NHugePages(1)).start_addr());
+  unsigned char* to = from + kHugePageSize;
+  ASSERT_LE(to + kHugePageSize, static_cast<unsigned char*>(p) + kSize);
+
+  for (size_t i = 0; i < kHugePageSize; ++i) {
+    from[i] = i % 251;
+  }
+  to[0] = 0xab;
+  if (SystemRemap(from, kHugePageSize, to)) {
+    for (size_t i = 0; i < kHugePageSize; ++i) {
+      ASSERT_EQ(to[i], i % 251) << i;
+    }
+    // The source is still mapped, but empty.
+    EXPECT_EQ(from[0], 0);
+    EXPECT_EQ(from[kHugePageSize - 1], 0);
+  } else {
+    for (size_t i = 0; i < kHugePageSize; ++i) {
+      ASSERT_EQ(from[i], i % 251) << i;
+    }
+    EXPECT_EQ(to[0], 0xab);
+  }
+
+  EXPECT_EQ(munmap(p, kSize), 0);
+}
+
+// Once someone else's region factory has been installed, any idle range might
+// be in one of its regions, which we have no business unmapping.
+TEST(SystemUnmap, LeavesForeignRegionsMapped) {
+  AddressRegionFactory* before = MallocExtension::GetRegionFactory();
+  MallocExtension::SetRegionFactory(&f);
+
+  static std::vector<void*> metadata;
+  HugeAllocator allocator(
+      [](size_t bytes, size_t* actual, size_t align) {
+        return SystemAlloc(bytes, actual, align, /*tagged=*/false);
+      },
+      [](size_t bytes) {
+        void* ptr = malloc(bytes);
+        metadata.push_back(ptr);
+        return ptr;
+      },
+      [](void* start, size_t len, size_t* /*metadata_bytes*/) {
+        return SystemUnmap(start, len);
+      });
+  const HugeRange r = allocator.Get(HugeAllocator::kMinUnmap);
+  ASSERT_TRUE(r.valid());
+  unsigned char* first = static_cast<unsigned char*>(r.start_addr());
+  unsigned char* last = first + r.byte_len() - 1;
+  *first = 0xab;
+  *last = 0xcd;
+  allocator.Release(r);
+  const HugeLength system = allocator.system();
+
+  EXPECT_EQ(NHugePages(0),
+            allocator.UnmapIdle(absl::base_internal::CycleClock::Now()));
+  EXPECT_EQ(system, allocator.system());
+  // Still mapped, contents and all.
+  EXPECT_EQ(0xab, *first);
+  EXPECT_EQ(0xcd, *last);
+
+  MallocExtension::SetRegionFactory(before);
+  for (void* ptr : metadata) {
+    free(ptr);
+  }
+  metadata.clear();
+}
+
+long MinorFaults() {
+  struct rusage usage;
+  CHECK_CONDITION(getrusage(RUSAGE_SELF, &usage) == 0);
+  return usage.ru_minflt;
+}
+
+TEST(SystemBack, PopulatesWhenEnabled) {
+  const size_t kHardwarePageSize = 4 * 1024;
+  const size_t kSize = 4 * kHugePageSize;
+  const size_t kPages = kSize / kHardwarePageSize;
+  const bool was_populating = Parameters::populate_on_back();
+
+  for (bool populate : {false, true}) {
+    SCOPED_TRACE(populate);
+    Parameters::set_populate_on_back(populate);
+
+    void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(p, MAP_FAILED);
+#ifdef MADV_NOHUGEPAGE
+    // Make the unpopulated case take a fault per small page, regardless of
+    // the system's THP configuration.
+    madvise(p, kSize, MADV_NOHUGEPAGE);
+#endif
+    unsigned char* c = static_cast<unsigned char*>(p);
+    c[0] = 0xab;
+
+    SystemBack(p, kSize);
+    EXPECT_EQ(c[0], 0xab);
+
+    const long before = MinorFaults();
+    for (size_t i = 0; i < kSize; i += kHardwarePageSize) {
+      c[i] = 1;
+    }
+    const long faults = MinorFaults() - before;
+    if (populate) {
+      EXPECT_LT(faults, kPages / 8);
+    } else {
+      EXPECT_GE(faults, kPages / 2);
+    }
+
+    EXPECT_EQ(munmap(p, kSize), 0);
+  }
+
+  Parameters::set_populate_on_back(was_populating);
+}
+
+// Releases a few hugepages and then writes to every page again, as happens
+// when we subrelease memory that the application soon needs again.  With
+// MADV_FREE (state.range(0) == 1) the pages are usually still present.
+void BM_ReleaseAndReback(benchmark::State& state) {
+  const size_t kHardwarePageSize = 4 * 1024;
+  const size_t kSize = 8 * kHugePageSize;
+  const bool was_lazy = Parameters::madvise_free();
+  Parameters::set_madvise_free(state.range(0) != 0);
+
+  void* p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK_CONDITION(p != MAP_FAILED);
+  volatile char* c = static_cast<volatile char*>(p);
+  for (size_t i = 0; i < kSize; i += kHardwarePageSize) {
+    c[i] = 1;
+  }
+
+  for (auto s : state) {
+    SystemRelease(p, kSize);
+    for (size_t i = 0; i < kSize; i += kHardwarePageSize) {
+      c[i] = 1;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kSize);
+  state.SetLabel(SystemReleaseIsLazy() ? "MADV_FREE" : "MADV_DONTNEED");
+
+  munmap(p, kSize);
+  Parameters::set_madvise_free(was_lazy);
+}
+BENCHMARK(BM_ReleaseAndReback)->Arg(0)->Arg(1);
+
+// Releases state.range(0) scattered, touched pages, as subreleasing a
+// fragmented hugepage does: one at a time (state.range(1) == 0) or with
+// SystemReleaseRanges.
+void BM_ReleaseScattered(benchmark::State& state) {
+  const size_t kHardwarePageSize = 4 * 1024;
+  const size_t n = state.range(0);
+  const bool batched = state.range(1) != 0;
+  const size_t size = 2 * n * kHardwarePageSize;
+  const bool was_lazy = Parameters::madvise_free();
+  Parameters::set_madvise_free(false);
+
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK_CONDITION(p != MAP_FAILED);
+  volatile char* c = static_cast<volatile char*>(p);
+  std::vector<struct iovec> ranges(n);
+  for (size_t i = 0; i < n; ++i) {
+    ranges[i].iov_base = const_cast<char*>(c) + 2 * i * kHardwarePageSize;
+    ranges[i].iov_len = kHardwarePageSize;
+  }
+
+  const SystemReleaseStats before = GetSystemReleaseStats();
+  for (auto s : state) {
+    state.PauseTiming();
+    for (size_t i = 0; i < size; i += kHardwarePageSize) {
+      c[i] = 1;
+    }
+    state.ResumeTiming();
+
+    if (batched) {
+      SystemReleaseRanges(ranges.data(), n);
+    } else {
+      for (const struct iovec& r : ranges) {
+        SystemRelease(r.iov_base, r.iov_len);
+      }
+    }
+  }
+  const SystemReleaseStats after = GetSystemReleaseStats();
+  state.SetBytesProcessed(state.iterations() * n * kHardwarePageSize);
+  state.counters["syscalls_per_iteration"] =
+      static_cast<double>(after.syscalls - before.syscalls) /
+      state.iterations();
+
+  munmap(p, size);
+  Parameters::set_madvise_free(was_lazy);
+}
+BENCHMARK(BM_ReleaseScattered)->ArgsProduct({{16, 256}, {0, 1}});
+
 }  // namespace
 }  // namespace tcmalloc
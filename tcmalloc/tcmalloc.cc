@@ -22,7 +22,10 @@
 //     a time.
 //  2. We have a lock per central free-list, and hold it while manipulating
 //     the central free list for a particular size.
-//  3. The central page allocator is protected by "pageheap_lock".
+//  3. The central page allocator is protected by "pageheap_lock", except
+//     for the hugepage-aware allocator's supply of whole hugepages, which is
+//     protected by "huge_cache_lock".  Where both are held, "huge_cache_lock"
+//     is acquired first.
 //  4. The pagemap (which maps from page-number to descriptor),
 //     can be read without holding any locks, and written while holding
 //     the "pageheap_lock".
@@ -74,6 +77,7 @@
 #include "absl/base/config.h"
 #include "absl/base/const_init.h"
 #include "absl/base/dynamic_annotations.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/base/macros.h"
@@ -83,11 +87,15 @@
 #include "absl/memory/memory.h"
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/strip.h"
+#include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/internal/cgroup_memory.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/linked_list.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/memory_stats.h"
@@ -138,6 +146,170 @@ using tcmalloc::ThreadCache;
 
 // ----------------------- IMPLEMENTATION -------------------------------
 
+// Callbacks registered with MallocExtension::AddMemoryPressureCallback.  A
+// fixed table, so that registering one never allocates.
+static constexpr int kMaxMemoryPressureCallbacks = 16;
+ABSL_CONST_INIT static std::atomic<
+    tcmalloc::MallocExtension::MemoryPressureCallback>
+    memory_pressure_callbacks[kMaxMemoryPressureCallbacks];
+
+// Held by the one thread reclaiming memory for a soft limit at a time.
+ABSL_CONST_INIT static absl::base_internal::SpinLock soft_limit_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+// How often we have done so, and how often that came down to the callbacks.
+ABSL_CONST_INIT static std::atomic<int64_t> soft_limit_reclaims(0);
+ABSL_CONST_INIT static std::atomic<int64_t> memory_pressure_calls(0);
+
+// Returns what the per-CPU caches hold, and what that and frees on other CPUs
+// left in the transfer caches, to the central free lists.  Needs their locks,
+// so must be called with none of ours held.
+static void ReclaimCaches() {
+  if (Static::CPUCacheActive()) {
+    const int num_cpus = absl::base_internal::NumCPUs();
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      Static::cpu_cache()->Reclaim(cpu);
+    }
+  }
+  for (int cl = 1; cl < kNumClasses; ++cl) {
+    Static::transfer_cache()[cl].Flush();
+  }
+}
+
+// Gives back free memory, cheapest first, until we're under a soft limit:
+// the per-CPU caches, the transfer caches, then what the page allocators
+// hold without and finally with breaking up hugepages.  If that is not enough,
+// asks the memory pressure callbacks to free some, and goes through our caches
+// once more for what they freed.  Needs the caches' locks, so must be called
+// with none of ours held.
+static ABSL_ATTRIBUTE_NOINLINE void ReclaimToSoftLimit() {
+  // Don't let a callback's allocations reclaim again underneath it.
+  if (!soft_limit_lock.TryLock()) return;
+  if (!Static::page_allocator()->TakeSoftLimitPressure()) {
+    soft_limit_lock.Unlock();
+    return;
+  }
+  soft_limit_reclaims.fetch_add(1, std::memory_order_relaxed);
+
+  auto pages_over_limit = []() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return Static::page_allocator()->PagesOverLimit();
+  };
+  auto reclaim = [&]() {
+    ReclaimCaches();
+
+    // What the release calls return may include credit for earlier eager
+    // releases, so we measure how far over we still are after each.
+    Length pages = pages_over_limit();
+    if (pages == 0) return Length(0);
+    Static::page_allocator()->ReleaseCached(pages);
+    pages = pages_over_limit();
+    if (pages == 0) return Length(0);
+    Static::page_allocator()->ReleaseBreakingHugepages(pages);
+    return pages_over_limit();
+  };
+
+  Length pages = reclaim();
+  if (pages > 0) {
+    memory_pressure_calls.fetch_add(1, std::memory_order_relaxed);
+    for (auto& slot : memory_pressure_callbacks) {
+      auto callback = slot.load(std::memory_order_acquire);
+      if (callback == nullptr) continue;
+      callback(pages << kPageShift);
+      pages = pages_over_limit();
+      if (pages == 0) break;
+    }
+    pages = reclaim();
+  }
+  soft_limit_lock.Unlock();
+
+  if (pages > 0) {
+    // Print logs once.
+    static std::atomic<bool> warned(false);
+    if (warned.exchange(true, std::memory_order_relaxed)) return;
+    Log(kLogWithStack, __FILE__, __LINE__, "Couldn't respect usage limit of ",
+        Static::page_allocator()->limit().first,
+        "and OOM is likely to follow.");
+  }
+}
+
+// Guards what we last read of memory pressure, and when.
+ABSL_CONST_INIT static absl::base_internal::SpinLock memory_pressure_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+ABSL_CONST_INIT static int64_t memory_pressure_checked
+    ABSL_GUARDED_BY(memory_pressure_lock) = 0;
+ABSL_CONST_INIT static bool memory_pressure_found
+    ABSL_GUARDED_BY(memory_pressure_lock) = false;
+ABSL_CONST_INIT static bool under_memory_pressure
+    ABSL_GUARDED_BY(memory_pressure_lock) = false;
+ABSL_CONST_INIT static tcmalloc::tcmalloc_internal::MemoryPressure
+    memory_pressure ABSL_GUARDED_BY(memory_pressure_lock) = {0, 0};
+// How often we released memory for it, and how much.
+ABSL_CONST_INIT static std::atomic<int64_t> memory_pressure_releases(0);
+ABSL_CONST_INIT static std::atomic<int64_t> memory_pressure_release_bytes(0);
+
+static const char* MemoryPressureFile() {
+  const char* e = tcmalloc::tcmalloc_internal::thread_safe_getenv(
+      "TCMALLOC_MEMORY_PRESSURE_FILE");
+  return e != nullptr ? e : "/proc/pressure/memory";
+}
+
+// With Parameters::memory_pressure_release_threshold() set, reads memory
+// pressure from $TCMALLOC_MEMORY_PRESSURE_FILE (by default, the system-wide
+// /proc/pressure/memory; a cgroup's memory.pressure works too), at most once a
+// second.  While some tasks stall on memory for at least that percentage of
+// the time, gives back all the free memory we can without breaking up
+// hugepages: the per-CPU and transfer caches, the page allocators' run caches
+// and the HugeCaches.  From twice that, or once all tasks stall that much,
+// breaks up hugepages too.  Returns whether we are under pressure, in which
+// case the caller should not refill what we released.  Reads a file and needs
+// the caches' locks, so must be called with none of ours held.
+static bool ReleaseForMemoryPressure() {
+  const double threshold =
+      tcmalloc::Parameters::memory_pressure_release_threshold();
+  if (threshold <= 0) return false;
+
+  tcmalloc::tcmalloc_internal::MemoryPressure pressure;
+  {
+    absl::base_internal::SpinLockHolder l(&memory_pressure_lock);
+    const int64_t now = absl::base_internal::CycleClock::Now();
+    if (now - memory_pressure_checked <
+        absl::base_internal::CycleClock::Frequency()) {
+      return under_memory_pressure;
+    }
+    memory_pressure_checked = now;
+    memory_pressure_found = tcmalloc::tcmalloc_internal::GetMemoryPressure(
+        MemoryPressureFile(), &memory_pressure);
+    under_memory_pressure =
+        memory_pressure_found && memory_pressure.some_avg10 >= threshold;
+    if (!under_memory_pressure) return false;
+    pressure = memory_pressure;
+  }
+  const bool severe = pressure.some_avg10 >= 2 * threshold ||
+                      pressure.full_avg10 >= threshold;
+
+  ReclaimCaches();
+  tcmalloc::PageAllocator* page_allocator = Static::page_allocator();
+  auto stats = [page_allocator]() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return page_allocator->stats();
+  };
+  const tcmalloc::BackingStats before = stats();
+  page_allocator->ReleaseCached(before.free_bytes >> kPageShift);
+  if (severe) {
+    page_allocator->ReleaseBreakingHugepages(stats().free_bytes >> kPageShift);
+  }
+  // The release calls' counts may include earlier eager releases; see what
+  // we actually unmapped.
+  const tcmalloc::BackingStats after = stats();
+  memory_pressure_releases.fetch_add(1, std::memory_order_relaxed);
+  if (after.unmapped_bytes > before.unmapped_bytes) {
+    memory_pressure_release_bytes.fetch_add(
+        after.unmapped_bytes - before.unmapped_bytes,
+        std::memory_order_relaxed);
+  }
+  return true;
+}
+
 // Extract interesting stats
 struct TCMallocStats {
   uint64_t thread_bytes;            // Bytes in thread caches
@@ -253,6 +425,80 @@ static uint64_t InUseByApp(const TCMallocStats& stats) {
                  stats.pageheap.unmapped_bytes);
 }
 
+// With a memory limit, what the per-CPU and transfer caches hold counts
+// against it, but ShrinkToUsageLimit can't get it back.  So we give them at
+// most 1/kCacheBudgetDivisor of the limit, and at most half of what the
+// application leaves below it, split evenly between the two.
+static constexpr uint64_t kCacheBudgetDivisor = 8;
+// Each CPU keeps this much, so that its cache still holds a few batches.
+static constexpr uint64_t kMinPerCpuCacheLimit = 32 << 10;
+
+// Guards when we last set the cache budgets, and for what limit.
+ABSL_CONST_INIT static absl::base_internal::SpinLock cache_budget_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+ABSL_CONST_INIT static int64_t cache_budget_checked
+    ABSL_GUARDED_BY(cache_budget_lock) = 0;
+ABSL_CONST_INIT static size_t cache_budget_limit
+    ABSL_GUARDED_BY(cache_budget_lock) = std::numeric_limits<size_t>::max();
+
+// Returns the bytes the transfer caches may hold now, and could ever hold.
+static std::pair<uint64_t, uint64_t> TransferCacheBudget() {
+  uint64_t budget = 0, max = 0;
+  for (int cl = 1; cl < kNumClasses; ++cl) {
+    const size_t size = Static::sizemap()->class_to_size(cl);
+    budget += size * Static::transfer_cache()[cl].capacity_limit();
+    max += size * Static::transfer_cache()[cl].max_capacity();
+  }
+  return {budget, max};
+}
+
+// Sizes the per-CPU and transfer caches for our memory limit and how much of
+// it the application uses, at most once a second unless forced or the limit
+// has changed.  Without a
+// limit, they get what Parameters::max_per_cpu_cache_size() and the transfer
+// caches' own maximums allow.  Needs the caches' locks, so must be called
+// with none of ours held.
+static void UpdateCacheBudgets(bool force) {
+  const size_t limit = Static::page_allocator()->limit().first;
+  absl::base_internal::SpinLockHolder l(&cache_budget_lock);
+  const int64_t now = absl::base_internal::CycleClock::Now();
+  if (!force && limit == cache_budget_limit &&
+      now - cache_budget_checked <
+          absl::base_internal::CycleClock::Frequency()) {
+    return;
+  }
+  cache_budget_checked = now;
+  cache_budget_limit = limit;
+
+  const uint64_t max_per_cpu = tcmalloc::Parameters::max_per_cpu_cache_size();
+  const uint64_t max_transfer = TransferCacheBudget().second;
+  uint64_t per_cpu = max_per_cpu;
+  uint64_t transfer = max_transfer;
+  if (limit != std::numeric_limits<size_t>::max()) {
+    TCMallocStats stats;
+    ExtractStats(&stats, nullptr, nullptr, nullptr, false);
+    const uint64_t budget = std::min<uint64_t>(
+        limit / kCacheBudgetDivisor, StatSub(limit, InUseByApp(stats)) / 2);
+    per_cpu = std::min(
+        max_per_cpu,
+        std::max(kMinPerCpuCacheLimit,
+                 budget / 2 / absl::base_internal::NumCPUs()));
+    transfer = std::min(max_transfer, budget / 2);
+  }
+
+  if (Static::CPUCacheActive()) {
+    Static::cpu_cache()->SetCacheLimit(per_cpu);
+  }
+  // Scale every size class alike, relative to its own maximum.
+  for (int cl = 1; cl < kNumClasses; ++cl) {
+    tcmalloc::TransferCache& cache = Static::transfer_cache()[cl];
+    const uint64_t max_capacity = cache.max_capacity();
+    cache.SetCapacityLimit(
+        max_transfer == 0 ? max_capacity
+                          : max_capacity * transfer / max_transfer);
+  }
+}
+
 static uint64_t VirtualMemoryUsed(const TCMallocStats& stats) {
   return stats.pageheap.system_bytes + stats.metadata_bytes;
 }
@@ -432,7 +678,45 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
                 limit_bytes, is_hard ? "(hard)" : "");
     long long limit_hits = Static::page_allocator()->limit_hits();
     out->printf("Number of times limit was hit: %lld\n", limit_hits);
+    out->printf(
+        "Soft limit reclaims: %lld, calling memory pressure callbacks %lld "
+        "times\n",
+        static_cast<long long>(soft_limit_reclaims.load()),
+        static_cast<long long>(memory_pressure_calls.load()));
+    {
+      absl::base_internal::SpinLockHolder l(&memory_pressure_lock);
+      if (memory_pressure_found) {
+        out->printf(
+            "Memory pressure: some %.2f%%, full %.2f%% (avg10); released "
+            "%lld bytes in %lld releases under pressure\n",
+            memory_pressure.some_avg10, memory_pressure.full_avg10,
+            static_cast<long long>(memory_pressure_release_bytes.load()),
+            static_cast<long long>(memory_pressure_releases.load()));
+      }
+    }
+    const std::pair<uint64_t, uint64_t> transfer = TransferCacheBudget();
+    out->printf(
+        "Cache budgets: per-CPU %" PRIu64 " of %" PRIu64
+        " bytes per cpu, transfer %" PRIu64 " of %" PRIu64 " bytes\n",
+        tcmalloc::UsePerCpuCache() ? Static::cpu_cache()->CacheLimit() : 0,
+        static_cast<uint64_t>(tcmalloc::Parameters::max_per_cpu_cache_size()),
+        transfer.first, transfer.second);
+    tcmalloc::tcmalloc_internal::CgroupMemoryLimits cgroup;
+    if (Static::page_allocator()->cgroup_limits(&cgroup)) {
+      auto cgroup_limit = [](size_t limit) {
+        return limit == std::numeric_limits<size_t>::max()
+                   ? std::string("max")
+                   : absl::StrCat(limit);
+      };
+      out->printf("Cgroup memory.high: %s, memory.max: %s\n",
+                  cgroup_limit(cgroup.high).c_str(),
+                  cgroup_limit(cgroup.max).c_str());
+    }
 
+    out->printf("PARAMETER tcmalloc_cgroup_memory_limit_fraction %f\n",
+                tcmalloc::Parameters::cgroup_memory_limit_fraction());
+    out->printf("PARAMETER tcmalloc_memory_pressure_release_threshold %f\n",
+                tcmalloc::Parameters::memory_pressure_release_threshold());
     out->printf("PARAMETER tcmalloc_per_cpu_caches %d\n",
                 tcmalloc::Parameters::per_cpu_caches() ? 1 : 0);
     out->printf("PARAMETER tcmalloc_max_per_cpu_cache_size %d\n",
@@ -441,6 +725,43 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
         tcmalloc::Parameters::max_total_thread_cache_bytes();
     out->printf("PARAMETER tcmalloc_max_total_thread_cache_bytes %lld\n",
                 thread_cache_max);
+    out->printf("PARAMETER tcmalloc_madvise_free %d\n",
+                tcmalloc::Parameters::madvise_free() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_hugepage_collapse %d\n",
+                tcmalloc::Parameters::hugepage_collapse() ? 1 : 0);
+    out->printf(
+        "PARAMETER tcmalloc_filler_adaptive_partial_rerelease %d\n",
+        tcmalloc::Parameters::filler_adaptive_partial_rerelease() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_filler_segregate_span_lengths %d\n",
+                tcmalloc::Parameters::filler_segregate_span_lengths() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_filler_skip_subrelease_max_interval %s\n",
+                absl::FormatDuration(
+                    tcmalloc::Parameters::filler_skip_subrelease_max_interval())
+                    .c_str());
+    out->printf(
+        "PARAMETER tcmalloc_huge_cache_deferred_unback_bytes %lld\n",
+        static_cast<long long>(
+            tcmalloc::Parameters::huge_cache_deferred_unback_bytes()));
+    out->printf("PARAMETER tcmalloc_huge_cache_warm_reserve_bytes %lld\n",
+                static_cast<long long>(
+                    tcmalloc::Parameters::huge_cache_warm_reserve_bytes()));
+    out->printf(
+        "PARAMETER tcmalloc_large_run_cache_bytes %lld\n",
+        static_cast<long long>(tcmalloc::Parameters::large_run_cache_bytes()));
+    out->printf(
+        "PARAMETER tcmalloc_page_run_cache_bytes %lld\n",
+        static_cast<long long>(tcmalloc::Parameters::page_run_cache_bytes()));
+    out->printf("PARAMETER tcmalloc_populate_on_back %d\n",
+                tcmalloc::Parameters::populate_on_back() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_thp_coverage_sample_interval %s\n",
+                absl::FormatDuration(
+                    tcmalloc::Parameters::thp_coverage_sample_interval())
+                    .c_str());
+    out->printf(
+        "PARAMETER tcmalloc_unmap_idle_address_space_interval %s\n",
+        absl::FormatDuration(
+            tcmalloc::Parameters::unmap_idle_address_space_interval())
+            .c_str());
   }
 }
 
@@ -469,6 +790,7 @@ namespace {
   region.PrintI64("malloc_metadata", stats.metadata_bytes);
   region.PrintI64("actual_mem_used", physical_memory_used);
   region.PrintI64("unmapped", stats.pageheap.unmapped_bytes);
+  region.PrintI64("lazily_freed", stats.pageheap.lazily_freed_bytes);
   region.PrintI64("virtual_address_space_used", virtual_memory_used);
   region.PrintI64("num_spans", uint64_t(stats.span_stats.in_use));
   region.PrintI64("num_spans_created", uint64_t(stats.span_stats.total));
@@ -545,6 +867,24 @@ namespace {
   region.PrintI64("desired_usage_limit_bytes", limit_bytes);
   region.PrintBool("hard_limit", is_hard);
   region.PrintI64("limit_hits", Static::page_allocator()->limit_hits());
+  region.PrintI64("soft_limit_reclaims", soft_limit_reclaims.load());
+  region.PrintI64("memory_pressure_calls", memory_pressure_calls.load());
+  region.PrintI64("memory_pressure_releases",
+                  memory_pressure_releases.load());
+  region.PrintI64("memory_pressure_release_bytes",
+                  memory_pressure_release_bytes.load());
+  if (tcmalloc::UsePerCpuCache()) {
+    region.PrintI64("per_cpu_cache_limit_bytes",
+                    Static::cpu_cache()->CacheLimit());
+  }
+  const std::pair<uint64_t, uint64_t> transfer = TransferCacheBudget();
+  region.PrintI64("transfer_cache_limit_bytes", transfer.first);
+  region.PrintI64("transfer_cache_max_bytes", transfer.second);
+  tcmalloc::tcmalloc_internal::CgroupMemoryLimits cgroup;
+  if (Static::page_allocator()->cgroup_limits(&cgroup)) {
+    region.PrintI64("cgroup_memory_high", cgroup.high);
+    region.PrintI64("cgroup_memory_max", cgroup.max);
+  }
 
   {
     auto gwp_asan = region.CreateSubRegion("gwp_asan");
@@ -552,13 +892,56 @@ namespace {
   }
 
   region.PrintI64("memory_release_failures", tcmalloc::SystemReleaseErrors());
-
+  {
+    const tcmalloc::SystemReleaseStats release =
+        tcmalloc::GetSystemReleaseStats();
+    auto release_region = region.CreateSubRegion("memory_release");
+    release_region.PrintI64("ranges", release.ranges);
+    release_region.PrintI64("bytes", release.bytes);
+    release_region.PrintI64("syscalls", release.syscalls);
+    release_region.PrintI64("batched_syscalls", release.batched_syscalls);
+    release_region.PrintDouble("seconds", release.seconds);
+  }
+
+  region.PrintDouble("tcmalloc_cgroup_memory_limit_fraction",
+                     tcmalloc::Parameters::cgroup_memory_limit_fraction());
+  region.PrintDouble("tcmalloc_memory_pressure_release_threshold",
+                     tcmalloc::Parameters::memory_pressure_release_threshold());
   region.PrintBool("tcmalloc_per_cpu_caches",
                    tcmalloc::Parameters::per_cpu_caches());
   region.PrintI64("tcmalloc_max_per_cpu_cache_size",
                   tcmalloc::Parameters::max_per_cpu_cache_size());
   region.PrintI64("tcmalloc_max_total_thread_cache_bytes",
                   tcmalloc::Parameters::max_total_thread_cache_bytes());
+  region.PrintBool("tcmalloc_madvise_free",
+                   tcmalloc::Parameters::madvise_free());
+  region.PrintBool("tcmalloc_hugepage_collapse",
+                   tcmalloc::Parameters::hugepage_collapse());
+  region.PrintBool("tcmalloc_filler_adaptive_partial_rerelease",
+                   tcmalloc::Parameters::filler_adaptive_partial_rerelease());
+  region.PrintBool("tcmalloc_filler_segregate_span_lengths",
+                   tcmalloc::Parameters::filler_segregate_span_lengths());
+  region.PrintI64(
+      "tcmalloc_filler_skip_subrelease_max_interval_ns",
+      absl::ToInt64Nanoseconds(
+          tcmalloc::Parameters::filler_skip_subrelease_max_interval()));
+  region.PrintI64("tcmalloc_huge_cache_deferred_unback_bytes",
+                  tcmalloc::Parameters::huge_cache_deferred_unback_bytes());
+  region.PrintI64("tcmalloc_huge_cache_warm_reserve_bytes",
+                  tcmalloc::Parameters::huge_cache_warm_reserve_bytes());
+  region.PrintI64("tcmalloc_large_run_cache_bytes",
+                  tcmalloc::Parameters::large_run_cache_bytes());
+  region.PrintI64("tcmalloc_page_run_cache_bytes",
+                  tcmalloc::Parameters::page_run_cache_bytes());
+  region.PrintBool("tcmalloc_populate_on_back",
+                   tcmalloc::Parameters::populate_on_back());
+  region.PrintI64("tcmalloc_thp_coverage_sample_interval_ns",
+                  absl::ToInt64Nanoseconds(
+                      tcmalloc::Parameters::thp_coverage_sample_interval()));
+  region.PrintI64(
+      "tcmalloc_unmap_idle_address_space_interval_ns",
+      absl::ToInt64Nanoseconds(
+          tcmalloc::Parameters::unmap_idle_address_space_interval()));
 }
 
 }  // namespace
@@ -776,6 +1159,14 @@ extern "C" size_t TCMalloc_Internal_GetStats(char* buffer,
   printer.printf("\nLow-level allocator stats:\n");
   printer.printf("Memory Release Failures: %d\n",
                  tcmalloc::SystemReleaseErrors());
+  const tcmalloc::SystemReleaseStats release =
+      tcmalloc::GetSystemReleaseStats();
+  const double released_mib = release.bytes / 1048576.0;
+  printer.printf(
+      "Memory Released: %" PRId64 " ranges, %.1f MiB in %" PRId64
+      " system calls (%" PRId64 " batched), %.1f MiB/s\n",
+      release.ranges, released_mib, release.syscalls, release.batched_syscalls,
+      release.seconds > 0 ? released_mib / release.seconds : 0.0);
 
   size_t n = printer.SpaceRequired();
   // SpaceRequired includes the null terminator.  Remove it.
@@ -891,6 +1282,12 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
     return true;
   }
 
+  if (name == "tcmalloc.pageheap_lazily_freed_bytes") {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    *value = Static::page_allocator()->stats().lazily_freed_bytes;
+    return true;
+  }
+
   if (name == "tcmalloc.page_algorithm") {
     absl::base_internal::SpinLockHolder l(&pageheap_lock);
     *value = Static::page_allocator()->algorithm();
@@ -1012,6 +1409,30 @@ extern "C" void MallocExtension_Internal_SetMemoryLimit(
   } else {
     tcmalloc::Parameters::set_heap_size_hard_limit(limit->limit);
   }
+  UpdateCacheBudgets(/*force=*/true);
+}
+
+extern "C" bool MallocExtension_Internal_AddMemoryPressureCallback(
+    tcmalloc::MallocExtension::MemoryPressureCallback callback) {
+  for (auto& slot : memory_pressure_callbacks) {
+    tcmalloc::MallocExtension::MemoryPressureCallback expected = nullptr;
+    if (slot.compare_exchange_strong(expected, callback,
+                                     std::memory_order_acq_rel)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+extern "C" void MallocExtension_Internal_RemoveMemoryPressureCallback(
+    tcmalloc::MallocExtension::MemoryPressureCallback callback) {
+  for (auto& slot : memory_pressure_callbacks) {
+    tcmalloc::MallocExtension::MemoryPressureCallback expected = callback;
+    if (slot.compare_exchange_strong(expected, nullptr,
+                                     std::memory_order_acq_rel)) {
+      return;
+    }
+  }
 }
 
 extern "C" void MallocExtension_Internal_MarkThreadIdle() {
@@ -1045,9 +1466,20 @@ extern "C" void MallocExtension_Internal_ReleaseMemoryToSystem(
   // memory at a constant rate.
   ABSL_CONST_INIT static size_t extra_bytes_released;
 
+  // For the same reason, this is where we follow our cgroup's limits and
+  // memory pressure, resize our caches for our limit, and get back under a
+  // soft limit that no allocation has run into.  That reads files and takes
+  // the caches' locks, so do it before taking our locks.
+  Static::page_allocator()->UpdateCgroupLimit(/*force=*/false);
+  const bool under_memory_pressure = ReleaseForMemoryPressure();
+  UpdateCacheBudgets(/*force=*/false);
+  Static::page_allocator()->CheckSoftLimit();
+  if (Static::page_allocator()->soft_limit_pressure()) {
+    ReclaimToSoftLimit();
+  }
+
   absl::base_internal::SpinLockHolder rh(&release_lock);
 
-  absl::base_internal::SpinLockHolder h(&pageheap_lock);
   if (num_bytes <= extra_bytes_released) {
     // We released too much on a prior call, so don't release any
     // more this time.
@@ -1075,6 +1507,12 @@ extern "C" void MallocExtension_Internal_ReleaseMemoryToSystem(
     // with a big release next time.
     extra_bytes_released = 0;
   }
+  // There is no background thread to keep the HugeCaches' warm reserves
+  // topped up, so do it here: callers release memory periodically.  Under
+  // memory pressure, they have just been given up, and should stay that way.
+  if (!under_memory_pressure) {
+    Static::page_allocator()->RefillWarmReserves();
+  }
 }
 
 // nallocx slow path.
@@ -1154,6 +1592,8 @@ extern "C" void MallocExtension_Internal_GetProperties(
       stats.pageheap.unmapped_bytes;
   (*result)["tcmalloc.page_heap_unmapped"].value =
       stats.pageheap.unmapped_bytes;
+  (*result)["tcmalloc.pageheap_lazily_freed_bytes"].value =
+      stats.pageheap.lazily_freed_bytes;
 
   (*result)["tcmalloc.page_algorithm"].value =
       Static::page_allocator()->algorithm();
@@ -1521,31 +1961,71 @@ inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE AllocSmall(Policy policy, size_t cl,
   return result;
 }
 
+// What is left to do for a sample that UnsampleSpan() dropped, once the caller
+// has released pageheap_lock.
+struct Unsampled {
+  void* proxy = nullptr;
+  size_t size = 0;
+  bool notify_sampled_alloc = false;
+};
+
+// Drops span's sample, if it has one, as its allocation is going away: it is
+// being freed or resized.
+static Unsampled UnsampleSpan(Span* span)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  Unsampled unsampled;
+  if (StackTrace* st = span->Unsample()) {
+    unsampled.proxy = st->proxy;
+    unsampled.size = st->allocated_size;
+    if (unsampled.proxy == nullptr && unsampled.size <= kMaxSize) {
+      tcmalloc::tracking::Report(tcmalloc::kFreeMiss,
+                                 Static::sizemap()->SizeClass(unsampled.size),
+                                 1);
+    }
+    unsampled.notify_sampled_alloc = true;
+    Static::stacktrace_allocator()->Delete(st);
+  }
+  return unsampled;
+}
+
+static void FinishUnsample(const Unsampled& unsampled)
+    ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+  if (unsampled.notify_sampled_alloc) {
+  }
+
+  if (unsampled.proxy) {
+    FreeSmall<Hooks::NO>(unsampled.proxy,
+                         Static::sizemap()->SizeClass(unsampled.size));
+  }
+}
+
 // Handles freeing object that doesn't have size class, i.e. which
 // is either large or sampled. We explicitly prevent inlining it to
 // keep it out of fast-path. This helps avoid expensive
 // prologue/epiloge for fast-path freeing functions.
 ABSL_ATTRIBUTE_NOINLINE
 static void do_free_pages(void* ptr, const PageId p) {
-  void* proxy = nullptr;
-  size_t size;
-  bool notify_sampled_alloc = false;
+  Unsampled unsampled;
 
   Span* span = Static::pagemap()->GetExistingDescriptor(p);
   ASSERT(span != nullptr);
+  // Unsampled spans are ours alone now, so we can try to cache them, or free
+  // whole hugepages, without pageheap_lock.  Sampled ones need it to
+  // Unsample().
+  bool tried_cache = false;
+  if (!span->sampled() && !tcmalloc::IsTaggedMemory(ptr)) {
+    ASSERT(span->first_page() == p);
+    ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
+    if (Static::page_allocator()->DeleteToCache(span, /*tagged=*/false) ||
+        Static::page_allocator()->DeleteWithoutLock(span, /*tagged=*/false)) {
+      return;
+    }
+    tried_cache = true;
+  }
   {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
     ASSERT(span->first_page() == p);
-    if (StackTrace* st = span->Unsample()) {
-      proxy = st->proxy;
-      size = st->allocated_size;
-      if (proxy == nullptr && size <= kMaxSize) {
-        tcmalloc::tracking::Report(tcmalloc::kFreeMiss,
-                                   Static::sizemap()->SizeClass(size), 1);
-      }
-      notify_sampled_alloc = true;
-      Static::stacktrace_allocator()->Delete(st);
-    }
+    unsampled = UnsampleSpan(span);
     if (tcmalloc::IsTaggedMemory(ptr)) {
       if (Static::guardedpage_allocator()->PointerIsMine(ptr)) {
         // Release lock while calling Deallocate() since it does a system call.
@@ -1555,20 +2035,21 @@ static void do_free_pages(void* ptr, const PageId p) {
         Span::Delete(span);
       } else {
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
-        Static::page_allocator()->Delete(span, /*tagged=*/true);
+        if (!Static::page_allocator()->DeleteToCache(span, /*tagged=*/true)) {
+          Static::page_allocator()->Delete(span, /*tagged=*/true);
+        }
       }
     } else {
       ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
-      Static::page_allocator()->Delete(span, /*tagged=*/false);
+      // The cache turned away what we already offered it; it would again.
+      if (tried_cache ||
+          !Static::page_allocator()->DeleteToCache(span, /*tagged=*/false)) {
+        Static::page_allocator()->Delete(span, /*tagged=*/false);
+      }
     }
   }
-
-  if (notify_sampled_alloc) {
-  }
-
-  if (proxy) {
-    FreeSmall<Hooks::NO>(proxy, Static::sizemap()->SizeClass(size));
-  }
+  Static::page_allocator()->ReturnFreedHugepages();
+  FinishUnsample(unsampled);
 }
 
 #ifndef NDEBUG
@@ -1790,6 +2271,10 @@ static void* ABSL_ATTRIBUTE_SECTION(google_malloc)
       return Policy::handle_oom(size);
     }
   }
+  // With no locks held, this is where we can get back under a soft limit.
+  if (ABSL_PREDICT_FALSE(Static::page_allocator()->soft_limit_pressure())) {
+    ReclaimToSoftLimit();
+  }
   if (Policy::invoke_hooks()) {
   }
   return p;
@@ -1958,6 +2443,40 @@ extern "C" void TCMallocInternalCfree(void* ptr) noexcept
 }
 #endif  // TCMALLOC_ALIAS
 
+// Resizes old_ptr, a page-level allocation, to new_size bytes (or, growing,
+// at least new_size) without copying it, if the page allocator can (see
+// PageAllocator::Resize).  Returns where it lives now, or nullptr if it is as
+// it was.
+static void* TryResizePages(void* old_ptr, size_t new_size, bool may_move) {
+  // Tagged memory is sampled (and maybe guarded); it's never large enough to
+  // be worth the trouble.
+  if (tcmalloc::IsTaggedMemory(old_ptr)) return nullptr;
+  const PageId p = PageIdContaining(old_ptr);
+  if (Static::pagemap()->sizeclass(p) != 0) return nullptr;
+  Span* span = Static::pagemap()->GetExistingDescriptor(p);
+  const Length n = tcmalloc::BytesToLengthCeil(new_size);
+  // A sample records the old size, so it has to be redone even then.
+  if (n == span->num_pages() && !span->sampled()) return old_ptr;
+  span = Static::page_allocator()->Resize(span, n, may_move,
+                                          /*tagged=*/false);
+  if (span == nullptr) return nullptr;
+
+  // Any sample was of the old size; drop it as do_free_pages would, and sample
+  // the new one afresh, as if we had allocated it.
+  Unsampled unsampled;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    unsampled = UnsampleSpan(span);
+  }
+  FinishUnsample(unsampled);
+  void* result = span->start_address();
+  if (size_t weight = ShouldSampleAllocation(new_size)) {
+    CHECK_CONDITION(result == SampleifyAllocation(new_size, weight, 0, 0,
+                                                  nullptr, span, nullptr));
+  }
+  return result;
+}
+
 static inline void* do_realloc(void* old_ptr, size_t new_size) {
   Static::InitIfNecessary();
   // Get the size of the old entry
@@ -1978,6 +2497,13 @@ static inline void* do_realloc(void* old_ptr, size_t new_size) {
     // Need to reallocate.
     void* new_ptr = nullptr;
 
+    // Large allocations that stay large may be able to grow or shrink
+    // without a copy.
+    if (old_size > kMaxSize && new_size > kMaxSize) {
+      new_ptr = TryResizePages(old_ptr, new_size, /*may_move=*/true);
+      if (new_ptr != nullptr) return new_ptr;
+    }
+
     if (new_size > old_size && new_size < lower_bound_to_grow) {
       // Avoid fast_alloc() reporting a hook with the lower bound size
       // as we the expectation for pointer returning allocation functions
@@ -2017,6 +2543,20 @@ extern "C" void* TCMallocInternalRealloc(void* old_ptr,
   return do_realloc(old_ptr, new_size);
 }
 
+extern "C" bool tcmalloc_try_resize(void* ptr, size_t new_size) noexcept {
+  if (ptr == nullptr || tcmalloc::IsTaggedMemory(ptr)) return false;
+  const size_t cl = Static::pagemap()->sizeclass(PageIdContaining(ptr));
+  if (cl != 0) {
+    // Small objects can only take on the sizes of their own class.
+    uint32_t new_cl;
+    return Static::sizemap()->GetSizeClass(new_size, &new_cl) && new_cl == cl;
+  }
+  // Page-level allocations must stay that size, or sized delete would look
+  // for a size class.
+  if (new_size <= kMaxSize || GetSize(ptr) <= kMaxSize) return false;
+  return TryResizePages(ptr, new_size, /*may_move=*/false) != nullptr;
+}
+
 extern "C" void* TCMallocInternalNewNothrow(size_t size,
                                             const std::nothrow_t&) noexcept {
   return fast_alloc(CppPolicy().Nothrow(), size);
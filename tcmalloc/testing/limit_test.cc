@@ -15,7 +15,10 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <fstream>
 #include <limits>
 #include <map>
 #include <string>
@@ -25,8 +28,11 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/parameter_accessors.h"
@@ -166,8 +172,8 @@ TEST_F(LimitTest, LimitRespected) {
   statsPbtxt = GetStatsInPbTxt();
   // The HugePageAwareAllocator hits the limit more than once.
   EXPECT_THAT(statsBuf,
-              ContainsRegex(R"(Number of times limit was hit: [1-9]\d*)"));
-  EXPECT_THAT(statsPbtxt, ContainsRegex(R"(limit_hits: [1-9]\d*)"));
+              ContainsRegex(R"(Number of times limit was hit: [1-9][0-9]*)"));
+  EXPECT_THAT(statsPbtxt, ContainsRegex(R"(limit_hits: [1-9][0-9]*)"));
 
   for (auto p : ptrs) {
     free(p);
@@ -247,5 +253,260 @@ TEST_F(LimitTest, HardLimitRespectsNoSubrelease) {
   SetLimit(std::numeric_limits<size_t>::max(), false);
 }
 
+// What the memory pressure callback below may free, and how often it has
+// been called.
+std::vector<void *> *held_chunks;
+int pressure_calls;
+constexpr size_t kChunk = 1 << 20;
+
+void FreeHeldChunks(size_t bytes) {
+  ++pressure_calls;
+  size_t freed = 0;
+  while (freed < bytes && !held_chunks->empty()) {
+    ::operator delete(held_chunks->back());
+    held_chunks->pop_back();
+    freed += kChunk;
+  }
+}
+
+TEST_F(LimitTest, SoftLimitCallsPressureCallbacks) {
+  std::vector<void *> chunks;
+  chunks.reserve(256);
+  held_chunks = &chunks;
+  pressure_calls = 0;
+  ASSERT_TRUE(MallocExtension::AddMemoryPressureCallback(FreeHeldChunks));
+
+  const size_t limit = physical_memory_used() + 64 * kChunk;
+  SetLimit(limit, false);
+  // Nothing is free, so only the callback can keep us under the limit.
+  for (int i = 0; i < 128; ++i) {
+    chunks.push_back(::operator new(kChunk));
+  }
+  EXPECT_GT(pressure_calls, 0);
+  EXPECT_LT(chunks.size(), 128);
+  EXPECT_LE(physical_memory_used(), limit);
+
+  absl::string_view statsBuf = GetStats();
+  absl::string_view statsPbtxt = GetStatsInPbTxt();
+  EXPECT_THAT(statsBuf,
+              ContainsRegex(R"(Soft limit reclaims: [1-9][0-9]*, calling )"
+                            R"(memory pressure callbacks [1-9][0-9]* times)"));
+  EXPECT_THAT(statsPbtxt, ContainsRegex(R"(memory_pressure_calls: [1-9][0-9]*)"));
+
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+  MallocExtension::RemoveMemoryPressureCallback(FreeHeldChunks);
+  const int calls = pressure_calls;
+  void *p = ::operator new(kChunk);
+  EXPECT_EQ(calls, pressure_calls);
+  ::operator delete(p);
+  for (void *chunk : chunks) {
+    ::operator delete(chunk);
+  }
+}
+
+TEST_F(LimitTest, ReleaseReclaimsToSoftLimit) {
+  MallocExtension::ReleaseMemoryToSystem(std::numeric_limits<size_t>::max());
+  const size_t before = physical_memory_used();
+  std::vector<void *> chunks;
+  for (int i = 0; i < 64; ++i) {
+    chunks.push_back(malloc_pages(kChunk));
+  }
+  for (void *chunk : chunks) {
+    free(chunk);
+  }
+
+  // Some of what we just freed is still backed, and nothing allocates from
+  // here on, so only releasing memory can get us under a lower limit.
+  const size_t after = physical_memory_used();
+  ASSERT_GT(after, before + 4 * kChunk);
+  const size_t limit = before + (after - before) / 2;
+  SetLimit(limit, false);
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_LE(physical_memory_used(), limit);
+  absl::string_view statsBuf = GetStats();
+  EXPECT_THAT(statsBuf,
+              ContainsRegex(R"(Soft limit reclaims: [1-9][0-9]*, calling )"));
+
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+}
+
+TEST_F(LimitTest, FollowsCgroupLimits) {
+  // A fake cgroup v2 hierarchy, whose root's limits apply to everyone.
+  std::string root = "/tmp/limit_test_cgroup.XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(&root[0]));
+  auto write = [&](const char *file, const char *contents) {
+    std::ofstream(root + "/" + file) << contents << "\n";
+  };
+  write("memory.high", "1073741824");
+  write("memory.max", "max");
+  ASSERT_EQ(0, setenv("TCMALLOC_CGROUP_ROOT", root.c_str(), 1));
+
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(0.5);
+  EXPECT_EQ(512 << 20, GetLimit(false));
+  absl::string_view statsBuf = GetStats();
+  EXPECT_TRUE(absl::StrContains(
+      statsBuf, "Cgroup memory.high: 1073741824, memory.max: max"))
+      << statsBuf;
+  EXPECT_TRUE(absl::StrContains(
+      statsBuf, "PARAMETER tcmalloc_cgroup_memory_limit_fraction 0.500000"))
+      << statsBuf;
+  absl::string_view statsPbtxt = GetStatsInPbTxt();
+  EXPECT_TRUE(absl::StrContains(statsPbtxt, "cgroup_memory_high: 1073741824"))
+      << statsPbtxt;
+
+  // Releasing memory picks up changes, once they are worth rereading.  The
+  // tighter of the two limits wins.
+  write("memory.high", "2147483648");
+  write("memory.max", "1610612736");
+  absl::SleepFor(absl::Milliseconds(1100));
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_EQ(768 << 20, GetLimit(false));
+
+  // A limit of our own applies alongside the cgroup's, whichever is tighter,
+  // and survives the cgroup's changing.
+  SetLimit(300 << 20, false);
+  EXPECT_EQ(300 << 20, GetLimit(false));
+  write("memory.high", "1073741824");
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(0.5);
+  EXPECT_EQ(300 << 20, GetLimit(false));
+  write("memory.high", "419430400");
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(0.5);
+  EXPECT_EQ(200 << 20, GetLimit(false));
+  write("memory.high", "1073741824");
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(0.5);
+  EXPECT_EQ(300 << 20, GetLimit(false));
+
+  // So does a hard one, which is only hard while it is the tighter.
+  SetLimit(1 << 30, true);
+  EXPECT_EQ(512 << 20, GetLimit(false));
+  SetLimit(256 << 20, true);
+  EXPECT_EQ(256 << 20, GetLimit(true));
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+  EXPECT_EQ(512 << 20, GetLimit(false));
+
+  // Disabling drops only the cgroup's.
+  SetLimit(300 << 20, false);
+  TCMalloc_Internal_SetCgroupMemoryLimitFraction(0);
+  EXPECT_EQ(300 << 20, GetLimit(false));
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+  EXPECT_EQ(std::numeric_limits<size_t>::max(), GetLimit(false));
+
+  unsetenv("TCMALLOC_CGROUP_ROOT");
+  unlink((root + "/memory.high").c_str());
+  unlink((root + "/memory.max").c_str());
+  rmdir(root.c_str());
+}
+
+TEST_F(LimitTest, ScalesCacheBudgets) {
+  auto stat = [&](absl::string_view name) -> int64_t {
+    absl::string_view pbtxt = GetStatsInPbTxt();
+    const std::string key = absl::StrCat(name, ": ");
+    size_t pos = pbtxt.find(key);
+    if (pos == absl::string_view::npos) return -1;
+    return strtoll(pbtxt.data() + pos + key.size(), nullptr, 10);
+  };
+  const int64_t max_per_cpu = MallocExtension::GetMaxPerCpuCacheSize();
+
+  // Without a limit, the caches may use everything they are configured for.
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+  const int64_t transfer_max = stat("transfer_cache_max_bytes");
+  EXPECT_GT(transfer_max, 0);
+  EXPECT_EQ(transfer_max, stat("transfer_cache_limit_bytes"));
+  const int64_t per_cpu = stat("per_cpu_cache_limit_bytes");
+  if (per_cpu >= 0) {
+    EXPECT_EQ(max_per_cpu, per_cpu);
+  }
+
+  // With one, they get a share of what the application leaves below it.
+  SetLimit(physical_memory_used() + (16 << 20), false);
+  const int64_t transfer_limit = stat("transfer_cache_limit_bytes");
+  EXPECT_LT(transfer_limit, transfer_max);
+  if (per_cpu >= 0) {
+    EXPECT_LT(stat("per_cpu_cache_limit_bytes"), max_per_cpu);
+  }
+  absl::string_view statsBuf = GetStats();
+  EXPECT_THAT(statsBuf,
+              ContainsRegex(absl::StrCat("Cache budgets: per-CPU [0-9]+ of ",
+                                         max_per_cpu, " bytes per cpu, ",
+                                         "transfer ", transfer_limit, " of ",
+                                         transfer_max, " bytes")));
+
+  SetLimit(std::numeric_limits<size_t>::max(), false);
+  EXPECT_EQ(transfer_max, stat("transfer_cache_limit_bytes"));
+  if (per_cpu >= 0) {
+    EXPECT_EQ(max_per_cpu, stat("per_cpu_cache_limit_bytes"));
+  }
+}
+
+TEST_F(LimitTest, ReleasesUnderMemoryPressure) {
+  std::string path = "/tmp/limit_test_pressure.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  auto write = [&](const char *some, const char *full) {
+    std::ofstream(path) << "some avg10=" << some
+                        << " avg60=0.00 avg300=0.00 total=0\n"
+                        << "full avg10=" << full
+                        << " avg60=0.00 avg300=0.00 total=0\n";
+  };
+  // Leaves memory free in the page heap, for us to release.
+  auto alloc_and_free = [&]() {
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 64; ++i) {
+      ptrs.push_back(malloc_pages(1 << 20));
+      memset(ptrs.back(), 0, 1 << 20);
+    }
+    for (void *p : ptrs) free(p);
+  };
+  auto free_bytes = []() {
+    return *MallocExtension::GetNumericProperty("tcmalloc.pageheap_free_bytes");
+  };
+  write("0.00", "0.00");
+  ASSERT_EQ(0, setenv("TCMALLOC_MEMORY_PRESSURE_FILE", path.c_str(), 1));
+  TCMalloc_Internal_SetMemoryPressureReleaseThreshold(10);
+
+  // No pressure, so we hold on to what we have.
+  alloc_and_free();
+  const size_t before = free_bytes();
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_GE(free_bytes(), before);
+  absl::string_view statsBuf = GetStats();
+  EXPECT_TRUE(absl::StrContains(
+      statsBuf,
+      "Memory pressure: some 0.00%, full 0.00% (avg10); released 0 bytes in "
+      "0 releases under pressure"))
+      << statsBuf;
+
+  // Once tasks stall on memory, we give it back.  We read the file no more
+  // than once a second.
+  write("25.00", "0.00");
+  absl::SleepFor(absl::Milliseconds(1100));
+  alloc_and_free();
+  const size_t moderate = free_bytes();
+  MallocExtension::ReleaseMemoryToSystem(0);
+  const size_t left = free_bytes();
+  EXPECT_LT(left, moderate);
+  statsBuf = GetStats();
+  EXPECT_THAT(statsBuf, ContainsRegex("Memory pressure: some 25.00%, full "
+                                      "0.00% \\(avg10\\); released "
+                                      "[1-9][0-9]* bytes in 1 releases"));
+  absl::string_view statsPbtxt = GetStatsInPbTxt();
+  EXPECT_THAT(statsPbtxt, HasSubstr("memory_pressure_releases: 1"));
+  EXPECT_THAT(statsPbtxt,
+              ContainsRegex("memory_pressure_release_bytes: [1-9][0-9]*"));
+
+  // Once all tasks stall, we break up hugepages for what is left.
+  write("25.00", "12.00");
+  absl::SleepFor(absl::Milliseconds(1100));
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_LE(free_bytes(), left);
+  statsPbtxt = GetStatsInPbTxt();
+  EXPECT_THAT(statsPbtxt, HasSubstr("memory_pressure_releases: 2"));
+
+  TCMalloc_Internal_SetMemoryPressureReleaseThreshold(0);
+  unsetenv("TCMALLOC_MEMORY_PRESSURE_FILE");
+  unlink(path.c_str());
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -95,6 +95,7 @@ void TransferCache::Init(size_t cl) {
         std::max<size_t>(objs_to_move, (1024 * 1024) / (bytes * objs_to_move) *
                                            objs_to_move));
     info.capacity = std::min(info.capacity, max_capacity_);
+    capacity_limit_.store(max_capacity_, std::memory_order_relaxed);
     slots_ = reinterpret_cast<void **>(
         Static::arena()->Alloc(max_capacity_ * sizeof(void *)));
   }
@@ -106,7 +107,7 @@ bool TransferCache::MakeCacheSpace(int N) {
   // Is there room in the cache?
   if (info.used + N <= info.capacity) return true;
   // Check if we can expand this cache?
-  if (info.capacity + N > max_capacity_) return false;
+  if (info.capacity + N > capacity_limit()) return false;
 
   int to_evict = gEvictionManager.DetermineSizeClassToEvict();
   if (to_evict == freelist_.size_class()) return false;
@@ -123,7 +124,7 @@ bool TransferCache::MakeCacheSpace(int N) {
   // changed.  Therefore, check and verify that it is still OK to increase the
   // cache_size.
   info = slot_info_.load(std::memory_order_relaxed);
-  if (info.capacity + N > max_capacity_) return false;
+  if (info.capacity + N > capacity_limit()) return false;
   info.capacity += N;
   SetSlotInfo(info);
   return true;
@@ -162,6 +163,37 @@ bool TransferCache::ShrinkCache() {
   return true;
 }
 
+void TransferCache::SetCapacityLimit(int32_t limit) {
+  const int32_t N =
+      Static::sizemap()->num_objects_to_move(freelist_.size_class());
+  limit = std::min(std::max(limit, N), max_capacity_);
+  capacity_limit_.store(limit, std::memory_order_relaxed);
+  while (GetSlotInfo().capacity > limit && ShrinkCache()) {
+  }
+}
+
+size_t TransferCache::Flush() {
+  const int B = Static::sizemap()->num_objects_to_move(freelist_.size_class());
+  void *to_free[kMaxObjectsToMove];
+  size_t flushed = 0;
+  for (;;) {
+    int n;
+    {
+      absl::base_internal::SpinLockHolder h(&lock_);
+      auto info = slot_info_.load(std::memory_order_relaxed);
+      n = std::min(B, info.used);
+      info.used -= n;
+      SetSlotInfo(info);
+      memcpy(to_free, GetSlot(info.used), sizeof(void *) * n);
+    }
+    if (n == 0) return flushed;
+
+    // As in ShrinkCache, access the freelist without holding the lock.
+    freelist_.InsertRange(to_free, n);
+    flushed += n;
+  }
+}
+
 void TransferCache::InsertRange(absl::Span<void *> batch, int N) {
   const int B = Static::sizemap()->num_objects_to_move(freelist_.size_class());
   ASSERT(0 < N && N <= B);
@@ -45,6 +45,7 @@ class TransferCache {
   constexpr TransferCache()
       : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
         max_capacity_(0),
+        capacity_limit_(0),
         slot_info_{},
         slots_(nullptr),
         freelist_() {}
@@ -69,6 +70,11 @@ class TransferCache {
   // Returns the number of free objects in the transfer cache.
   size_t tc_length();
 
+  // Hands every cached object back to the central free list, so that spans
+  // whose objects are all free can go back to the page heap.  The cache keeps
+  // its capacity.  Returns the number of objects handed back.
+  size_t Flush() ABSL_LOCKS_EXCLUDED(lock_);
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
@@ -81,6 +87,19 @@ class TransferCache {
     return slot_info_.load(std::memory_order_relaxed);
   }
 
+  // Returns the most objects the cache could ever hold.
+  int32_t max_capacity() const { return max_capacity_; }
+
+  // Returns the most objects the cache may hold now: max_capacity(), unless
+  // SetCapacityLimit lowered it.
+  int32_t capacity_limit() const {
+    return capacity_limit_.load(std::memory_order_relaxed);
+  }
+
+  // Limits the cache to between one batch and max_capacity() objects,
+  // shrinking it if it is over.
+  void SetCapacityLimit(int32_t limit) ABSL_LOCKS_EXCLUDED(lock_);
+
  private:
   // REQUIRES: lock is held.
   // Tries to make room for a batch.  If the cache is full it will try to expand
@@ -112,6 +131,9 @@ class TransferCache {
   // Maximum size of the cache for a given size class. (immutable after Init())
   int32_t max_capacity_;
 
+  // The most slot_info_.capacity may grow to, at most max_capacity_.
+  std::atomic<int32_t> capacity_limit_;
+
   // Number of currently used and available cached entries in slots_.  This
   // variable is updated under a lock but can be read without one.
   // INVARIANT: [0 <= slot_info_.used <= slot_info.capacity <= max_cache_slots_]
@@ -150,8 +172,16 @@ class TransferCache {
 
   size_t tc_length() { return 0; }
 
+  size_t Flush() { return 0; }
+
   size_t OverheadBytes() { return freelist_.OverheadBytes(); }
 
+  int32_t max_capacity() const { return 0; }
+
+  int32_t capacity_limit() const { return 0; }
+
+  void SetCapacityLimit(int32_t limit) {}
+
  private:
   CentralFreeList freelist_;
 } ABSL_CACHELINE_ALIGNED;